@@ -38,6 +38,8 @@
 #define CONF_BATCH_SIZE_WIDTH "batch_size_width"
 #define CONF_BATCH_SIZE_HEIGHT "batch_size_height"
 #define CONF_BATCH_SIZE_SCALE "batch_size_scale"
+#define CONF_BATCH_MEMORY_BUDGET "batch_memory_budget"
+#define CONF_BATCH_PROFILES "batch_profiles"
 #define CONF_ROI_GRID "roi_grid"
 #define CONF_CROP_ASPECT "crop_aspect"
 #define CONF_SHOW_FILENAMES "show_filenames_in_iconview"
@@ -59,6 +61,7 @@
 #define CONF_SHOW_TOOLBOX_HIST "show_toolbox_hist"
 #define CONF_TOOLBOX_WIDTH "toolbox_width"
 #define CONF_SPLIT_CONTINUOUS "split_continuous"
+#define CONF_PREVIEW_PROGRESSIVE "preview_progressive"
 #define CONF_LAST_PRIORITY_PAGE "last_priority_page"
 #define CONF_STORE_SORT_METHOD "store_sort_method"
 #define CONF_LIBRARY_AUTOTAG "library_autotag"
@@ -60,6 +60,8 @@ extern "C" {
 #include "rs-output.h"
 #include "rs-plugin-manager.h"
 #include "rs-job-queue.h"
+#include "rs-worker-pool.h"
+#include "rs-trace.h"
 #include "rs-utils.h"
 #include "rs-math.h"
 #include "rs-color.h"
@@ -25,6 +25,9 @@ struct _RSFilterRequest {
 	gboolean roi_set;
 	GdkRectangle roi;
 	gboolean quick;
+	gint tile_width;
+	gint tile_height;
+	GHashTable *tile_cache;
 };
 
 G_DEFINE_TYPE(RSFilterRequest, rs_filter_request, RS_TYPE_FILTER_PARAM)
@@ -32,6 +35,11 @@ G_DEFINE_TYPE(RSFilterRequest, rs_filter_request, RS_TYPE_FILTER_PARAM)
 static void
 rs_filter_request_finalize(GObject *object)
 {
+	RSFilterRequest *filter_request = RS_FILTER_REQUEST(object);
+
+	if (filter_request->tile_cache)
+		g_hash_table_unref(filter_request->tile_cache);
+
 	G_OBJECT_CLASS (rs_filter_request_parent_class)->finalize (object);
 }
 
@@ -48,6 +56,9 @@ rs_filter_request_init(RSFilterRequest *filter_request)
 {
 	filter_request->roi_set = FALSE;
 	filter_request->quick = FALSE;
+	filter_request->tile_width = 0;
+	filter_request->tile_height = 0;
+	filter_request->tile_cache = NULL;
 }
 
 /**
@@ -96,6 +107,9 @@ rs_filter_request_clone(const RSFilterRequest *filter_request)
 		new_filter_request->roi_set = filter_request->roi_set;
 		new_filter_request->roi = filter_request->roi;
 		new_filter_request->quick = filter_request->quick;
+		new_filter_request->tile_width = filter_request->tile_width;
+		new_filter_request->tile_height = filter_request->tile_height;
+		rs_filter_request_set_tile_cache(new_filter_request, filter_request->tile_cache);
 
 		rs_filter_param_clone(RS_FILTER_PARAM(new_filter_request), RS_FILTER_PARAM(filter_request));
 	}
@@ -165,3 +179,76 @@ gboolean rs_filter_request_get_quick(const RSFilterRequest *filter_request)
 
 	return ret;
 }
+
+/**
+ * Request tiled execution, rs_filter_get_image() will pull the image through
+ * the filter chain one tile at a time and assemble the result. This keeps
+ * the working set of pointwise and small margin filters in cache, it does
+ * not reduce memory use: every tile is answered with a full size image,
+ * the result is assembled in another one, and filters needing their
+ * complete input keep a full frame until all tiles are done
+ * @param filter_request A RSFilterRequest
+ * @param tile_width The width of a tile or 0 to use complete rows
+ * @param tile_height The height of a tile or 0 to disable tiling
+ */
+void rs_filter_request_set_tile_size(RSFilterRequest *filter_request, gint tile_width, gint tile_height)
+{
+	g_return_if_fail(RS_IS_FILTER_REQUEST(filter_request));
+
+	filter_request->tile_width = MAX(0, tile_width);
+	filter_request->tile_height = MAX(0, tile_height);
+}
+
+/**
+ * Get the tile size of a RSFilterRequest
+ * @param filter_request A RSFilterRequest
+ * @param tile_width A pointer to a gint where the width will be written or NULL
+ * @param tile_height A pointer to a gint where the height will be written or NULL
+ * @return TRUE if tiled execution is requested, FALSE otherwise
+ */
+gboolean rs_filter_request_get_tile_size(const RSFilterRequest *filter_request, gint *tile_width, gint *tile_height)
+{
+	if (!RS_IS_FILTER_REQUEST(filter_request) || (filter_request->tile_height == 0))
+		return FALSE;
+
+	if (tile_width)
+		*tile_width = filter_request->tile_width;
+	if (tile_height)
+		*tile_height = filter_request->tile_height;
+
+	return TRUE;
+}
+
+/**
+ * Set the table used to keep the complete output of filters that cannot work
+ * on tiles while a tiled request is running
+ * @note This is used by rs_filter_get_image(), filters should not touch it
+ * @param filter_request A RSFilterRequest
+ * @param tile_cache A GHashTable mapping RSFilter to RSFilterResponse or NULL
+ */
+void rs_filter_request_set_tile_cache(RSFilterRequest *filter_request, GHashTable *tile_cache)
+{
+	g_return_if_fail(RS_IS_FILTER_REQUEST(filter_request));
+
+	if (tile_cache)
+		g_hash_table_ref(tile_cache);
+	if (filter_request->tile_cache)
+		g_hash_table_unref(filter_request->tile_cache);
+
+	filter_request->tile_cache = tile_cache;
+}
+
+/**
+ * Get the tile cache of a RSFilterRequest
+ * @param filter_request A RSFilterRequest
+ * @return A GHashTable or NULL if no tiled request is running
+ */
+GHashTable *rs_filter_request_get_tile_cache(const RSFilterRequest *filter_request)
+{
+	GHashTable *ret = NULL;
+
+	if (RS_IS_FILTER_REQUEST(filter_request))
+		ret = filter_request->tile_cache;
+
+	return ret;
+}
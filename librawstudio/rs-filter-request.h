@@ -91,6 +91,44 @@ void rs_filter_request_set_quick(RSFilterRequest *filter_request, gboolean quick
  */
 gboolean rs_filter_request_get_quick(const RSFilterRequest *filter_request);
 
+/**
+ * Request tiled execution, rs_filter_get_image() will pull the image through
+ * the filter chain one tile at a time and assemble the result. This keeps
+ * the working set of pointwise and small margin filters in cache, it does
+ * not reduce memory use: every tile is answered with a full size image,
+ * the result is assembled in another one, and filters needing their
+ * complete input keep a full frame until all tiles are done
+ * @param filter_request A RSFilterRequest
+ * @param tile_width The width of a tile or 0 to use complete rows
+ * @param tile_height The height of a tile or 0 to disable tiling
+ */
+void rs_filter_request_set_tile_size(RSFilterRequest *filter_request, gint tile_width, gint tile_height);
+
+/**
+ * Get the tile size of a RSFilterRequest
+ * @param filter_request A RSFilterRequest
+ * @param tile_width A pointer to a gint where the width will be written or NULL
+ * @param tile_height A pointer to a gint where the height will be written or NULL
+ * @return TRUE if tiled execution is requested, FALSE otherwise
+ */
+gboolean rs_filter_request_get_tile_size(const RSFilterRequest *filter_request, gint *tile_width, gint *tile_height);
+
+/**
+ * Set the table used to keep the complete output of filters that cannot work
+ * on tiles while a tiled request is running
+ * @note This is used by rs_filter_get_image(), filters should not touch it
+ * @param filter_request A RSFilterRequest
+ * @param tile_cache A GHashTable mapping RSFilter to RSFilterResponse or NULL
+ */
+void rs_filter_request_set_tile_cache(RSFilterRequest *filter_request, GHashTable *tile_cache);
+
+/**
+ * Get the tile cache of a RSFilterRequest
+ * @param filter_request A RSFilterRequest
+ * @return A GHashTable or NULL if no tiled request is running
+ */
+GHashTable *rs_filter_request_get_tile_cache(const RSFilterRequest *filter_request);
+
 G_END_DECLS
 
 #endif /* RS_FILTER_REQUEST_H */
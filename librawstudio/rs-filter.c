@@ -18,24 +18,15 @@
  */
 
 #include <stdlib.h> /* system() */
+#include <string.h> /* memcpy() */
 #include <rawstudio.h>
 #include "rs-filter.h"
 
-#if 0 /* Change to 1 to enable performance info */
-#define filter_performance printf
-#define FILTER_SHOW_PERFORMANCE
-#else
-#define filter_performance(...) {}
-#endif
-
-/* How much time should a filter at least have taken to show performance number */
-#define FILTER_PERF_ELAPSED_MIN 0.001
-#define CHAIN_PERF_ELAPSED_MIN 0.001
-
 G_DEFINE_TYPE (RSFilter, rs_filter, G_TYPE_OBJECT)
 
 enum {
   CHANGED_SIGNAL,
+  REGION_CHANGED_SIGNAL,
   LAST_SIGNAL
 };
 
@@ -72,10 +63,24 @@ rs_filter_class_init(RSFilterClass *klass)
 		g_cclosure_marshal_VOID__INT,
 		G_TYPE_NONE, 1, G_TYPE_INT);
 
+	/* Emitted after "changed" with the changed region, or NULL if everything changed */
+	signals[REGION_CHANGED_SIGNAL] = g_signal_new ("region-changed",
+		G_TYPE_FROM_CLASS (klass),
+		G_SIGNAL_RUN_FIRST | G_SIGNAL_ACTION,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_POINTER);
+
 	klass->get_image = NULL;
 	klass->get_image8 = NULL;
 	klass->get_size = NULL;
+	klass->get_margin = NULL;
+	klass->get_pointwise_request = NULL;
+	klass->prepare_pointwise = NULL;
 	klass->previous_changed = NULL;
+	klass->map_changed_region = NULL;
 
 	object_class->dispose = dispose;
 }
@@ -153,181 +158,509 @@ rs_filter_set_previous(RSFilter *filter, RSFilter *previous)
 void
 rs_filter_changed(RSFilter *filter, RSFilterChangedMask mask)
 {
-	RS_DEBUG(FILTERS, "rs_filter_changed(%s [%p], %04x)", RS_FILTER_NAME(filter), filter, mask);
+	rs_filter_changed_region(filter, mask, NULL);
+}
+
+/* Maps a changed region of filter->previous to the output of filter */
+static gboolean
+map_changed_region(RSFilter *filter, GdkRectangle *region)
+{
+	RSFilterClass *klass = RS_FILTER_GET_CLASS(filter);
+	RSFilterRequest *request;
+	gint margin;
+
+	if (!filter->enabled)
+		return TRUE;
+
+	if (klass->map_changed_region)
+		return klass->map_changed_region(filter, region);
+
+	if (klass->get_pointwise_request)
+		return TRUE;
+
+	/* Filters keeping geometry only spread changes by their margin */
+	if (klass->get_size)
+		return FALSE;
+
+	request = rs_filter_request_new();
+	margin = rs_filter_get_margin(filter, request);
+	g_object_unref(request);
+
+	if (margin == RS_FILTER_MARGIN_FULL)
+		return FALSE;
+
+	region->width += region->x - MAX(0, region->x - margin) + margin;
+	region->height += region->y - MAX(0, region->y - margin) + margin;
+	region->x = MAX(0, region->x - margin);
+	region->y = MAX(0, region->y - margin);
+
+	return TRUE;
+}
+
+/**
+ * Signal that a part of the output of a filter has changed. The region is
+ * mapped through the geometry of all following filters. Listeners of the
+ * "region-changed" signal will receive the region in output coordinates
+ * This should only be called from filters
+ * @param filter The changed filter
+ * @param mask A mask indicating what changed
+ * @param region The changed area in output coordinates of filter, or NULL if
+ *               everything changed. Ignored for dimension changes
+ */
+void
+rs_filter_changed_region(RSFilter *filter, RSFilterChangedMask mask, const GdkRectangle *region)
+{
 	g_return_if_fail(RS_IS_FILTER(filter));
 
+	if (region)
+		RS_DEBUG(FILTERS, "rs_filter_changed(%s [%p], %04x, %d,%d %dx%d)", RS_FILTER_NAME(filter), filter, mask, region->x, region->y, region->width, region->height);
+	else
+		RS_DEBUG(FILTERS, "rs_filter_changed(%s [%p], %04x)", RS_FILTER_NAME(filter), filter, mask);
+
+	/* Everything moves when dimensions change */
+	if ((mask & RS_FILTER_CHANGED_DIMENSION) == RS_FILTER_CHANGED_DIMENSION)
+		region = NULL;
+
 	gint i, n_next = g_slist_length(filter->next_filters);
 
 	for(i=0; i<n_next; i++)
 	{
 		RSFilter *next = RS_FILTER(g_slist_nth_data(filter->next_filters, i));
+		GdkRectangle next_region;
+		const GdkRectangle *mapped = NULL;
 
 		g_assert(RS_IS_FILTER(next));
 
+		if (region)
+		{
+			next_region = *region;
+			if (map_changed_region(next, &next_region))
+				mapped = &next_region;
+		}
+
+		/* Nothing visible changed after this filter */
+		if (mapped && (mapped->width <= 0 || mapped->height <= 0))
+			continue;
+
 		/* Notify "next" filter or try "next next" filter */
 		if (RS_FILTER_GET_CLASS(next)->previous_changed)
-			RS_FILTER_GET_CLASS(next)->previous_changed(next, filter, mask);
+			RS_FILTER_GET_CLASS(next)->previous_changed(next, filter, mask, mapped);
 		else
-			rs_filter_changed(next, mask);
+			rs_filter_changed_region(next, mask, mapped);
 	}
 
 	g_signal_emit(G_OBJECT(filter), signals[CHANGED_SIGNAL], 0, mask);
+	g_signal_emit(G_OBJECT(filter), signals[REGION_CHANGED_SIGNAL], 0, mask, region);
 }
 
-/* Clamps ROI rectangle to image size */
-/* Returns a new rectangle, or NULL if ROI was within bounds*/
+/* Grows ROI rectangle by margin and clamps it to image size */
+/* Returns a new rectangle, or NULL if ROI was within bounds and margin is 0 */
 
 static GdkRectangle* 
-clamp_roi(const GdkRectangle *roi, RSFilter *filter, const RSFilterRequest *request)
+clamp_roi(const GdkRectangle *roi, gint margin, RSFilter *filter, const RSFilterRequest *request)
 {
 	RSFilterResponse *response = rs_filter_get_size(filter, request);
 	gint w = rs_filter_response_get_width(response);
 	gint h = rs_filter_response_get_height(response);
 	g_object_unref(response);
 
-	if ((roi->x >= 0) && (roi->y >=0) && (roi->x + roi->width <= w) && (roi->y + roi->height <= h))
+	if ((margin == 0) && (roi->x >= 0) && (roi->y >=0) && (roi->x + roi->width <= w) && (roi->y + roi->height <= h))
 		return NULL;
 
 	GdkRectangle* new_roi = g_new(GdkRectangle, 1);
-	new_roi->x = MAX(0, roi->x);
-	new_roi->y = MAX(0, roi->y);
-	new_roi->width = MIN(w - new_roi->x, roi->width);
-	new_roi->height = MAX(h - new_roi->y, roi->height);
+	new_roi->x = MAX(0, roi->x - margin);
+	new_roi->y = MAX(0, roi->y - margin);
+	new_roi->width = MIN(w, roi->x + roi->width + margin) - new_roi->x;
+	new_roi->height = MIN(h, roi->y + roi->height + margin) - new_roi->y;
 	return new_roi;
 }
 
-/**
- * Get the output image from a RSFilter
- * @param filter A RSFilter
- * @param param A RSFilterRequest defining parameters for a image request
- * @return A RS_IMAGE16, this must be unref'ed
- */
-RSFilterResponse *
-rs_filter_get_image(RSFilter *filter, const RSFilterRequest *request)
+/* Pulls the image through the chain one tile at a time, for cache locality.
+ * Peak memory is higher than an untiled render, see
+ * rs_filter_request_set_tile_size() */
+static RSFilterResponse *
+get_image_tiled(RSFilter *filter, const RSFilterRequest *request, gint tile_width, gint tile_height)
 {
-	GdkRectangle* roi = NULL;
-	RSFilterRequest *r = NULL;
+	RSFilterRequest *tile_request = rs_filter_request_clone(request);
+	RSFilterResponse *response = NULL;
+	RSFilterResponse *tile_response;
+	RS_IMAGE16 *output = NULL;
+	RS_IMAGE16 *image;
+	GHashTable *tile_cache;
+	GdkRectangle tile;
+	gint w, h, row;
 
-	g_return_val_if_fail(RS_IS_FILTER(filter), NULL);
-	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), NULL);
+	/* Tiles should not be tiled again */
+	rs_filter_request_set_tile_size(tile_request, 0, 0);
 
-	RS_DEBUG(FILTERS, "rs_filter_get_image(%s [%p])", RS_FILTER_NAME(filter), filter);
+	if (!rs_filter_get_size_simple(filter, tile_request, &w, &h))
+	{
+		response = rs_filter_get_image(filter, tile_request);
+		g_object_unref(tile_request);
+		return response;
+	}
 
-	/* This timer-hack will break badly when multithreaded! */
-	static gfloat last_elapsed = 0.0;
-	static gint count = -1;
-	gfloat elapsed;
-	static GTimer *gt = NULL;
+	if (tile_width <= 0)
+		tile_width = w;
 
-	RSFilterResponse *response;
-	RS_IMAGE16 *image;
+	/* Only one tile, don't bother */
+	if ((tile_width >= w) && (tile_height >= h))
+	{
+		response = rs_filter_get_image(filter, tile_request);
+		g_object_unref(tile_request);
+		return response;
+	}
 
-	if (count == -1)
-		gt = g_timer_new();
-	count++;
+	/* Filters needing their complete input will be rendered once and kept
+	 * here until all tiles are done */
+	tile_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_object_unref);
+	rs_filter_request_set_tile_cache(tile_request, tile_cache);
+	g_hash_table_unref(tile_cache);
 
-	if (filter->enabled && (roi = rs_filter_request_get_roi(request)))
+	RS_DEBUG(FILTERS, "get_image_tiled(%s [%p]): %dx%d in %dx%d tiles", RS_FILTER_NAME(filter), filter, w, h, tile_width, tile_height);
+
+	for (tile.y = 0; tile.y < h; tile.y += tile_height)
+		for (tile.x = 0; tile.x < w; tile.x += tile_width)
+		{
+			tile.width = MIN(tile_width, w - tile.x);
+			tile.height = MIN(tile_height, h - tile.y);
+			rs_filter_request_set_roi(tile_request, &tile);
+
+			tile_response = rs_filter_get_image(filter, tile_request);
+			image = rs_filter_response_get_image(tile_response);
+
+			/* We can only assemble tiles delivered at the predicted size */
+			if (!image || (image->w != w) || (image->h != h))
+			{
+				if (image)
+					g_object_unref(image);
+				g_object_unref(tile_response);
+
+				/* Drop any tiles assembled so far and render everything at once */
+				if (output)
+				{
+					RS_DEBUG(FILTERS, "get_image_tiled(%s [%p]): tile at %d,%d changed size, rendering untiled", RS_FILTER_NAME(filter), filter, tile.x, tile.y);
+					g_object_unref(output);
+					g_object_unref(response);
+				}
+				rs_filter_request_set_roi(tile_request, NULL);
+				rs_filter_request_set_tile_cache(tile_request, NULL);
+				response = rs_filter_get_image(filter, tile_request);
+				g_object_unref(tile_request);
+				return response;
+			}
+
+			if (!output)
+			{
+				response = rs_filter_response_clone(tile_response);
+				rs_filter_response_set_roi(response, NULL);
+				output = rs_image16_new(w, h, image->channels, image->pixelsize);
+				output->filters = image->filters;
+			}
+
+			for(row = tile.y; row < tile.y + tile.height; row++)
+				memcpy(GET_PIXEL(output, tile.x, row), GET_PIXEL(image, tile.x, row), tile.width * image->pixelsize * sizeof(gushort));
+
+			g_object_unref(image);
+			g_object_unref(tile_response);
+		}
+
+	rs_filter_response_set_image(response, output);
+	g_object_unref(output);
+	g_object_unref(tile_request);
+
+	return response;
+}
+
+/* Rows of pixel data processed by all fused stages before moving on */
+#define FUSED_BAND_BYTES (256*1024)
+
+typedef struct {
+	RSFilterPointwiseFunc func;
+	gpointer data;
+	GDestroyNotify destroy;
+} FusedStage;
+
+typedef struct {
+	RS_IMAGE16 *input;
+	RS_IMAGE16 *output;
+	GArray *stages;
+	gint band_rows;
+} FusedRun;
+
+static void
+fused_rows(gint start_y, gint end_y, gpointer user_data)
+{
+	FusedRun *run = user_data;
+	const gsize row_bytes = run->output->w * run->output->pixelsize * sizeof(gushort);
+	gint y, row;
+	guint i;
+
+	for(y = start_y; y < end_y; y += run->band_rows)
 	{
-		roi = clamp_roi(roi, filter, request);
-		if (roi)
+		const gint band_end = MIN(end_y, y + run->band_rows);
+
+		for(row = y; row < band_end; row++)
+			memcpy(GET_PIXEL(run->output, 0, row), GET_PIXEL(run->input, 0, row), row_bytes);
+
+		/* The band stays in cache while all stages are applied */
+		for(i = 0; i < run->stages->len; i++)
 		{
-			r = rs_filter_request_clone(request);
-			rs_filter_request_set_roi(r, roi);
-			request = r;
+			FusedStage *stage = &g_array_index(run->stages, FusedStage, i);
+			stage->func(stage->data, run->output, y, band_end);
 		}
 	}
+}
+
+/* Runs consecutive pointwise filters as one pass over the image, instead
+ * of one full image pass and one output image per filter */
+/* Returns NULL if less than two pointwise filters can be fused */
+static RSFilterResponse *
+get_image_fused(RSFilter *filter, const RSFilterRequest *request)
+{
+	GSList *filters = NULL;
+	GSList *requests = NULL;
+	GSList *fl, *rl;
+	RSFilterRequest *current = g_object_ref((gpointer) request);
+	RSFilterResponse *previous_response, *response;
+	RS_IMAGE16 *input, *output;
+	GdkRectangle *roi;
+	RSFilter *f = filter;
+	FusedRun run;
+	gint n = 0;
+
+	/* Collect filters from here and upstream, disabled filters pass data through */
+	while (f)
+	{
+		RSFilterRequest *upstream;
+
+		if (!f->enabled)
+		{
+			f = f->previous;
+			continue;
+		}
+
+		if (!RS_FILTER_GET_CLASS(f)->get_pointwise_request || !RS_FILTER_GET_CLASS(f)->prepare_pointwise)
+			break;
+
+		upstream = RS_FILTER_GET_CLASS(f)->get_pointwise_request(f, current);
+		if (!upstream)
+			break;
+
+		/* Upstream filters end up first */
+		filters = g_slist_prepend(filters, f);
+		requests = g_slist_prepend(requests, current);
+		current = upstream;
+		f = f->previous;
+		n++;
+	}
+
+	if (n < 2 || !f)
+	{
+		g_slist_free(filters);
+		g_slist_free_full(requests, g_object_unref);
+		g_object_unref(current);
+		return NULL;
+	}
 
-	if (RS_FILTER_GET_CLASS(filter)->get_image && filter->enabled)
-		response = RS_FILTER_GET_CLASS(filter)->get_image(filter, request);
+	RS_DEBUG(FILTERS, "get_image_fused(%s [%p]): fusing %d filters", RS_FILTER_NAME(filter), filter, n);
+
+	previous_response = rs_filter_get_image(f, current);
+	g_object_unref(current);
+	input = rs_filter_response_get_image(previous_response);
+	if (!input)
+	{
+		g_slist_free(filters);
+		g_slist_free_full(requests, g_object_unref);
+		return previous_response;
+	}
+
+	response = rs_filter_response_clone(previous_response);
+	g_object_unref(previous_response);
+
+	run.stages = g_array_new(FALSE, TRUE, sizeof(FusedStage));
+	for (fl = filters, rl = requests; fl; fl = fl->next, rl = rl->next)
+	{
+		RSFilter *stage_filter = fl->data;
+		FusedStage stage = {NULL, NULL, NULL};
+
+		stage.func = RS_FILTER_GET_CLASS(stage_filter)->prepare_pointwise(stage_filter, rl->data, response, &stage.data, &stage.destroy);
+		if (stage.func)
+			g_array_append_val(run.stages, stage);
+		else if (stage.destroy)
+			stage.destroy(stage.data);
+	}
+	g_slist_free(filters);
+	g_slist_free_full(requests, g_object_unref);
+
+	if (run.stages->len == 0)
+	{
+		rs_filter_response_set_image(response, input);
+		g_object_unref(input);
+		g_array_free(run.stages, TRUE);
+		return response;
+	}
+
+	output = rs_image16_copy(input, FALSE);
+
+	if ((roi = rs_filter_request_get_roi(request)))
+	{
+		run.input = rs_image16_new_subframe(input, roi);
+		run.output = rs_image16_new_subframe(output, roi);
+	}
 	else
-		response = rs_filter_get_image(filter->previous, request);
+	{
+		run.input = g_object_ref(input);
+		run.output = g_object_ref(output);
+	}
 
-	g_assert(RS_IS_FILTER_RESPONSE(response));
+	run.band_rows = MAX(1, FUSED_BAND_BYTES / (run.output->w * run.output->pixelsize * sizeof(gushort)));
 
-	image = rs_filter_response_get_image(response);
+	if (run.output->w * run.output->h < 200*200)
+		fused_rows(0, run.output->h, &run);
+	else
+		rs_worker_pool_parallel_rows(run.output->h, run.band_rows, fused_rows, &run);
 
-	elapsed = g_timer_elapsed(gt, NULL) - last_elapsed;
+	while (run.stages->len > 0)
+	{
+		FusedStage *stage = &g_array_index(run.stages, FusedStage, run.stages->len - 1);
+		if (stage->destroy)
+			stage->destroy(stage->data);
+		g_array_remove_index(run.stages, run.stages->len - 1);
+	}
+	g_array_free(run.stages, TRUE);
 
-	if (roi)
-		g_free(roi);
-	if (r)
-		g_object_unref(r);
+	rs_filter_response_set_image(response, output);
+	g_object_unref(run.input);
+	g_object_unref(run.output);
+	g_object_unref(output);
+	g_object_unref(input);
 
-#ifdef FILTER_SHOW_PERFORMANCE
-	if ((elapsed > FILTER_PERF_ELAPSED_MIN) && (image != NULL)) 
+	return response;
+}
+
+static RSFilterResponse *
+filter_get_image(RSFilter *filter, const RSFilterRequest *request)
+{
+	GdkRectangle* roi = NULL;
+	RSFilterRequest *r = NULL;
+	GHashTable *tile_cache = NULL;
+	gint tile_width, tile_height;
+	RSFilterResponse *response = NULL;
+
+	if (rs_filter_request_get_tile_size(request, &tile_width, &tile_height) && !rs_filter_request_get_roi(request))
+		return get_image_tiled(filter, request, tile_width, tile_height);
+
+	if (filter->enabled && (roi = rs_filter_request_get_roi(request)))
 	{
-		gint iw = image->w;
-		gint ih = image->h;
-		if (rs_filter_response_get_roi(response)) 
+		gint margin = rs_filter_get_margin(filter, request);
+
+		if ((margin == RS_FILTER_MARGIN_FULL) && (tile_cache = rs_filter_request_get_tile_cache(request)))
 		{
-			roi = rs_filter_response_get_roi(response);
-			iw = roi->width;
-			ih = roi->height;
+			/* Render the complete image once and reuse it for all tiles */
+			roi = NULL;
+			response = g_hash_table_lookup(tile_cache, filter);
+			if (response)
+				g_object_ref(response);
+			else
+			{
+				r = rs_filter_request_clone(request);
+				rs_filter_request_set_roi(r, NULL);
+				request = r;
+			}
+		}
+		else
+		{
+			tile_cache = NULL;
+			roi = clamp_roi(roi, MAX(0, margin), filter, request);
+			if (roi)
+			{
+				r = rs_filter_request_clone(request);
+				rs_filter_request_set_roi(r, roi);
+				request = r;
+			}
 		}
-		filter_performance("%s took: \033[32m%.0f\033[0mms", RS_FILTER_NAME(filter), elapsed*1000);
-		if ((elapsed > 0.001) && (image != NULL))
-			filter_performance(" [\033[33m%.01f\033[0mMpix/s]", ((gfloat)(iw*ih))/elapsed/1000000.0);
-		if (image)
-			filter_performance(" [w: %d, h: %d, roi-w:%d, roi-h:%d, channels: %d, pixelsize: %d, rowstride: %d]",
-				image->w, image->h, iw, ih, image->channels, image->pixelsize, image->rowstride);
-		filter_performance("\n");
 	}
-#endif
-	g_assert(RS_IS_IMAGE16(image) || (image == NULL));
-	last_elapsed += elapsed;
 
-	count--;
-	if (count == -1)
+	if (!response && filter->enabled && RS_FILTER_GET_CLASS(filter)->get_pointwise_request)
+		response = get_image_fused(filter, request);
+
+	if (!response)
 	{
-		last_elapsed = 0.0;
-		if (g_timer_elapsed(gt,NULL) > CHAIN_PERF_ELAPSED_MIN)
-			filter_performance("Complete 16 bit chain took: \033[32m%.0f\033[0mms\n\n", g_timer_elapsed(gt, NULL)*1000.0);
-		rs_filter_param_set_float(RS_FILTER_PARAM(response), "16-bit-time", g_timer_elapsed(gt, NULL));
-		g_timer_destroy(gt);
+		if (RS_FILTER_GET_CLASS(filter)->get_image && filter->enabled)
+			response = RS_FILTER_GET_CLASS(filter)->get_image(filter, request);
+		else
+			response = rs_filter_get_image(filter->previous, request);
+
+		/* Keep it for the following tiles */
+		if (tile_cache)
+			g_hash_table_insert(tile_cache, filter, g_object_ref(response));
 	}
-	
-	if (image)
-		g_object_unref(image);
+
+	if (roi)
+		g_free(roi);
+	if (r)
+		g_object_unref(r);
 
 	return response;
 }
 
-
 /**
- * Get 8 bit output image from a RSFilter
+ * Get the output image from a RSFilter
  * @param filter A RSFilter
  * @param param A RSFilterRequest defining parameters for a image request
  * @return A RS_IMAGE16, this must be unref'ed
  */
 RSFilterResponse *
-rs_filter_get_image8(RSFilter *filter, const RSFilterRequest *request)
+rs_filter_get_image(RSFilter *filter, const RSFilterRequest *request)
 {
+	RSFilterResponse *response;
+	RS_IMAGE16 *image;
+	const gboolean trace = rs_trace_is_enabled();
+
 	g_return_val_if_fail(RS_IS_FILTER(filter), NULL);
 	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), NULL);
 
-	RS_DEBUG(FILTERS, "rs_filter_get_image8(%s [%p])", RS_FILTER_NAME(filter), filter);
+	RS_DEBUG(FILTERS, "rs_filter_get_image(%s [%p])", RS_FILTER_NAME(filter), filter);
+
+	if (trace)
+		rs_trace_begin();
+
+	response = filter_get_image(filter, request);
+
+	g_assert(RS_IS_FILTER_RESPONSE(response));
+
+	image = rs_filter_response_get_image(response);
+	g_assert(RS_IS_IMAGE16(image) || (image == NULL));
+
+	if (trace)
+	{
+		GdkRectangle *roi = rs_filter_response_get_roi(response);
+		gint64 pixels = 0;
+
+		if (roi)
+			pixels = ((gint64) roi->width) * roi->height;
+		else if (image)
+			pixels = ((gint64) image->w) * image->h;
+		rs_trace_end(RS_FILTER_NAME(filter), "filter", roi, pixels);
+	}
 
-	/* This timer-hack will break badly when multithreaded! */
-	static gfloat last_elapsed = 0.0;
-	static gint count = -1;
-	gfloat elapsed, temp;
-	static GTimer *gt = NULL;
+	if (image)
+		g_object_unref(image);
 
+	return response;
+}
+
+static RSFilterResponse *
+filter_get_image8(RSFilter *filter, const RSFilterRequest *request)
+{
 	RSFilterResponse *response = NULL;
-	GdkPixbuf *image = NULL;
 	GdkRectangle* roi = NULL;
 	RSFilterRequest *r = NULL;
 
-	g_return_val_if_fail(RS_IS_FILTER(filter), NULL);
-	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), NULL);
-
-	if (count == -1)
-		gt = g_timer_new();
-	count++;
-
 	if (filter->enabled && (roi = rs_filter_request_get_roi(request)))
 	{
-		roi = clamp_roi(roi, filter, request);
+		roi = clamp_roi(roi, 0, filter, request);
 		if (roi)
 		{
 			r = rs_filter_request_clone(request);
@@ -341,50 +674,52 @@ rs_filter_get_image8(RSFilter *filter, const RSFilterRequest *request)
 	else if (filter->previous)
 		response = rs_filter_get_image8(filter->previous, request);
 
-	g_assert(RS_IS_FILTER_RESPONSE(response));
-
-	image = rs_filter_response_get_image8(response);
-	elapsed = g_timer_elapsed(gt, NULL) - last_elapsed;
-
-	/* Subtract 16 bit time */
-	if (rs_filter_param_get_float(RS_FILTER_PARAM(response), "16-bit-time", &temp))
-		elapsed -= temp;
-
 	if (roi)
 		g_free(roi);
 	if (r)
 		g_object_unref(r);
 
-#ifdef FILTER_SHOW_PERFORMANCE
-	if ((elapsed > FILTER_PERF_ELAPSED_MIN) && (image != NULL)) {
-		gint iw = gdk_pixbuf_get_width(image);
-		gint ih = gdk_pixbuf_get_height(image);
-		if (rs_filter_response_get_roi(response)) 
-		{
-			GdkRectangle *roi = rs_filter_response_get_roi(response);
-			iw = roi->width;
-			ih = roi->height;
-		}
-		filter_performance("%s took: \033[32m%.0f\033[0mms", RS_FILTER_NAME(filter), elapsed * 1000);
-		filter_performance(" [\033[33m%.01f\033[0mMpix/s]", ((gfloat)(iw * ih)) / elapsed / 1000000.0);
-		filter_performance("\n");
-	}
-#endif
+	return response;
+}
+
+/**
+ * Get 8 bit output image from a RSFilter
+ * @param filter A RSFilter
+ * @param param A RSFilterRequest defining parameters for a image request
+ * @return A RS_IMAGE16, this must be unref'ed
+ */
+RSFilterResponse *
+rs_filter_get_image8(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSFilterResponse *response;
+	GdkPixbuf *image;
+	const gboolean trace = rs_trace_is_enabled();
 
-	last_elapsed += elapsed;
+	g_return_val_if_fail(RS_IS_FILTER(filter), NULL);
+	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), NULL);
+
+	RS_DEBUG(FILTERS, "rs_filter_get_image8(%s [%p])", RS_FILTER_NAME(filter), filter);
 
+	if (trace)
+		rs_trace_begin();
+
+	response = filter_get_image8(filter, request);
+
+	g_assert(RS_IS_FILTER_RESPONSE(response));
+
+	image = rs_filter_response_get_image8(response);
 	g_assert(GDK_IS_PIXBUF(image) || (image == NULL));
 
-	count--;
-	if (count == -1)
+	if (trace)
 	{
-		last_elapsed = 0.0;
-		rs_filter_param_get_float(RS_FILTER_PARAM(response), "16-bit-time", &last_elapsed);
-		last_elapsed = g_timer_elapsed(gt, NULL)-last_elapsed;
-		if (last_elapsed > CHAIN_PERF_ELAPSED_MIN)
-			filter_performance("Complete 8 bit chain took: \033[32m%.0f\033[0mms\n\n", last_elapsed*1000.0);
-		g_timer_destroy(gt);
-		last_elapsed = 0.0;
+		GdkRectangle *roi = rs_filter_response_get_roi(response);
+		gint64 pixels = 0;
+
+		if (roi)
+			pixels = ((gint64) roi->width) * roi->height;
+		else if (image)
+			pixels = ((gint64) gdk_pixbuf_get_width(image)) * gdk_pixbuf_get_height(image);
+		rs_trace_end(RS_FILTER_NAME(filter), "filter8", roi, pixels);
 	}
 
 	if (image)
@@ -414,6 +749,27 @@ rs_filter_get_size(RSFilter *filter, const RSFilterRequest *request)
 	return response;
 }
 
+/**
+ * Get the number of pixels a RSFilter needs around a region of interest
+ * @param filter A RSFilter
+ * @param request A RSFilterRequest defining parameters for the request
+ * @return The margin in pixels or RS_FILTER_MARGIN_FULL if the filter needs
+ *         its complete input
+ */
+gint
+rs_filter_get_margin(RSFilter *filter, const RSFilterRequest *request)
+{
+	gint margin = 0;
+
+	g_return_val_if_fail(RS_IS_FILTER(filter), 0);
+	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), 0);
+
+	if (RS_FILTER_GET_CLASS(filter)->get_margin && filter->enabled)
+		margin = RS_FILTER_GET_CLASS(filter)->get_margin(filter, request);
+
+	return margin;
+}
+
 /**
  * Get predicted size of a RSFilter
  * @param filter A RSFilter
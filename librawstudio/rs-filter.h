@@ -76,11 +76,23 @@ typedef enum {
 	RS_FILTER_CHANGED_ICC_PROFILE = 1<<2
 } RSFilterChangedMask;
 
+/* Returned by get_margin() when a filter needs its complete input */
+#define RS_FILTER_MARGIN_FULL (-1)
+
 typedef struct _RSFilter RSFilter;
 typedef struct _RSFilterClass RSFilterClass;
 
 typedef RSFilterResponse *(*RSFilterFunc)(RSFilter *filter, const RSFilterRequest *request);
 
+/**
+ * A pointwise operation applied in place to a range of rows
+ * @param data Data returned by the prepare_pointwise() class method
+ * @param image The image to modify, all columns must be processed
+ * @param start_y The first row to process
+ * @param end_y The row after the last row to process
+ */
+typedef void (*RSFilterPointwiseFunc)(gpointer data, RS_IMAGE16 *image, gint start_y, gint end_y);
+
 struct _RSFilter {
 	GObject parent;
 	gboolean dispose_has_run;
@@ -98,7 +110,23 @@ struct _RSFilterClass {
 	RSFilterFunc get_image;
 	RSFilterFunc get_image8;
 	RSFilterResponse *(*get_size)(RSFilter *filter, const RSFilterRequest *request);
-	void (*previous_changed)(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask);
+	gint (*get_margin)(RSFilter *filter, const RSFilterRequest *request);
+	/* Pointwise filters can implement these to be fused with neighbouring
+	 * pointwise filters into a single pass. get_pointwise_request() returns
+	 * the request to pass upstream, or NULL if the filter cannot run
+	 * pointwise for this request. prepare_pointwise() receives the upstream
+	 * response, updates its parameters to describe the output and returns
+	 * the function to apply, or NULL if pixels are left untouched */
+	RSFilterRequest *(*get_pointwise_request)(RSFilter *filter, const RSFilterRequest *request);
+	RSFilterPointwiseFunc (*prepare_pointwise)(RSFilter *filter, const RSFilterRequest *request, RSFilterResponse *response, gpointer *data, GDestroyNotify *destroy);
+	/* region is the changed area in the output of this filter, or NULL if
+	 * all of it changed. Implementations must call rs_filter_changed_region() */
+	void (*previous_changed)(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask, const GdkRectangle *region);
+	/* Maps a changed area of the previous filter's output to the area of
+	 * this filter's output depending on it. Returns FALSE if all output
+	 * depends on it. Filters without it are assumed to change everything,
+	 * unless they are pointwise or keep geometry and have a finite margin */
+	gboolean (*map_changed_region)(RSFilter *filter, GdkRectangle *region);
 };
 
 GType rs_filter_get_type(void) G_GNUC_CONST;
@@ -126,6 +154,18 @@ extern void rs_filter_set_previous(RSFilter *filter, RSFilter *previous);
  */
 extern void rs_filter_changed(RSFilter *filter, RSFilterChangedMask mask);
 
+/**
+ * Signal that a part of the output of a filter has changed. The region is
+ * mapped through the geometry of all following filters. Listeners of the
+ * "region-changed" signal will receive the region in output coordinates
+ * This should only be called from filters
+ * @param filter The changed filter
+ * @param mask A mask indicating what changed
+ * @param region The changed area in output coordinates of filter, or NULL if
+ *               everything changed. Ignored for dimension changes
+ */
+extern void rs_filter_changed_region(RSFilter *filter, RSFilterChangedMask mask, const GdkRectangle *region);
+
 /**
  * Get the output image from a RSFilter
  * @param filter A RSFilter
@@ -159,6 +199,15 @@ extern RSFilterResponse *rs_filter_get_size(RSFilter *filter, const RSFilterRequ
  */
 extern gboolean rs_filter_get_size_simple(RSFilter *filter, const RSFilterRequest *request, gint *width, gint *height);
 
+/**
+ * Get the number of pixels a RSFilter needs around a region of interest
+ * @param filter A RSFilter
+ * @param request A RSFilterRequest defining parameters for the request
+ * @return The margin in pixels or RS_FILTER_MARGIN_FULL if the filter needs
+ *         its complete input
+ */
+extern gint rs_filter_get_margin(RSFilter *filter, const RSFilterRequest *request);
+
 /**
  * Set a GObject property on zero or more filters above #filter recursively
  * @param filter A RSFilter
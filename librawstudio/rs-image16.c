@@ -29,10 +29,144 @@
 
 #define PITCH(width) ((((width)+15)/16)*16)
 
+/* Buffers smaller than this are not worth pooling */
+#define POOL_MIN_BYTES (64*1024)
+/* Size classes per power of two, limits waste to 1/POOL_CLASS_STEPS */
+#define POOL_CLASS_STEPS 8
+#define POOL_DEFAULT_LIMIT (256*1024*1024)
+
+/* An idle pixel buffer, linked into the global LRU and into its size class */
+typedef struct {
+	GList lru_link;
+	GList class_link;
+	gushort *pixels;
+	gsize size;
+} PoolBuffer;
+
+static GMutex pool_lock;
+static GQueue pool_lru = G_QUEUE_INIT; /* Most recently released first */
+static GHashTable *pool_classes = NULL; /* size -> GQueue of PoolBuffer */
+static gsize pool_limit = POOL_DEFAULT_LIMIT;
+static RSImage16PoolStats pool_stats;
+
 G_DEFINE_TYPE (RS_IMAGE16, rs_image16, G_TYPE_OBJECT);
 
 static GObjectClass *parent_class = NULL;
 
+/* Round up to the size class, so buffers can be reused for slightly different sizes */
+static gsize
+pool_class_size(gsize size)
+{
+	gsize power = POOL_MIN_BYTES;
+	gsize step;
+
+	while (power * 2 <= size)
+		power *= 2;
+
+	step = power / POOL_CLASS_STEPS;
+
+	return ((size + step - 1) / step) * step;
+}
+
+/* Must be called with pool_lock held */
+static void
+pool_evict(PoolBuffer *buffer)
+{
+	GQueue *class = g_hash_table_lookup(pool_classes, GSIZE_TO_POINTER(buffer->size));
+
+	g_queue_unlink(&pool_lru, &buffer->lru_link);
+	g_queue_unlink(class, &buffer->class_link);
+
+	pool_stats.bytes_resident -= buffer->size;
+	free(buffer->pixels);
+	g_slice_free(PoolBuffer, buffer);
+}
+
+/* Must be called with pool_lock held */
+static void
+pool_trim(gsize limit)
+{
+	while (pool_stats.bytes_resident > limit && pool_lru.tail)
+	{
+		pool_evict(pool_lru.tail->data);
+		pool_stats.evictions++;
+	}
+}
+
+/* Get a 16 byte aligned buffer of at least size bytes, size is updated to the actual size */
+static gushort *
+pool_get(gsize *size)
+{
+	gushort *pixels = NULL;
+	GQueue *class;
+
+	*size = pool_class_size(*size);
+
+	g_mutex_lock(&pool_lock);
+	if (pool_classes && (class = g_hash_table_lookup(pool_classes, GSIZE_TO_POINTER(*size))) && class->head)
+	{
+		/* The most recently released buffer is most likely to still be cached */
+		PoolBuffer *buffer = class->head->data;
+
+		pixels = buffer->pixels;
+		buffer->pixels = NULL;
+		pool_evict(buffer);
+		pool_stats.hits++;
+	}
+	else
+		pool_stats.misses++;
+	g_mutex_unlock(&pool_lock);
+
+	if (!pixels && posix_memalign((void **) &pixels, 16, *size) > 0)
+		return NULL;
+
+	g_mutex_lock(&pool_lock);
+	pool_stats.bytes_in_use += *size;
+	g_mutex_unlock(&pool_lock);
+
+	return pixels;
+}
+
+static void
+pool_release(gushort *pixels, gsize size)
+{
+	PoolBuffer *buffer;
+	GQueue *class;
+
+	g_mutex_lock(&pool_lock);
+
+	pool_stats.bytes_in_use -= size;
+
+	if (size > pool_limit)
+	{
+		g_mutex_unlock(&pool_lock);
+		free(pixels);
+		return;
+	}
+
+	if (!pool_classes)
+		pool_classes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_queue_free);
+
+	class = g_hash_table_lookup(pool_classes, GSIZE_TO_POINTER(size));
+	if (!class)
+	{
+		class = g_queue_new();
+		g_hash_table_insert(pool_classes, GSIZE_TO_POINTER(size), class);
+	}
+
+	buffer = g_slice_new0(PoolBuffer);
+	buffer->pixels = pixels;
+	buffer->size = size;
+	buffer->lru_link.data = buffer;
+	buffer->class_link.data = buffer;
+	g_queue_push_head_link(&pool_lru, &buffer->lru_link);
+	g_queue_push_head_link(class, &buffer->class_link);
+	pool_stats.bytes_resident += size;
+
+	pool_trim(pool_limit);
+	g_mutex_unlock(&pool_lock);
+}
+
 static void
 rs_image16_dispose (GObject *obj)
 {
@@ -51,7 +185,12 @@ rs_image16_finalize (GObject *obj)
 	RS_IMAGE16 *self = (RS_IMAGE16 *)obj;
 
 	if (self->pixels && (self->pixels_refcount == 1))
-		free(self->pixels);
+	{
+		if (self->pixels_size > 0)
+			pool_release(self->pixels, self->pixels_size);
+		else
+			free(self->pixels);
+	}
 
 	self->pixels_refcount--;
 
@@ -76,6 +215,7 @@ rs_image16_init (RS_IMAGE16 *self)
 	self->filters = 0;
 	self->pixels = NULL;
 	self->pixels_refcount = 0;
+	self->pixels_size = 0;
 }
 
 void
@@ -120,7 +260,8 @@ rs_image16_transform_getwh(RS_IMAGE16 *in, RS_RECT *crop, gdouble angle, gint or
 RS_IMAGE16 *
 rs_image16_new(const guint width, const guint height, const guint channels, const guint pixelsize)
 {
-	gint ret;
+	gint ret = 0;
+	gsize size;
 	RS_IMAGE16 *rsi;
 
 	g_return_val_if_fail(width < 65536, NULL);
@@ -141,8 +282,18 @@ rs_image16_new(const guint width, const guint height, const guint channels, cons
 	rsi->pixelsize = pixelsize;
 	rsi->filters = 0;
 
-	/* Allocate actual pixels */
-	ret = posix_memalign((void **) &rsi->pixels, 16, rsi->h*rsi->rowstride * sizeof(gushort));
+	/* Allocate actual pixels, reusing a pooled buffer if possible */
+	size = rsi->h*rsi->rowstride * sizeof(gushort);
+	if (size >= POOL_MIN_BYTES)
+	{
+		rsi->pixels = pool_get(&size);
+		if (rsi->pixels)
+			rsi->pixels_size = size;
+		else
+			ret = 1;
+	}
+	else
+		ret = posix_memalign((void **) &rsi->pixels, 16, size);
 	if (ret > 0)
 	{
 		rsi->pixels = NULL;
@@ -150,6 +301,7 @@ rs_image16_new(const guint width, const guint height, const guint channels, cons
 		return NULL;
 	}
 	rsi->pixels_refcount = 1;
+	rs_trace_allocated(rsi->h*rsi->rowstride * sizeof(gushort));
 
 	/* Verify alignment */
 	g_assert((GPOINTER_TO_INT(rsi->pixels) % 16) == 0);
@@ -328,3 +480,43 @@ rs_image16_get_checksum(RS_IMAGE16 *image)
 	}
 	return g_compute_checksum_for_data(G_CHECKSUM_SHA256, (guchar *) pixels, w*h*c);
 }
+
+/**
+ * Set the maximum amount of memory kept by idle pooled pixel buffers. Least
+ * recently released buffers are freed first
+ * @param bytes The limit in bytes, 0 disables pooling
+ */
+void
+rs_image16_pool_set_limit(gsize bytes)
+{
+	g_mutex_lock(&pool_lock);
+	pool_limit = bytes;
+	pool_trim(pool_limit);
+	g_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Free all idle pooled pixel buffers, buffers in use are not affected
+ */
+void
+rs_image16_pool_trim(void)
+{
+	g_mutex_lock(&pool_lock);
+	pool_trim(0);
+	g_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Get statistics for the pixel buffer pool
+ * @param stats A RSImage16PoolStats to fill
+ */
+void
+rs_image16_pool_get_stats(RSImage16PoolStats *stats)
+{
+	g_return_if_fail(stats != NULL);
+
+	g_mutex_lock(&pool_lock);
+	*stats = pool_stats;
+	stats->limit = pool_limit;
+	g_mutex_unlock(&pool_lock);
+}
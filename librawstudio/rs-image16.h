@@ -39,6 +39,7 @@ struct _rs_image16 {
 	guint pixelsize; /* the size of a pixel in SHORTS */
 	gushort *pixels;
 	gint pixels_refcount;
+	gsize pixels_size; /* Size of pooled pixel buffer, 0 if not pooled */
 	guint filters;
 	gboolean dispose_has_run;
 };
@@ -49,6 +50,15 @@ struct _RS_IMAGE16Class {
 	GObjectClass parent;
 };
 
+typedef struct {
+	guint64 hits;
+	guint64 misses;
+	guint64 evictions;
+	gsize bytes_resident; /* Idle buffers kept for reuse */
+	gsize bytes_in_use;
+	gsize limit;
+} RSImage16PoolStats;
+
 GType rs_image16_get_type (void);
 
 /**
@@ -89,4 +99,22 @@ extern gushort *rs_image16_get_pixel(RS_IMAGE16 *image, gint x, gint y, gboolean
 
 extern gchar *rs_image16_get_checksum(RS_IMAGE16 *image);
 
+/**
+ * Set the maximum amount of memory kept by idle pooled pixel buffers. Least
+ * recently released buffers are freed first
+ * @param bytes The limit in bytes, 0 disables pooling
+ */
+extern void rs_image16_pool_set_limit(gsize bytes);
+
+/**
+ * Free all idle pooled pixel buffers, buffers in use are not affected
+ */
+extern void rs_image16_pool_trim(void);
+
+/**
+ * Get statistics for the pixel buffer pool
+ * @param stats A RSImage16PoolStats to fill
+ */
+extern void rs_image16_pool_get_stats(RSImage16PoolStats *stats);
+
 #endif /* RS_IMAGE16_H */
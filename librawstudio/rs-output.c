@@ -99,6 +99,79 @@ rs_output_execute(RSOutput *output, RSFilter *filter)
 		return FALSE;
 }
 
+/**
+ * Render the rows of strip from a filter chain, for encoders writing an image
+ * in strips. Filters not knowing about "crop-to-roi" return the complete
+ * image, it is kept in complete and reused for the following strips
+ * @param filter A RSFilter to get image data from
+ * @param request A RSFilterRequest, its ROI will be set to strip
+ * @param image16 TRUE to get a RS_IMAGE16, FALSE to get a GdkPixbuf
+ * @param width The width of the complete image
+ * @param height The height of the complete image
+ * @param strip The rows to render
+ * @param strip_y Will be set to the image row at the top of the returned image
+ * @param complete Must point to NULL before the first strip, unref when done
+ * @return A new reference to the image or NULL on failure, unref when done
+ */
+GObject *
+rs_output_get_strip(RSFilter *filter, RSFilterRequest *request, gboolean image16, gint width, gint height, GdkRectangle *strip, gint *strip_y, GObject **complete)
+{
+	RSFilterResponse *response;
+	GObject *image;
+	gint w = 0, h = 0;
+
+	if (*complete)
+	{
+		*strip_y = 0;
+		return g_object_ref(*complete);
+	}
+
+	rs_filter_request_set_roi(request, strip);
+	if (image16)
+	{
+		response = rs_filter_get_image(filter, request);
+		image = (GObject *) rs_filter_response_get_image(response);
+		if (image)
+		{
+			w = RS_IMAGE16(image)->w;
+			h = RS_IMAGE16(image)->h;
+		}
+	}
+	else
+	{
+		response = rs_filter_get_image8(filter, request);
+		image = (GObject *) rs_filter_response_get_image8(response);
+		if (image)
+		{
+			w = gdk_pixbuf_get_width(GDK_PIXBUF(image));
+			h = gdk_pixbuf_get_height(GDK_PIXBUF(image));
+		}
+	}
+	g_object_unref(response);
+
+	if (image && w == width)
+	{
+		/* Filters not knowing about "crop-to-roi" return the complete image,
+		 * keep it instead of rendering it again for every strip */
+		if (h == height)
+		{
+			*complete = g_object_ref(image);
+			*strip_y = 0;
+			return image;
+		}
+		if (h == strip->height)
+		{
+			*strip_y = strip->y;
+			return image;
+		}
+	}
+
+	if (image)
+		g_object_unref(image);
+
+	return NULL;
+}
+
 static void
 integer_changed(GtkAdjustment *adjustment, gpointer user_data)
 {
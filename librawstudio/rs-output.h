@@ -111,6 +111,23 @@ rs_output_get_extension(RSOutput *output);
 extern gboolean
 rs_output_execute(RSOutput *output, RSFilter *filter);
 
+/**
+ * Render the rows of strip from a filter chain, for encoders writing an image
+ * in strips. Filters not knowing about "crop-to-roi" return the complete
+ * image, it is kept in complete and reused for the following strips
+ * @param filter A RSFilter to get image data from
+ * @param request A RSFilterRequest, its ROI will be set to strip
+ * @param image16 TRUE to get a RS_IMAGE16, FALSE to get a GdkPixbuf
+ * @param width The width of the complete image
+ * @param height The height of the complete image
+ * @param strip The rows to render
+ * @param strip_y Will be set to the image row at the top of the returned image
+ * @param complete Must point to NULL before the first strip, unref when done
+ * @return A new reference to the image or NULL on failure, unref when done
+ */
+extern GObject *
+rs_output_get_strip(RSFilter *filter, RSFilterRequest *request, gboolean image16, gint width, gint height, GdkRectangle *strip, gint *strip_y, GObject **complete);
+
 /**
  * Load parameters from config for a RSOutput
  * @param output A RSOutput
@@ -0,0 +1,394 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <unistd.h> /* getpid() */
+#include <glib/gstdio.h>
+#include <rawstudio.h>
+#include "rs-trace.h"
+
+#define TRACE_CHUNK_SIZE 1024
+#define TRACE_STACK_DEPTH 64
+
+typedef struct {
+	const gchar *name;
+	const gchar *category;
+	gint64 begin;
+	gint64 end;
+	gint64 self;
+	gint64 pixels;
+	gint64 bytes;
+	gboolean has_roi;
+	GdkRectangle roi;
+} TraceEvent;
+
+typedef struct _TraceChunk TraceChunk;
+struct _TraceChunk {
+	TraceEvent events[TRACE_CHUNK_SIZE];
+	gint n_events;      /* Published with atomics, read by rs_trace_dump() */
+	TraceChunk *next;   /* Published with atomics, read by rs_trace_dump() */
+};
+
+typedef struct {
+	gint64 begin;
+	gint64 children;
+	gint64 allocated;
+	gint64 children_allocated;
+} TraceFrame;
+
+/* Only the owning thread writes to this, rs_trace_dump() reads published
+ * events without locking */
+typedef struct _TraceThread TraceThread;
+struct _TraceThread {
+	gint tid;
+	TraceChunk *first;
+	TraceChunk *last;
+	TraceFrame stack[TRACE_STACK_DEPTH];
+	gint depth;
+	gint64 allocated;
+	TraceThread *next;
+};
+
+static gint enabled = 0;
+static gint64 epoch = 0;
+static gchar *trace_filename = NULL;
+static gint next_tid = 1;
+static TraceThread *threads = NULL;
+static GPrivate current_thread = G_PRIVATE_INIT(NULL);
+
+/* The buffer is intentionally never freed when a thread exits, the events
+ * must survive until they are dumped */
+static TraceThread *
+get_thread(void)
+{
+	TraceThread *thread = g_private_get(&current_thread);
+
+	if (G_UNLIKELY(!thread))
+	{
+		thread = g_new0(TraceThread, 1);
+		thread->tid = g_atomic_int_add(&next_tid, 1);
+		thread->first = thread->last = g_new0(TraceChunk, 1);
+
+		do {
+			thread->next = g_atomic_pointer_get(&threads);
+		} while (!g_atomic_pointer_compare_and_exchange(&threads, thread->next, thread));
+
+		g_private_set(&current_thread, thread);
+	}
+
+	return thread;
+}
+
+/**
+ * Enable tracing of filter invocations. Events are kept in per-thread
+ * buffers until rs_trace_dump() is called
+ * @param filename Where to write the trace, if NULL the environment
+ *                 variable RS_TRACE is used. If neither is set tracing
+ *                 stays disabled
+ */
+void
+rs_trace_setup(const gchar *filename)
+{
+	if (!filename)
+		filename = g_getenv("RS_TRACE");
+
+	if (!filename || !filename[0])
+		return;
+
+	g_free(trace_filename);
+	trace_filename = g_strdup(filename);
+	rs_trace_enable();
+
+	RS_DEBUG(PERFORMANCE, "Tracing filter invocations to %s", trace_filename);
+}
+
+/**
+ * Enable tracing without a default output file, events can still be
+ * read back with rs_trace_summarize() or rs_trace_dump()
+ */
+void
+rs_trace_enable(void)
+{
+	if (rs_trace_is_enabled())
+		return;
+
+	epoch = g_get_monotonic_time();
+	g_atomic_int_set(&enabled, 1);
+}
+
+/**
+ * Check if tracing is enabled
+ * @return TRUE if events are being recorded
+ */
+gboolean
+rs_trace_is_enabled(void)
+{
+	return g_atomic_int_get(&enabled) != 0;
+}
+
+/**
+ * Mark the beginning of a traced span on the calling thread. Spans can
+ * be nested and every call must be matched by rs_trace_end()
+ */
+void
+rs_trace_begin(void)
+{
+	TraceThread *thread = get_thread();
+
+	if (thread->depth < TRACE_STACK_DEPTH)
+	{
+		TraceFrame *frame = &thread->stack[thread->depth];
+		frame->begin = g_get_monotonic_time();
+		frame->children = 0;
+		frame->allocated = thread->allocated;
+		frame->children_allocated = 0;
+	}
+	thread->depth++;
+}
+
+/**
+ * Mark the end of the innermost span on the calling thread and record it
+ * @param name Name of the event, this must stay valid until the trace is dumped
+ * @param category Category of the event, this must stay valid until the trace is dumped
+ * @param roi The region processed or NULL
+ * @param pixels The number of pixels processed
+ */
+void
+rs_trace_end(const gchar *name, const gchar *category, const GdkRectangle *roi, gint64 pixels)
+{
+	TraceThread *thread = get_thread();
+	TraceFrame *frame;
+	TraceEvent *event;
+	TraceChunk *chunk;
+	gint64 end, duration, allocated;
+
+	g_return_if_fail(thread->depth > 0);
+
+	thread->depth--;
+	if (thread->depth >= TRACE_STACK_DEPTH)
+		return;
+
+	end = g_get_monotonic_time();
+	frame = &thread->stack[thread->depth];
+	duration = end - frame->begin;
+	allocated = thread->allocated - frame->allocated;
+
+	/* Let the parent know how much of its time and memory was ours */
+	if (thread->depth > 0)
+	{
+		thread->stack[thread->depth-1].children += duration;
+		thread->stack[thread->depth-1].children_allocated += allocated;
+	}
+
+	chunk = thread->last;
+	if (chunk->n_events == TRACE_CHUNK_SIZE)
+	{
+		TraceChunk *new_chunk = g_new0(TraceChunk, 1);
+		g_atomic_pointer_set(&chunk->next, new_chunk);
+		thread->last = chunk = new_chunk;
+	}
+
+	event = &chunk->events[chunk->n_events];
+	event->name = name;
+	event->category = category;
+	event->begin = frame->begin;
+	event->end = end;
+	event->self = duration - frame->children;
+	event->pixels = pixels;
+	event->bytes = allocated - frame->children_allocated;
+	event->has_roi = (roi != NULL);
+	if (roi)
+		event->roi = *roi;
+
+	/* Publish the event */
+	g_atomic_int_set(&chunk->n_events, chunk->n_events + 1);
+}
+
+/**
+ * Account memory allocated by the calling thread to the current span
+ * @param bytes The number of bytes allocated
+ */
+void
+rs_trace_allocated(gsize bytes)
+{
+	if (!rs_trace_is_enabled())
+		return;
+
+	get_thread()->allocated += bytes;
+}
+
+/**
+ * Write all recorded events as Chrome trace_event JSON, this can be
+ * loaded in chrome://tracing or Perfetto
+ * @param filename The file to write, if NULL the file given to rs_trace_setup() is used
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean
+rs_trace_dump(const gchar *filename)
+{
+	TraceThread *thread;
+	FILE *file;
+	gboolean first = TRUE;
+	gchar mpix[G_ASCII_DTOSTR_BUF_SIZE];
+	const gint pid = getpid();
+
+	if (!filename)
+		filename = trace_filename;
+
+	if (!filename)
+		return FALSE;
+
+	file = g_fopen(filename, "w");
+	if (!file)
+	{
+		g_warning("Could not open %s for writing trace", filename);
+		return FALSE;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for (thread = g_atomic_pointer_get(&threads); thread; thread = thread->next)
+	{
+		TraceChunk *chunk;
+
+		fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"Thread %d\"}}",
+			first ? "" : ",", pid, thread->tid, thread->tid);
+		first = FALSE;
+
+		for (chunk = thread->first; chunk; chunk = g_atomic_pointer_get(&chunk->next))
+		{
+			const gint n_events = g_atomic_int_get(&chunk->n_events);
+			gint i;
+
+			for (i = 0; i < n_events; i++)
+			{
+				TraceEvent *event = &chunk->events[i];
+				gchar *name = g_strescape(event->name, NULL);
+				gdouble rate = 0.0;
+
+				/* Pixels per microsecond equals megapixels per second */
+				if (event->self > 0)
+					rate = ((gdouble) event->pixels) / ((gdouble) event->self);
+				g_ascii_formatd(mpix, sizeof(mpix), "%.2f", rate);
+
+				fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+					"\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ",\"args\":{"
+					"\"self-us\":%" G_GINT64_FORMAT ",\"pixels\":%" G_GINT64_FORMAT ",\"mpix-per-s\":%s,\"bytes-allocated\":%" G_GINT64_FORMAT,
+					name, event->category, pid, thread->tid,
+					event->begin - epoch, event->end - event->begin,
+					event->self, event->pixels, mpix, event->bytes);
+				if (event->has_roi)
+					fprintf(file, ",\"roi\":[%d,%d,%d,%d]", event->roi.x, event->roi.y, event->roi.width, event->roi.height);
+				fprintf(file, "}}");
+
+				g_free(name);
+			}
+		}
+	}
+
+	fprintf(file, "\n]}\n");
+
+	return fclose(file) == 0;
+}
+
+static gint
+summary_compare(gconstpointer a, gconstpointer b)
+{
+	const RSTraceSummary *sa = a;
+	const RSTraceSummary *sb = b;
+
+	if (sa->self_us == sb->self_us)
+		return 0;
+	return (sa->self_us < sb->self_us) ? 1 : -1;
+}
+
+/**
+ * Sum up all recorded events by name
+ * @return A GArray of RSTraceSummary sorted by descending self time, this must be freed with g_array_free()
+ */
+GArray *
+rs_trace_summarize(void)
+{
+	GArray *summary = g_array_new(FALSE, TRUE, sizeof(RSTraceSummary));
+	GHashTable *index = g_hash_table_new(g_str_hash, g_str_equal);
+	TraceThread *thread;
+
+	for (thread = g_atomic_pointer_get(&threads); thread; thread = thread->next)
+	{
+		TraceChunk *chunk;
+
+		for (chunk = thread->first; chunk; chunk = g_atomic_pointer_get(&chunk->next))
+		{
+			const gint n_events = g_atomic_int_get(&chunk->n_events);
+			gint i;
+
+			for (i = 0; i < n_events; i++)
+			{
+				TraceEvent *event = &chunk->events[i];
+				RSTraceSummary *sum;
+				gpointer pos;
+
+				if (!g_hash_table_lookup_extended(index, event->name, NULL, &pos))
+				{
+					RSTraceSummary empty = {0};
+					empty.name = event->name;
+					pos = GUINT_TO_POINTER(summary->len);
+					g_array_append_val(summary, empty);
+					g_hash_table_insert(index, (gpointer) event->name, pos);
+				}
+
+				sum = &g_array_index(summary, RSTraceSummary, GPOINTER_TO_UINT(pos));
+				sum->calls++;
+				sum->self_us += event->self;
+				sum->pixels += event->pixels;
+				sum->bytes += event->bytes;
+			}
+		}
+	}
+
+	g_hash_table_destroy(index);
+	g_array_sort(summary, summary_compare);
+
+	return summary;
+}
+
+/**
+ * Forget all recorded events
+ * @note This must not be called while traced spans are in progress on any thread
+ */
+void
+rs_trace_clear(void)
+{
+	TraceThread *thread;
+
+	for (thread = g_atomic_pointer_get(&threads); thread; thread = thread->next)
+	{
+		TraceChunk *chunk = thread->first->next;
+
+		while (chunk)
+		{
+			TraceChunk *next = chunk->next;
+			g_free(chunk);
+			chunk = next;
+		}
+
+		g_atomic_pointer_set(&thread->first->next, NULL);
+		g_atomic_int_set(&thread->first->n_events, 0);
+		thread->last = thread->first;
+	}
+}
@@ -0,0 +1,110 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_TRACE_H
+#define RS_TRACE_H
+
+#include <glib.h>
+#include <gdk/gdk.h>
+
+G_BEGIN_DECLS
+
+/* Accumulated numbers for all events sharing a name */
+typedef struct {
+	const gchar *name;
+	guint calls;
+	gint64 self_us;
+	gint64 pixels;
+	gint64 bytes;
+} RSTraceSummary;
+
+/**
+ * Enable tracing of filter invocations. Events are kept in per-thread
+ * buffers until rs_trace_dump() is called
+ * @param filename Where to write the trace, if NULL the environment
+ *                 variable RS_TRACE is used. If neither is set tracing
+ *                 stays disabled
+ */
+extern void
+rs_trace_setup(const gchar *filename);
+
+/**
+ * Enable tracing without a default output file, events can still be
+ * read back with rs_trace_summarize() or rs_trace_dump()
+ */
+extern void
+rs_trace_enable(void);
+
+/**
+ * Check if tracing is enabled
+ * @return TRUE if events are being recorded
+ */
+extern gboolean
+rs_trace_is_enabled(void);
+
+/**
+ * Mark the beginning of a traced span on the calling thread. Spans can
+ * be nested and every call must be matched by rs_trace_end()
+ */
+extern void
+rs_trace_begin(void);
+
+/**
+ * Mark the end of the innermost span on the calling thread and record it
+ * @param name Name of the event, this must stay valid until the trace is dumped
+ * @param category Category of the event, this must stay valid until the trace is dumped
+ * @param roi The region processed or NULL
+ * @param pixels The number of pixels processed
+ */
+extern void
+rs_trace_end(const gchar *name, const gchar *category, const GdkRectangle *roi, gint64 pixels);
+
+/**
+ * Account memory allocated by the calling thread to the current span
+ * @param bytes The number of bytes allocated
+ */
+extern void
+rs_trace_allocated(gsize bytes);
+
+/**
+ * Write all recorded events as Chrome trace_event JSON, this can be
+ * loaded in chrome://tracing or Perfetto
+ * @param filename The file to write, if NULL the file given to rs_trace_setup() is used
+ * @return TRUE on success, FALSE otherwise
+ */
+extern gboolean
+rs_trace_dump(const gchar *filename);
+
+/**
+ * Sum up all recorded events by name
+ * @return A GArray of RSTraceSummary sorted by descending self time, this must be freed with g_array_free()
+ */
+extern GArray *
+rs_trace_summarize(void);
+
+/**
+ * Forget all recorded events
+ * @note This must not be called while traced spans are in progress on any thread
+ */
+extern void
+rs_trace_clear(void);
+
+G_END_DECLS
+
+#endif /* RS_TRACE_H */
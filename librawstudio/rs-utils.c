@@ -142,6 +142,10 @@ rs_constrain_to_bounding_box(gint target_width, gint target_height, gint *width,
 	*height = MIN((gint) ((gdouble)*height) / scale, target_height);
 }
 
+/* We assume processors will not be added/removed during our lifetime */
+static gint processor_cores = 0;
+static GMutex cores_lock;
+
 /**
  * Try to count the number of processor cores in a system.
  * @note This currently only works for systems with /proc/cpuinfo
@@ -150,16 +154,11 @@ rs_constrain_to_bounding_box(gint target_width, gint target_height, gint *width,
 gint
 rs_get_number_of_processor_cores(void)
 {
-	static GMutex lock;
-
-	/* We assume processors will not be added/removed during our lifetime */
-	static gint num = 0;
+	if (processor_cores)
+		return processor_cores;
 
-	if (num)
-		return num;
-
-	g_mutex_lock (&lock);
-	if (num == 0)
+	g_mutex_lock (&cores_lock);
+	if (processor_cores == 0)
 	{
 		/* Use a temporary for thread safety */
 		gint temp_num = 0;
@@ -191,11 +190,24 @@ rs_get_number_of_processor_cores(void)
 		/* Be sure we have at least 1 processor and as sanity check, clamp to no more than 127 */
 		temp_num = (temp_num <= 0) ? 1 : MIN(temp_num, 127);
 		RS_DEBUG(PERFORMANCE, "Detected %d CPU cores.", temp_num);
-		num = temp_num;
+		processor_cores = temp_num;
 	}
-	g_mutex_unlock (&lock);
+	g_mutex_unlock (&cores_lock);
 
-	return num;
+	return processor_cores;
+}
+
+/**
+ * Override the number of processor cores used for threading
+ * @note This must be called before any filter is run, the worker pool keeps the number it was started with
+ * @param cores The number of cores to report, 0 to detect again
+ */
+void
+rs_set_number_of_processor_cores(gint cores)
+{
+	g_mutex_lock (&cores_lock);
+	processor_cores = CLAMP(cores, 0, 127);
+	g_mutex_unlock (&cores_lock);
 }
 
 #if defined (__i386__) || defined (__x86_64__)
@@ -220,6 +232,19 @@ rs_detect_cpu_features(void)
        : "=a" (eax), "=c" (ecx),  "=d" (edx) \
        : "0" (cmd) \
      ); \
+} while(0)
+/* Sub-leaf 0 of cmd, returning only ebx */
+#define cpuid_ebx(cmd, ebx) \
+  do { \
+     guint _eax, _ecx = 0, _edx; \
+     asm ( \
+       "push %%"REG_b"\n\t"\
+       "cpuid\n\t" \
+       "mov %%ebx, %%esi\n\t" \
+       "pop %%"REG_b"\n\t" \
+       : "=a" (_eax), "=S" (ebx), "+c" (_ecx), "=d" (_edx) \
+       : "0" (cmd) \
+     ); \
 } while(0)
 	guint eax;
 	guint edx;
@@ -260,9 +285,11 @@ rs_detect_cpu_features(void)
 		{
 			guint std_dsc;
 			guint ext_dsc;
+			guint max_std;
 
 			/* Get the standard level */
 			cpuid(0x00000000, std_dsc, ecx, edx);
+			max_std = std_dsc;
 
 			if (std_dsc)
 			{
@@ -292,6 +319,15 @@ rs_detect_cpu_features(void)
 						if ((eax & 0x6) == 0x6)
 							cpuflags |= RS_CPU_FLAG_AVX;
 				}
+
+				/* AVX2 needs the same OS support as AVX */
+				if (max_std >= 7 && (cpuflags & RS_CPU_FLAG_AVX))
+				{
+					guint ebx;
+					cpuid_ebx(0x00000007, ebx);
+					if (ebx & 0x00000020)
+						cpuflags |= RS_CPU_FLAG_AVX2;
+				}
 			}
 
 			/* Is there extensions */
@@ -331,10 +367,12 @@ rs_detect_cpu_features(void)
 	report("SSE4.1",RS_CPU_FLAG_SSE4_1);
 	report("SSE4.2",RS_CPU_FLAG_SSE4_2);
 	report("AVX",RS_CPU_FLAG_AVX);
+	report("AVX2",RS_CPU_FLAG_AVX2);
 #undef report
 
 	return(stored_cpuflags);
 #undef cpuid
+#undef cpuid_ebx
 }
 
 #else
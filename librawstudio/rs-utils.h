@@ -72,6 +72,14 @@ rs_constrain_to_bounding_box(gint target_width, gint target_height, gint *width,
 extern gint
 rs_get_number_of_processor_cores(void);
 
+/**
+ * Override the number of processor cores used for threading
+ * @note This must be called before any filter is run, the worker pool keeps the number it was started with
+ * @param cores The number of cores to report, 0 to detect again
+ */
+extern void
+rs_set_number_of_processor_cores(gint cores);
+
 /**
  * Detect cpu features
  * @return A bitmask of @RSCpuFlags
@@ -0,0 +1,218 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <rawstudio.h>
+#include "rs-worker-pool.h"
+
+/* A set of tasks submitted by one caller of rs_worker_pool_run() */
+typedef struct {
+	gint refcount;
+	gchar *tasks;
+	gsize task_size;
+	gint n_tasks;
+	GThreadFunc func;
+	gint next;
+	gint done;
+	GMutex lock;
+	GCond cond;
+} RSWorkerBatch;
+
+typedef struct {
+	gint start_y;
+	gint end_y;
+	RSWorkerRowFunc func;
+	gpointer user_data;
+} RowTask;
+
+static GMutex init_lock;
+static GThreadPool *pool = NULL;
+static guint n_workers = 0;
+
+static void
+batch_unref(RSWorkerBatch *batch)
+{
+	if (g_atomic_int_dec_and_test(&batch->refcount))
+	{
+		g_mutex_clear(&batch->lock);
+		g_cond_clear(&batch->cond);
+		g_free(batch);
+	}
+}
+
+static void
+batch_process(RSWorkerBatch *batch)
+{
+	gint i;
+
+	/* Grab tasks until none are left */
+	while ((i = g_atomic_int_add(&batch->next, 1)) < batch->n_tasks)
+	{
+		batch->func(batch->tasks + i * batch->task_size);
+
+		g_mutex_lock(&batch->lock);
+		if (++batch->done == batch->n_tasks)
+			g_cond_signal(&batch->cond);
+		g_mutex_unlock(&batch->lock);
+	}
+}
+
+static void
+worker(gpointer data, gpointer unused)
+{
+	RSWorkerBatch *batch = data;
+
+	batch_process(batch);
+	batch_unref(batch);
+}
+
+static GThreadPool *
+get_pool(void)
+{
+	g_mutex_lock(&init_lock);
+	if (!pool)
+	{
+		n_workers = rs_get_number_of_processor_cores();
+		/* Exclusive threads are started right away and kept for our lifetime */
+		pool = g_thread_pool_new(worker, NULL, n_workers, TRUE, NULL);
+		RS_DEBUG(PERFORMANCE, "Started %u filter workers.", n_workers);
+	}
+	g_mutex_unlock(&init_lock);
+
+	return pool;
+}
+
+/**
+ * Get the number of persistent threads in the shared worker pool
+ * @return The number of worker threads
+ */
+guint
+rs_worker_pool_get_n_workers(void)
+{
+	get_pool();
+
+	return n_workers;
+}
+
+/**
+ * Run a function on every element of an array of tasks using the shared
+ * worker pool and wait for all of them to finish. The calling thread will
+ * process tasks as well, so this is safe to call from inside a worker
+ * @note func must simply return, it must NOT call g_thread_exit()
+ * @param tasks An array of n_tasks elements, each task_size bytes
+ * @param task_size The size of a single element in tasks
+ * @param n_tasks The number of elements in tasks
+ * @param func A function to call with a pointer to each element
+ */
+void
+rs_worker_pool_run(gpointer tasks, gsize task_size, guint n_tasks, GThreadFunc func)
+{
+	RSWorkerBatch *batch;
+	GThreadPool *p;
+	guint i, helpers;
+
+	g_return_if_fail(tasks != NULL);
+	g_return_if_fail(func != NULL);
+
+	if (n_tasks == 0)
+		return;
+
+	/* Nothing to share, don't bother the pool */
+	if (n_tasks == 1)
+	{
+		func(tasks);
+		return;
+	}
+
+	p = get_pool();
+
+	batch = g_new0(RSWorkerBatch, 1);
+	batch->tasks = tasks;
+	batch->task_size = task_size;
+	batch->n_tasks = n_tasks;
+	batch->func = func;
+	g_mutex_init(&batch->lock);
+	g_cond_init(&batch->cond);
+
+	/* The caller takes part in the work, so we need at most n_tasks-1 helpers.
+	 * Helpers arriving late will find nothing left to do and return at once */
+	helpers = MIN(n_tasks - 1, n_workers);
+	batch->refcount = 1 + helpers;
+	for (i = 0; i < helpers; i++)
+		g_thread_pool_push(p, batch, NULL);
+
+	batch_process(batch);
+
+	/* Wait for the tasks picked up by helpers */
+	g_mutex_lock(&batch->lock);
+	while (batch->done < batch->n_tasks)
+		g_cond_wait(&batch->cond, &batch->lock);
+	g_mutex_unlock(&batch->lock);
+
+	batch_unref(batch);
+}
+
+static gpointer
+row_task_func(gpointer data)
+{
+	RowTask *t = data;
+
+	t->func(t->start_y, t->end_y, t->user_data);
+
+	return NULL;
+}
+
+/**
+ * Split height rows into bands and process them in parallel using the
+ * shared worker pool, this will return when all rows are processed
+ * @param height The number of rows to process
+ * @param min_rows The minimum number of rows in a band
+ * @param func A function to call for every band
+ * @param user_data Data to pass to func
+ */
+void
+rs_worker_pool_parallel_rows(gint height, gint min_rows, RSWorkerRowFunc func, gpointer user_data)
+{
+	guint i, n_tasks, rows_per_task;
+	RowTask *t;
+
+	g_return_if_fail(func != NULL);
+
+	if (height <= 0)
+		return;
+
+	min_rows = MAX(1, min_rows);
+	n_tasks = MIN(rs_get_number_of_processor_cores(), (height + min_rows - 1) / min_rows);
+	n_tasks = MAX(1, n_tasks);
+	rows_per_task = (height + n_tasks - 1) / n_tasks;
+	/* Rounding up may leave the last band(s) empty */
+	n_tasks = (height + rows_per_task - 1) / rows_per_task;
+
+	t = g_new(RowTask, n_tasks);
+	for (i = 0; i < n_tasks; i++)
+	{
+		t[i].start_y = i * rows_per_task;
+		t[i].end_y = MIN(height, t[i].start_y + rows_per_task);
+		t[i].func = func;
+		t[i].user_data = user_data;
+	}
+
+	rs_worker_pool_run(t, sizeof(RowTask), n_tasks, row_task_func);
+
+	g_free(t);
+}
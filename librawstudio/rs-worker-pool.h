@@ -0,0 +1,68 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_WORKER_POOL_H
+#define RS_WORKER_POOL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * A function processing a range of rows
+ * @param start_y The first row to process
+ * @param end_y The row after the last row to process
+ * @param user_data Data passed to rs_worker_pool_parallel_rows()
+ */
+typedef void (*RSWorkerRowFunc)(gint start_y, gint end_y, gpointer user_data);
+
+/**
+ * Get the number of persistent threads in the shared worker pool
+ * @return The number of worker threads
+ */
+extern guint
+rs_worker_pool_get_n_workers(void);
+
+/**
+ * Run a function on every element of an array of tasks using the shared
+ * worker pool and wait for all of them to finish. The calling thread will
+ * process tasks as well, so this is safe to call from inside a worker
+ * @note func must simply return, it must NOT call g_thread_exit()
+ * @param tasks An array of n_tasks elements, each task_size bytes
+ * @param task_size The size of a single element in tasks
+ * @param n_tasks The number of elements in tasks
+ * @param func A function to call with a pointer to each element
+ */
+extern void
+rs_worker_pool_run(gpointer tasks, gsize task_size, guint n_tasks, GThreadFunc func);
+
+/**
+ * Split height rows into bands and process them in parallel using the
+ * shared worker pool, this will return when all rows are processed
+ * @param height The number of rows to process
+ * @param min_rows The minimum number of rows in a band
+ * @param func A function to call for every band
+ * @param user_data Data to pass to func
+ */
+extern void
+rs_worker_pool_parallel_rows(gint height, gint min_rows, RSWorkerRowFunc func, gpointer user_data);
+
+G_END_DECLS
+
+#endif /* RS_WORKER_POOL_H */
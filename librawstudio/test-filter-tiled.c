@@ -0,0 +1,159 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>,
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Checks that tiled pulls fall back to a single untiled render when a tile
+ * comes back at another size than predicted */
+
+#include "rawstudio.h"
+
+#define WIDTH 200
+#define HEIGHT 150
+#define TILE 64
+
+/* Delivers a gradient, narrower from the resize_after'th render on */
+typedef struct {
+	RSFilter parent;
+
+	gint renders;
+	gint resize_after;
+	gboolean untiled;
+} TestSource;
+
+typedef struct {
+	RSFilterClass parent_class;
+} TestSourceClass;
+
+G_DEFINE_TYPE(TestSource, test_source, RS_TYPE_FILTER)
+
+static RSFilterResponse *
+test_source_get_size(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSFilterResponse *response = rs_filter_response_new();
+
+	rs_filter_response_set_width(response, WIDTH);
+	rs_filter_response_set_height(response, HEIGHT);
+
+	return response;
+}
+
+static RSFilterResponse *
+test_source_get_image(RSFilter *filter, const RSFilterRequest *request)
+{
+	TestSource *source = (TestSource *) filter;
+	RSFilterResponse *response = rs_filter_response_new();
+	const gint width = (source->renders++ < source->resize_after) ? WIDTH : WIDTH - 8;
+	RS_IMAGE16 *image = rs_image16_new(width, HEIGHT, 3, 4);
+	gint x, y;
+
+	if (!rs_filter_request_get_roi(request))
+		source->untiled = TRUE;
+
+	for(y = 0; y < image->h; y++)
+		for(x = 0; x < image->w; x++)
+			GET_PIXEL(image, x, y)[0] = x + y * WIDTH;
+
+	rs_filter_response_set_image(response, image);
+	g_object_unref(image);
+
+	return response;
+}
+
+static void
+test_source_class_init(TestSourceClass *klass)
+{
+	RSFilterClass *filter_class = RS_FILTER_CLASS(klass);
+
+	filter_class->name = "Test source";
+	filter_class->get_image = test_source_get_image;
+	filter_class->get_size = test_source_get_size;
+}
+
+static void
+test_source_init(TestSource *source)
+{
+	source->resize_after = G_MAXINT;
+}
+
+/* Renders source in tiles, returns the number of tiles that did not match
+ * the gradient or -1 if the size is not the expected */
+static gint
+render(TestSource *source, gint expected_width)
+{
+	RSFilterRequest *request = rs_filter_request_new();
+	RSFilterResponse *response;
+	RS_IMAGE16 *image;
+	gint x, y, errors = 0;
+
+	rs_filter_request_set_tile_size(request, TILE, TILE);
+	response = rs_filter_get_image(RS_FILTER(source), request);
+	image = rs_filter_response_get_image(response);
+
+	if (!image || image->w != expected_width || image->h != HEIGHT)
+		errors = -1;
+	else
+		for(y = 0; y < image->h; y++)
+			for(x = 0; x < image->w; x++)
+				if (GET_PIXEL(image, x, y)[0] != (gushort) (x + y * WIDTH))
+					errors++;
+
+	if (image)
+		g_object_unref(image);
+	g_object_unref(response);
+	g_object_unref(request);
+
+	return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+	TestSource *source;
+	gint ret = 0;
+
+	/* All tiles at the predicted size are assembled */
+	source = g_object_new(test_source_get_type(), NULL);
+	if (render(source, WIDTH) != 0 || source->untiled || source->renders < 2)
+	{
+		g_printerr("tiled render failed\n");
+		ret = 1;
+	}
+	g_object_unref(source);
+
+	/* The first tile is off, one untiled render */
+	source = g_object_new(test_source_get_type(), NULL);
+	source->resize_after = 0;
+	if (render(source, WIDTH - 8) != 0 || !source->untiled || source->renders != 2)
+	{
+		g_printerr("size change in first tile not handled\n");
+		ret = 1;
+	}
+	g_object_unref(source);
+
+	/* A tile in the middle is off, tiles so far are dropped */
+	source = g_object_new(test_source_get_type(), NULL);
+	source->resize_after = 3;
+	if (render(source, WIDTH - 8) != 0 || !source->untiled || source->renders != 5)
+	{
+		g_printerr("size change in later tile not handled\n");
+		ret = 1;
+	}
+	g_object_unref(source);
+
+	return ret;
+}
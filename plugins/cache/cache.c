@@ -15,11 +15,11 @@
  * You should have received a copy of the GNU General Public License
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
- */
 
 /* Plugin tmpl version 4 */
 
 #include <rawstudio.h>
+#include <string.h> /* memcpy() */
 
 #if 0 /* Change to 1 to enable debugging info */
 #define filter_debug g_debug
@@ -35,10 +35,32 @@
 typedef struct _RSCache RSCache;
 typedef struct _RSCacheClass RSCacheClass;
 
+/* One cached response and the request parameters it can answer */
+typedef struct {
+	RSFilterResponse *response;
+	gboolean is_image8;
+	gboolean quick;
+	gboolean has_roi;
+	GdkRectangle roi;        /* Valid area, the full image if has_roi is FALSE */
+	gint width;
+	gint height;
+	RSColorSpace *colorspace; /* Only used for image8 entries */
+	gfloat preview_scale;
+	gint binning;            /* Demosaic binning of the image, 1 for none */
+	guint generation;
+	gsize bytes;
+	gboolean is_dirty;
+	GdkRectangle dirty;      /* Area to render again before use, inside roi */
+} CacheEntry;
+
 struct _RSCache {
 	RSFilter parent;
 
-	RSFilterResponse *cached_image;
+	GList *entries;          /* Most recently used first */
+	gsize bytes_used;
+	guint generation;
+	gint max_entries;
+	gint memory_limit;       /* In megabytes */
 	gboolean ignore_changed;
 	RSFilterChangedMask mask;
 	gboolean ignore_roi;
@@ -55,7 +77,9 @@ RS_DEFINE_FILTER(rs_cache, RSCache)
 enum {
 	PROP_0,
 	PROP_LATENCY,
-	PROP_IGNORE_ROI
+	PROP_IGNORE_ROI,
+	PROP_MAX_ENTRIES,
+	PROP_MEMORY_LIMIT
 };
 
 static void finalize(GObject *object);
@@ -64,7 +88,7 @@ static void set_property (GObject *object, guint property_id, const GValue *valu
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
 static RSFilterResponse *get_image8(RSFilter *filter, const RSFilterRequest *request);
 static void flush(RSCache *cache);
-static void previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask);
+static void previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask, const GdkRectangle *region);
 
 G_MODULE_EXPORT void
 rs_plugin_load(RSPlugin *plugin)
@@ -94,6 +118,18 @@ rs_cache_class_init(RSCacheClass *klass)
 			FALSE,
 			G_PARAM_READWRITE)
 	);
+	g_object_class_install_property(object_class,
+		PROP_MAX_ENTRIES, g_param_spec_int(
+			"max-entries", "max-entries", "Maximum number of responses kept in the cache",
+			1, 64, 4,
+			G_PARAM_READWRITE)
+	);
+	g_object_class_install_property(object_class,
+		PROP_MEMORY_LIMIT, g_param_spec_int(
+			"memory-limit", "memory-limit", "Memory budget in megabytes. The most recent response is always kept, even if it exceeds the budget",
+			0, 65536, 256,
+			G_PARAM_READWRITE)
+	);
 
 	filter_class->name = "Listen for changes and caches image data";
 	filter_class->get_image = get_image;
@@ -107,7 +143,11 @@ rs_cache_init(RSCache *cache)
 	cache->ignore_changed = FALSE;
 	cache->ignore_roi = FALSE;
 	cache->latency = 0;
-	cache->cached_image = rs_filter_response_new();
+	cache->entries = NULL;
+	cache->bytes_used = 0;
+	cache->generation = 0;
+	cache->max_entries = 4;
+	cache->memory_limit = 256;
 	g_mutex_init(&cache->cache_mutex);
 }
 
@@ -119,6 +159,36 @@ finalize(GObject *object)
 	g_mutex_clear(&cache->cache_mutex);
 }
 
+static void
+entry_free(CacheEntry *entry)
+{
+	g_object_unref(entry->response);
+	if (entry->colorspace)
+		g_object_unref(entry->colorspace);
+	g_free(entry);
+}
+
+/* Drop least recently used entries until we are within budget. The
+ * entry at the head of the list is never dropped. Must be called with
+ * cache_mutex held */
+static void
+trim(RSCache *cache)
+{
+	const gsize limit = ((gsize) cache->memory_limit) << 20;
+
+	while (cache->entries && cache->entries->next &&
+		((gint) g_list_length(cache->entries) > cache->max_entries || cache->bytes_used > limit))
+	{
+		GList *last = g_list_last(cache->entries);
+		CacheEntry *entry = last->data;
+
+		filter_debug("Cache[%p]: Evicting entry of %" G_GSIZE_FORMAT " bytes", cache, entry->bytes);
+		cache->bytes_used -= entry->bytes;
+		cache->entries = g_list_delete_link(cache->entries, last);
+		entry_free(entry);
+	}
+}
+
 static void
 get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspec)
 {
@@ -132,6 +202,12 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 		case PROP_IGNORE_ROI:
 			g_value_set_boolean(value, cache->ignore_roi);
 			break;
+		case PROP_MAX_ENTRIES:
+			g_value_set_int(value, cache->max_entries);
+			break;
+		case PROP_MEMORY_LIMIT:
+			g_value_set_int(value, cache->memory_limit);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -150,6 +226,18 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 		case PROP_IGNORE_ROI:
 			cache->ignore_roi = g_value_get_boolean(value);
 			break;
+		case PROP_MAX_ENTRIES:
+			g_mutex_lock(&cache->cache_mutex);
+			cache->max_entries = g_value_get_int(value);
+			trim(cache);
+			g_mutex_unlock(&cache->cache_mutex);
+			break;
+		case PROP_MEMORY_LIMIT:
+			g_mutex_lock(&cache->cache_mutex);
+			cache->memory_limit = g_value_get_int(value);
+			trim(cache);
+			g_mutex_unlock(&cache->cache_mutex);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -164,170 +252,245 @@ rectangle_is_inside(GdkRectangle *outer_rect, GdkRectangle *inner_rect)
 		inner_rect->y + inner_rect->height <= outer_rect->y + outer_rect->height;
 }
 
-static gint get_cached_width(RSCache *cache)
+/* Progressive preview levels are rendered at reduced size */
+static gfloat
+request_preview_scale(const RSFilterRequest *request)
 {
-	gint ret = -1;
-	if (rs_filter_response_has_image(cache->cached_image)) {
-		RS_IMAGE16 *img = rs_filter_response_get_image(cache->cached_image);
-		ret = img->w;
-		g_object_unref(img);
-	}
+	gfloat preview_scale = 1.0f;
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-		GdkPixbuf *img  =  rs_filter_response_get_image8(cache->cached_image);
-		ret = gdk_pixbuf_get_width(img);
-		g_object_unref(img);
-	}
-	return ret;
+	rs_filter_param_get_float(RS_FILTER_PARAM(request), "preview-scale", &preview_scale);
+
+	return preview_scale;
+}
+
+/* Demosaic binning asked for by a downscaling filter, see RSResample */
+static gint
+param_binning(RSFilterParam *param)
+{
+	gint binning = 1;
+
+	rs_filter_param_get_integer(param, "demosaic-binning", &binning);
+
+	return MAX(1, binning);
 }
 
-static gint get_cached_height(RSCache *cache)
+/* Returns the most recently used entry able to answer the request and
+ * moves it to the front of the list. Must be called with cache_mutex held */
+static CacheEntry *
+lookup(RSCache *cache, const RSFilterRequest *request, GdkRectangle *roi, gboolean is_image8)
 {
-	gint ret = -1;
-	if (rs_filter_response_has_image(cache->cached_image)) {
-		RS_IMAGE16 *img = rs_filter_response_get_image(cache->cached_image);
-		ret = img->h;
-		g_object_unref(img);
+	const gboolean quick = rs_filter_request_get_quick(request);
+	const gfloat preview_scale = request_preview_scale(request);
+	const gint binning = param_binning(RS_FILTER_PARAM(request));
+	RSColorSpace *requested_space = NULL;
+	CacheEntry *found = NULL;
+	GList *node;
+
+	if (is_image8)
+		requested_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
+
+	for (node = cache->entries; node; node = node->next)
+	{
+		CacheEntry *entry = node->data;
+
+		if (entry->is_image8 != is_image8 || entry->generation != cache->generation)
+			continue;
+
+		if (entry->preview_scale != preview_scale)
+			continue;
+
+		/* A full quality image can answer a quick request, not the other way around */
+		if (entry->quick && !quick)
+			continue;
+
+		/* Likewise a binned image can only answer requests allowing as much */
+		if (entry->binning > binning)
+			continue;
+
+		if (is_image8 && entry->colorspace && requested_space && entry->colorspace != requested_space)
+			continue;
+
+		if (roi)
+		{
+			GdkRectangle clamped;
+			clamped.x = MAX(0, roi->x);
+			clamped.y = MAX(0, roi->y);
+			clamped.width = MIN(roi->x + roi->width, entry->width) - clamped.x;
+			clamped.height = MIN(roi->y + roi->height, entry->height) - clamped.y;
+			if (!rectangle_is_inside(&entry->roi, &clamped))
+				continue;
+		}
+		else if (entry->has_roi)
+			continue;
+
+		found = entry;
+		break;
 	}
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-		GdkPixbuf *img  =  rs_filter_response_get_image8(cache->cached_image);
-		ret = gdk_pixbuf_get_height(img);
-		g_object_unref(img);
+	if (found && node != cache->entries)
+	{
+		cache->entries = g_list_remove_link(cache->entries, node);
+		cache->entries = g_list_concat(node, cache->entries);
 	}
-	return ret;
+
+	if (requested_space)
+		g_object_unref(requested_space);
+
+	return found;
 }
 
+/* Takes a reference to response. Must be called with cache_mutex held */
 static void
-set_roi_to_full(RSCache *cache) {
-	GdkRectangle *r = g_new(GdkRectangle, 1);
-	r->x = 0;
-	r->y = 0;
-
-	if (rs_filter_response_has_image(cache->cached_image)) {
-		RS_IMAGE16 *img = rs_filter_response_get_image(cache->cached_image);
-		r->width = img->w;
-		r->height = img->h;
-		rs_filter_response_set_roi(cache->cached_image,r);
-		g_object_unref(img);
+insert(RSCache *cache, const RSFilterRequest *request, GdkRectangle *roi, RSFilterResponse *response, gboolean is_image8)
+{
+	CacheEntry *entry = g_new0(CacheEntry, 1);
+
+	if (is_image8)
+	{
+		GdkPixbuf *pixbuf = rs_filter_response_get_image8(response);
+		entry->width = gdk_pixbuf_get_width(pixbuf);
+		entry->height = gdk_pixbuf_get_height(pixbuf);
+		entry->bytes = (gsize) gdk_pixbuf_get_rowstride(pixbuf) * entry->height;
+		entry->colorspace = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
+		g_object_unref(pixbuf);
+	}
+	else
+	{
+		RS_IMAGE16 *image = rs_filter_response_get_image(response);
+		entry->width = image->w;
+		entry->height = image->h;
+		entry->bytes = (gsize) image->rowstride * image->h * sizeof(gushort);
+		g_object_unref(image);
 	}
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-		GdkPixbuf *img  =  rs_filter_response_get_image8(cache->cached_image);
-		r->width = gdk_pixbuf_get_width(img);
-		r->height = gdk_pixbuf_get_height(img);
-		rs_filter_response_set_roi(cache->cached_image,r);
-		g_object_unref(img);
+	entry->response = g_object_ref(response);
+	entry->is_image8 = is_image8;
+	entry->quick = rs_filter_request_get_quick(request);
+	entry->preview_scale = request_preview_scale(request);
+	entry->binning = param_binning(RS_FILTER_PARAM(response));
+	entry->generation = cache->generation;
+	entry->has_roi = (roi != NULL);
+	if (roi)
+		entry->roi = *roi;
+	else
+	{
+		entry->roi.x = 0;
+		entry->roi.y = 0;
+		entry->roi.width = entry->width;
+		entry->roi.height = entry->height;
 	}
-	filter_debug("Cache[%p]: Setting request ROI to full from cache!", cache);
-	filter_debug("Cache[%p]: Saved   ROI x:%d, y:%d, w:%d, h:%d", cache, r->x, r->y, r->width, r->height);
+
+	if (entry->quick)
+		rs_filter_response_set_quick(entry->response);
+	rs_filter_response_set_roi(entry->response, roi);
+
+	filter_debug("Cache[%p]: Saved   ROI x:%d, y:%d, w:%d, h:%d", cache, entry->roi.x, entry->roi.y, entry->roi.width, entry->roi.height);
+
+	cache->entries = g_list_prepend(cache->entries, entry);
+	cache->bytes_used += entry->bytes;
+	trim(cache);
 }
 
+/* The cached image is shared with the caller, no pixels are copied */
 static RSFilterResponse *
-get_image(RSFilter *filter, const RSFilterRequest *_request)
+response_from_entry(CacheEntry *entry)
 {
-	RSCache *cache = RS_CACHE(filter);
-	RSFilterRequest *request = rs_filter_request_clone(_request);
-	GdkRectangle *roi = rs_filter_request_get_roi(request);
+	RSFilterResponse *fr = rs_filter_response_clone(entry->response);
 
-	filter_debug("Cache[%p]: getimage() called", filter);
-
-	g_mutex_lock(&cache->cache_mutex);
-	if (roi && cache->ignore_roi)
+	if (entry->is_image8)
 	{
-		roi = NULL;
-		rs_filter_request_set_roi(request, NULL);
-		filter_debug("Cache[%p]: Disabling ROI for upward calls", filter);
+		GdkPixbuf *img = rs_filter_response_get_image8(entry->response);
+		rs_filter_response_set_image8(fr, img);
+		if (img)
+			g_object_unref(img);
+	}
+	else
+	{
+		RS_IMAGE16 *img = rs_filter_response_get_image(entry->response);
+		rs_filter_response_set_image(fr, img);
+		if (img)
+			g_object_unref(img);
 	}
 
-	if (rs_filter_response_has_image(cache->cached_image)) {
+	return fr;
+}
 
-		if (rs_filter_response_get_quick(cache->cached_image) && !rs_filter_request_get_quick(request))
-		{
-			filter_debug("Cache[%p]: Cached image is quick and requested image is not!", filter);
-			flush(cache);
-		}
+/* Renders the dirty area of an entry and returns a response with the
+ * patched image, or NULL if it cannot be patched. The cached image may be
+ * in use elsewhere, so it is copied before patching */
+static RSFilterResponse *
+patch_entry(RSFilter *filter, CacheEntry *entry, const RSFilterRequest *request, gboolean is_image8)
+{
+	RSFilterRequest *patch_request = rs_filter_request_clone(request);
+	RSFilterResponse *patch;
+	RSFilterResponse *fr = NULL;
+	const GdkRectangle *dirty = &entry->dirty;
 
-		if (!rs_filter_response_get_roi(cache->cached_image) && roi)
-			set_roi_to_full(cache);
+	filter_debug("Cache[%p]: Patching x:%d, y:%d, w:%d, h:%d", filter, dirty->x, dirty->y, dirty->width, dirty->height);
 
-		if (!roi && rs_filter_response_get_roi(cache->cached_image))
-		{
-				roi = g_new(GdkRectangle, 1);
-				roi->x = 0;
-				roi->y = 0;
-				roi->width = get_cached_width(cache);
-				roi->height = get_cached_height(cache);
-				rs_filter_request_set_roi(request, roi);
-				filter_debug("Cache[%p]: Setting request ROI from cache!", filter);
-		}
-		if (rs_filter_response_get_roi(cache->cached_image) && roi)
-		{
-			roi->x = MAX(0, roi->x);
-			roi->y = MAX(0, roi->y);
-			roi->width = MIN(roi->width, get_cached_width(cache));
-			roi->height = MIN(roi->height, get_cached_height(cache));
-		}
+	rs_filter_request_set_roi(patch_request, &entry->dirty);
+	rs_filter_request_set_quick(patch_request, entry->quick);
+	rs_filter_param_delete(RS_FILTER_PARAM(patch_request), "demosaic-binning");
+
+	if (is_image8)
+	{
+		patch = rs_filter_get_image8(filter->previous, patch_request);
+		GdkPixbuf *old = rs_filter_response_get_image8(entry->response);
+		GdkPixbuf *update = rs_filter_response_get_image8(patch);
 
-		if (!cache->ignore_roi && roi)
+		if (old && update && gdk_pixbuf_get_width(update) == entry->width && gdk_pixbuf_get_height(update) == entry->height)
 		{
-			if (rs_filter_response_get_roi(cache->cached_image)) 
-				if (!rectangle_is_inside(rs_filter_response_get_roi(cache->cached_image), roi))
-				{
-					filter_debug("Cache[%p]: Cached image ROI does not cover requested ROI!", filter);
-#if 0
-					GdkRectangle *r = rs_filter_response_get_roi(cache->cached_image);
-					filter_debug("Cache[%p]: Request ROI x:%d, y:%d, w:%d, h:%d", filter, roi->x, roi->y, roi->width, roi->height);
-					filter_debug("Cache[%p]: Cached  ROI x:%d, y:%d, w:%d, h:%d", filter, r->x, r->y, r->width, r->height);
-#endif
-					flush(cache);
-				}
+			GdkPixbuf *pixbuf = gdk_pixbuf_copy(old);
+			gdk_pixbuf_copy_area(update, dirty->x, dirty->y, dirty->width, dirty->height, pixbuf, dirty->x, dirty->y);
+			fr = rs_filter_response_clone(entry->response);
+			rs_filter_response_set_image8(fr, pixbuf);
+			g_object_unref(pixbuf);
 		}
+		if (old)
+			g_object_unref(old);
+		if (update)
+			g_object_unref(update);
 	}
-
-	if (!rs_filter_response_has_image(cache->cached_image))
+	else
 	{
-		filter_debug("Cache[%p]: Cached image NOT found", filter);
-		g_object_unref(cache->cached_image);
-		cache->cached_image = rs_filter_get_image(filter->previous, request);
+		patch = rs_filter_get_image(filter->previous, patch_request);
+		RS_IMAGE16 *old = rs_filter_response_get_image(entry->response);
+		RS_IMAGE16 *update = rs_filter_response_get_image(patch);
 
-		if (cache->cached_image && !roi)
-			set_roi_to_full(cache);
-		else
+		if (old && update && update->w == entry->width && update->h == entry->height && update->pixelsize == old->pixelsize)
 		{
-			rs_filter_response_set_roi(cache->cached_image, roi);
-			if (roi)
-				filter_debug("Cache[%p]: Saved   ROI x:%d, y:%d, w:%d, h:%d", filter, roi->x, roi->y, roi->width, roi->height);
-		}
+			RS_IMAGE16 *image = rs_image16_copy(old, TRUE);
+			gint row;
 
-		if (rs_filter_request_get_quick(request))
-		{
-			rs_filter_response_set_quick(cache->cached_image);
-			filter_debug("Cache[%p]: Setting image as quick", filter);
+			for(row = dirty->y; row < dirty->y + dirty->height; row++)
+				memcpy(GET_PIXEL(image, dirty->x, row), GET_PIXEL(update, dirty->x, row), dirty->width * image->pixelsize * sizeof(gushort));
+
+			fr = rs_filter_response_clone(entry->response);
+			rs_filter_response_set_image(fr, image);
+			g_object_unref(image);
 		}
+		if (old)
+			g_object_unref(old);
+		if (update)
+			g_object_unref(update);
 	}
 
-	RSFilterResponse *fr = rs_filter_response_clone(cache->cached_image);
-	RS_IMAGE16* img = rs_filter_response_get_image(cache->cached_image);
-	rs_filter_response_set_image(fr, img);
-
-	if (img)
-		g_object_unref(img);
-
-	g_object_unref(request);
-	g_mutex_unlock(&cache->cache_mutex);
+	if (patch)
+		g_object_unref(patch);
+	g_object_unref(patch_request);
 
 	return fr;
 }
 
-
 static RSFilterResponse *
-get_image8(RSFilter *filter, const RSFilterRequest *_request)
+get_cached(RSFilter *filter, const RSFilterRequest *_request, gboolean is_image8)
 {
 	RSCache *cache = RS_CACHE(filter);
 	RSFilterRequest *request = rs_filter_request_clone(_request);
 	GdkRectangle *roi = rs_filter_request_get_roi(request);
-	filter_debug("Cache[%p]: getimage8() called", filter);
+	RSFilterResponse *fr = NULL;
+	CacheEntry *entry;
+	guint generation;
 
 	g_mutex_lock(&cache->cache_mutex);
 	if (roi && cache->ignore_roi)
@@ -337,89 +500,141 @@ get_image8(RSFilter *filter, const RSFilterRequest *_request)
 		filter_debug("Cache[%p]: Disabling ROI for upward calls", filter);
 	}
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-
-		if (rs_filter_response_get_quick(cache->cached_image) && !rs_filter_request_get_quick(request))
-		{
-			filter_debug("Cache[%p]: Cached image is quick and requested image is not!", filter);
-			flush(cache);
-		}
+	entry = lookup(cache, request, roi, is_image8);
+	if (entry && !entry->is_dirty)
+	{
+		filter_debug("Cache[%p]: Cached image found", filter);
+		fr = response_from_entry(entry);
+		g_mutex_unlock(&cache->cache_mutex);
+		g_object_unref(request);
+		return fr;
+	}
 
-		if (!rs_filter_response_get_roi(cache->cached_image) && roi)
-		{
-			set_roi_to_full(cache);
-		}
+	/* Partly outdated, take it out while it is being patched */
+	if (entry)
+	{
+		cache->entries = g_list_remove(cache->entries, entry);
+		cache->bytes_used -= entry->bytes;
+	}
+	generation = cache->generation;
+	g_mutex_unlock(&cache->cache_mutex);
 
-		if (!cache->ignore_roi && roi) 
-			if (rs_filter_response_get_roi(cache->cached_image)) 
-				if (!rectangle_is_inside(rs_filter_response_get_roi(cache->cached_image), roi))
-				{
-					filter_debug("Cache[%p]: Cached image ROI does not cover requested ROI!", filter);
-					flush(cache);
-				}
+	/* Render without holding the lock, so other views can be served from
+	 * the cache meanwhile */
+	if (entry)
+	{
+		fr = patch_entry(filter, entry, request, is_image8);
 
-		if (!roi && rs_filter_response_get_roi(cache->cached_image))
+		/* The patched response answers the same requests as the entry did */
+		if (fr)
 		{
-			filter_debug("Cache[%p]: Cached image has ROI, but request does not.", filter);
-			flush(cache);
+			rs_filter_request_set_quick(request, entry->quick);
+			rs_filter_request_set_roi(request, entry->has_roi ? &entry->roi : NULL);
+			roi = rs_filter_request_get_roi(request);
 		}
-
-		RSColorSpace *cached_space = NULL;
-		if (cache->cached_image)
-			cached_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(cache->cached_image), "colorspace", RS_TYPE_COLOR_SPACE);
-
-		RSColorSpace *requested_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
-
-		if (cached_space && requested_space)
-			if (cached_space != requested_space)
-			{
-				filter_debug("Cache[%p]: Colorspace does not match Cached:%s vs Requested:%s.", filter, 
-										 rs_color_space_get_name(cached_space), rs_color_space_get_name(requested_space));
-				flush(cache);
-			}
+		entry_free(entry);
 	}
 
-	if (!rs_filter_response_has_image8(cache->cached_image))
+	if (!fr)
 	{
-		filter_debug("Cache[%p]: Cached image8 NOT found", filter);
-		g_object_unref(cache->cached_image);
-		cache->cached_image = rs_filter_get_image8(filter->previous, request);
-		rs_filter_response_set_roi(cache->cached_image, roi);
-		if (rs_filter_request_get_quick(request))
-			rs_filter_response_set_quick(cache->cached_image);
+		filter_debug("Cache[%p]: Cached image NOT found", filter);
+		if (is_image8)
+			fr = rs_filter_get_image8(filter->previous, request);
+		else
+			fr = rs_filter_get_image(filter->previous, request);
 	}
 
-	RSFilterResponse *fr = rs_filter_response_clone(cache->cached_image);
-	GdkPixbuf* img = rs_filter_response_get_image8(cache->cached_image);
-	rs_filter_response_set_image8(fr, img);
+	if (!fr || !(is_image8 ? rs_filter_response_has_image8(fr) : rs_filter_response_has_image(fr)))
+	{
+		g_object_unref(request);
+		return fr;
+	}
 
-	if (img)
-		g_object_unref(img);
+	g_mutex_lock(&cache->cache_mutex);
+	/* Settings changed while rendering, the result is already stale */
+	if (generation == cache->generation)
+	{
+		insert(cache, request, roi, fr, is_image8);
+		entry = cache->entries->data;
+		g_object_unref(fr);
+		fr = response_from_entry(entry);
+	}
+	g_mutex_unlock(&cache->cache_mutex);
 
 	g_object_unref(request);
-	g_mutex_unlock(&cache->cache_mutex);
 
 	return fr;
 }
 
+static RSFilterResponse *
+get_image(RSFilter *filter, const RSFilterRequest *request)
+{
+	filter_debug("Cache[%p]: getimage() called", filter);
+
+	return get_cached(filter, request, FALSE);
+}
+
+static RSFilterResponse *
+get_image8(RSFilter *filter, const RSFilterRequest *request)
+{
+	filter_debug("Cache[%p]: getimage8() called", filter);
+
+	return get_cached(filter, request, TRUE);
+}
 
 static void
 flush(RSCache *cache)
 {
 	filter_debug("Cache[%p]: Cache flushed", cache);
-	g_object_unref(cache->cached_image);
-	cache->cached_image = rs_filter_response_new();
+	g_list_foreach(cache->entries, (GFunc) entry_free, NULL);
+	g_list_free(cache->entries);
+	cache->entries = NULL;
+	cache->bytes_used = 0;
 }
 
 static void
-previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask)
+previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask, const GdkRectangle *region)
 {
 	RSCache *cache = RS_CACHE(filter);
+	GList *node;
 
 	filter_debug("Cache[%p]: Previous Changed (%x)", filter, mask);
 	g_mutex_lock(&cache->cache_mutex);
 	if (mask & RS_FILTER_CHANGED_PIXELDATA)
-		flush(cache);
+	{
+		/* Renders in progress are outdated in any case */
+		cache->generation++;
+
+		/* Patching needs ROI support upstream */
+		if (!region || cache->ignore_roi)
+			flush(cache);
+		else
+			for (node = cache->entries; node; node = node->next)
+			{
+				CacheEntry *entry = node->data;
+				GdkRectangle changed;
+
+				if (entry->generation != cache->generation - 1)
+					continue;
+
+				/* Regions are in full size coordinates, binned and reduced
+				 * preview entries go stale */
+				if (entry->binning > 1 || entry->preview_scale != 1.0f)
+					continue;
+
+				entry->generation = cache->generation;
+
+				/* Mark the part of the entry to render again */
+				if (gdk_rectangle_intersect((GdkRectangle *) region, &entry->roi, &changed))
+				{
+					if (entry->is_dirty)
+						gdk_rectangle_union(&entry->dirty, &changed, &entry->dirty);
+					else
+						entry->dirty = changed;
+					entry->is_dirty = TRUE;
+				}
+			}
+	}
 	g_mutex_unlock(&cache->cache_mutex);
-	rs_filter_changed(filter, mask);
+	rs_filter_changed_region(filter, mask, region);
 }
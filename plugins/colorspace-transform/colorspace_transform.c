@@ -47,6 +47,8 @@ enum {
 
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
 static RSFilterResponse *get_image8(RSFilter *filter, const RSFilterRequest *request);
+static RSFilterRequest *get_pointwise_request(RSFilter *filter, const RSFilterRequest *request);
+static RSFilterPointwiseFunc prepare_pointwise(RSFilter *filter, const RSFilterRequest *request, RSFilterResponse *response, gpointer *data, GDestroyNotify *destroy);
 static gboolean convert_colorspace16(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *input_image, RS_IMAGE16 *output_image, RSColorSpace *input_space, RSColorSpace *output_space, GdkRectangle *_roi);
 static void convert_colorspace8(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *input_image, GdkPixbuf *output_image, RSColorSpace *input_space, RSColorSpace *output_space, GdkRectangle *roi);
 
@@ -78,6 +80,8 @@ rs_colorspace_transform_class_init(RSColorspaceTransformClass *klass)
 	filter_class->name = "ColorspaceTransform filter";
 	filter_class->get_image = get_image;
 	filter_class->get_image8 = get_image8;
+	filter_class->get_pointwise_request = get_pointwise_request;
+	filter_class->prepare_pointwise = prepare_pointwise;
 }
 
 static void
@@ -88,6 +92,18 @@ rs_colorspace_transform_init(RSColorspaceTransform *colorspace_transform)
 	rs_cmm_set_num_threads(colorspace_transform->cmm, rs_get_number_of_processor_cores());
 }
 
+/* A subframe doesn't keep the image it points into alive, so hold on to it */
+static RS_IMAGE16 *
+crop_rows(RS_IMAGE16 *input, GdkRectangle *roi)
+{
+	RS_IMAGE16 *strip = rs_image16_new_subframe(input, roi);
+
+	if (strip)
+		g_object_set_data_full(G_OBJECT(strip), "parent-image", g_object_ref(input), g_object_unref);
+
+	return strip;
+}
+
 static RSFilterResponse *
 get_image(RSFilter *filter, const RSFilterRequest *request)
 {
@@ -97,6 +113,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	RS_IMAGE16 *input;
 	RS_IMAGE16 *output = NULL;
 	GdkRectangle *roi;
+	gboolean crop_to_roi = FALSE;
 	int i;
 
 	roi = rs_filter_request_get_roi(request);
@@ -105,6 +122,25 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	if (!RS_IS_IMAGE16(input))
 		return previous_response;
 
+	/* Like get_image8(), return only complete rows of the ROI if asked to */
+	rs_filter_param_get_boolean(RS_FILTER_PARAM(request), "crop-to-roi", &crop_to_roi);
+	if (crop_to_roi && roi && roi->x == 0 && roi->width == input->w)
+	{
+		RS_IMAGE16 *strip = crop_rows(input, roi);
+		if (strip)
+		{
+			g_object_unref(input);
+			input = strip;
+			roi = NULL;
+
+			response = rs_filter_response_clone(previous_response);
+			g_object_unref(previous_response);
+			rs_filter_response_set_image(response, input);
+			rs_filter_response_set_roi(response, NULL);
+			previous_response = response;
+		}
+	}
+
 	RSColorSpace *input_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(previous_response), "colorspace", RS_TYPE_COLOR_SPACE);
 	RSColorSpace *output_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
 
@@ -159,6 +195,8 @@ get_image8(RSFilter *filter, const RSFilterRequest *request)
 	RS_IMAGE16 *input;
 	GdkPixbuf *output = NULL;
 	GdkRectangle *roi;
+	gboolean crop_to_roi = FALSE;
+	gboolean cropped = FALSE;
 	int i;
 
 	previous_response = rs_filter_get_image(filter->previous, request);
@@ -167,11 +205,28 @@ get_image8(RSFilter *filter, const RSFilterRequest *request)
 		return previous_response;
 
 	roi = rs_filter_request_get_roi(request);
+
+	/* Return only the ROI if asked to, the pixbuf then starts at the top of
+	 * the ROI. This is only done for complete rows, so the subframe is exact */
+	rs_filter_param_get_boolean(RS_FILTER_PARAM(request), "crop-to-roi", &crop_to_roi);
+	if (crop_to_roi && roi && roi->x == 0 && roi->width == input->w)
+	{
+		RS_IMAGE16 *strip = crop_rows(input, roi);
+		if (strip)
+		{
+			g_object_unref(input);
+			input = strip;
+			roi = NULL;
+			cropped = TRUE;
+		}
+	}
 	RSColorSpace *input_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(previous_response), "colorspace", RS_TYPE_COLOR_SPACE);
 	RSColorSpace *output_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
 
 	response = rs_filter_response_clone(previous_response);
 	g_object_unref(previous_response);
+	if (cropped)
+		rs_filter_response_set_roi(response, NULL);
 
 	for( i = 0; i < 4; i++)
 		colorspace_transform->premul[i] = 1.0f;
@@ -262,7 +317,7 @@ transform8_c(ThreadInfo* t)
 
 
 static void
-transform16_c(gushort* __restrict input, gushort* __restrict output, gint num_pixels, const gint pixelsize, RS_MATRIX3 *matrix)
+transform16_c(gushort* input, gushort* output, gint num_pixels, const gint pixelsize, RS_MATRIX3 *matrix)
 {
 	gint r,g,b;
 	RS_MATRIX3Int mati;
@@ -363,6 +418,88 @@ convert_colorspace16(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *in
 	return TRUE;
 }
 
+/* State for one fused 16 bit transform */
+typedef struct {
+	RSCmm *cmm;
+	RS_MATRIX3 matrix;
+} PointwiseInfo;
+
+static RSFilterRequest *
+get_pointwise_request(RSFilter *filter, const RSFilterRequest *request)
+{
+	/* We pass the request on untouched */
+	return rs_filter_request_clone(request);
+}
+
+static void
+transform16_pointwise(gpointer data, RS_IMAGE16 *image, gint start_y, gint end_y)
+{
+	PointwiseInfo *info = data;
+	gint row;
+
+	if (info->cmm)
+		rs_cmm_transform16(info->cmm, image, image, 0, image->w, start_y, end_y);
+	else
+		for(row = start_y; row < end_y; row++)
+			transform16_c(GET_PIXEL(image, 0, row), GET_PIXEL(image, 0, row), image->w, image->pixelsize, &info->matrix);
+}
+
+static RSFilterPointwiseFunc
+prepare_pointwise(RSFilter *filter, const RSFilterRequest *request, RSFilterResponse *response, gpointer *data, GDestroyNotify *destroy)
+{
+	RSColorspaceTransform *colorspace_transform = RS_COLORSPACE_TRANSFORM(filter);
+	RSColorSpace *input_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(response), "colorspace", RS_TYPE_COLOR_SPACE);
+	RSColorSpace *output_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
+	RSFilterPointwiseFunc func = NULL;
+	gboolean is_premultiplied = FALSE;
+	gboolean has_premul = FALSE;
+	gfloat premul[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+
+	if (input_space && output_space && (input_space != output_space))
+	{
+		PointwiseInfo *info = g_new0(PointwiseInfo, 1);
+
+		rs_filter_param_get_boolean(RS_FILTER_PARAM(response), "is-premultiplied", &is_premultiplied);
+		if (!is_premultiplied)
+			has_premul = rs_filter_param_get_float4(RS_FILTER_PARAM(request), "premul", premul);
+
+		/* Same as convert_colorspace16() */
+		if (RS_COLOR_SPACE_REQUIRES_CMS(input_space) || RS_COLOR_SPACE_REQUIRES_CMS(output_space))
+		{
+			rs_cmm_set_premul(colorspace_transform->cmm, premul);
+			rs_cmm_set_input_profile(colorspace_transform->cmm, rs_color_space_get_icc_profile(input_space, TRUE));
+			rs_cmm_set_output_profile(colorspace_transform->cmm, rs_color_space_get_icc_profile(output_space, TRUE));
+			rs_cmm_prepare_transform16(colorspace_transform->cmm);
+			info->cmm = colorspace_transform->cmm;
+		}
+		else
+		{
+			RS_VECTOR3 vec = {{premul[0]},{premul[1]},{premul[2]}};
+			const RS_MATRIX3 mul_vec = vector3_as_diagonal(&vec);
+			const RS_MATRIX3 a = rs_color_space_get_matrix_from_pcs(input_space);
+			RS_MATRIX3 a_premul;
+			matrix3_multiply(&a, &mul_vec, &a_premul);
+			const RS_MATRIX3 b = rs_color_space_get_matrix_to_pcs(output_space);
+			matrix3_multiply(&b, &a_premul, &info->matrix);
+		}
+
+		if (has_premul)
+			rs_filter_param_set_boolean(RS_FILTER_PARAM(response), "is-premultiplied", TRUE);
+		rs_filter_param_set_object(RS_FILTER_PARAM(response), "colorspace", output_space);
+
+		*data = info;
+		*destroy = g_free;
+		func = transform16_pointwise;
+	}
+
+	if (input_space)
+		g_object_unref(input_space);
+	if (output_space)
+		g_object_unref(output_space);
+
+	return func;
+}
+
 gpointer
 start_single_cs8_transform_thread(gpointer _thread_info)
 {
@@ -516,16 +653,9 @@ convert_colorspace8(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *inp
 			t[i].end_y = y_offset;
 			t[i].matrix = &mat;
 			t[i].table8 = NULL;
-			t[i].single_thread = (threads == 1);
-			if (threads == 1)
-				start_single_cs8_transform_thread(&t[0]);
-			else
-				t[i].threadid = g_thread_new("RSColorspaceTransform worker", start_single_cs8_transform_thread, &t[i]);
 		}
 
-		/* Wait for threads to finish */
-		for(i = 0; threads > 1 && i < threads; i++)
-			g_thread_join(t[i].threadid);
+		rs_worker_pool_run(t, sizeof(ThreadInfo), threads, start_single_cs8_transform_thread);
 
 		g_free(t);
 	}
@@ -57,7 +57,6 @@ static GMutex is_profile_gamma_22_corrected_linear_lock;
 
 typedef struct {
 	RSCmm *cmm;
-	GThread *threadid;
 	gint start_y;
 	gint end_y;
 	gint start_x;
@@ -150,6 +149,15 @@ rs_cmm_set_premul(RSCmm *cmm, const gfloat premul[3])
 	cmm->clip[B] = (gushort) 65535.0 / cmm->premul[B];
 }
 
+void
+rs_cmm_prepare_transform16(RSCmm *cmm)
+{
+	g_return_if_fail(RS_IS_CMM(cmm));
+
+	if (cmm->dirty16)
+		prepare16(cmm);
+}
+
 void
 rs_cmm_transform16(RSCmm *cmm, RS_IMAGE16 *input, RS_IMAGE16 *output, gint start_x, gint end_x, gint start_y, gint end_y)
 {
@@ -305,13 +313,9 @@ rs_cmm_transform(RSCmm *cmm, RS_IMAGE16 *input, void *output, gboolean sixteen_t
 		y_offset += y_per_thread;
 		y_offset = MIN(input->h, y_offset);
 		t[i].end_y = y_offset;
-
-		t[i].threadid = g_thread_new("RSCmm worker", start_single_transform_thread, &t[i]);
 	}
 
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	rs_worker_pool_run(t, sizeof(ThreadInfo), threads, start_single_transform_thread);
 
 	g_free(t);
 }
@@ -54,6 +54,10 @@ void rs_cmm_set_premul(RSCmm *cmm, const gfloat premul[3]);
 
 void rs_cmm_transform(RSCmm *cmm, RS_IMAGE16 *input, void *output, gboolean sixteen_to_16);
 
+void rs_cmm_prepare_transform16(RSCmm *cmm);
+
+void rs_cmm_transform16(RSCmm *cmm, RS_IMAGE16 *input, RS_IMAGE16 *output, gint start_x, gint end_x, gint start_y, gint end_y);
+
 G_END_DECLS
 
 #endif /* RS_CMM_H */
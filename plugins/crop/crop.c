@@ -66,6 +66,7 @@ static void set_property (GObject *object, guint property_id, const GValue *valu
 static void calc(RSCrop *crop);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
 static RSFilterResponse *get_size(RSFilter *filter, const RSFilterRequest *request);
+static gboolean map_changed_region(RSFilter *filter, GdkRectangle *region);
 
 static RSFilterClass *rs_crop_parent_class = NULL;
 
@@ -130,6 +131,7 @@ rs_crop_class_init (RSCropClass *klass)
 	filter_class->name = "Crop filter";
 	filter_class->get_image = get_image;
 	filter_class->get_size = get_size;
+	filter_class->map_changed_region = map_changed_region;
 }
 
 static void
@@ -345,10 +347,13 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 
 	response = rs_filter_response_clone(previous_response);
 	gboolean half_size = FALSE;
+	gint binning = 2;
 	rs_filter_param_get_boolean(RS_FILTER_PARAM(previous_response), "half-size", &half_size);
+	rs_filter_param_get_integer(RS_FILTER_PARAM(previous_response), "demosaic-binning", &binning);
 	g_object_unref(previous_response);
 
-	int shift = half_size ? 1 : 0;
+	/* Demosaic may have binned 2x2 or 4x4 */
+	int shift = half_size ? ((binning >= 4) ? 2 : 1) : 0;
 	output = rs_image16_new(crop->width>>shift, crop->height>>shift, 3, input->pixelsize);
 	rs_filter_response_set_image(response, output);
 	g_object_unref(output);
@@ -381,3 +386,25 @@ get_size(RSFilter *filter, const RSFilterRequest *request)
 
 	return response;
 }
+
+static gboolean
+map_changed_region(RSFilter *filter, GdkRectangle *region)
+{
+	RSCrop *crop = RS_CROP(filter);
+	GdkRectangle output;
+
+	calc(crop);
+
+	output.x = 0;
+	output.y = 0;
+	output.width = crop->width;
+	output.height = crop->height;
+
+	region->x -= crop->effective.x1;
+	region->y -= crop->effective.y1;
+
+	if (!gdk_rectangle_intersect(region, &output, region))
+		region->width = region->height = 0;
+
+	return TRUE;
+}
@@ -39,6 +39,8 @@ enum {
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
+static RSFilterRequest *get_pointwise_request(RSFilter *filter, const RSFilterRequest *request);
+static RSFilterPointwiseFunc prepare_pointwise(RSFilter *filter, const RSFilterRequest *request, RSFilterResponse *response, gpointer *data, GDestroyNotify *destroy);
 static void settings_changed(RSSettings *settings, RSSettingsMask mask, RSDcp *dcp);
 static void settings_weak_notify(gpointer data, GObject *where_the_object_was);
 static RS_xy_COORD neutral_to_xy(RSDcp *dcp, const RS_VECTOR3 *neutral);
@@ -117,6 +119,8 @@ rs_dcp_class_init(RSDcpClass *klass)
 
 	filter_class->name = "Adobe DNG camera profile filter";
 	filter_class->get_image = get_image;
+	filter_class->get_pointwise_request = get_pointwise_request;
+	filter_class->prepare_pointwise = prepare_pointwise;
 }
 
 static void
@@ -473,13 +477,11 @@ settings_weak_notify(gpointer data, GObject *where_the_object_was)
 }
 
 
-gpointer
-start_single_dcp_thread(gpointer _thread_info)
+static void
+render_rows(ThreadInfo* t)
 {
-	ThreadInfo* t = _thread_info;
 	RS_IMAGE16 *tmp = t->tmp;
 
-	pre_cache_tables(t->dcp);
 	if (tmp->pixelsize == 4  && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2) && !t->dcp->read_out_curve)
 	{
 		if ((rs_detect_cpu_features() & RS_CPU_FLAG_AVX) && render_AVX(t))
@@ -518,11 +520,17 @@ start_single_dcp_thread(gpointer _thread_info)
 	}
 	else
 		render(t);
+}
+
+gpointer
+start_single_dcp_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
 
-	if (!t->single_thread)
-		g_thread_exit(NULL);
+	pre_cache_tables(t->dcp);
+	render_rows(t);
 
-	return NULL; /* Make the compiler shut up - we'll never return */
+	return NULL;
 }
 
 static inline void 
@@ -625,16 +633,9 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		t[i].end_y = y_offset;
 		for(j = 0; j < 256; j++)
 			t[i].curve_input_values[j] = 0;
-		t[i].single_thread = (threads == 1);
-		if (threads == 1)
-			start_single_dcp_thread(&t[0]);
-		else	
-			t[i].threadid = g_thread_new("RSDcp worker", start_single_dcp_thread, &t[i]);
 	}
 
-	/* Wait for threads to finish */
-	for(i = 0; threads > 1 && i < threads; i++)
-		g_thread_join(t[i].threadid);
+	rs_worker_pool_run(t, sizeof(ThreadInfo), threads, start_single_dcp_thread);
 
 	/* Settings can change now */
 	g_rec_mutex_unlock(&dcp_mutex);
@@ -655,6 +656,72 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	return response;
 }
 
+static RSFilterRequest *
+get_pointwise_request(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSDcp *dcp = RS_DCP(filter);
+	RSDcpClass *klass = RS_DCP_GET_CLASS(dcp);
+	RSFilterRequest *request_clone;
+
+	/* Histogram data is collected per thread in get_image() */
+	if (dcp->read_out_curve)
+		return NULL;
+
+	request_clone = rs_filter_request_clone(request);
+
+	if (!dcp->use_profile)
+	{
+		gfloat premul[4] = {dcp->pre_mul.x, dcp->pre_mul.y, dcp->pre_mul.z, 1.0};
+		rs_filter_param_set_float4(RS_FILTER_PARAM(request_clone), "premul", premul);
+	}
+
+	rs_filter_param_set_object(RS_FILTER_PARAM(request_clone), "colorspace", klass->prophoto);
+
+	return request_clone;
+}
+
+static void
+render_pointwise(gpointer data, RS_IMAGE16 *image, gint start_y, gint end_y)
+{
+	ThreadInfo t;
+
+	t.dcp = RS_DCP(data);
+	t.tmp = image;
+	t.start_x = 0;
+	t.start_y = start_y;
+	t.end_y = end_y;
+
+	/* Tables were prepared once in prepare_pointwise() */
+	render_rows(&t);
+}
+
+static void
+finish_pointwise(gpointer data)
+{
+	/* Settings can change now */
+	g_rec_mutex_unlock(&dcp_mutex);
+}
+
+static RSFilterPointwiseFunc
+prepare_pointwise(RSFilter *filter, const RSFilterRequest *request, RSFilterResponse *response, gpointer *data, GDestroyNotify *destroy)
+{
+	RSDcp *dcp = RS_DCP(filter);
+	RSDcpClass *klass = RS_DCP_GET_CLASS(dcp);
+
+	/* We always deliver in ProPhoto */
+	rs_filter_param_set_object(RS_FILTER_PARAM(response), "colorspace", klass->prophoto);
+
+	/* Held until all rows are rendered */
+	g_rec_mutex_lock(&dcp_mutex);
+	init_exposure(dcp);
+	pre_cache_tables(dcp);
+
+	*data = dcp;
+	*destroy = finish_pointwise;
+
+	return render_pointwise;
+}
+
 /* dng_color_spec::NeutralToXY */
 static RS_xy_COORD
 neutral_to_xy(RSDcp *dcp, const RS_VECTOR3 *neutral)
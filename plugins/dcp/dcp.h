@@ -115,13 +115,11 @@ struct _RSDcpClass {
 
 typedef struct {
 	RSDcp *dcp;
-	GThread *threadid;
 	gint start_x;
 	gint start_y;
 	gint end_y;
 	RS_IMAGE16 *tmp;
 	guint curve_input_values[256];
-	gboolean single_thread;
 } ThreadInfo;
 
 gboolean render_SSE2(ThreadInfo* t);
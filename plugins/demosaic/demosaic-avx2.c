@@ -0,0 +1,333 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>,
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "demosaic.h"
+
+#if defined (__AVX2__)
+
+#include <immintrin.h>
+
+/* Picks the channel of the first pixel in each 128 bit lane into the lowest
+ * dword of the lane */
+static const gint8 channel_shuffle[3][32] __attribute__ ((aligned (32))) = {
+	{ 0, 1, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128,
+	  0, 1, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+	{ 2, 3, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128,
+	  2, 3, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+	{ 4, 5, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128,
+	  4, 5, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+};
+
+/* Pixel of every dword returned by load_channel(), relative to pix. Shuffles
+ * stay within lanes, so the low lane gets pixels 0, 4, 8 and 12 */
+static const gint dword_pixel[8] = { 0, 4, 8, 12, 2, 6, 10, 14 };
+
+/* Loads one channel of every second pixel from pix, eight pixels as 32 bit in
+ * the order of dword_pixel */
+static inline __m256i
+load_channel(const gushort *pix, const __m256i mask)
+{
+	const __m256i *v = (const __m256i *) pix;
+	__m256i a = _mm256_shuffle_epi8(_mm256_loadu_si256(v), mask);
+	__m256i b = _mm256_shuffle_epi8(_mm256_loadu_si256(v + 1), mask);
+	__m256i c = _mm256_shuffle_epi8(_mm256_loadu_si256(v + 2), mask);
+	__m256i d = _mm256_shuffle_epi8(_mm256_loadu_si256(v + 3), mask);
+
+	return _mm256_or_si256(_mm256_or_si256(a, _mm256_slli_si256(b, 4)),
+		_mm256_or_si256(_mm256_slli_si256(c, 8), _mm256_slli_si256(d, 12)));
+}
+
+static inline void
+store_channel(gushort *pix, const gint channel, const __m256i value)
+{
+	gint values[8] __attribute__ ((aligned (32)));
+	gint i;
+
+	_mm256_store_si256((__m256i *) values, value);
+	for (i = 0; i < 8; i++)
+		pix[dword_pixel[i]*4 + channel] = values[i];
+}
+
+static inline __m256i
+ulim(const __m256i x, const __m256i y, const __m256i z)
+{
+	return _mm256_min_epi32(_mm256_max_epi32(x, _mm256_min_epi32(y, z)), _mm256_max_epi32(y, z));
+}
+
+static inline __m256i
+clip(const __m256i x)
+{
+	return _mm256_min_epi32(_mm256_max_epi32(x, _mm256_setzero_si256()), _mm256_set1_epi32(65535));
+}
+
+static inline __m256i
+times3(const __m256i x)
+{
+	return _mm256_add_epi32(_mm256_add_epi32(x, x), x);
+}
+
+gint
+ppg_green_row_AVX2(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	const gint p = image->rowstride;
+	const __m256i mc = _mm256_load_si256((const __m256i *) channel_shuffle[c]);
+	const __m256i mg = _mm256_load_si256((const __m256i *) channel_shuffle[1]);
+
+	/* Reads up to three pixels right of the last of the eight */
+	for (; col + 19 <= image->w; col += 16)
+	{
+		gushort *pix = GET_PIXEL(image, col, row);
+		__m256i cc = load_channel(pix, mc);
+		__m256i l1 = load_channel(pix - 4, mg);
+		__m256i r1 = load_channel(pix + 4, mg);
+		__m256i l2 = load_channel(pix - 8, mc);
+		__m256i r2 = load_channel(pix + 8, mc);
+		__m256i l3 = load_channel(pix - 12, mg);
+		__m256i r3 = load_channel(pix + 12, mg);
+		__m256i u1 = load_channel(pix - p, mg);
+		__m256i d1 = load_channel(pix + p, mg);
+		__m256i u2 = load_channel(pix - 2*p, mc);
+		__m256i d2 = load_channel(pix + 2*p, mc);
+		__m256i u3 = load_channel(pix - 3*p, mg);
+		__m256i d3 = load_channel(pix + 3*p, mg);
+
+		__m256i sum = _mm256_add_epi32(_mm256_add_epi32(l1, cc), r1);
+		__m256i guessA = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_add_epi32(sum, sum), l2), r2);
+		__m256i diffA = _mm256_add_epi32(
+			times3(_mm256_add_epi32(_mm256_add_epi32(
+				_mm256_abs_epi32(_mm256_sub_epi32(l2, cc)),
+				_mm256_abs_epi32(_mm256_sub_epi32(r2, cc))),
+				_mm256_abs_epi32(_mm256_sub_epi32(l1, r1)))),
+			_mm256_slli_epi32(_mm256_add_epi32(
+				_mm256_abs_epi32(_mm256_sub_epi32(r3, r1)),
+				_mm256_abs_epi32(_mm256_sub_epi32(l3, l1))), 1));
+
+		sum = _mm256_add_epi32(_mm256_add_epi32(u1, cc), d1);
+		__m256i guessB = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_add_epi32(sum, sum), u2), d2);
+		__m256i diffB = _mm256_add_epi32(
+			times3(_mm256_add_epi32(_mm256_add_epi32(
+				_mm256_abs_epi32(_mm256_sub_epi32(u2, cc)),
+				_mm256_abs_epi32(_mm256_sub_epi32(d2, cc))),
+				_mm256_abs_epi32(_mm256_sub_epi32(u1, d1)))),
+			_mm256_slli_epi32(_mm256_add_epi32(
+				_mm256_abs_epi32(_mm256_sub_epi32(d3, d1)),
+				_mm256_abs_epi32(_mm256_sub_epi32(u3, u1))), 1));
+
+		__m256i a = ulim(_mm256_srai_epi32(guessA, 2), r1, l1);
+		__m256i b = ulim(_mm256_srai_epi32(guessB, 2), d1, u1);
+
+		store_channel(pix, 1, _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi32(diffA, diffB)));
+	}
+
+	return col;
+}
+
+gint
+ppg_rb_at_green_row_AVX2(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	const gint p = image->rowstride;
+	const __m256i mc = _mm256_load_si256((const __m256i *) channel_shuffle[c]);
+	const __m256i mo = _mm256_load_si256((const __m256i *) channel_shuffle[2-c]);
+	const __m256i mg = _mm256_load_si256((const __m256i *) channel_shuffle[1]);
+
+	/* Reads one pixel right of the last of the eight */
+	for (; col + 17 <= image->w; col += 16)
+	{
+		gushort *pix = GET_PIXEL(image, col, row);
+		__m256i g2 = _mm256_slli_epi32(load_channel(pix, mg), 1);
+		__m256i h = _mm256_add_epi32(load_channel(pix - 4, mc), load_channel(pix + 4, mc));
+		__m256i hg = _mm256_add_epi32(load_channel(pix - 4, mg), load_channel(pix + 4, mg));
+		__m256i v = _mm256_add_epi32(load_channel(pix - p, mo), load_channel(pix + p, mo));
+		__m256i vg = _mm256_add_epi32(load_channel(pix - p, mg), load_channel(pix + p, mg));
+
+		store_channel(pix, c, clip(_mm256_srai_epi32(_mm256_sub_epi32(_mm256_add_epi32(h, g2), hg), 1)));
+		store_channel(pix, 2-c, clip(_mm256_srai_epi32(_mm256_sub_epi32(_mm256_add_epi32(v, g2), vg), 1)));
+	}
+
+	return col;
+}
+
+gint
+ppg_rb_at_rb_row_AVX2(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	const gint p = image->rowstride;
+	const __m256i mc = _mm256_load_si256((const __m256i *) channel_shuffle[c]);
+	const __m256i mg = _mm256_load_si256((const __m256i *) channel_shuffle[1]);
+
+	/* Reads one pixel right of the last of the eight */
+	for (; col + 17 <= image->w; col += 16)
+	{
+		gushort *pix = GET_PIXEL(image, col, row);
+		__m256i g = load_channel(pix, mg);
+		__m256i g2 = _mm256_slli_epi32(g, 1);
+
+		/* Top left to bottom right */
+		__m256i ca = load_channel(pix - p - 4, mc);
+		__m256i cb = load_channel(pix + p + 4, mc);
+		__m256i ga = load_channel(pix - p - 4, mg);
+		__m256i gb = load_channel(pix + p + 4, mg);
+		__m256i diffA = _mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(ca, cb)),
+			_mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(ga, g)), _mm256_abs_epi32(_mm256_sub_epi32(gb, g))));
+		__m256i guessA = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(ca, cb), g2), _mm256_add_epi32(ga, gb));
+
+		/* Top right to bottom left */
+		ca = load_channel(pix - p + 4, mc);
+		cb = load_channel(pix + p - 4, mc);
+		ga = load_channel(pix - p + 4, mg);
+		gb = load_channel(pix + p - 4, mg);
+		__m256i diffB = _mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(ca, cb)),
+			_mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(ga, g)), _mm256_abs_epi32(_mm256_sub_epi32(gb, g))));
+		__m256i guessB = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(ca, cb), g2), _mm256_add_epi32(ga, gb));
+
+		__m256i guess = _mm256_blendv_epi8(guessA, guessB, _mm256_cmpgt_epi32(diffA, diffB));
+		store_channel(pix, c, clip(_mm256_srai_epi32(guess, 1)));
+	}
+
+	return col;
+}
+
+/* Splits sixteen CFA samples into the even and odd columns, as 32 bit */
+static inline void
+split_columns(const gushort *pix, __m256i *even, __m256i *odd)
+{
+	const __m256i v = _mm256_loadu_si256((const __m256i *) pix);
+
+	*even = _mm256_and_si256(v, _mm256_set1_epi32(0xffff));
+	*odd = _mm256_srli_epi32(v, 16);
+}
+
+/* Adds red, green and blue of eight 2x2 cells starting at col in row and the
+ * row below */
+static inline void
+sum_cells(const gushort *top, const gushort *bottom, const gint layout[4], __m256i *r, __m256i *g, __m256i *b)
+{
+	__m256i s[4];
+
+	split_columns(top, &s[0], &s[1]);
+	split_columns(bottom, &s[2], &s[3]);
+	*r = _mm256_add_epi32(*r, s[layout[0]]);
+	*g = _mm256_add_epi32(*g, _mm256_add_epi32(s[layout[1]], s[layout[2]]));
+	*b = _mm256_add_epi32(*b, s[layout[3]]);
+}
+
+/* Stores eight RGB pixels with the fourth channel cleared. Unpacking stays
+ * within lanes, giving pixels 0, 1, 4, 5 and 2, 3, 6, 7 */
+static inline void
+store_rgb(gushort *pix, const __m256i r, const __m256i g, const __m256i b)
+{
+	const __m256i rg = _mm256_or_si256(r, _mm256_slli_epi32(g, 16));
+	const __m256i lo = _mm256_unpacklo_epi32(rg, b);
+	const __m256i hi = _mm256_unpackhi_epi32(rg, b);
+
+	_mm256_storeu_si256((__m256i *) pix, _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i *) (pix + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+/* Adds neighbouring dwords of a and b, in the order of the cells */
+static inline __m256i
+add_pairs(const __m256i a, const __m256i b)
+{
+	return _mm256_permute4x64_epi64(_mm256_hadd_epi32(a, b), 0xd8);
+}
+
+gint
+bin_row_AVX2(RS_IMAGE16 *input, RS_IMAGE16 *output, gint row, gint factor, guint filters)
+{
+	gushort *out = GET_PIXEL(output, 0, row);
+	gint layout[4];
+	gint col = 0;
+
+	if (!bin_cell_layout(filters, layout))
+		return col;
+
+	if (factor == 2)
+	{
+		const gushort *top = GET_PIXEL(input, 0, row*2);
+		const gushort *bottom = GET_PIXEL(input, 0, row*2+1);
+		const __m256i one = _mm256_set1_epi32(1);
+
+		for (; col + 8 <= output->w; col += 8, out += 32)
+		{
+			__m256i r = _mm256_setzero_si256();
+			__m256i g = _mm256_setzero_si256();
+			__m256i b = _mm256_setzero_si256();
+
+			sum_cells(top + col*2, bottom + col*2, layout, &r, &g, &b);
+			store_rgb(out, r, _mm256_srli_epi32(_mm256_add_epi32(g, one), 1), b);
+		}
+	}
+	else if (factor == 4)
+	{
+		const gushort *rows[4];
+		const __m256i two = _mm256_set1_epi32(2);
+		const __m256i four = _mm256_set1_epi32(4);
+		gint i;
+
+		for (i = 0; i < 4; i++)
+			rows[i] = GET_PIXEL(input, 0, row*4+i);
+
+		for (; col + 8 <= output->w; col += 8, out += 32)
+		{
+			__m256i r[2], g[2], b[2];
+
+			/* Two cells across make an output pixel, so do sixteen cells and
+			 * add neighbours */
+			for (i = 0; i < 2; i++)
+			{
+				r[i] = g[i] = b[i] = _mm256_setzero_si256();
+				sum_cells(rows[0] + col*4 + i*16, rows[1] + col*4 + i*16, layout, &r[i], &g[i], &b[i]);
+				sum_cells(rows[2] + col*4 + i*16, rows[3] + col*4 + i*16, layout, &r[i], &g[i], &b[i]);
+			}
+			store_rgb(out,
+				_mm256_srli_epi32(_mm256_add_epi32(add_pairs(r[0], r[1]), two), 2),
+				_mm256_srli_epi32(_mm256_add_epi32(add_pairs(g[0], g[1]), four), 3),
+				_mm256_srli_epi32(_mm256_add_epi32(add_pairs(b[0], b[1]), two), 2));
+		}
+	}
+
+	return col;
+}
+
+#else /* not defined (__AVX2__) */
+
+gint
+ppg_green_row_AVX2(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	return col;
+}
+
+gint
+ppg_rb_at_green_row_AVX2(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	return col;
+}
+
+gint
+ppg_rb_at_rb_row_AVX2(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	return col;
+}
+
+gint
+bin_row_AVX2(RS_IMAGE16 *input, RS_IMAGE16 *output, gint row, gint factor, guint filters)
+{
+	return 0;
+}
+
+#endif /* not defined (__AVX2__) */
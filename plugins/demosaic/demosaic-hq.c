@@ -0,0 +1,631 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>,
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+   AHD and VNG interpolation, based on the dcraw/ufraw versions in
+   plugins/load-dcraw/dcraw_indi.c.
+
+   Instead of running over the complete frame, both are done in tiles small
+   enough to stay in cache. Every tile reads the Bayer data it needs from
+   the input, including a border, and only writes its own pixels to the
+   output, so tiles can be interpolated in any order by any number of
+   threads. The result is the same as for the complete frame.
+*/
+
+#include <rawstudio.h>
+#include <string.h>
+#include <math.h>
+#include "demosaic.h"
+
+/* Size of an AHD tile including the 3 pixels shared with its neighbours on
+ * each side. The buffers for one tile take 26 bytes per pixel */
+#define AHD_TILE (128)
+
+/* Pixels along the edges done by border interpolation instead of AHD */
+#define AHD_BORDER (5)
+
+/* Pixels written by a VNG tile in each direction */
+#define VNG_TILE (128)
+
+/* VNG reads two pixels away, and the bilinear guess it starts from reads one
+ * more */
+#define VNG_PITCH (VNG_TILE + 6)
+
+typedef struct {
+	RS_IMAGE16 *input;
+	RS_IMAGE16 *output;
+	guint filters;
+	GdkRectangle area;
+	gint tiles_x;
+	gint n_tiles;
+	gint next_tile;
+	gint lin_code[16][16][32];
+	gint *vng_code[16][16];
+	gint *vng_code_buffer;
+	gint prow;
+	gint pcol;
+} TileJob;
+
+static gfloat cbrt_table[0x10000];
+static gfloat xyz_cam[3][3];
+
+/* The input is camera RGB, which is treated as sRGB. AHD only compares
+ * neighbouring pixels, so the exact colour space matters little */
+static void
+cielab_init(void)
+{
+	static gsize initialized = 0;
+	static const gdouble xyz_rgb[3][3] = {
+		{ 0.412453, 0.357580, 0.180423 },
+		{ 0.212671, 0.715160, 0.072169 },
+		{ 0.019334, 0.119193, 0.950227 } };
+	static const gdouble d65_white[3] = { 0.950456, 1.0, 1.088754 };
+	gint i, j;
+	gfloat r;
+
+	if (g_once_init_enter(&initialized))
+	{
+		for (i = 0; i < 0x10000; i++)
+		{
+			r = i / 65535.0;
+			cbrt_table[i] = r > 0.008856 ? pow(r, 1/3.0) : 7.787 * r + 16 / 116.0;
+		}
+		for (i = 0; i < 3; i++)
+			for (j = 0; j < 3; j++)
+				xyz_cam[i][j] = xyz_rgb[i][j] / d65_white[i];
+		g_once_init_leave(&initialized, 1);
+	}
+}
+
+static inline void
+cielab(const gushort rgb[3], gshort lab[3])
+{
+	gint c;
+	gfloat xyz[3];
+
+	xyz[0] = xyz[1] = xyz[2] = 0.5;
+	for (c = 0; c < 3; c++)
+	{
+		xyz[0] += xyz_cam[0][c] * rgb[c];
+		xyz[1] += xyz_cam[1][c] * rgb[c];
+		xyz[2] += xyz_cam[2][c] * rgb[c];
+	}
+	xyz[0] = cbrt_table[CLIP((gint) xyz[0])];
+	xyz[1] = cbrt_table[CLIP((gint) xyz[1])];
+	xyz[2] = cbrt_table[CLIP((gint) xyz[2])];
+	lab[0] = 64 * (116 * xyz[1] - 16);
+	lab[1] = 64 * 500 * (xyz[0] - xyz[1]);
+	lab[2] = 64 * 200 * (xyz[1] - xyz[2]);
+}
+
+static gboolean
+tile_in_area(const TileJob *job, gint x, gint y, gint width, gint height)
+{
+	GdkRectangle tile = { x, y, width, height };
+	GdkRectangle dummy;
+
+	return gdk_rectangle_intersect(&tile, (GdkRectangle *) &job->area, &dummy);
+}
+
+/* Average the same colour in the 3x3 neighbourhood for pixels closer than
+ * border to the edge of the image, as border_interpolate_INDI() */
+static void
+border_interpolate(const TileJob *job, gint border)
+{
+	RS_IMAGE16 *input = job->input;
+	RS_IMAGE16 *output = job->output;
+	const guint filters = job->filters;
+	const gint x1 = job->area.x + job->area.width;
+	const gint y1 = job->area.y + job->area.height;
+	gint row, col, y, x, f, c, sum[8];
+	gushort *pix;
+
+	for (row = job->area.y; row < y1; row++)
+		for (col = job->area.x; col < x1; col++)
+		{
+			if (row >= border && row < input->h - border && col >= border && col < input->w - border)
+			{
+				col = input->w - border;
+				if (col >= x1)
+					break;
+			}
+			memset(sum, 0, sizeof sum);
+			for (y = row-1; y != row+2; y++)
+				for (x = col-1; x != col+2; x++)
+					if (y >= 0 && y < input->h && x >= 0 && x < input->w)
+					{
+						f = fc_INDI(filters, y, x);
+						sum[f] += GET_PIXEL(input, x, y)[0];
+						sum[f+4]++;
+					}
+			f = fc_INDI(filters, row, col);
+			pix = GET_PIXEL(output, col, row);
+			for (c = 0; c < 3; c++)
+				if (c == f)
+					pix[c] = GET_PIXEL(input, col, row)[0];
+				else
+					pix[c] = sum[c+4] ? sum[c] / sum[c+4] : 0;
+		}
+}
+
+/*
+   Adaptive Homogeneity-Directed interpolation is based on
+   the work of Keigo Hirakawa, Thomas Parks, and Paul Lee.
+
+   This does a single tile with its top left corner at top, left. Pixels
+   from top+3 and left+3 are written, the rest is needed to decide them.
+ */
+static void
+ahd_interpolate_tile(const TileJob *job, const gint top, const gint left, gchar *buffer)
+{
+	RS_IMAGE16 *input = job->input;
+	RS_IMAGE16 *output = job->output;
+	const guint filters = job->filters;
+	const gint width = input->w;
+	const gint height = input->h;
+	const gint p = input->rowstride;
+	static const gint dir[4] = { -1, 1, -AHD_TILE, AHD_TILE };
+	gint i, j, row, col, tr, tc, c, d, val, hm[2];
+	guint ldiff[2][4], abdiff[2][4], leps, abeps;
+	gushort (*rgb)[AHD_TILE][AHD_TILE][3], (*rix)[3];
+	gshort (*lab)[AHD_TILE][AHD_TILE][3], (*lix)[3];
+	gchar (*homo)[AHD_TILE][AHD_TILE];
+	gushort *cfa, *pix;
+
+	rgb = (gushort (*)[AHD_TILE][AHD_TILE][3]) buffer;
+	lab = (gshort (*)[AHD_TILE][AHD_TILE][3]) (buffer + 12*AHD_TILE*AHD_TILE);
+	homo = (gchar (*)[AHD_TILE][AHD_TILE]) (buffer + 24*AHD_TILE*AHD_TILE);
+
+	/*  Interpolate green horizontally and vertically: */
+	for (row = top; row < top+AHD_TILE && row < height-2; row++)
+	{
+		col = left + (FC(row,left) & 1);
+		for (c = FC(row,col); col < left+AHD_TILE && col < width-2; col += 2)
+		{
+			cfa = GET_PIXEL(input, col, row);
+			val = ((cfa[-1] + cfa[0] + cfa[1]) * 2 - cfa[-2] - cfa[2]) >> 2;
+			rgb[0][row-top][col-left][1] = ULIM(val, cfa[-1], cfa[1]);
+			val = ((cfa[-p] + cfa[0] + cfa[p]) * 2 - cfa[-2*p] - cfa[2*p]) >> 2;
+			rgb[1][row-top][col-left][1] = ULIM(val, cfa[-p], cfa[p]);
+		}
+	}
+
+	/*  Interpolate red and blue, and convert to CIELab: */
+	for (d = 0; d < 2; d++)
+		for (row = top+1; row < top+AHD_TILE-1 && row < height-3; row++)
+			for (col = left+1; col < left+AHD_TILE-1 && col < width-3; col++)
+			{
+				cfa = GET_PIXEL(input, col, row);
+				rix = &rgb[d][row-top][col-left];
+				lix = &lab[d][row-top][col-left];
+				if ((c = 2 - FC(row,col)) == 1)
+				{
+					c = FC(row+1,col);
+					val = cfa[0] + ((cfa[-1] + cfa[1] - rix[-1][1] - rix[1][1]) >> 1);
+					rix[0][2-c] = CLIP(val);
+					val = cfa[0] + ((cfa[-p] + cfa[p] - rix[-AHD_TILE][1] - rix[AHD_TILE][1]) >> 1);
+				}
+				else
+					val = rix[0][1] + ((cfa[-p-1] + cfa[-p+1] + cfa[p-1] + cfa[p+1]
+						- rix[-AHD_TILE-1][1] - rix[-AHD_TILE+1][1]
+						- rix[AHD_TILE-1][1] - rix[AHD_TILE+1][1] + 1) >> 2);
+				rix[0][c] = CLIP(val);
+				c = FC(row,col);
+				rix[0][c] = cfa[0];
+				cielab(rix[0], lix[0]);
+			}
+
+	/*  Build homogeneity maps from the CIELab images: */
+	memset(homo, 0, 2*AHD_TILE*AHD_TILE);
+	for (row = top+2; row < top+AHD_TILE-2 && row < height-4; row++)
+	{
+		tr = row - top;
+		for (col = left+2; col < left+AHD_TILE-2 && col < width-4; col++)
+		{
+			tc = col - left;
+			for (d = 0; d < 2; d++)
+			{
+				lix = &lab[d][tr][tc];
+				for (i = 0; i < 4; i++)
+				{
+					ldiff[d][i] = ABS(lix[0][0] - lix[dir[i]][0]);
+					abdiff[d][i] = (lix[0][1] - lix[dir[i]][1]) * (lix[0][1] - lix[dir[i]][1])
+						+ (lix[0][2] - lix[dir[i]][2]) * (lix[0][2] - lix[dir[i]][2]);
+				}
+			}
+			leps = MIN(MAX(ldiff[0][0], ldiff[0][1]), MAX(ldiff[1][2], ldiff[1][3]));
+			abeps = MIN(MAX(abdiff[0][0], abdiff[0][1]), MAX(abdiff[1][2], abdiff[1][3]));
+			for (d = 0; d < 2; d++)
+				for (i = 0; i < 4; i++)
+					if (ldiff[d][i] <= leps && abdiff[d][i] <= abeps)
+						homo[d][tr][tc]++;
+		}
+	}
+
+	/*  Combine the most homogenous pixels for the final result: */
+	for (row = top+3; row < top+AHD_TILE-3 && row < height-AHD_BORDER; row++)
+	{
+		tr = row - top;
+		pix = GET_PIXEL(output, left+3, row);
+		for (col = left+3; col < left+AHD_TILE-3 && col < width-AHD_BORDER; col++, pix += output->pixelsize)
+		{
+			tc = col - left;
+			for (d = 0; d < 2; d++)
+				for (hm[d] = 0, i = tr-1; i <= tr+1; i++)
+					for (j = tc-1; j <= tc+1; j++)
+						hm[d] += homo[d][i][j];
+			if (hm[0] != hm[1])
+				for (c = 0; c < 3; c++)
+					pix[c] = rgb[hm[1] > hm[0]][tr][tc][c];
+			else
+				for (c = 0; c < 3; c++)
+					pix[c] = (rgb[0][tr][tc][c] + rgb[1][tr][tc][c]) >> 1;
+		}
+	}
+}
+
+static gpointer
+ahd_thread(gpointer _job)
+{
+	TileJob *job = *(TileJob **) _job;
+	gchar *buffer = g_malloc(26*AHD_TILE*AHD_TILE);
+	gint i, top, left;
+
+	while ((i = g_atomic_int_add(&job->next_tile, 1)) < job->n_tiles)
+	{
+		/* Tiles overlap by 6 pixels, so they write next to each other */
+		top = AHD_BORDER-3 + (i / job->tiles_x) * (AHD_TILE-6);
+		left = AHD_BORDER-3 + (i % job->tiles_x) * (AHD_TILE-6);
+		if (tile_in_area(job, left+3, top+3, AHD_TILE-6, AHD_TILE-6))
+			ahd_interpolate_tile(job, top, left, buffer);
+	}
+
+	g_free(buffer);
+	return NULL;
+}
+
+static void
+run_tiles(TileJob *job, GThreadFunc func)
+{
+	const guint threads = MIN(rs_get_number_of_processor_cores(), (guint) job->n_tiles);
+	TileJob **t = g_new(TileJob *, MAX(threads, 1));
+	guint i;
+
+	/* Every thread picks the next free tile until all are done */
+	for (i = 0; i < threads; i++)
+		t[i] = job;
+	rs_worker_pool_run(t, sizeof(TileJob *), threads, func);
+
+	g_free(t);
+}
+
+static TileJob *
+tile_job_new(RS_IMAGE16 *image, RS_IMAGE16 *output, const guint filters, const GdkRectangle *roi)
+{
+	TileJob *job = g_new0(TileJob, 1);
+	GdkRectangle frame = { 0, 0, image->w, image->h };
+
+	job->input = image;
+	job->output = output;
+	job->filters = filters;
+	job->area = frame;
+	if (roi)
+		gdk_rectangle_intersect((GdkRectangle *) roi, &frame, &job->area);
+
+	return job;
+}
+
+/* AHD interpolation of a Bayer image, limited to the tiles touching roi if
+ * it is given */
+void
+ahd_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const guint filters, const GdkRectangle *roi)
+{
+	TileJob *job = tile_job_new(image, output, filters, roi);
+	const gint step = AHD_TILE-6;
+
+	cielab_init();
+	border_interpolate(job, AHD_BORDER);
+
+	if (image->w > AHD_BORDER*2 && image->h > AHD_BORDER*2)
+	{
+		job->tiles_x = (image->w - AHD_BORDER*2 + step-1) / step;
+		job->n_tiles = job->tiles_x * ((image->h - AHD_BORDER*2 + step-1) / step);
+		run_tiles(job, ahd_thread);
+	}
+
+	g_free(job);
+}
+
+/*
+   This algorithm is officially called:
+
+   "Interpolation using a Threshold-based variable number of gradients"
+
+   described in http://scien.stanford.edu/class/psych221/projects/99/tingchen/algodep/vargra.html
+
+   I've extended the basic idea to work with non-Bayer filter arrays.
+   Gradients are numbered clockwise from NW=0 to W=7.
+
+   Offsets in the tables refer to a tile buffer VNG_PITCH pixels wide.
+ */
+static void
+vng_prepare(TileJob *job)
+{
+	static const signed char *cp, terms[] = {
+		-2,-2,+0,-1,0,0x01, -2,-2,+0,+0,1,0x01, -2,-1,-1,+0,0,0x01,
+		-2,-1,+0,-1,0,0x02, -2,-1,+0,+0,0,0x03, -2,-1,+0,+1,1,0x01,
+		-2,+0,+0,-1,0,0x06, -2,+0,+0,+0,1,0x02, -2,+0,+0,+1,0,0x03,
+		-2,+1,-1,+0,0,0x04, -2,+1,+0,-1,1,0x04, -2,+1,+0,+0,0,0x06,
+		-2,+1,+0,+1,0,0x02, -2,+2,+0,+0,1,0x04, -2,+2,+0,+1,0,0x04,
+		-1,-2,-1,+0,0,0x80, -1,-2,+0,-1,0,0x01, -1,-2,+1,-1,0,0x01,
+		-1,-2,+1,+0,1,0x01, -1,-1,-1,+1,0,0x88, -1,-1,+1,-2,0,0x40,
+		-1,-1,+1,-1,0,0x22, -1,-1,+1,+0,0,0x33, -1,-1,+1,+1,1,0x11,
+		-1,+0,-1,+2,0,0x08, -1,+0,+0,-1,0,0x44, -1,+0,+0,+1,0,0x11,
+		-1,+0,+1,-2,1,0x40, -1,+0,+1,-1,0,0x66, -1,+0,+1,+0,1,0x22,
+		-1,+0,+1,+1,0,0x33, -1,+0,+1,+2,1,0x10, -1,+1,+1,-1,1,0x44,
+		-1,+1,+1,+0,0,0x66, -1,+1,+1,+1,0,0x22, -1,+1,+1,+2,0,0x10,
+		-1,+2,+0,+1,0,0x04, -1,+2,+1,+0,1,0x04, -1,+2,+1,+1,0,0x04,
+		+0,-2,+0,+0,1,0x80, +0,-1,+0,+1,1,0x88, +0,-1,+1,-2,0,0x40,
+		+0,-1,+1,+0,0,0x11, +0,-1,+2,-2,0,0x40, +0,-1,+2,-1,0,0x20,
+		+0,-1,+2,+0,0,0x30, +0,-1,+2,+1,1,0x10, +0,+0,+0,+2,1,0x08,
+		+0,+0,+2,-2,1,0x40, +0,+0,+2,-1,0,0x60, +0,+0,+2,+0,1,0x20,
+		+0,+0,+2,+1,0,0x30, +0,+0,+2,+2,1,0x10, +0,+1,+1,+0,0,0x44,
+		+0,+1,+1,+2,0,0x10, +0,+1,+2,-1,1,0x40, +0,+1,+2,+0,0,0x60,
+		+0,+1,+2,+1,0,0x20, +0,+1,+2,+2,0,0x10, +1,-2,+1,+0,0,0x80,
+		+1,-1,+1,+1,0,0x88, +1,+0,+1,+2,0,0x08, +1,+0,+2,-1,0,0x40,
+		+1,+0,+2,+1,0,0x10
+	}, chood[] = { -1,-1, -1,0, -1,+1, 0,+1, +1,+1, +1,0, +1,-1, 0,-1 };
+	const guint filters = job->filters;
+	gint *ip, sum[4];
+	gint row, col, x, y, x1, x2, y1, y2, t, weight, grads, color, diag;
+	gint g, c, shift;
+
+	/* Bilinear interpolation as lin_interpolate_INDI() */
+	for (row = 0; row < 16; row++)
+		for (col = 0; col < 16; col++)
+		{
+			ip = job->lin_code[row][col];
+			memset(sum, 0, sizeof sum);
+			for (y = -1; y <= 1; y++)
+				for (x = -1; x <= 1; x++)
+				{
+					shift = (y==0) + (x==0);
+					if (shift == 2) continue;
+					color = fc_INDI(filters, row+y, col+x);
+					*ip++ = (VNG_PITCH*y + x)*4 + color;
+					*ip++ = shift;
+					*ip++ = color;
+					sum[color] += 1 << shift;
+				}
+			for (c = 0; c < 3; c++)
+				if (c != fc_INDI(filters, row, col))
+				{
+					*ip++ = c;
+					*ip++ = 256 / sum[c];
+				}
+		}
+
+	job->prow = 8;
+	job->pcol = 2;
+	if (filters == 1)
+		job->prow = job->pcol = 16;
+
+	ip = job->vng_code_buffer = g_malloc0(job->prow * job->pcol * 1280);
+	for (row = 0; row < job->prow; row++)
+		for (col = 0; col < job->pcol; col++)
+		{
+			job->vng_code[row][col] = ip;
+			for (cp = terms, t = 0; t < 64; t++)
+			{
+				y1 = *cp++;  x1 = *cp++;
+				y2 = *cp++;  x2 = *cp++;
+				weight = *cp++;
+				grads = *cp++;
+				color = fc_INDI(filters, row+y1, col+x1);
+				if (fc_INDI(filters, row+y2, col+x2) != color) continue;
+				diag = (fc_INDI(filters, row, col+1) == color && fc_INDI(filters, row+1, col) == color) ? 2:1;
+				if (ABS(y1-y2) == diag && ABS(x1-x2) == diag) continue;
+				*ip++ = (y1*VNG_PITCH + x1)*4 + color;
+				*ip++ = (y2*VNG_PITCH + x2)*4 + color;
+				*ip++ = weight;
+				for (g = 0; g < 8; g++)
+					if (grads & 1<<g) *ip++ = g;
+				*ip++ = -1;
+			}
+			*ip++ = G_MAXINT;
+			for (cp = chood, g = 0; g < 8; g++)
+			{
+				y = *cp++;  x = *cp++;
+				*ip++ = (y*VNG_PITCH + x)*4;
+				color = fc_INDI(filters, row, col);
+				if (fc_INDI(filters, row+y, col+x) != color && fc_INDI(filters, row+y*2, col+x*2) == color)
+					*ip++ = (y*VNG_PITCH + x)*8 + color;
+				else
+					*ip++ = 0;
+			}
+		}
+}
+
+/* VNG for the pixels from x0, y0 up to VNG_TILE in each direction */
+static void
+vng_interpolate_tile(const TileJob *job, const gint x0, const gint y0, gushort (*buffer)[4])
+{
+	RS_IMAGE16 *input = job->input;
+	RS_IMAGE16 *output = job->output;
+	const guint filters = job->filters;
+	const gint width = input->w;
+	const gint height = input->h;
+	const gint x1 = MIN(x0 + VNG_TILE, width);
+	const gint y1 = MIN(y0 + VNG_TILE, height);
+	/* Top left pixel of the buffer */
+	const gint bx = MAX(0, x0-3);
+	const gint by = MAX(0, y0-3);
+	gint row, col, x, y, f, c, i, g, t;
+	gint gval[8], gmin, gmax, thold, sum[8], diff, num, color;
+	gushort *src, *pix, *out;
+	const gint *ip;
+
+#define BUF(x, y) (buffer[((y)-by)*VNG_PITCH + (x)-bx])
+
+	/* Bayer data for the tile and three pixels around it */
+	for (row = by; row < MIN(y1+3, height); row++)
+	{
+		src = GET_PIXEL(input, bx, row);
+		pix = BUF(bx, row);
+		for (col = bx; col < MIN(x1+3, width); col++, pix += 4)
+		{
+			pix[0] = pix[1] = pix[2] = 0;
+			pix[fc_INDI(filters, row, col)] = *src++;
+		}
+	}
+
+	/* Bilinear interpolation of the tile and two pixels around it */
+	for (row = MAX(0, y0-2); row < MIN(y1+2, height); row++)
+		for (col = MAX(0, x0-2); col < MIN(x1+2, width); col++)
+		{
+			pix = BUF(col, row);
+			memset(sum, 0, sizeof sum);
+			if (row == 0 || col == 0 || row == height-1 || col == width-1)
+			{
+				for (y = row-1; y != row+2; y++)
+					for (x = col-1; x != col+2; x++)
+						if (y >= 0 && y < height && x >= 0 && x < width)
+						{
+							f = fc_INDI(filters, y, x);
+							sum[f] += BUF(x, y)[f];
+							sum[f+4]++;
+						}
+				f = fc_INDI(filters, row, col);
+				for (c = 0; c < 3; c++)
+					if (c != f && sum[c+4])
+						pix[c] = sum[c] / sum[c+4];
+			}
+			else
+			{
+				ip = job->lin_code[row & 15][col & 15];
+				for (i = 8; i--; ip += 3)
+					sum[ip[2]] += pix[ip[0]] << ip[1];
+				for (i = 3; --i; ip += 2)
+					pix[ip[0]] = sum[ip[0]] * ip[1] >> 8;
+			}
+		}
+
+	for (row = y0; row < y1; row++)
+	{
+		out = GET_PIXEL(output, x0, row);
+		for (col = x0; col < x1; col++, out += output->pixelsize)
+		{
+			pix = BUF(col, row);
+
+			/* The outer two pixels keep the bilinear result */
+			if (row < 2 || col < 2 || row >= height-2 || col >= width-2)
+			{
+				out[0] = pix[0];
+				out[1] = pix[1];
+				out[2] = pix[2];
+				continue;
+			}
+
+			ip = job->vng_code[row % job->prow][col % job->pcol];
+			memset(gval, 0, sizeof gval);
+			while ((g = ip[0]) != G_MAXINT)	/* Calculate gradients */
+			{
+				diff = ABS(pix[g] - pix[ip[1]]) << ip[2];
+				gval[ip[3]] += diff;
+				ip += 5;
+				if ((g = ip[-1]) == -1) continue;
+				gval[g] += diff;
+				while ((g = *ip++) != -1)
+					gval[g] += diff;
+			}
+			ip++;
+			gmin = gmax = gval[0];		/* Choose a threshold */
+			for (g = 1; g < 8; g++)
+			{
+				if (gmin > gval[g]) gmin = gval[g];
+				if (gmax < gval[g]) gmax = gval[g];
+			}
+			if (gmax == 0)
+			{
+				out[0] = pix[0];
+				out[1] = pix[1];
+				out[2] = pix[2];
+				continue;
+			}
+			thold = gmin + (gmax >> 1);
+			memset(sum, 0, sizeof sum);
+			color = fc_INDI(filters, row, col);
+			for (num = g = 0; g < 8; g++, ip += 2)	/* Average the neighbors */
+			{
+				if (gval[g] <= thold)
+				{
+					for (c = 0; c < 3; c++)
+						if (c == color && ip[1])
+							sum[c] += (pix[c] + pix[ip[1]]) >> 1;
+						else
+							sum[c] += pix[ip[0] + c];
+					num++;
+				}
+			}
+			for (c = 0; c < 3; c++)
+			{
+				t = pix[color];
+				if (c != color)
+					t += (sum[c] - sum[color]) / num;
+				out[c] = CLIP(t);
+			}
+		}
+	}
+#undef BUF
+}
+
+static gpointer
+vng_thread(gpointer _job)
+{
+	TileJob *job = *(TileJob **) _job;
+	gushort (*buffer)[4] = g_malloc(VNG_PITCH * VNG_PITCH * sizeof(*buffer));
+	gint i, x0, y0;
+
+	while ((i = g_atomic_int_add(&job->next_tile, 1)) < job->n_tiles)
+	{
+		x0 = (i % job->tiles_x) * VNG_TILE;
+		y0 = (i / job->tiles_x) * VNG_TILE;
+		if (tile_in_area(job, x0, y0, VNG_TILE, VNG_TILE))
+			vng_interpolate_tile(job, x0, y0, buffer);
+	}
+
+	g_free(buffer);
+	return NULL;
+}
+
+/* VNG interpolation, limited to the tiles touching roi if it is given */
+void
+vng_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const guint filters, const GdkRectangle *roi)
+{
+	TileJob *job = tile_job_new(image, output, filters, roi);
+
+	vng_prepare(job);
+
+	job->tiles_x = (image->w + VNG_TILE-1) / VNG_TILE;
+	job->n_tiles = job->tiles_x * ((image->h + VNG_TILE-1) / VNG_TILE);
+	run_tiles(job, vng_thread);
+
+	g_free(job->vng_code_buffer);
+	g_free(job);
+}
@@ -0,0 +1,314 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>,
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "demosaic.h"
+
+#if defined (__SSE4_1__)
+
+#include <smmintrin.h>
+
+/* Picks the channel of the first pixel in a vector into the lowest dword */
+static const gint8 channel_shuffle[3][16] __attribute__ ((aligned (16))) = {
+	{ 0, 1, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+	{ 2, 3, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+	{ 4, 5, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+};
+
+/* Loads one channel of every second pixel from pix, four pixels as 32 bit */
+static inline __m128i
+load_channel(const gushort *pix, const __m128i mask)
+{
+	const __m128i *v = (const __m128i *) pix;
+	__m128i a = _mm_shuffle_epi8(_mm_loadu_si128(v), mask);
+	__m128i b = _mm_shuffle_epi8(_mm_loadu_si128(v + 1), mask);
+	__m128i c = _mm_shuffle_epi8(_mm_loadu_si128(v + 2), mask);
+	__m128i d = _mm_shuffle_epi8(_mm_loadu_si128(v + 3), mask);
+
+	return _mm_or_si128(_mm_or_si128(a, _mm_slli_si128(b, 4)),
+		_mm_or_si128(_mm_slli_si128(c, 8), _mm_slli_si128(d, 12)));
+}
+
+static inline void
+store_channel(gushort *pix, const gint channel, const __m128i value)
+{
+	gint values[4] __attribute__ ((aligned (16)));
+	gint i;
+
+	_mm_store_si128((__m128i *) values, value);
+	for (i = 0; i < 4; i++)
+		pix[i*8 + channel] = values[i];
+}
+
+static inline __m128i
+ulim(const __m128i x, const __m128i y, const __m128i z)
+{
+	return _mm_min_epi32(_mm_max_epi32(x, _mm_min_epi32(y, z)), _mm_max_epi32(y, z));
+}
+
+static inline __m128i
+clip(const __m128i x)
+{
+	return _mm_min_epi32(_mm_max_epi32(x, _mm_setzero_si128()), _mm_set1_epi32(65535));
+}
+
+static inline __m128i
+times3(const __m128i x)
+{
+	return _mm_add_epi32(_mm_add_epi32(x, x), x);
+}
+
+gint
+ppg_green_row_SSE4(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	const gint p = image->rowstride;
+	const __m128i mc = _mm_load_si128((const __m128i *) channel_shuffle[c]);
+	const __m128i mg = _mm_load_si128((const __m128i *) channel_shuffle[1]);
+
+	/* Reads up to three pixels right of the last of the four */
+	for (; col + 11 <= image->w; col += 8)
+	{
+		gushort *pix = GET_PIXEL(image, col, row);
+		__m128i cc = load_channel(pix, mc);
+		__m128i l1 = load_channel(pix - 4, mg);
+		__m128i r1 = load_channel(pix + 4, mg);
+		__m128i l2 = load_channel(pix - 8, mc);
+		__m128i r2 = load_channel(pix + 8, mc);
+		__m128i l3 = load_channel(pix - 12, mg);
+		__m128i r3 = load_channel(pix + 12, mg);
+		__m128i u1 = load_channel(pix - p, mg);
+		__m128i d1 = load_channel(pix + p, mg);
+		__m128i u2 = load_channel(pix - 2*p, mc);
+		__m128i d2 = load_channel(pix + 2*p, mc);
+		__m128i u3 = load_channel(pix - 3*p, mg);
+		__m128i d3 = load_channel(pix + 3*p, mg);
+
+		__m128i sum = _mm_add_epi32(_mm_add_epi32(l1, cc), r1);
+		__m128i guessA = _mm_sub_epi32(_mm_sub_epi32(_mm_add_epi32(sum, sum), l2), r2);
+		__m128i diffA = _mm_add_epi32(
+			times3(_mm_add_epi32(_mm_add_epi32(
+				_mm_abs_epi32(_mm_sub_epi32(l2, cc)),
+				_mm_abs_epi32(_mm_sub_epi32(r2, cc))),
+				_mm_abs_epi32(_mm_sub_epi32(l1, r1)))),
+			_mm_slli_epi32(_mm_add_epi32(
+				_mm_abs_epi32(_mm_sub_epi32(r3, r1)),
+				_mm_abs_epi32(_mm_sub_epi32(l3, l1))), 1));
+
+		sum = _mm_add_epi32(_mm_add_epi32(u1, cc), d1);
+		__m128i guessB = _mm_sub_epi32(_mm_sub_epi32(_mm_add_epi32(sum, sum), u2), d2);
+		__m128i diffB = _mm_add_epi32(
+			times3(_mm_add_epi32(_mm_add_epi32(
+				_mm_abs_epi32(_mm_sub_epi32(u2, cc)),
+				_mm_abs_epi32(_mm_sub_epi32(d2, cc))),
+				_mm_abs_epi32(_mm_sub_epi32(u1, d1)))),
+			_mm_slli_epi32(_mm_add_epi32(
+				_mm_abs_epi32(_mm_sub_epi32(d3, d1)),
+				_mm_abs_epi32(_mm_sub_epi32(u3, u1))), 1));
+
+		__m128i a = ulim(_mm_srai_epi32(guessA, 2), r1, l1);
+		__m128i b = ulim(_mm_srai_epi32(guessB, 2), d1, u1);
+
+		store_channel(pix, 1, _mm_blendv_epi8(a, b, _mm_cmpgt_epi32(diffA, diffB)));
+	}
+
+	return col;
+}
+
+gint
+ppg_rb_at_green_row_SSE4(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	const gint p = image->rowstride;
+	const __m128i mc = _mm_load_si128((const __m128i *) channel_shuffle[c]);
+	const __m128i mo = _mm_load_si128((const __m128i *) channel_shuffle[2-c]);
+	const __m128i mg = _mm_load_si128((const __m128i *) channel_shuffle[1]);
+
+	/* Reads one pixel right of the last of the four */
+	for (; col + 9 <= image->w; col += 8)
+	{
+		gushort *pix = GET_PIXEL(image, col, row);
+		__m128i g2 = _mm_slli_epi32(load_channel(pix, mg), 1);
+		__m128i h = _mm_add_epi32(load_channel(pix - 4, mc), load_channel(pix + 4, mc));
+		__m128i hg = _mm_add_epi32(load_channel(pix - 4, mg), load_channel(pix + 4, mg));
+		__m128i v = _mm_add_epi32(load_channel(pix - p, mo), load_channel(pix + p, mo));
+		__m128i vg = _mm_add_epi32(load_channel(pix - p, mg), load_channel(pix + p, mg));
+
+		store_channel(pix, c, clip(_mm_srai_epi32(_mm_sub_epi32(_mm_add_epi32(h, g2), hg), 1)));
+		store_channel(pix, 2-c, clip(_mm_srai_epi32(_mm_sub_epi32(_mm_add_epi32(v, g2), vg), 1)));
+	}
+
+	return col;
+}
+
+gint
+ppg_rb_at_rb_row_SSE4(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	const gint p = image->rowstride;
+	const __m128i mc = _mm_load_si128((const __m128i *) channel_shuffle[c]);
+	const __m128i mg = _mm_load_si128((const __m128i *) channel_shuffle[1]);
+
+	/* Reads one pixel right of the last of the four */
+	for (; col + 9 <= image->w; col += 8)
+	{
+		gushort *pix = GET_PIXEL(image, col, row);
+		__m128i g = load_channel(pix, mg);
+		__m128i g2 = _mm_slli_epi32(g, 1);
+
+		/* Top left to bottom right */
+		__m128i ca = load_channel(pix - p - 4, mc);
+		__m128i cb = load_channel(pix + p + 4, mc);
+		__m128i ga = load_channel(pix - p - 4, mg);
+		__m128i gb = load_channel(pix + p + 4, mg);
+		__m128i diffA = _mm_add_epi32(_mm_abs_epi32(_mm_sub_epi32(ca, cb)),
+			_mm_add_epi32(_mm_abs_epi32(_mm_sub_epi32(ga, g)), _mm_abs_epi32(_mm_sub_epi32(gb, g))));
+		__m128i guessA = _mm_sub_epi32(_mm_add_epi32(_mm_add_epi32(ca, cb), g2), _mm_add_epi32(ga, gb));
+
+		/* Top right to bottom left */
+		ca = load_channel(pix - p + 4, mc);
+		cb = load_channel(pix + p - 4, mc);
+		ga = load_channel(pix - p + 4, mg);
+		gb = load_channel(pix + p - 4, mg);
+		__m128i diffB = _mm_add_epi32(_mm_abs_epi32(_mm_sub_epi32(ca, cb)),
+			_mm_add_epi32(_mm_abs_epi32(_mm_sub_epi32(ga, g)), _mm_abs_epi32(_mm_sub_epi32(gb, g))));
+		__m128i guessB = _mm_sub_epi32(_mm_add_epi32(_mm_add_epi32(ca, cb), g2), _mm_add_epi32(ga, gb));
+
+		__m128i guess = _mm_blendv_epi8(guessA, guessB, _mm_cmpgt_epi32(diffA, diffB));
+		store_channel(pix, c, clip(_mm_srai_epi32(guess, 1)));
+	}
+
+	return col;
+}
+
+/* Splits eight CFA samples into the even and odd columns, as 32 bit */
+static inline void
+split_columns(const gushort *pix, __m128i *even, __m128i *odd)
+{
+	const __m128i v = _mm_loadu_si128((const __m128i *) pix);
+
+	*even = _mm_and_si128(v, _mm_set1_epi32(0xffff));
+	*odd = _mm_srli_epi32(v, 16);
+}
+
+/* Adds red, green and blue of four 2x2 cells starting at col in row and the
+ * row below */
+static inline void
+sum_cells(const gushort *top, const gushort *bottom, const gint layout[4], __m128i *r, __m128i *g, __m128i *b)
+{
+	__m128i s[4];
+
+	split_columns(top, &s[0], &s[1]);
+	split_columns(bottom, &s[2], &s[3]);
+	*r = _mm_add_epi32(*r, s[layout[0]]);
+	*g = _mm_add_epi32(*g, _mm_add_epi32(s[layout[1]], s[layout[2]]));
+	*b = _mm_add_epi32(*b, s[layout[3]]);
+}
+
+/* Stores four RGB pixels with the fourth channel cleared */
+static inline void
+store_rgb(gushort *pix, const __m128i r, const __m128i g, const __m128i b)
+{
+	const __m128i rg = _mm_or_si128(r, _mm_slli_epi32(g, 16));
+
+	_mm_storeu_si128((__m128i *) pix, _mm_unpacklo_epi32(rg, b));
+	_mm_storeu_si128((__m128i *) (pix + 8), _mm_unpackhi_epi32(rg, b));
+}
+
+gint
+bin_row_SSE4(RS_IMAGE16 *input, RS_IMAGE16 *output, gint row, gint factor, guint filters)
+{
+	gushort *out = GET_PIXEL(output, 0, row);
+	gint layout[4];
+	gint col = 0;
+
+	if (!bin_cell_layout(filters, layout))
+		return col;
+
+	if (factor == 2)
+	{
+		const gushort *top = GET_PIXEL(input, 0, row*2);
+		const gushort *bottom = GET_PIXEL(input, 0, row*2+1);
+		const __m128i one = _mm_set1_epi32(1);
+
+		for (; col + 4 <= output->w; col += 4, out += 16)
+		{
+			__m128i r = _mm_setzero_si128();
+			__m128i g = _mm_setzero_si128();
+			__m128i b = _mm_setzero_si128();
+
+			sum_cells(top + col*2, bottom + col*2, layout, &r, &g, &b);
+			store_rgb(out, r, _mm_srli_epi32(_mm_add_epi32(g, one), 1), b);
+		}
+	}
+	else if (factor == 4)
+	{
+		const gushort *rows[4];
+		const __m128i two = _mm_set1_epi32(2);
+		const __m128i four = _mm_set1_epi32(4);
+		gint i;
+
+		for (i = 0; i < 4; i++)
+			rows[i] = GET_PIXEL(input, 0, row*4+i);
+
+		for (; col + 4 <= output->w; col += 4, out += 16)
+		{
+			__m128i r[2], g[2], b[2];
+
+			/* Two cells across make an output pixel, so do eight cells and
+			 * add neighbours */
+			for (i = 0; i < 2; i++)
+			{
+				r[i] = g[i] = b[i] = _mm_setzero_si128();
+				sum_cells(rows[0] + col*4 + i*8, rows[1] + col*4 + i*8, layout, &r[i], &g[i], &b[i]);
+				sum_cells(rows[2] + col*4 + i*8, rows[3] + col*4 + i*8, layout, &r[i], &g[i], &b[i]);
+			}
+			store_rgb(out,
+				_mm_srli_epi32(_mm_add_epi32(_mm_hadd_epi32(r[0], r[1]), two), 2),
+				_mm_srli_epi32(_mm_add_epi32(_mm_hadd_epi32(g[0], g[1]), four), 3),
+				_mm_srli_epi32(_mm_add_epi32(_mm_hadd_epi32(b[0], b[1]), two), 2));
+		}
+	}
+
+	return col;
+}
+
+#else /* not defined (__SSE4_1__) */
+
+gint
+ppg_green_row_SSE4(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	return col;
+}
+
+gint
+ppg_rb_at_green_row_SSE4(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	return col;
+}
+
+gint
+ppg_rb_at_rb_row_SSE4(RS_IMAGE16 *image, gint row, gint col, gint c)
+{
+	return col;
+}
+
+gint
+bin_row_SSE4(RS_IMAGE16 *input, RS_IMAGE16 *output, gint row, gint factor, guint filters)
+{
+	return 0;
+}
+
+#endif /* not defined (__SSE4_1__) */
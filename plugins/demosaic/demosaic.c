@@ -21,6 +21,18 @@
 
 #include <rawstudio.h>
 #include <string.h>
+#include <math.h>
+#include "demosaic.h"
+
+/* Pixels around a region needed for pixel-grouping to give the same result as
+ * for the complete frame. Hot pixel removal reads four pixels away and skips
+ * the outer four, and interpolation reaches four more. This also covers the
+ * five pixels needed by AHD and three by VNG */
+#define DEMOSAIC_BORDER (8)
+
+/* Regions start on a multiple of this, keeping the phase of all supported
+ * filter patterns */
+#define DEMOSAIC_ALIGN (16)
 
 #define RS_TYPE_DEMOSAIC (rs_demosaic_type)
 #define RS_DEMOSAIC(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_DEMOSAIC, RSDemosaic))
@@ -33,21 +45,43 @@ typedef struct {
 	RS_IMAGE16 *image;
 	RS_IMAGE16 *output;
 	guint filters;
-	GThread *threadid;
+	gint stage;
+	gint binning;
+	gint fuji_width;
+	guint cpuflags;
 } ThreadInfo;
 
 typedef enum {
 	RS_DEMOSAIC_NONE,
 	RS_DEMOSAIC_BILINEAR,
 	RS_DEMOSAIC_PPG,
+	RS_DEMOSAIC_VNG,
+	RS_DEMOSAIC_AHD,
 	RS_DEMOSAIC_MAX,
-	RS_DEMOSAIC_NONE_HALF
+	RS_DEMOSAIC_BINNED
 } RS_DEMOSAIC;
 
 const static gchar *rs_demosaic_ascii[RS_DEMOSAIC_MAX] = {
 	"none",
 	"bilinear",
-	"pixel-grouping"
+	"pixel-grouping",
+	"vng",
+	"ahd"
+};
+
+typedef enum {
+	RS_DEMOSAIC_SIMD_AUTO,
+	RS_DEMOSAIC_SIMD_NONE,
+	RS_DEMOSAIC_SIMD_SSE4_1,
+	RS_DEMOSAIC_SIMD_AVX2,
+	RS_DEMOSAIC_SIMD_MAX
+} RS_DEMOSAIC_SIMD;
+
+const static gchar *rs_demosaic_simd_ascii[RS_DEMOSAIC_SIMD_MAX] = {
+	"auto",
+	"none",
+	"sse4.1",
+	"avx2"
 };
 
 typedef struct _RSDemosaic RSDemosaic;
@@ -58,6 +92,7 @@ struct _RSDemosaic {
 
 	RS_DEMOSAIC method;
 	gboolean allow_half;
+	RS_DEMOSAIC_SIMD simd;
 };
 
 struct _RSDemosaicClass {
@@ -70,16 +105,21 @@ enum {
 	PROP_0,
 	PROP_METHOD,
 	PROP_ALLOW_HALF, 
+	PROP_SIMD,
 };
 
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
-static inline int fc_INDI (const unsigned int filters, const int row, const int col);
+static RSFilterResponse *get_size(RSFilter *filter, const RSFilterRequest *request);
+static gint get_margin(RSFilter *filter, const RSFilterRequest *request);
 static void border_interpolate_INDI (const ThreadInfo* t, int colors, int border);
 static void lin_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors);
-static void ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors);
-static void none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const int colors, gboolean half_size);
+static void ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors, const guint cpuflags);
+static void ppg_interpolate_roi(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const guint cpuflags, const GdkRectangle *roi);
+static void none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const int colors);
+static void bin_interpolate(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const gint binning, const guint cpuflags);
+static void fuji_rotate(RSFilterResponse *response, RS_IMAGE16 *image, gint fuji_width);
 static void hotpixel_detect(const ThreadInfo* t);
 static void expand_cfa_data(const ThreadInfo* t);
 
@@ -105,7 +145,7 @@ rs_demosaic_class_init(RSDemosaicClass *klass)
 
 	g_object_class_install_property(object_class,
 		PROP_METHOD, g_param_spec_string(
-			"method", "demosaic method", "The demosaic algorithm to use (\"bilinear\" or \"pixel-grouping\")",
+			"method", "demosaic method", "The demosaic algorithm to use (\"bilinear\", \"pixel-grouping\", \"vng\" or \"ahd\")",
 			rs_demosaic_ascii[RS_DEMOSAIC_PPG], G_PARAM_READWRITE)
 	);
 
@@ -115,14 +155,23 @@ rs_demosaic_class_init(RSDemosaicClass *klass)
 			FALSE, G_PARAM_READWRITE)
 	);
 
+	g_object_class_install_property(object_class,
+		PROP_SIMD, g_param_spec_string(
+			"simd", "simd", "Vector instructions used for pixel-grouping (\"auto\", \"none\", \"sse4.1\" or \"avx2\")",
+			rs_demosaic_simd_ascii[RS_DEMOSAIC_SIMD_AUTO], G_PARAM_READWRITE)
+	);
+
 	filter_class->name = "Demosaic filter";
 	filter_class->get_image = get_image;
+	filter_class->get_size = get_size;
+	filter_class->get_margin = get_margin;
 }
 
 static void
 rs_demosaic_init(RSDemosaic *demosaic)
 {
 	demosaic->method = RS_DEMOSAIC_PPG;
+	demosaic->simd = RS_DEMOSAIC_SIMD_AUTO;
 }
 
 static void
@@ -138,6 +187,9 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 		case PROP_ALLOW_HALF:
 			g_value_set_boolean(value, demosaic->allow_half);
 			break;			
+		case PROP_SIMD:
+			g_value_set_string(value, rs_demosaic_simd_ascii[demosaic->simd]);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -163,20 +215,40 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 		case PROP_ALLOW_HALF:
 			demosaic->allow_half = g_value_get_boolean(value);
 			break;
+		case PROP_SIMD:
+			str = g_value_get_string(value);
+			for(i=0;i<RS_DEMOSAIC_SIMD_MAX;i++)
+			{
+				if (g_str_equal(rs_demosaic_simd_ascii[i], str))
+					demosaic->simd = i;
+			}
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
 }
 
-/*
-   In order to inline this calculation, I make the risky
-   assumption that all filter patterns can be described
-   by a repeating pattern of eight rows and two columns
+/* The vector kernels allowed by the "simd" property and supported by the CPU */
+static guint
+get_cpuflags(RSDemosaic *demosaic)
+{
+	guint allowed = 0;
 
-   Return values are either 0/1/2/3 = G/M/C/Y or 0/1/2/3 = R/G1/B/G2
- */
-#define FC(row,col) \
-  (int)(filters >> ((((row) << 1 & 14) + ((col) & 1)) << 1) & 3)
+	switch (demosaic->simd)
+	{
+		case RS_DEMOSAIC_SIMD_AUTO:
+		case RS_DEMOSAIC_SIMD_AVX2:
+			allowed = RS_CPU_FLAG_AVX2 | RS_CPU_FLAG_SSE4_1;
+			break;
+		case RS_DEMOSAIC_SIMD_SSE4_1:
+			allowed = RS_CPU_FLAG_SSE4_1;
+			break;
+		default:
+			break;
+	}
+
+	return rs_detect_cpu_features() & allowed;
+}
 
 static RSFilterResponse *
 get_image(RSFilter *filter, const RSFilterRequest *request)
@@ -188,6 +260,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	RS_IMAGE16 *output = NULL;
 	guint filters;
 	RS_DEMOSAIC method;
+	gboolean bayer;
 
 	previous_response = rs_filter_get_image(filter->previous, request);
 
@@ -196,9 +269,21 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	if (!RS_IS_IMAGE16(input))
 		return previous_response;
 
+	/* SuperCCD images are rotated here, the ROI is in rotated coordinates */
+	gint fuji_width = 0;
+	rs_filter_param_get_integer(RS_FILTER_PARAM(previous_response), "fuji-width", &fuji_width);
+	const GdkRectangle *roi = (fuji_width > 0) ? NULL : rs_filter_request_get_roi(request);
+
 	/* Just pass on output from previous filter if the image is not CFA */
 	if (input->filters == 0)
 	{
+		if (fuji_width > 0)
+		{
+			response = rs_filter_response_clone(previous_response);
+			fuji_rotate(response, input, fuji_width);
+			g_object_unref(previous_response);
+			previous_response = response;
+		}
 		g_object_unref(input);
 		return previous_response;
 	}
@@ -209,9 +294,19 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	response = rs_filter_response_clone(previous_response);
 	g_object_unref(previous_response);
 
-	gint fuji_width;
-	if (rs_filter_param_get_integer(RS_FILTER_PARAM(response), "fuji-width", &fuji_width) && (fuji_width > 0))
+	/* Binning is only done for complete frames, as requested by a
+	 * downscaling filter. The old half size switch is the same as 2x2 */
+	gint binning = 1;
+	if (!rs_filter_param_get_integer(RS_FILTER_PARAM(request), "demosaic-binning", &binning) || roi)
+		binning = 1;
+	if (binning == 1 && demosaic->allow_half && (demosaic->method == RS_DEMOSAIC_NONE || rs_filter_request_get_quick(request)))
+		binning = 2;
+
+	if (fuji_width > 0)
+	{
 		demosaic->allow_half = FALSE;
+		binning = 1;
+	}
 
 	method = demosaic->method;
 	if (rs_filter_request_get_quick(request))
@@ -224,25 +319,21 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	filters = input->filters;
 	filters &= ~((filters & 0x55555555) << 1);
 
-	/* Check if pattern is 2x2, otherwise we cannot do "none" demosaic */
-	if (method == RS_DEMOSAIC_NONE)
-		if (! ( (filters & 0xff ) == ((filters >> 8) & 0xff) &&
-			((filters >> 16) & 0xff) == ((filters >> 24) & 0xff) &&
-			(filters & 0xff) == ((filters >> 24) &0xff)))
-				method = RS_DEMOSAIC_PPG;
+	/* Check if pattern is 2x2, otherwise we cannot do "none", binning or AHD demosaic */
+	bayer = ( (filters & 0xff ) == ((filters >> 8) & 0xff) &&
+		((filters >> 16) & 0xff) == ((filters >> 24) & 0xff) &&
+		(filters & 0xff) == ((filters >> 24) &0xff));
+	if (method == RS_DEMOSAIC_NONE && !bayer)
+		method = RS_DEMOSAIC_PPG;
+	if (method == RS_DEMOSAIC_AHD && !bayer)
+		method = RS_DEMOSAIC_VNG;
 
-	if (method == RS_DEMOSAIC_NONE)
+	if (bayer && (binning == 2 || binning == 4))
 	{
-		if (demosaic->allow_half)
-		{
-			output = rs_image16_new(input->w/2, input->h/2, 3, 4);
-			rs_filter_param_set_boolean(RS_FILTER_PARAM(response), "half-size", TRUE);
-			method = RS_DEMOSAIC_NONE_HALF;
-		}
-		else
-		{
-			output = rs_image16_new(input->w, input->h, 3, 4);
-		}
+		output = rs_image16_new(input->w/binning, input->h/binning, 3, 4);
+		rs_filter_param_set_boolean(RS_FILTER_PARAM(response), "half-size", TRUE);
+		rs_filter_param_set_integer(RS_FILTER_PARAM(response), "demosaic-binning", binning);
+		method = RS_DEMOSAIC_BINNED;
 	}
 	else
 		output = rs_image16_new(input->w, input->h, 3, 4);
@@ -257,23 +348,95 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 			lin_interpolate_INDI(input, output, filters, 3);
 			break;
 	  case RS_DEMOSAIC_PPG:
-			ppg_interpolate_INDI(input,output, filters, 3);
+			/* The ROI already includes our margin, see get_margin() */
+			if (roi)
+				ppg_interpolate_roi(input, output, filters, get_cpuflags(demosaic), roi);
+			else
+				ppg_interpolate_INDI(input,output, filters, 3, get_cpuflags(demosaic));
+			break;
+		case RS_DEMOSAIC_VNG:
+			vng_interpolate_INDI(input, output, filters, roi);
+			break;
+		case RS_DEMOSAIC_AHD:
+			ahd_interpolate_INDI(input, output, filters, roi);
 			break;
 		case RS_DEMOSAIC_NONE:
-			none_interpolate_INDI(input, output, filters, 3, FALSE);
+			none_interpolate_INDI(input, output, filters, 3);
 			break;
-		case RS_DEMOSAIC_NONE_HALF:
-			none_interpolate_INDI(input, output, filters, 3, TRUE);
+		case RS_DEMOSAIC_BINNED:
+			bin_interpolate(input, output, filters, binning, get_cpuflags(demosaic));
 			break;
 		default:
 			/* Do nothing */
 			break;
 		}
 
+	/* Rotate while the interpolated frame is still at hand, instead of
+	 * leaving it to a filter of its own */
+	if (fuji_width > 0)
+		fuji_rotate(response, output, fuji_width);
+
 	g_object_unref(input);
 	return response;
 }
 
+/* Size of a SuperCCD image after rotating it 45 degrees */
+static void
+fuji_rotated_size(gint height, gint fuji_width, gint *wide, gint *high)
+{
+	const gdouble step = sqrt(0.5);
+
+	*wide = (gushort) ((fuji_width - 1) / step);
+	*high = (gushort) ((height - (fuji_width - 1)) / step);
+}
+
+static RSFilterResponse *
+get_size(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSFilterResponse *previous_response = rs_filter_get_size(filter->previous, request);
+	gint fuji_width = 0;
+	gint wide, high;
+
+	if (!rs_filter_param_get_integer(RS_FILTER_PARAM(previous_response), "fuji-width", &fuji_width) || (fuji_width <= 0))
+		return previous_response;
+
+	RSFilterResponse *response = rs_filter_response_clone(previous_response);
+	fuji_rotated_size(rs_filter_response_get_height(previous_response), fuji_width, &wide, &high);
+	rs_filter_response_set_width(response, wide);
+	rs_filter_response_set_height(response, high);
+	rs_filter_param_set_integer(RS_FILTER_PARAM(response), "fuji-width", 0);
+	g_object_unref(previous_response);
+
+	return response;
+}
+
+static gint
+get_margin(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSDemosaic *demosaic = RS_DEMOSAIC(filter);
+	RSFilterResponse *previous_response;
+	gint fuji_width = 0;
+	gint binning;
+
+	/* Pixel-grouping, VNG and AHD are limited to the ROI, the quick methods
+	 * and binning always interpolate the complete frame */
+	if (demosaic->method == RS_DEMOSAIC_NONE || demosaic->method == RS_DEMOSAIC_BILINEAR
+		|| rs_filter_request_get_quick(request))
+		return RS_FILTER_MARGIN_FULL;
+
+	if (rs_filter_param_get_integer(RS_FILTER_PARAM(request), "demosaic-binning", &binning) && binning > 1)
+		return RS_FILTER_MARGIN_FULL;
+
+	/* Rotating SuperCCD data needs the complete frame */
+	previous_response = rs_filter_get_size(filter->previous, request);
+	rs_filter_param_get_integer(RS_FILTER_PARAM(previous_response), "fuji-width", &fuji_width);
+	g_object_unref(previous_response);
+	if (fuji_width > 0)
+		return RS_FILTER_MARGIN_FULL;
+
+	return DEMOSAIC_BORDER;
+}
+
 /*
 The rest of this file is pretty much copied verbatim from dcraw/ufraw
 */
@@ -284,34 +447,6 @@ The rest of this file is pretty much copied verbatim from dcraw/ufraw
 #define BAYER(row,col) \
 	image[((row) >> shrink)*iwidth + ((col) >> shrink)][FC(row,col)]
 
-static inline int
-fc_INDI (const unsigned int filters, const int row, const int col)
-{
-  static const char filter[16][16] =
-  { { 2,1,1,3,2,3,2,0,3,2,3,0,1,2,1,0 },
-    { 0,3,0,2,0,1,3,1,0,1,1,2,0,3,3,2 },
-    { 2,3,3,2,3,1,1,3,3,1,2,1,2,0,0,3 },
-    { 0,1,0,1,0,2,0,2,2,0,3,0,1,3,2,1 },
-    { 3,1,1,2,0,1,0,2,1,3,1,3,0,1,3,0 },
-    { 2,0,0,3,3,2,3,1,2,0,2,0,3,2,2,1 },
-    { 2,3,3,1,2,1,2,1,2,1,1,2,3,0,0,1 },
-    { 1,0,0,2,3,0,0,3,0,3,0,3,2,1,2,3 },
-    { 2,3,3,1,1,2,1,0,3,2,3,0,2,3,1,3 },
-    { 1,0,2,0,3,0,3,2,0,1,1,2,0,1,0,2 },
-    { 0,1,1,3,3,2,2,1,1,3,3,0,2,1,3,2 },
-    { 2,3,2,0,0,1,3,0,2,0,1,2,3,0,1,0 },
-    { 1,3,1,2,3,2,3,2,0,2,0,1,1,0,3,0 },
-    { 0,2,0,3,1,0,0,1,1,3,3,2,3,2,2,1 },
-    { 2,1,3,2,3,1,2,1,0,3,0,2,0,2,0,2 },
-    { 0,3,1,0,0,2,0,3,2,1,3,1,1,3,1,3 } };
-
-  if (filters != 1) return FC(row,col);
-  /* Assume that we are handling the Leaf CatchLight with
-   * top_margin = 8; left_margin = 18; */
-//  return filter[(row+top_margin) & 15][(col+left_margin) & 15];
-  return filter[(row+8) & 15][(col+18) & 15];
-}
-
 
 static void
 border_interpolate_INDI (const ThreadInfo* t, int colors, int border)
@@ -344,7 +479,7 @@ border_interpolate_INDI (const ThreadInfo* t, int colors, int border)
 static void
 lin_interpolate_INDI(RS_IMAGE16 *input, RS_IMAGE16 *output, const unsigned int filters, const int colors) /*UF*/
 {
-	ThreadInfo *t = g_new(ThreadInfo, 1);
+	ThreadInfo *t = g_new0(ThreadInfo, 1);
 	t->image = input;
 	t->output = output;
 	t->filters = filters;
@@ -413,91 +548,68 @@ expand_cfa_data(const ThreadInfo* t) {
 	}
 }
 
-/*
-   Patterned Pixel Grouping Interpolation by Alain Desbiolles
-*/
-inline guint clampbits16(gint x) { guint32 _y_temp; if( (_y_temp=x>>16) ) x = ~_y_temp >> 16; return x;}
+static void
+interpolate_green_INDI_part(ThreadInfo *t)
+{
+	RS_IMAGE16 *image = t->output;
+	const unsigned int filters = t->filters;
 
-#define CLIP(x) clampbits16(x)
-#define ULIM(x,y,z) ((y) < (z) ? CLAMP(x,y,z) : CLAMP(x,z,y))
+	/* Subtract 3 from top and bottom  */
+	const int start_y = MAX(3, t->start_y);
+	const int end_y = MIN(image->h-3, t->end_y);
+	const int p = image->pitch;
+	int row, col, c;
+
+	/*  Fill in the green layer with gradients and pattern recognition: */
+	for (row=start_y; row < end_y; row++)
+	{
+		col = 3+(FC(row,3) & 1);
+		c = FC(row,col);
+		if (t->cpuflags & RS_CPU_FLAG_AVX2)
+			col = ppg_green_row_AVX2(image, row, col, c);
+		else if (t->cpuflags & RS_CPU_FLAG_SSE4_1)
+			col = ppg_green_row_SSE4(image, row, col, c);
+		for (; col < image->w-3; col+=2)
+			ppg_green_pixel((gushort (*)[4])GET_PIXEL(image, col, row), c, p);
+	}
+}
 
 static void
-interpolate_INDI_part(ThreadInfo *t)
+interpolate_rb_INDI_part(ThreadInfo *t)
 {
-  RS_IMAGE16 *image = t->output;
-  const unsigned int filters = t->filters;
-  
-  /* Subtract 3 from top and bottom  */
-  const int start_y = MAX(3, t->start_y);
-  const int end_y = MIN(image->h-3, t->end_y);
-  int row, col, c, d;
-	int diffA, diffB, guessA, guessB;
-	int p = image->pitch;
-	int p3 = p*3;
-  gushort (*pix)[4];
-
-  {
-/*  Fill in the green layer with gradients and pattern recognition: */
-  for (row=start_y; row < end_y; row++)
-    for (col=3+(FC(row,3) & 1), c=FC(row,col); col < image->w-3; col+=2) {
-      pix = (gushort (*)[4])GET_PIXEL(image, col, row);
-
-	guessA = (pix[-1][1] + pix[0][c] + pix[1][1]) * 2
-		      - pix[-2*1][c] - pix[2*1][c];
-	diffA = ( ABS(pix[-2*1][c] - pix[ 0][c]) +
-		    ABS(pix[ 2*1][c] - pix[ 0][c]) +
-		    ABS(pix[  -1][1] - pix[ 1][1]) ) * 3 +
-		  ( ABS(pix[ 3*1][1] - pix[ 1][1]) +
-		    ABS(pix[-3*1][1] - pix[-1][1]) ) * 2;
-
-	guessB = (pix[-p][1] + pix[0][c] + pix[p][1]) * 2
-		      - pix[-2*p][c] - pix[2*p][c];
-	diffB = ( ABS(pix[-2*p][c] - pix[ 0][c]) +
-		    ABS(pix[ 2*p][c] - pix[ 0][c]) +
-		    ABS(pix[  -p][1] - pix[ p][1]) ) * 3 +
-		  ( ABS(pix[ p3][1] - pix[ p][1]) +
-		    ABS(pix[-p3][1] - pix[-p][1]) ) * 2;
-
-		if (diffA > diffB)
-			pix[0][1] = ULIM(guessB >> 2, pix[p][1], pix[-p][1]);
-		else
-			pix[0][1] = ULIM(guessA >> 2, pix[1][1], pix[-1][1]);
-    }
-/*  Calculate red and blue for each green pixel:		*/
-  for (row=start_y-2; row < end_y+2; row++)
-    for (col=1+(FC(row,2) & 1), c=FC(row,col+1); col < image->w-1; col+=2) {
-      pix = (gushort (*)[4])GET_PIXEL(image, col, row);
-      pix[0][c] = CLIP((pix[-1][c] + pix[1][c] + 2*pix[0][1]
-          - pix[-1][1] - pix[1][1]) >> 1);
-      c=2-c;
-      pix[0][c] = CLIP((pix[-p][c] + pix[p][c] + 2*pix[0][1]
-          - pix[-p][1] - pix[p][1]) >> 1);
-      c=2-c;
-    }
+	RS_IMAGE16 *image = t->output;
+	const unsigned int filters = t->filters;
 
-/*  Calculate blue for red pixels and vice versa:		*/
+	/* Subtract 3 from top and bottom  */
+	const int start_y = MAX(3, t->start_y);
+	const int end_y = MIN(image->h-3, t->end_y);
+	const int p = image->pitch;
+	int row, col, c;
+
+	/*  Calculate red and blue for each green pixel:		*/
 	for (row=start_y-2; row < end_y+2; row++)
-		for (col=1+(FC(row,1) & 1), c=2-FC(row,col); col < image->w-1; col+=2) {
-			pix = (gushort (*)[4])GET_PIXEL(image, col, row);
-			d = 1 + p;
-			diffA = ABS(pix[-d][c] - pix[d][c]) +
-				ABS(pix[-d][1] - pix[0][1]) +
-				ABS(pix[ d][1] - pix[0][1]);
-			guessA = pix[-d][c] + pix[d][c] + 2*pix[0][1]
-			- pix[-d][1] - pix[d][1];
-
-			d = p - 1;
-			diffB = ABS(pix[-d][c] - pix[d][c]) +
-				ABS(pix[-d][1] - pix[0][1]) +
-				ABS(pix[ d][1] - pix[0][1]);
-			guessB = pix[-d][c] + pix[d][c] + 2*pix[0][1]
-				- pix[-d][1] - pix[d][1];
-
-			if (diffA > diffB)
-				pix[0][c] = CLIP(guessB >> 1);
-			else
-				pix[0][c] = CLIP(guessA >> 1);
-		}
+	{
+		col = 1+(FC(row,2) & 1);
+		c = FC(row,col+1);
+		if (t->cpuflags & RS_CPU_FLAG_AVX2)
+			col = ppg_rb_at_green_row_AVX2(image, row, col, c);
+		else if (t->cpuflags & RS_CPU_FLAG_SSE4_1)
+			col = ppg_rb_at_green_row_SSE4(image, row, col, c);
+		for (; col < image->w-1; col+=2)
+			ppg_rb_at_green_pixel((gushort (*)[4])GET_PIXEL(image, col, row), c, p);
+	}
+
+	/*  Calculate blue for red pixels and vice versa:		*/
+	for (row=start_y-2; row < end_y+2; row++)
+	{
+		col = 1+(FC(row,1) & 1);
+		c = 2-FC(row,col);
+		if (t->cpuflags & RS_CPU_FLAG_AVX2)
+			col = ppg_rb_at_rb_row_AVX2(image, row, col, c);
+		else if (t->cpuflags & RS_CPU_FLAG_SSE4_1)
+			col = ppg_rb_at_rb_row_SSE4(image, row, col, c);
+		for (; col < image->w-1; col+=2)
+			ppg_rb_at_rb_pixel((gushort (*)[4])GET_PIXEL(image, col, row), c, p);
 	}
 }
 
@@ -505,21 +617,32 @@ gpointer
 start_interp_thread(gpointer _thread_info)
 {
 	ThreadInfo* t = _thread_info;
-	hotpixel_detect(t);
-	expand_cfa_data(t);
-	border_interpolate_INDI (t, 3, 3);
-	interpolate_INDI_part(t);
-	g_thread_exit(NULL);
 
-	return NULL; /* Make the compiler shut up - we'll never return */
+	/* Every stage reads up to three rows from the neighbouring bands, so all
+	 * bands must have completed a stage before the next one is started */
+	switch (t->stage)
+	{
+		case 0:
+			hotpixel_detect(t);
+			expand_cfa_data(t);
+			break;
+		case 1:
+			border_interpolate_INDI (t, 3, 3);
+			interpolate_green_INDI_part(t);
+			break;
+		case 2:
+			interpolate_rb_INDI_part(t);
+			break;
+	}
+	return NULL;
 }
 
 static void
-ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors)
+ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors, const guint cpuflags)
 {
-	guint i, y_offset, y_per_thread, threaded_h;
+	guint i, stage, y_offset, y_per_thread, threaded_h;
 	const guint threads = rs_get_number_of_processor_cores();
-	ThreadInfo *t = g_new(ThreadInfo, threads);
+	ThreadInfo *t = g_new0(ThreadInfo, threads);
 
 	threaded_h = image->h;
 	y_per_thread = (threaded_h + threads-1)/threads;
@@ -530,21 +653,58 @@ ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int f
 		t[i].image = image;
 		t[i].output = output;
 		t[i].filters = filters;
+		t[i].cpuflags = cpuflags;
 		t[i].start_y = y_offset;
 		y_offset += y_per_thread;
 		y_offset = MIN(image->h, y_offset);
 		t[i].end_y = y_offset;
-
-		t[i].threadid = g_thread_new("RSDemosaic worker (ppg)", start_interp_thread, &t[i]);
 	}
 
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	for (stage = 0; stage < 3; stage++)
+	{
+		for (i = 0; i < threads; i++)
+			t[i].stage = stage;
+		rs_worker_pool_run(t, sizeof(ThreadInfo), threads, start_interp_thread);
+	}
 
 	g_free(t);
 }
 
+/* Interpolates the part of the image covered by roi. The output is still the
+ * complete frame, but only the area around roi is rendered */
+static void
+ppg_interpolate_roi(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const guint cpuflags, const GdkRectangle *roi)
+{
+	GdkRectangle area;
+	RS_IMAGE16 *in, *out;
+
+	/* Start on the same filter phase as the full frame */
+	area.x = CLAMP(roi->x, 0, image->w - 1) & ~(DEMOSAIC_ALIGN - 1);
+	area.y = CLAMP(roi->y, 0, image->h - 1) & ~(DEMOSAIC_ALIGN - 1);
+	area.width = MIN(image->w, roi->x + roi->width) - area.x;
+	area.height = MIN(image->h, roi->y + roi->height) - area.y;
+
+	/* Not worth it for most of the image, and too small for the borders */
+	if (((gint64) area.width) * area.height > ((gint64) image->w) * image->h / 2
+		|| area.width < DEMOSAIC_BORDER * 2 || area.height < DEMOSAIC_BORDER * 2)
+	{
+		ppg_interpolate_INDI(image, output, filters, 3, cpuflags);
+		return;
+	}
+
+	in = rs_image16_new_subframe(image, &area);
+	out = rs_image16_new_subframe(output, &area);
+
+	if (in && out && in->w == out->w && in->h == out->h)
+		ppg_interpolate_INDI(in, out, filters, 3, cpuflags);
+	else
+		ppg_interpolate_INDI(image, output, filters, 3, cpuflags);
+
+	if (in)
+		g_object_unref(in);
+	if (out)
+		g_object_unref(out);
+}
 
 gpointer
 start_none_thread(gpointer _thread_info)
@@ -621,68 +781,165 @@ start_none_thread(gpointer _thread_info)
 			memcpy(GET_PIXEL(t->output, 0, 0), GET_PIXEL(t->output, 0, 1), t->output->rowstride * 2);
 		}
 	}
-	g_thread_exit(NULL);
-
-	return NULL; /* Make the compiler shut up - we'll never return */
+	return NULL;
 }
 
 
+/* Averages binning x binning blocks of the CFA into each output pixel */
 gpointer
-start_none_thread_half(gpointer _thread_info)
+start_binning_thread(gpointer _thread_info)
 {
-	gint row, col, i, j;
-	gushort *src;
+	gint row, col, x, y, c;
+	gint count[4] = {0, 0, 0, 0};
+	guint sum[4];
 	gushort *dest;
 
 	ThreadInfo* t = _thread_info;
+	const gint binning = t->binning;
 	guint filters = t->filters;
-	gint col_end = t->output->w;
+
+	for(y = 0; y < binning; y++)
+		for(x = 0; x < binning; x++)
+			count[FC(y, x)]++;
 
 	for(row=t->start_y; row < t->end_y; row++)
 	{
-		gint src_row = row*2;
-		src = GET_PIXEL(t->image, 0, src_row);
-		dest = GET_PIXEL(t->output, 0, row);
-		gushort *g_src = (FC(src_row, 0) == 1) ? &src[0] : &src[1];
-		gushort *r_src = NULL;
-		gushort *b_src = NULL;
-		for(i = src_row; i < src_row + 2; i++)
+		col = 0;
+		if (t->cpuflags & RS_CPU_FLAG_AVX2)
+			col = bin_row_AVX2(t->image, t->output, row, binning, filters);
+		else if (t->cpuflags & RS_CPU_FLAG_SSE4_1)
+			col = bin_row_SSE4(t->image, t->output, row, binning, filters);
+
+		dest = GET_PIXEL(t->output, col, row);
+		for(; col < t->output->w; col++)
 		{
-			for( j = 0; j < 2; j ++)
+			sum[0] = sum[1] = sum[2] = sum[3] = 0;
+			for(y = row*binning; y < (row+1)*binning; y++)
 			{
-				if (FC(i, j) == 0)
-					r_src = GET_PIXEL(t->image, j, i);
-				if (FC(i, j) == 2)
-					b_src = GET_PIXEL(t->image, j, i);
+				gushort *src = GET_PIXEL(t->image, col*binning, y);
+				for(x = 0; x < binning; x++)
+					sum[FC(y, x)] += src[x];
 			}
+			for(c = 0; c < 3; c++)
+				dest[c] = count[c] ? (sum[c] + count[c]/2) / count[c] : 0;
+			dest += t->output->pixelsize;
 		}
-		
-		g_assert(r_src);
-		g_assert(b_src);
-		for(col=0 ; col < col_end; col++)
+	}
+	return NULL;
+}
+
+static void
+bin_interpolate(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const gint binning, const guint cpuflags)
+{
+	guint i, y_offset, y_per_thread;
+	const guint threads = rs_get_number_of_processor_cores();
+	ThreadInfo *t = g_new0(ThreadInfo, threads);
+
+	y_per_thread = (out->h + threads-1)/threads;
+	y_offset = 0;
+
+	for (i = 0; i < threads; i++)
+	{
+		t[i].image = in;
+		t[i].output = out;
+		t[i].filters = filters;
+		t[i].binning = binning;
+		t[i].cpuflags = cpuflags;
+		t[i].start_y = y_offset;
+		y_offset += y_per_thread;
+		y_offset = MIN(out->h, y_offset);
+		t[i].end_y = y_offset;
+	}
+
+	rs_worker_pool_run(t, sizeof(ThreadInfo), threads, start_binning_thread);
+
+	g_free(t);
+}
+
+/* Rotates SuperCCD rows 45 degrees with bilinear interpolation, adapted
+ * from fuji_rotate() in dcraw */
+gpointer
+start_fuji_rotate_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	RS_IMAGE16 *input = t->image;
+	RS_IMAGE16 *output = t->output;
+	const gint fuji_width = t->fuji_width - 1;
+	const gdouble step = sqrt(0.5);
+	gint row, col, c, ur, uc;
+	gfloat fr, fc, rf, cf;
+
+	for (row = t->start_y; row < t->end_y; row++)
+	{
+		gushort *out = GET_PIXEL(output, 0, row);
+		for (col = 0; col < output->w; col++, out += output->pixelsize)
 		{
-			*dest++ = *r_src;
-			*dest++ = *g_src;
-			*dest++ = *b_src;
-			dest++;
-			r_src+=2;
-			g_src+=2;
-			b_src+=2;
+			ur = rf = fuji_width + (row-col)*step;
+			uc = cf = (row+col)*step;
+
+			if (ur > input->h-2 || uc > input->w-2)
+			{
+				out[0] = out[1] = out[2] = 0;
+				continue;
+			}
+
+			fr = rf - ur;
+			fc = cf - uc;
+
+			gushort *top = GET_PIXEL(input, uc, ur);
+			gushort *bottom = GET_PIXEL(input, uc, ur+1);
+			for (c = 0; c < 3; c++)
+				out[c] =
+					  (top[c]    * (1-fc) + top[input->pixelsize+c]    * fc) * (1-fr)
+					+ (bottom[c] * (1-fc) + bottom[input->pixelsize+c] * fc) * fr;
 		}
+	}
+	return NULL;
+}
 
+/* Replaces the image of response with the rotated SuperCCD image */
+static void
+fuji_rotate(RSFilterResponse *response, RS_IMAGE16 *image, gint fuji_width)
+{
+	guint i, y_offset, y_per_thread;
+	const guint threads = rs_get_number_of_processor_cores();
+	ThreadInfo *t = g_new0(ThreadInfo, threads);
+	RS_IMAGE16 *output;
+	gint wide, high;
+
+	fuji_rotated_size(image->h, fuji_width, &wide, &high);
+	output = rs_image16_new(wide, high, 3, 4);
+
+	y_per_thread = (output->h + threads-1)/threads;
+	y_offset = 0;
+
+	for (i = 0; i < threads; i++)
+	{
+		t[i].image = image;
+		t[i].output = output;
+		t[i].fuji_width = fuji_width;
+		t[i].start_y = y_offset;
+		y_offset += y_per_thread;
+		y_offset = MIN(output->h, y_offset);
+		t[i].end_y = y_offset;
 	}
-	g_thread_exit(NULL);
 
-	return NULL; /* Make the compiler shut up - we'll never return */
-}
+	rs_worker_pool_run(t, sizeof(ThreadInfo), threads, start_fuji_rotate_thread);
+
+	g_free(t);
 
+	/* An RSFujiRotate still in the chain should not rotate again */
+	rs_filter_response_set_image(response, output);
+	rs_filter_param_set_integer(RS_FILTER_PARAM(response), "fuji-width", 0);
+	g_object_unref(output);
+}
 
 static void
-none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const int colors, gboolean half_size)
+none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const int colors)
 {
 	guint i, y_offset, y_per_thread, threaded_h;
 	const guint threads = rs_get_number_of_processor_cores();
-	ThreadInfo *t = g_new(ThreadInfo, threads);
+	ThreadInfo *t = g_new0(ThreadInfo, threads);
 
 	/* Subtract 1 from bottom  */
 	threaded_h = out->h-1;
@@ -698,16 +955,9 @@ none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filter
 		y_offset += y_per_thread;
 		y_offset = MIN(out->h-1, y_offset);
 		t[i].end_y = y_offset;
-
-		if (half_size)
-			t[i].threadid = g_thread_new("RSDemosaic worker (none) (half-size)", start_none_thread_half, &t[i]);
-		else
-			t[i].threadid = g_thread_new("RSDemosaic worker (none)", start_none_thread, &t[i]);
 	}
 
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	rs_worker_pool_run(t, sizeof(ThreadInfo), threads, start_none_thread);
 
 	g_free(t);
 }
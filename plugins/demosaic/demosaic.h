@@ -0,0 +1,192 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>,
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef DEMOSAIC_H
+#define DEMOSAIC_H
+
+#include <rawstudio.h>
+
+/*
+   In order to inline this calculation, I make the risky
+   assumption that all filter patterns can be described
+   by a repeating pattern of eight rows and two columns
+
+   Return values are either 0/1/2/3 = G/M/C/Y or 0/1/2/3 = R/G1/B/G2
+ */
+#define FC(row,col) \
+  (int)(filters >> ((((row) << 1 & 14) + ((col) & 1)) << 1) & 3)
+
+static inline int
+fc_INDI (const unsigned int filters, const int row, const int col)
+{
+  static const char filter[16][16] =
+  { { 2,1,1,3,2,3,2,0,3,2,3,0,1,2,1,0 },
+    { 0,3,0,2,0,1,3,1,0,1,1,2,0,3,3,2 },
+    { 2,3,3,2,3,1,1,3,3,1,2,1,2,0,0,3 },
+    { 0,1,0,1,0,2,0,2,2,0,3,0,1,3,2,1 },
+    { 3,1,1,2,0,1,0,2,1,3,1,3,0,1,3,0 },
+    { 2,0,0,3,3,2,3,1,2,0,2,0,3,2,2,1 },
+    { 2,3,3,1,2,1,2,1,2,1,1,2,3,0,0,1 },
+    { 1,0,0,2,3,0,0,3,0,3,0,3,2,1,2,3 },
+    { 2,3,3,1,1,2,1,0,3,2,3,0,2,3,1,3 },
+    { 1,0,2,0,3,0,3,2,0,1,1,2,0,1,0,2 },
+    { 0,1,1,3,3,2,2,1,1,3,3,0,2,1,3,2 },
+    { 2,3,2,0,0,1,3,0,2,0,1,2,3,0,1,0 },
+    { 1,3,1,2,3,2,3,2,0,2,0,1,1,0,3,0 },
+    { 0,2,0,3,1,0,0,1,1,3,3,2,3,2,2,1 },
+    { 2,1,3,2,3,1,2,1,0,3,0,2,0,2,0,2 },
+    { 0,3,1,0,0,2,0,3,2,1,3,1,1,3,1,3 } };
+
+  if (filters != 1) return FC(row,col);
+  /* Assume that we are handling the Leaf CatchLight with
+   * top_margin = 8; left_margin = 18; */
+//  return filter[(row+top_margin) & 15][(col+left_margin) & 15];
+  return filter[(row+8) & 15][(col+18) & 15];
+}
+
+/*
+   Patterned Pixel Grouping Interpolation by Alain Desbiolles
+
+   The per pixel steps are kept here, so the vectorised kernels in
+   demosaic-sse4.c and demosaic-avx2.c can finish their rows with exactly
+   the same code as the plain C path.
+*/
+static inline guint clampbits16(gint x) { guint32 _y_temp; if( (_y_temp=x>>16) ) x = ~_y_temp >> 16; return x;}
+
+#define CLIP(x) clampbits16(x)
+#define ULIM(x,y,z) ((y) < (z) ? CLAMP(x,y,z) : CLAMP(x,z,y))
+
+/* Green at a red or blue pixel of colour c, p is the pitch in pixels */
+static inline void
+ppg_green_pixel(gushort (*pix)[4], const gint c, const gint p)
+{
+	const gint p3 = p*3;
+	gint diffA, diffB, guessA, guessB;
+
+	guessA = (pix[-1][1] + pix[0][c] + pix[1][1]) * 2
+		- pix[-2][c] - pix[2][c];
+	diffA = ( ABS(pix[-2][c] - pix[ 0][c]) +
+		ABS(pix[ 2][c] - pix[ 0][c]) +
+		ABS(pix[-1][1] - pix[ 1][1]) ) * 3 +
+		( ABS(pix[ 3][1] - pix[ 1][1]) +
+		ABS(pix[-3][1] - pix[-1][1]) ) * 2;
+
+	guessB = (pix[-p][1] + pix[0][c] + pix[p][1]) * 2
+		- pix[-2*p][c] - pix[2*p][c];
+	diffB = ( ABS(pix[-2*p][c] - pix[ 0][c]) +
+		ABS(pix[ 2*p][c] - pix[ 0][c]) +
+		ABS(pix[  -p][1] - pix[ p][1]) ) * 3 +
+		( ABS(pix[ p3][1] - pix[ p][1]) +
+		ABS(pix[-p3][1] - pix[-p][1]) ) * 2;
+
+	if (diffA > diffB)
+		pix[0][1] = ULIM(guessB >> 2, pix[p][1], pix[-p][1]);
+	else
+		pix[0][1] = ULIM(guessA >> 2, pix[1][1], pix[-1][1]);
+}
+
+/* Red and blue at a green pixel, c is the colour left and right of it */
+static inline void
+ppg_rb_at_green_pixel(gushort (*pix)[4], const gint c, const gint p)
+{
+	pix[0][c] = CLIP((pix[-1][c] + pix[1][c] + 2*pix[0][1]
+		- pix[-1][1] - pix[1][1]) >> 1);
+	pix[0][2-c] = CLIP((pix[-p][2-c] + pix[p][2-c] + 2*pix[0][1]
+		- pix[-p][1] - pix[p][1]) >> 1);
+}
+
+/* Blue at a red pixel and vice versa, c is the missing colour */
+static inline void
+ppg_rb_at_rb_pixel(gushort (*pix)[4], const gint c, const gint p)
+{
+	gint diffA, diffB, guessA, guessB, d;
+
+	d = 1 + p;
+	diffA = ABS(pix[-d][c] - pix[d][c]) +
+		ABS(pix[-d][1] - pix[0][1]) +
+		ABS(pix[ d][1] - pix[0][1]);
+	guessA = pix[-d][c] + pix[d][c] + 2*pix[0][1]
+		- pix[-d][1] - pix[d][1];
+
+	d = p - 1;
+	diffB = ABS(pix[-d][c] - pix[d][c]) +
+		ABS(pix[-d][1] - pix[0][1]) +
+		ABS(pix[ d][1] - pix[0][1]);
+	guessB = pix[-d][c] + pix[d][c] + 2*pix[0][1]
+		- pix[-d][1] - pix[d][1];
+
+	if (diffA > diffB)
+		pix[0][c] = CLIP(guessB >> 1);
+	else
+		pix[0][c] = CLIP(guessA >> 1);
+}
+
+/* Vectorised versions of the above, working on every second pixel of a row
+ * from col. They return the first column left for the C loop to finish, which
+ * is col itself if the kernel was not compiled in. Images must have a
+ * pixelsize of 4 */
+gint ppg_green_row_SSE4(RS_IMAGE16 *image, gint row, gint col, gint c);
+gint ppg_rb_at_green_row_SSE4(RS_IMAGE16 *image, gint row, gint col, gint c);
+gint ppg_rb_at_rb_row_SSE4(RS_IMAGE16 *image, gint row, gint col, gint c);
+gint ppg_green_row_AVX2(RS_IMAGE16 *image, gint row, gint col, gint c);
+gint ppg_rb_at_green_row_AVX2(RS_IMAGE16 *image, gint row, gint col, gint c);
+gint ppg_rb_at_rb_row_AVX2(RS_IMAGE16 *image, gint row, gint col, gint c);
+
+/* Finds the red, the two green and the blue sample of a 2x2 cell starting on
+ * an even row and column. They are numbered 0 to 3 as top left, top right,
+ * bottom left and bottom right. Returns FALSE for other patterns */
+static inline gboolean
+bin_cell_layout(const guint filters, gint layout[4])
+{
+	gint i, greens = 0;
+
+	layout[0] = layout[3] = -1;
+	for (i = 0; i < 4; i++)
+		switch (FC(i>>1, i&1))
+		{
+			case 0:
+				layout[0] = i;
+				break;
+			case 1:
+				if (greens == 2)
+					return FALSE;
+				layout[1 + greens++] = i;
+				break;
+			case 2:
+				layout[3] = i;
+				break;
+			default:
+				return FALSE;
+		}
+
+	return (greens == 2 && layout[0] >= 0 && layout[3] >= 0);
+}
+
+/* Averages factor x factor blocks of the CFA into output row, factor is 2 or
+ * 4. Returns the first column left for the C loop, the output must have a
+ * pixelsize of 4 */
+gint bin_row_SSE4(RS_IMAGE16 *input, RS_IMAGE16 *output, gint row, gint factor, guint filters);
+gint bin_row_AVX2(RS_IMAGE16 *input, RS_IMAGE16 *output, gint row, gint factor, guint filters);
+
+/* Tiled and threaded AHD and VNG in demosaic-hq.c. Only the tiles touching
+ * roi are interpolated, if it is given */
+void ahd_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const guint filters, const GdkRectangle *roi);
+void vng_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const guint filters, const GdkRectangle *roi);
+
+#endif /* DEMOSAIC_H */
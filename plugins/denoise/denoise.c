@@ -63,6 +63,7 @@ static void get_property (GObject *object, guint property_id, GValue *value, GPa
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static void settings_weak_notify(gpointer data, GObject *where_the_object_was);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
+static gint get_margin(RSFilter *filter, const RSFilterRequest *request);
 static void settings_changed(RSSettings *settings, RSSettingsMask mask, RSDenoise *denoise);
 
 static RSFilterClass *rs_denoise_parent_class = NULL;
@@ -107,6 +108,7 @@ rs_denoise_class_init(RSDenoiseClass *klass)
 
 	filter_class->name = "FFT denoise filter";
 	filter_class->get_image = get_image;
+	filter_class->get_margin = get_margin;
 }
 
 
@@ -224,6 +226,18 @@ bit_blt(char* dstp, int dst_pitch, const char* srcp, int src_pitch, int row_size
 }
 
 
+static gint
+get_margin(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSDenoise *denoise = RS_DENOISE(filter);
+
+	if (rs_filter_request_get_quick(request) || ((denoise->sharpen + denoise->denoise_luma + denoise->denoise_chroma) == 0))
+		return 0;
+
+	/* One FFT block (FFT_BLOCK_SIZE) on each side hides tile seams */
+	return 128;
+}
+
 static RSFilterResponse *
 get_image(RSFilter *filter, const RSFilterRequest *request)
 {
@@ -52,6 +52,7 @@ static void get_property (GObject *object, guint property_id, GValue *value, GPa
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
 static RSFilterResponse *get_size(RSFilter *filter, const RSFilterRequest *request);
+static gint get_margin(RSFilter *filter, const RSFilterRequest *request);
 
 static RSFilterClass *rs_fuji_rotate_parent_class = NULL;
 
@@ -84,6 +85,7 @@ rs_fuji_rotate_class_init(RSFujiRotateClass *klass)
 	filter_class->name = "FujiRotate filter";
 	filter_class->get_image = get_image;
 	filter_class->get_size = get_size;
+	filter_class->get_margin = get_margin;
 }
 
 static void
@@ -173,6 +175,8 @@ do_rotate(RS_IMAGE16 *input, gint fuji_width)
 	return output;
 }
 
+/* RSDemosaic rotates SuperCCD images itself and clears "fuji-width", so
+ * this only acts on input that was demosaiced elsewhere */
 static RSFilterResponse *
 get_image(RSFilter *filter, const RSFilterRequest *request)
 {
@@ -220,3 +224,16 @@ get_size(RSFilter *filter, const RSFilterRequest *request)
 
 	return response;
 }
+
+static gint
+get_margin(RSFilter *filter, const RSFilterRequest *request)
+{
+	gint fuji_width = 0;
+	RSFilterResponse *previous_response = rs_filter_get_size(filter->previous, request);
+
+	/* Rotating SuperCCD data needs the complete frame */
+	rs_filter_param_get_integer(RS_FILTER_PARAM(previous_response), "fuji-width", &fuji_width);
+	g_object_unref(previous_response);
+
+	return (fuji_width > 0) ? RS_FILTER_MARGIN_FULL : 0;
+}
@@ -88,6 +88,8 @@ static void settings_weak_notify(gpointer data, GObject *where_the_object_was);
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
+static gint get_margin(RSFilter *filter, const RSFilterRequest *request);
+static gboolean map_changed_region(RSFilter *filter, GdkRectangle *region);
 static void inline rs_image16_nearest_full(RS_IMAGE16 *in, gushort *out, gfloat *pos);
 static void inline rs_image16_bilinear_full(RS_IMAGE16 *in, gushort *out, gfloat *pos);
 extern gboolean is_sse2_compiled(void);
@@ -189,6 +191,8 @@ rs_lensfun_class_init(RSLensfunClass *klass)
 	);
 	filter_class->name = "Lensfun filter";
 	filter_class->get_image = get_image;
+	filter_class->get_margin = get_margin;
+	filter_class->map_changed_region = map_changed_region;
 
 	rs_lf_version = rs_guess_lensfun_version();
 }
@@ -355,7 +359,6 @@ typedef struct {
 	lfModifier *mod;
 	RS_IMAGE16 *input;
 	RS_IMAGE16 *output;
-	GThread *threadid;
 	gint effective_flags;
 	GdkRectangle *roi;
 	gint stage;
@@ -443,6 +446,44 @@ thread_func(gpointer _thread_info)
 }
 
 
+static gint
+get_margin(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSLensfun *lensfun = RS_LENSFUN(filter);
+
+	/* Quick requests are passed through untouched */
+	if (rs_filter_request_get_quick(request))
+		return 0;
+
+	/* Distortion and TCA correction can move pixels from anywhere in the
+	 * frame. The lens is not looked up until the next render, so assume
+	 * distortion will apply while dirty */
+	if (lensfun->distortion_enabled && (lensfun->DIRTY || lensfun->selected_lens))
+		return RS_FILTER_MARGIN_FULL;
+	if (ABS(lensfun->tca_kr) + ABS(lensfun->tca_kb) >= 0.001)
+		return RS_FILTER_MARGIN_FULL;
+
+	/* Vignetting correction is pointwise */
+	return 0;
+}
+
+static gboolean
+map_changed_region(RSFilter *filter, GdkRectangle *region)
+{
+	RSLensfun *lensfun = RS_LENSFUN(filter);
+
+	/* Geometry is unknown until the next render */
+	if (lensfun->DIRTY)
+		return FALSE;
+
+	/* Distortion and TCA correction can move pixels anywhere, vignetting
+	 * correction is pointwise */
+	if ((lensfun->selected_lens && lensfun->distortion_enabled) || (ABS(lensfun->tca_kr) + ABS(lensfun->tca_kb) >= 0.001))
+		return FALSE;
+
+	return TRUE;
+}
+
 static RSFilterResponse *
 get_image(RSFilter *filter, const RSFilterRequest *request)
 {
@@ -686,12 +727,9 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 					y_offset += y_per_thread;
 					y_offset = MIN(vign_roi->y + vign_roi->height, y_offset);
 					t[i].end_y = y_offset;
-					t[i].threadid = g_thread_new("RSLensfun worker (phase 2)", thread_func, &t[i]);
 				}
-				
-				/* Wait for threads to finish */
-				for(i = 0; i < threads; i++)
-					g_thread_join(t[i].threadid);
+
+				rs_worker_pool_run(t, sizeof(ThreadInfo), threads, thread_func);
 
 				input = output;
 			}
@@ -715,12 +753,9 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 					y_offset = MIN(roi->y + roi->height, y_offset);
 					t[i].end_y = y_offset;
 					t[i].stage = 3;
-					t[i].threadid = g_thread_new("RSLensfun worker (phase 1+3)", thread_func, &t[i]);
 				}
-				
-				/* Wait for threads to finish */
-				for(i = 0; i < threads; i++)
-					g_thread_join(t[i].threadid);
+
+				rs_worker_pool_run(t, sizeof(ThreadInfo), threads, thread_func);
 			}
 			else
 			{
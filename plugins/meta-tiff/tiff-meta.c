@@ -2001,7 +2001,8 @@ raw_thumbnail_reader(const gchar *service, RSMetadata *meta)
 	
 	g_object_set(fresample, "width", 256,
 				 "height", 256, 
-				"bounding-box", TRUE, NULL);
+				"bounding-box", TRUE,
+				"allow-binning", TRUE, NULL);
 
 	g_object_set(finput, "filename", service, NULL);
 
@@ -45,6 +45,7 @@ struct _RSJpegfile {
 	gint quality;
 	RSColorSpace *color_space;
 	gboolean copy_metadata;
+	gint encoder_threads;
 };
 
 struct _RSJpegfileClass {
@@ -58,7 +59,8 @@ enum {
 	PROP_FILENAME,
 	PROP_QUALITY,
 	PROP_METADATA,
-	PROP_COLORSPACE
+	PROP_COLORSPACE,
+	PROP_ENCODER_THREADS
 };
 
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
@@ -104,6 +106,12 @@ rs_jpegfile_class_init(RSJpegfileClass *klass)
 			TRUE, G_PARAM_READWRITE)
 	);
 
+	g_object_class_install_property(object_class,
+		PROP_ENCODER_THREADS, g_param_spec_int(
+			"encoder-threads", "Encoder threads", _("Threads used for encoding, 0 to use all cores"),
+			0, 64, 0, G_PARAM_READWRITE)
+	);
+
 	output_class->execute = execute;
 	output_class->extension = "jpg";
 	output_class->display_name = _("JPEG (Joint Photographic Experts Group)");
@@ -116,6 +124,7 @@ rs_jpegfile_init(RSJpegfile *jpegfile)
 	jpegfile->quality = 90;
 	jpegfile->color_space = rs_color_space_new_singleton("RSSrgb");
 	jpegfile->copy_metadata = TRUE;
+	jpegfile->encoder_threads = 0;
 }
 
 static void
@@ -137,6 +146,9 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 		case PROP_METADATA:
 			g_value_set_boolean(value, jpegfile->copy_metadata);
 			break;
+		case PROP_ENCODER_THREADS:
+			g_value_set_int(value, jpegfile->encoder_threads);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -163,6 +175,9 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 		case PROP_METADATA:
 			jpegfile->copy_metadata = g_value_get_boolean(value);
 			break;
+		case PROP_ENCODER_THREADS:
+			jpegfile->encoder_threads = g_value_get_int(value);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -213,39 +228,191 @@ rs_jpeg_write_icc_profile(j_compress_ptr cinfo, const JOCTET *icc_data_ptr, guin
 	return;
 }
 
+/* Rows pulled through the filter chain at a time, peak memory for the 8 bit
+ * image is bounded by this instead of image height */
+#define STRIP_ROWS (128)
+
+#define OUTPUT_BUFFER_SIZE (64*1024)
+
+/* Like jpeg_stdio_dest(), but only holds the IO lock while writing, since
+ * the image is rendered while compressing */
+typedef struct {
+	struct jpeg_destination_mgr pub;
+	FILE *outfile;
+	JOCTET *buffer;
+} LockedDestination;
+
+static void
+locked_write(j_compress_ptr cinfo, size_t length)
+{
+	LockedDestination *dest = (LockedDestination *) cinfo->dest;
+	size_t written;
+
+	rs_io_lock();
+	written = fwrite(dest->buffer, 1, length, dest->outfile);
+	rs_io_unlock();
+
+	if (written != length)
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+}
+
+static void
+locked_init_destination(j_compress_ptr cinfo)
+{
+	LockedDestination *dest = (LockedDestination *) cinfo->dest;
+
+	dest->buffer = (JOCTET *) (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE, OUTPUT_BUFFER_SIZE * sizeof(JOCTET));
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = OUTPUT_BUFFER_SIZE;
+}
+
+static boolean
+locked_empty_output_buffer(j_compress_ptr cinfo)
+{
+	LockedDestination *dest = (LockedDestination *) cinfo->dest;
+
+	locked_write(cinfo, OUTPUT_BUFFER_SIZE);
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = OUTPUT_BUFFER_SIZE;
+
+	return TRUE;
+}
+
+static void
+locked_term_destination(j_compress_ptr cinfo)
+{
+	LockedDestination *dest = (LockedDestination *) cinfo->dest;
+	size_t length = OUTPUT_BUFFER_SIZE - dest->pub.free_in_buffer;
+
+	if (length > 0)
+		locked_write(cinfo, length);
+
+	rs_io_lock();
+	fflush(dest->outfile);
+	rs_io_unlock();
+	if (ferror(dest->outfile))
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+}
+
+static void
+locked_dest(j_compress_ptr cinfo, FILE *outfile)
+{
+	LockedDestination *dest;
+
+	cinfo->dest = (struct jpeg_destination_mgr *) (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(LockedDestination));
+	dest = (LockedDestination *) cinfo->dest;
+	dest->pub.init_destination = locked_init_destination;
+	dest->pub.empty_output_buffer = locked_empty_output_buffer;
+	dest->pub.term_destination = locked_term_destination;
+	dest->outfile = outfile;
+}
+
+/* Compress rows until last_row, pixbuf_y is the image row at the top of pixbuf */
 static gboolean
-execute(RSOutput *output, RSFilter *filter)
+write_rows(j_compress_ptr cinfo, GdkPixbuf *pixbuf, gint pixbuf_y, gint last_row, guchar *line)
 {
-	RSJpegfile *jpegfile = RS_JPEGFILE(output);
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	FILE * outfile;
+	const gint channels = gdk_pixbuf_get_n_channels(pixbuf);
 	JSAMPROW row_pointer[1];
-	gint x,y;
-	
-	
-	RSFilterRequest *request = rs_filter_request_new();
-	rs_filter_request_set_quick(RS_FILTER_REQUEST(request), FALSE);
-	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", jpegfile->color_space);
-	RSFilterResponse *response = rs_filter_get_image8(filter, request);
-	
-	g_object_unref(request);
-	GdkPixbuf *pixbuf = rs_filter_response_get_image8(response);
-	g_object_unref(response);
+	gint x;
 
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-	if ((outfile = fopen(jpegfile->filename, "wb")) == NULL)
-		return(FALSE);
-	jpeg_stdio_dest(&cinfo, outfile);
-	cinfo.image_width = gdk_pixbuf_get_width(pixbuf);
-	cinfo.image_height = gdk_pixbuf_get_height(pixbuf);
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_RGB;
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, jpegfile->quality, TRUE);
-	rs_io_lock();
-	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo->next_scanline < last_row)
+	{
+		guchar *in = GET_PIXBUF_PIXEL(pixbuf, 0, cinfo->next_scanline - pixbuf_y);
+
+		if (channels == 4)
+		{
+			guchar *o = line;
+			for(x = 0; x < cinfo->image_width; x++)
+			{
+				o[0] = in[0];
+				o[1] = in[1];
+				o[2] = in[2];
+				in += 4;
+				o += 3;
+			}
+			row_pointer[0] = line;
+		}
+		else
+			row_pointer[0] = in;
+
+		if (jpeg_write_scanlines(cinfo, row_pointer, 1) != 1)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Keeps the compressed data of a band in memory until it can be joined */
+typedef struct {
+	struct jpeg_destination_mgr pub;
+	guchar *data;
+	gsize allocated;
+	gsize length;
+} MemoryDestination;
+
+static void
+memory_init_destination(j_compress_ptr cinfo)
+{
+	MemoryDestination *dest = (MemoryDestination *) cinfo->dest;
+
+	dest->allocated = OUTPUT_BUFFER_SIZE;
+	dest->data = g_malloc(dest->allocated);
+	dest->pub.next_output_byte = dest->data;
+	dest->pub.free_in_buffer = dest->allocated;
+}
+
+static boolean
+memory_empty_output_buffer(j_compress_ptr cinfo)
+{
+	MemoryDestination *dest = (MemoryDestination *) cinfo->dest;
+	gsize used = dest->allocated;
+
+	dest->allocated *= 2;
+	dest->data = g_realloc(dest->data, dest->allocated);
+	dest->pub.next_output_byte = dest->data + used;
+	dest->pub.free_in_buffer = dest->allocated - used;
+
+	return TRUE;
+}
+
+static void
+memory_term_destination(j_compress_ptr cinfo)
+{
+	MemoryDestination *dest = (MemoryDestination *) cinfo->dest;
+
+	dest->length = dest->allocated - dest->pub.free_in_buffer;
+}
+
+static MemoryDestination *
+memory_dest(j_compress_ptr cinfo)
+{
+	MemoryDestination *dest;
+
+	cinfo->dest = (struct jpeg_destination_mgr *) (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(MemoryDestination));
+	dest = (MemoryDestination *) cinfo->dest;
+	dest->pub.init_destination = memory_init_destination;
+	dest->pub.empty_output_buffer = memory_empty_output_buffer;
+	dest->pub.term_destination = memory_term_destination;
+	dest->data = NULL;
+	dest->length = 0;
+
+	return dest;
+}
+
+static void
+compress_setup(RSJpegfile *jpegfile, j_compress_ptr cinfo, gint width, gint height)
+{
+	cinfo->image_width = width;
+	cinfo->image_height = height;
+	cinfo->input_components = 3;
+	cinfo->in_color_space = JCS_RGB;
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, jpegfile->quality, TRUE);
+}
+
+static void
+write_icc_profile(RSJpegfile *jpegfile, j_compress_ptr cinfo)
+{
 	if (jpegfile->color_space && !g_str_equal(G_OBJECT_TYPE_NAME(jpegfile->color_space), "RSSrgb"))
 	{
 		const RSIccProfile *profile = rs_color_space_get_icc_profile(jpegfile->color_space, FALSE);
@@ -254,48 +421,314 @@ execute(RSOutput *output, RSFilter *filter)
 			gchar *data;
 			gsize data_length;
 			rs_icc_profile_get_data(profile, &data, &data_length);
-			rs_jpeg_write_icc_profile(&cinfo, (guchar *) data, data_length);
+			rs_jpeg_write_icc_profile(cinfo, (guchar *) data, data_length);
 			g_free(data);
 		}
 	}
+}
+
+static gboolean
+execute_serial(RSJpegfile *jpegfile, RSFilter *filter, RSFilterRequest *request, FILE *outfile, gint width, gint height)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	GObject *complete = NULL;
+	GdkPixbuf *pixbuf;
+	GdkRectangle strip;
+	guchar *line;
+	gint pixbuf_y;
+	gboolean ret = TRUE;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	locked_dest(&cinfo, outfile);
+	compress_setup(jpegfile, &cinfo, width, height);
+	jpeg_start_compress(&cinfo, TRUE);
+	write_icc_profile(jpegfile, &cinfo);
+
+	line = g_new(guchar, width * 3);
+	strip.x = 0;
+	strip.width = width;
+	while (ret && cinfo.next_scanline < cinfo.image_height)
+	{
+		strip.y = cinfo.next_scanline;
+		strip.height = MIN(STRIP_ROWS, height - strip.y);
+
+		pixbuf = (GdkPixbuf *) rs_output_get_strip(filter, request, FALSE, width, height, &strip, &pixbuf_y, &complete);
+		if (pixbuf)
+		{
+			ret = write_rows(&cinfo, pixbuf, pixbuf_y, strip.y + strip.height, line);
+			g_object_unref(pixbuf);
+		}
+		else
+			ret = FALSE;
+	}
+	g_free(line);
+	if (complete)
+		g_object_unref(complete);
+
+	if (ret)
+		jpeg_finish_compress(&cinfo);
+	else
+		jpeg_abort_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	return ret;
+}
+
+/* A horizontal band of the image, compressed as a JPEG of its own */
+typedef struct {
+	RSJpegfile *jpegfile;
+	GdkPixbuf *pixbuf;
+	gint pixbuf_y;
+	gint y;
+	gint rows;
+	gint width;
+	guchar *data;
+	gsize length;
+} Band;
+
+static gpointer
+encode_band(gpointer data)
+{
+	Band *band = data;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	MemoryDestination *dest;
+	guchar *line = g_new(guchar, band->width * 3);
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	dest = memory_dest(&cinfo);
+	compress_setup(band->jpegfile, &cinfo, band->width, band->rows);
+	/* A restart after every MCU row resets the entropy coder, so a band
+	 * codes exactly like the same rows inside a complete image */
+	cinfo.restart_in_rows = 1;
+	jpeg_start_compress(&cinfo, TRUE);
+	if (band->y == 0)
+		write_icc_profile(band->jpegfile, &cinfo);
+
+	if (write_rows(&cinfo, band->pixbuf, band->pixbuf_y - band->y, band->rows, line))
+		jpeg_finish_compress(&cinfo);
+	else
+		jpeg_abort_compress(&cinfo);
+
+	band->data = dest->data;
+	band->length = dest->length;
+	jpeg_destroy_compress(&cinfo);
+	g_free(line);
+
+	return NULL;
+}
+
+/* Find where the entropy coded data starts, and the frame header */
+static gboolean
+find_scan(const guchar *data, gsize length, gsize *scan, gsize *frame)
+{
+	gsize pos = 2;
+
+	*frame = 0;
+
+	if (length < 4 || data[0] != 0xFF || data[1] != 0xD8)
+		return FALSE;
+
+	/* The compressed data must end with EOI */
+	if (data[length-2] != 0xFF || data[length-1] != 0xD9)
+		return FALSE;
+
+	while (pos + 4 <= length && data[pos] == 0xFF)
+	{
+		const guchar marker = data[pos+1];
+
+		if (marker >= 0xC0 && marker <= 0xC2)
+			*frame = pos;
+		pos += 2 + ((data[pos+2] << 8) | data[pos+3]);
+
+		if (marker == 0xDA)
+		{
+			*scan = pos;
+			return (pos <= length - 2);
+		}
+	}
+
+	return FALSE;
+}
+
+/* Append a band to the file. Restart markers cycle through RST0-RST7, and
+ * all bands but the last are a multiple of 8 MCU rows, so every band
+ * starts where a complete image would have put RST7 */
+static gboolean
+write_band(Band *band, FILE *outfile, gint height)
+{
+	static const guchar restart[2] = { 0xFF, 0xD7 };
+	static const guchar end[2] = { 0xFF, 0xD9 };
+	gsize scan, frame, length;
+	gboolean ret = TRUE;
+
+	if (!band->data || !find_scan(band->data, band->length, &scan, &frame))
+		return FALSE;
+
+	/* Entropy coded data without EOI */
+	length = band->length - scan - 2;
+
+	rs_io_lock();
+	if (band->y == 0)
+	{
+		if (frame == 0)
+			ret = FALSE;
+		else
+		{
+			/* Headers of the first band, with the height of the complete image */
+			band->data[frame+5] = (height >> 8) & 0xff;
+			band->data[frame+6] = height & 0xff;
+			ret = (fwrite(band->data, 1, scan, outfile) == scan);
+		}
+	}
+	else
+		ret = (fwrite(restart, 1, 2, outfile) == 2);
+
+	if (ret)
+		ret = (fwrite(band->data + scan, 1, length, outfile) == length);
+
+	if (ret && (band->y + band->rows == height))
+		ret = (fwrite(end, 1, 2, outfile) == 2);
+	rs_io_unlock();
+
+	return ret;
+}
 
-	if (gdk_pixbuf_get_n_channels(pixbuf) == 4)
+/* Splits the image in bands compressed in parallel on the worker pool. The
+ * result is the same for any number of threads */
+static gboolean
+execute_parallel(RSJpegfile *jpegfile, RSFilter *filter, RSFilterRequest *request, FILE *outfile, gint width, gint height, gint threads)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	GObject *complete = NULL;
+	GdkRectangle strip;
+	Band *bands;
+	gint mcu_rows = 0, band_rows;
+	gint i, n, y = 0;
+	gboolean ret = TRUE;
+
+	/* Find the MCU height for the settings used */
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	compress_setup(jpegfile, &cinfo, width, height);
+	for(i = 0; i < cinfo.num_components; i++)
+		mcu_rows = MAX(mcu_rows, cinfo.comp_info[i].v_samp_factor * DCTSIZE);
+	jpeg_destroy_compress(&cinfo);
+
+	band_rows = 8 * mcu_rows;
+	band_rows *= MAX(1, STRIP_ROWS / band_rows);
+
+	bands = g_new0(Band, threads);
+	strip.x = 0;
+	strip.width = width;
+	while (ret && y < height)
 	{
-		GdkPixbuf *out = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, cinfo.image_width, cinfo.image_height);
-		for( y = 0; y < cinfo.image_height; y++){
-			gint* in = (gint*)GET_PIXBUF_PIXEL(pixbuf, 0, y);
-			guchar* o = GET_PIXBUF_PIXEL(out, 0, y);
-			for( x = 0; x < cinfo.image_width ; x++) {
-				guint i = *in++;
-				o[0] = i&0xff;
-				o[1] = (i>>8)&0xff;
-				o[2] = (i>>16)&0xff;
-				o+=3;
+		/* Render a band for every thread, then compress them all at once */
+		for(n = 0; n < threads && y < height; n++)
+		{
+			Band *band = &bands[n];
+
+			strip.y = y;
+			strip.height = MIN(band_rows, height - y);
+
+			band->jpegfile = jpegfile;
+			band->y = strip.y;
+			band->rows = strip.height;
+			band->width = width;
+			band->data = NULL;
+			band->pixbuf = (GdkPixbuf *) rs_output_get_strip(filter, request, FALSE, width, height, &strip, &band->pixbuf_y, &complete);
+			if (!band->pixbuf)
+			{
+				ret = FALSE;
+				break;
 			}
+			y += strip.height;
+		}
+
+		if (ret)
+			rs_worker_pool_run(bands, sizeof(Band), n, encode_band);
+
+		for(i = 0; i < n; i++)
+		{
+			if (ret)
+				ret = write_band(&bands[i], outfile, height);
+			g_free(bands[i].data);
+			g_object_unref(bands[i].pixbuf);
 		}
-		g_object_unref(pixbuf);
-		pixbuf = out;
 	}
+	g_free(bands);
+	if (complete)
+		g_object_unref(complete);
 
-	while (cinfo.next_scanline < cinfo.image_height)
+	if (ret)
 	{
-		row_pointer[0] = GET_PIXBUF_PIXEL(pixbuf, 0, cinfo.next_scanline);
-		if (jpeg_write_scanlines(&cinfo, row_pointer, 1) != 1)
-			break;
+		rs_io_lock();
+		ret = (fflush(outfile) == 0);
+		rs_io_unlock();
 	}
-	jpeg_finish_compress(&cinfo);
+
+	return ret;
+}
+
+static gboolean
+execute(RSOutput *output, RSFilter *filter)
+{
+	RSJpegfile *jpegfile = RS_JPEGFILE(output);
+	RSFilterRequest *request;
+	GHashTable *tile_cache;
+	FILE *outfile;
+	gint width, height, threads;
+	gboolean ret;
+
+	request = rs_filter_request_new();
+	rs_filter_request_set_quick(RS_FILTER_REQUEST(request), FALSE);
+	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", jpegfile->color_space);
+	/* Ask for pixbufs covering only the strip, not the complete image */
+	rs_filter_param_set_boolean(RS_FILTER_PARAM(request), "crop-to-roi", TRUE);
+
+	if (!rs_filter_get_size_simple(filter, request, &width, &height) || width < 1 || height < 1)
+	{
+		g_object_unref(request);
+		return FALSE;
+	}
+
+	if ((outfile = fopen(jpegfile->filename, "wb")) == NULL)
+	{
+		g_object_unref(request);
+		return FALSE;
+	}
+
+	/* Filters needing their complete input are rendered once for all strips */
+	tile_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_object_unref);
+	rs_filter_request_set_tile_cache(request, tile_cache);
+	g_hash_table_unref(tile_cache);
+
+	threads = (jpegfile->encoder_threads > 0) ? jpegfile->encoder_threads : rs_get_number_of_processor_cores();
+
+	/* One thread writes a plain JPEG without restart markers */
+	if (threads > 1 && height > STRIP_ROWS)
+		ret = execute_parallel(jpegfile, filter, request, outfile, width, height, threads);
+	else
+		ret = execute_serial(jpegfile, filter, request, outfile, width, height);
+
+	g_object_unref(request);
 	fclose(outfile);
-	jpeg_destroy_compress(&cinfo);
-	g_object_unref(pixbuf);
+
+	if (!ret)
+		return FALSE;
 
 	gchar *input_filename = NULL;
 	rs_filter_get_recursive(filter, "filename", &input_filename, NULL);
 
+	rs_io_lock();
 	if (jpegfile->copy_metadata)
 		rs_exif_copy(input_filename, jpegfile->filename, G_OBJECT_TYPE_NAME(jpegfile->color_space), RS_EXIF_FILE_TYPE_JPEG);
 	else
 		rs_exif_add_colorspace(jpegfile->filename, G_OBJECT_TYPE_NAME(jpegfile->color_space), RS_EXIF_FILE_TYPE_JPEG);
-
 	rs_io_unlock();
 	g_free(input_filename);
 
@@ -24,6 +24,14 @@
 #include <gettext.h>
 #include <png.h>
 #include <zlib.h>
+#include <string.h>
+
+/* Filtered bytes deflated as one independent piece, like pigz does. Pieces
+ * always start on a row, so the output doesn't depend on the thread count */
+#define CHUNK_SIZE (128*1024)
+
+/* Deflate window, each piece is primed with this much of the data before it */
+#define DICT_SIZE (32*1024)
 
 #define RS_TYPE_PNGFILE (rs_pngfile_type)
 #define RS_PNGFILE(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_PNGFILE, RSPngfile))
@@ -42,6 +50,8 @@ struct _RSPngfile {
 	gboolean save16bit;
 	gboolean copy_metadata;
 	gboolean quick;
+	gint compression_level;
+	gint encoder_threads;
 };
 
 struct _RSPngfileClass {
@@ -56,7 +66,9 @@ enum {
 	PROP_16BIT,
 	PROP_METADATA,
 	PROP_COLORSPACE,
-	PROP_QUICK
+	PROP_QUICK,
+	PROP_COMPRESSION_LEVEL,
+	PROP_ENCODER_THREADS
 };
 
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
@@ -103,6 +115,16 @@ rs_pngfile_class_init(RSPngfileClass *klass)
 			"quick", "Quick", _("Quick export"),
 			TRUE, G_PARAM_READWRITE)
 	);
+	g_object_class_install_property(object_class,
+		PROP_COMPRESSION_LEVEL, g_param_spec_int(
+			"compression-level", "Compression level", _("Compression level, 0 is fastest and 9 is smallest"),
+			0, 9, 6, G_PARAM_READWRITE)
+	);
+	g_object_class_install_property(object_class,
+		PROP_ENCODER_THREADS, g_param_spec_int(
+			"encoder-threads", "Encoder threads", _("Threads used for encoding, 0 to use all cores"),
+			0, 64, 0, G_PARAM_READWRITE)
+	);
 
 	output_class->execute = execute;
 	output_class->extension = "png";
@@ -117,6 +139,8 @@ rs_pngfile_init(RSPngfile *pngfile)
 	pngfile->save16bit = FALSE;
 	pngfile->copy_metadata = TRUE;
 	pngfile->quick = FALSE;
+	pngfile->compression_level = 6;
+	pngfile->encoder_threads = 0;
 }
 
 static void
@@ -141,6 +165,12 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 		case PROP_QUICK:
 			g_value_set_boolean(value, pngfile->quick);
 			break;
+		case PROP_COMPRESSION_LEVEL:
+			g_value_set_int(value, pngfile->compression_level);
+			break;
+		case PROP_ENCODER_THREADS:
+			g_value_set_int(value, pngfile->encoder_threads);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -170,36 +200,428 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 		case PROP_QUICK:
 			pngfile->quick = g_value_get_boolean(value);
 			break;
+		case PROP_COMPRESSION_LEVEL:
+			pngfile->compression_level = g_value_get_int(value);
+			break;
+		case PROP_ENCODER_THREADS:
+			pngfile->encoder_threads = g_value_get_int(value);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
 }
 
+typedef struct {
+	/* Source, only one of image and pixbuf is set */
+	RS_IMAGE16 *image;
+	GdkPixbuf *pixbuf;
+	gint source_y;
+	gint strip_y;
+	const guchar *prior;
+	gint y;
+	gint rows;
+	gint width;
+	gint bytes_per_pixel;
+	gint level;
+	gboolean last;
+
+	/* Filtered rows of this chunk, the data before them primes deflate */
+	guchar *filtered;
+	gsize length;
+	const guchar *dictionary;
+	gsize dictionary_length;
+
+	/* Result, data is NULL if compression failed */
+	guchar *data;
+	gsize data_length;
+	uLong adler;
+} Chunk;
+
+/* Packs image row y to big endian RGB as PNG wants it */
+static void
+pack_row(const Chunk *chunk, gint y, guchar *out)
+{
+	gint col;
+
+	if (chunk->image)
+	{
+		const gint pixelsize = chunk->image->pixelsize;
+		const gushort *in = GET_PIXEL(chunk->image, 0, y - chunk->source_y);
+		for(col = 0; col < chunk->width; col++)
+		{
+			out[col*6 + 0] = in[col*pixelsize + R] >> 8;
+			out[col*6 + 1] = in[col*pixelsize + R] & 0xff;
+			out[col*6 + 2] = in[col*pixelsize + G] >> 8;
+			out[col*6 + 3] = in[col*pixelsize + G] & 0xff;
+			out[col*6 + 4] = in[col*pixelsize + B] >> 8;
+			out[col*6 + 5] = in[col*pixelsize + B] & 0xff;
+		}
+	}
+	else
+	{
+		const gint channels = gdk_pixbuf_get_n_channels(chunk->pixbuf);
+		const guchar *in = GET_PIXBUF_PIXEL(chunk->pixbuf, 0, y - chunk->source_y);
+		for(col = 0; col < chunk->width; col++)
+		{
+			out[col*3 + R] = in[col*channels + R];
+			out[col*3 + G] = in[col*channels + G];
+			out[col*3 + B] = in[col*channels + B];
+		}
+	}
+}
+
+static inline gint
+paeth(gint a, gint b, gint c)
+{
+	const gint p = a + b - c;
+	const gint pa = ABS(p - a);
+	const gint pb = ABS(p - b);
+	const gint pc = ABS(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+/* Tries all five PNG filters on a row and keeps the one with the smallest sum
+ * of absolute differences, the same heuristic libpng uses */
+static void
+filter_row(const guchar *row, const guchar *prior, gsize length, gint bpp, guchar *candidates, guchar *out)
+{
+	guint64 best_sum = G_MAXUINT64;
+	gint type, best = 0;
+	gsize i;
+
+	for(type = 0; type < 5; type++)
+	{
+		guchar *filtered = candidates + type * length;
+		guint64 sum = 0;
+
+		for(i = 0; i < length; i++)
+		{
+			const gint a = (i >= bpp) ? row[i - bpp] : 0;
+			const gint b = prior[i];
+			const gint c = (i >= bpp) ? prior[i - bpp] : 0;
+			gint predicted;
+
+			switch (type)
+			{
+				case 1: predicted = a; break;
+				case 2: predicted = b; break;
+				case 3: predicted = (a + b) >> 1; break;
+				case 4: predicted = paeth(a, b, c); break;
+				default: predicted = 0; break;
+			}
+
+			filtered[i] = (row[i] - predicted) & 0xff;
+			sum += (filtered[i] < 128) ? filtered[i] : 256 - filtered[i];
+		}
+
+		if (sum < best_sum)
+		{
+			best_sum = sum;
+			best = type;
+		}
+	}
+
+	out[0] = best;
+	memcpy(out + 1, candidates + best * length, length);
+}
+
+static gpointer
+filter_chunk(gpointer data)
+{
+	Chunk *chunk = data;
+	const gsize row_bytes = chunk->width * chunk->bytes_per_pixel;
+	guchar *rows = g_malloc0(row_bytes * 2);
+	guchar *candidates = g_malloc(row_bytes * 5);
+	guchar *prior = rows;
+	guchar *current = rows + row_bytes;
+	guchar *swap;
+	gint row;
+
+	/* The row above the first row of the image is all zeros */
+	if (chunk->y > chunk->strip_y)
+		pack_row(chunk, chunk->y - 1, prior);
+	else if (chunk->prior)
+		memcpy(prior, chunk->prior, row_bytes);
+
+	for(row = 0; row < chunk->rows; row++)
+	{
+		pack_row(chunk, chunk->y + row, current);
+		filter_row(current, prior, row_bytes, chunk->bytes_per_pixel, candidates, chunk->filtered + row * (row_bytes + 1));
+		swap = prior;
+		prior = current;
+		current = swap;
+	}
+
+	g_free(candidates);
+	g_free(rows);
+
+	return NULL;
+}
+
+/* Deflates a chunk as raw deflate blocks. All but the last chunk end with a
+ * sync flush, so the chunks can simply be concatenated */
+static gpointer
+compress_chunk(gpointer data)
+{
+	Chunk *chunk = data;
+	z_stream stream;
+	gsize capacity;
+	gint ret;
+
+	chunk->data = NULL;
+	chunk->adler = adler32(adler32(0L, Z_NULL, 0), chunk->filtered, chunk->length);
+
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, chunk->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	if (chunk->dictionary_length > 0)
+		deflateSetDictionary(&stream, chunk->dictionary, chunk->dictionary_length);
+
+	/* Leave room for the empty block of the sync flush */
+	capacity = deflateBound(&stream, chunk->length) + 16;
+	chunk->data = g_malloc(capacity);
+
+	stream.next_in = chunk->filtered;
+	stream.avail_in = chunk->length;
+	stream.next_out = chunk->data;
+	stream.avail_out = capacity;
+
+	while(TRUE)
+	{
+		ret = deflate(&stream, (chunk->last) ? Z_FINISH : Z_SYNC_FLUSH);
+
+		if (ret == Z_STREAM_END || (ret == Z_OK && !chunk->last && stream.avail_out > 0))
+			break;
+
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+		{
+			g_free(chunk->data);
+			chunk->data = NULL;
+			break;
+		}
+
+		capacity *= 2;
+		chunk->data = g_realloc(chunk->data, capacity);
+		stream.next_out = chunk->data + stream.total_out;
+		stream.avail_out = capacity - stream.total_out;
+	}
+
+	chunk->data_length = stream.total_out;
+	deflateEnd(&stream);
+
+	return NULL;
+}
+
+static gboolean
+write_chunk(FILE *fp, const gchar *type, const guchar *data, gsize length)
+{
+	guchar head[8];
+	guchar tail[4];
+	uLong crc;
+
+	head[0] = (length >> 24) & 0xff;
+	head[1] = (length >> 16) & 0xff;
+	head[2] = (length >> 8) & 0xff;
+	head[3] = length & 0xff;
+	memcpy(head + 4, type, 4);
+
+	crc = crc32(crc32(0L, Z_NULL, 0), head + 4, 4);
+	if (length > 0)
+		crc = crc32(crc, data, length);
+
+	tail[0] = (crc >> 24) & 0xff;
+	tail[1] = (crc >> 16) & 0xff;
+	tail[2] = (crc >> 8) & 0xff;
+	tail[3] = crc & 0xff;
+
+	return (fwrite(head, 8, 1, fp) == 1
+		&& (length == 0 || fwrite(data, length, 1, fp) == 1)
+		&& fwrite(tail, 4, 1, fp) == 1);
+}
+
+/* Writes the image data as IDAT chunks. Every strip is filtered and deflated
+ * in independent pieces on the worker pool, each primed with the 32KB before
+ * it, and the pieces are joined into one zlib stream */
+static gboolean
+write_image(RSPngfile *pngfile, RSFilter *filter, RSFilterRequest *request, FILE *fp, gint width, gint height)
+{
+	const gint bytes_per_pixel = (pngfile->save16bit) ? 6 : 3;
+	const gsize row_bytes = width * bytes_per_pixel;
+	const gint chunk_rows = MAX(1, CHUNK_SIZE / (row_bytes + 1));
+	const gint threads = (pngfile->encoder_threads > 0) ? pngfile->encoder_threads : rs_get_number_of_processor_cores();
+	const gint strip_rows = chunk_rows * threads;
+	GObject *complete = NULL;
+	GObject *source;
+	GdkRectangle strip;
+	GByteArray *idat = g_byte_array_new();
+	Chunk *chunks = g_new0(Chunk, threads);
+	guchar *filtered = g_malloc(DICT_SIZE + strip_rows * (row_bytes + 1));
+	guchar *prior = g_malloc(row_bytes);
+	uLong adler = adler32(0L, Z_NULL, 0);
+	gsize history = 0;
+	guchar header[2];
+	gint strip_y, flevel, n, i;
+	gboolean ret = TRUE;
+
+	/* zlib header for a 32KB window, FLEVEL is only informative */
+	if (pngfile->compression_level < 2)
+		flevel = 0;
+	else if (pngfile->compression_level < 6)
+		flevel = 1;
+	else if (pngfile->compression_level == 6)
+		flevel = 2;
+	else
+		flevel = 3;
+	header[0] = 0x78;
+	header[1] = flevel << 6;
+	if ((header[0] * 256 + header[1]) % 31)
+		header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+	g_byte_array_append(idat, header, 2);
+
+	strip.x = 0;
+	strip.width = width;
+	for(strip.y = 0; ret && strip.y < height; strip.y += strip_rows)
+	{
+		gsize offset = 0;
+
+		strip.height = MIN(strip_rows, height - strip.y);
+
+		source = rs_output_get_strip(filter, request, pngfile->save16bit, width, height, &strip, &strip_y, &complete);
+		if (!source)
+		{
+			ret = FALSE;
+			break;
+		}
+
+		n = (strip.height + chunk_rows - 1) / chunk_rows;
+		for(i = 0; i < n; i++)
+		{
+			Chunk *chunk = &chunks[i];
+
+			chunk->image = (pngfile->save16bit) ? RS_IMAGE16(source) : NULL;
+			chunk->pixbuf = (pngfile->save16bit) ? NULL : GDK_PIXBUF(source);
+			chunk->source_y = strip_y;
+			chunk->strip_y = strip.y;
+			chunk->prior = (strip.y > 0) ? prior : NULL;
+			chunk->y = strip.y + i * chunk_rows;
+			chunk->rows = MIN(chunk_rows, strip.y + strip.height - chunk->y);
+			chunk->width = width;
+			chunk->bytes_per_pixel = bytes_per_pixel;
+			chunk->level = pngfile->compression_level;
+			chunk->last = (chunk->y + chunk->rows == height);
+			chunk->filtered = filtered + DICT_SIZE + offset;
+			chunk->length = chunk->rows * (row_bytes + 1);
+			chunk->dictionary_length = MIN(DICT_SIZE, history + offset);
+			chunk->dictionary = chunk->filtered - chunk->dictionary_length;
+			offset += chunk->length;
+		}
+
+		/* Deflate needs the filtered data before a chunk as dictionary */
+		rs_worker_pool_run(chunks, sizeof(Chunk), n, filter_chunk);
+		rs_worker_pool_run(chunks, sizeof(Chunk), n, compress_chunk);
+
+		/* Keep what the next strip needs from this one */
+		pack_row(&chunks[n-1], strip.y + strip.height - 1, prior);
+		history = MIN(DICT_SIZE, history + offset);
+		memmove(filtered + DICT_SIZE - history, filtered + DICT_SIZE + offset - history, history);
+		g_object_unref(source);
+
+		/* One IDAT per chunk keeps the file independent of the thread count */
+		rs_io_lock();
+		for(i = 0; i < n; i++)
+		{
+			if (chunks[i].data)
+			{
+				g_byte_array_append(idat, chunks[i].data, chunks[i].data_length);
+				adler = adler32_combine(adler, chunks[i].adler, chunks[i].length);
+			}
+			else
+				ret = FALSE;
+			g_free(chunks[i].data);
+
+			if (chunks[i].last)
+			{
+				guchar trailer[4] = { (adler >> 24) & 0xff, (adler >> 16) & 0xff, (adler >> 8) & 0xff, adler & 0xff };
+				g_byte_array_append(idat, trailer, 4);
+			}
+
+			ret = ret && write_chunk(fp, "IDAT", idat->data, idat->len);
+			g_byte_array_set_size(idat, 0);
+		}
+		rs_io_unlock();
+	}
+
+	if (ret)
+	{
+		rs_io_lock();
+		ret = write_chunk(fp, "IEND", NULL, 0);
+		rs_io_unlock();
+	}
+
+	if (complete)
+		g_object_unref(complete);
+	g_free(prior);
+	g_free(filtered);
+	g_free(chunks);
+	g_byte_array_free(idat, TRUE);
+
+	return ret;
+}
+
 static gboolean
 execute(RSOutput *output, RSFilter *filter)
 {
 	RSPngfile *pngfile = RS_PNGFILE(output);
-	png_bytep *row_pointers;
+	RSFilterRequest *request;
+	GHashTable *tile_cache;
+	gint width, height;
+	gboolean ret;
+
+	request = rs_filter_request_new();
+	rs_filter_request_set_quick(RS_FILTER_REQUEST(request), pngfile->quick);
+	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", pngfile->color_space);
+	/* Ask for images covering only the strip, not the complete image */
+	rs_filter_param_set_boolean(RS_FILTER_PARAM(request), "crop-to-roi", TRUE);
+
+	if (!rs_filter_get_size_simple(filter, request, &width, &height) || width < 1 || height < 1)
+	{
+		g_object_unref(request);
+		return FALSE;
+	}
+
 	FILE *fp = fopen(pngfile->filename, "wb");
 	if (!fp)
-	  return FALSE;
+	{
+		g_object_unref(request);
+		return FALSE;
+	}
 
 	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, (png_voidp)NULL, NULL, NULL);
 
 	if (!png_ptr)
+	{
+		g_object_unref(request);
+		fclose(fp);
 		return FALSE;
+	}
 
 	png_infop info_ptr = png_create_info_struct(png_ptr);
 	if (!info_ptr)
 	{
 		png_destroy_write_struct(&png_ptr,(png_infopp)NULL);
-       return FALSE;
-    }
+		g_object_unref(request);
+		fclose(fp);
+		return FALSE;
+	}
 
+	/* libpng only writes the chunks before the image data */
 	png_init_io(png_ptr, fp);
-	/* set the zlib compression level */
-	png_set_compression_level(png_ptr, Z_DEFAULT_COMPRESSION);
-
 
 	if (pngfile->color_space == rs_color_space_new_singleton("RSSrgb") && !pngfile->save16bit)
 	{
@@ -217,85 +639,36 @@ execute(RSOutput *output, RSFilter *filter)
 			png_set_gAMA(png_ptr, info_ptr, 1.0);
 	}
 
-	RSFilterResponse *response;
-	RSFilterRequest *request = rs_filter_request_new();
-	rs_filter_request_set_quick(RS_FILTER_REQUEST(request), pngfile->quick);
-	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", pngfile->color_space);
-
-	if (pngfile->save16bit)
-	{
-		response = rs_filter_get_image(filter, request);
-		RS_IMAGE16 *image = rs_filter_response_get_image(response);
-
-		gint n_channels = image->pixelsize;
-		gint width = image->w;
-		gint height = image->h;
-
-		png_set_IHDR(png_ptr, info_ptr, width, height,
-					16, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-					PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-		png_write_info(png_ptr, info_ptr);
-
-		row_pointers = g_malloc(sizeof(png_bytep*)*height);
-		gint i;
-		for( i = 0; i < height; i++)
-			row_pointers[i] = (png_bytep)GET_PIXEL(image, 0, i);
-
-		if (n_channels == 4)
-			png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
-#ifdef G_BIG_ENDIAN
-		png_set_swap(png_ptr);
-#endif
-		rs_io_lock();
-		png_write_image(png_ptr, row_pointers);
-		g_object_unref(image);
-	}
-	else  // 8 bit
-	{
-		response = rs_filter_get_image8(filter, request);
-		GdkPixbuf *pixbuf = rs_filter_response_get_image8(response);
-
-		gint n_channels = gdk_pixbuf_get_n_channels (pixbuf);
-		gint width = gdk_pixbuf_get_width (pixbuf);
-		gint height = gdk_pixbuf_get_height (pixbuf);
-		gint rowstride = gdk_pixbuf_get_rowstride (pixbuf);
-		guchar* pixels = gdk_pixbuf_get_pixels (pixbuf);
+	png_set_IHDR(png_ptr, info_ptr, width, height,
+		(pngfile->save16bit) ? 16 : 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
-		png_set_IHDR(png_ptr, info_ptr, width, height,
-			8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-		png_write_info(png_ptr, info_ptr);
+	rs_io_lock();
+	png_write_info(png_ptr, info_ptr);
+	rs_io_unlock();
 
-		row_pointers = g_malloc(sizeof(png_bytep*)*height);
-		gint i;
-		for( i = 0; i < height; i++)
-			row_pointers[i] = (png_bytep)(pixels + i * rowstride);
+	/* Filters needing their complete input are rendered once for all strips */
+	tile_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_object_unref);
+	rs_filter_request_set_tile_cache(request, tile_cache);
+	g_hash_table_unref(tile_cache);
 
-		if (n_channels == 4)
-			png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
-		
-		rs_io_lock();
-		png_write_image(png_ptr, row_pointers);
-		g_object_unref(pixbuf);
-	}
+	ret = write_image(pngfile, filter, request, fp, width, height);
 
-	png_write_end(png_ptr, NULL);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
 	fclose(fp);
 	g_object_unref(request);
-	g_object_unref(response);
-	g_free(row_pointers);
+
+	if (!ret)
+		return FALSE;
 
 	gchar *input_filename = NULL;
 	rs_filter_get_recursive(filter, "filename", &input_filename, NULL);
 
+	rs_io_lock();
 	if (pngfile->copy_metadata)
 		rs_exif_copy(input_filename, pngfile->filename, G_OBJECT_TYPE_NAME(pngfile->color_space), RS_EXIF_FILE_TYPE_PNG);
 	else
 		rs_exif_add_colorspace(pngfile->filename, G_OBJECT_TYPE_NAME(pngfile->color_space), RS_EXIF_FILE_TYPE_PNG);
-
 	rs_io_unlock();
 	g_free(input_filename);
 
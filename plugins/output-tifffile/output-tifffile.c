@@ -20,8 +20,15 @@
 #include "config.h"
 #include <rawstudio.h>
 #include <tiffio.h>
+#include <zlib.h>
+#include <string.h>
 #include <gettext.h>
 
+/* Tiles are square, and must be a multiple of 16 */
+#define TILE_SIZE (256)
+
+#define ZIP_QUALITY (9)
+
 #define RS_TYPE_TIFFFILE (rs_tifffile_type)
 #define RS_TIFFFILE(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_TIFFFILE, RSTifffile))
 #define RS_TIFFFILE_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), RS_TYPE_TIFFFILE, RSTifffileClass))
@@ -38,6 +45,7 @@ struct _RSTifffile {
 	gboolean save16bit;
 	RSColorSpace *color_space;
 	gboolean copy_metadata;
+	gboolean tiled;
 };
 
 struct _RSTifffileClass {
@@ -52,7 +60,8 @@ enum {
 	PROP_UNCOMPRESSED,
 	PROP_16BIT,
 	PROP_METADATA,
-	PROP_COLORSPACE
+	PROP_COLORSPACE,
+	PROP_TILED
 };
 
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
@@ -103,6 +112,12 @@ rs_tifffile_class_init(RSTifffileClass *klass)
 			RS_TYPE_COLOR_SPACE, G_PARAM_READWRITE)
 	);
 
+	g_object_class_install_property(object_class,
+		PROP_TILED, g_param_spec_boolean(
+			"tiled", "Tiled TIFF", _("Save tiled TIFF, compressed using all cores"),
+			FALSE, G_PARAM_READWRITE)
+	);
+
 	output_class->execute = execute;
 	output_class->extension = "tif";
 	output_class->display_name = _("TIFF (Tagged Image File Format)");
@@ -115,6 +130,7 @@ rs_tifffile_init(RSTifffile *tifffile)
 	tifffile->uncompressed = FALSE;
 	tifffile->save16bit = FALSE;
 	tifffile->copy_metadata = TRUE;
+	tifffile->tiled = FALSE;
 	tifffile->color_space = rs_color_space_new_singleton("RSSrgb");
 }
 
@@ -140,6 +156,9 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 		case PROP_METADATA:
 			g_value_set_boolean(value, tifffile->copy_metadata);
 			break;
+		case PROP_TILED:
+			g_value_set_boolean(value, tifffile->tiled);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -169,15 +188,18 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 		case PROP_METADATA:
 			tifffile->copy_metadata = g_value_get_boolean(value);
 			break;
+		case PROP_TILED:
+			tifffile->tiled = g_value_get_boolean(value);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
 }
 
-static void rs_tiff_generic_init(TIFF *output, guint w, guint h, const guint samples_per_pixel, const RSIccProfile *profile, gboolean uncompressed);
+static void rs_tiff_generic_init(TIFF *output, guint w, guint h, const guint samples_per_pixel, const RSIccProfile *profile, gboolean uncompressed, gboolean tiled);
 
 static void
-rs_tiff_generic_init(TIFF *output, guint w, guint h, const guint samples_per_pixel, const RSIccProfile *profile, gboolean uncompressed)
+rs_tiff_generic_init(TIFF *output, guint w, guint h, const guint samples_per_pixel, const RSIccProfile *profile, gboolean uncompressed, gboolean tiled)
 {
 	TIFFSetField(output, TIFFTAG_IMAGEWIDTH, w);
 	TIFFSetField(output, TIFFTAG_IMAGELENGTH, h);
@@ -190,7 +212,7 @@ rs_tiff_generic_init(TIFF *output, guint w, guint h, const guint samples_per_pix
 	else
 	{
 		TIFFSetField(output, TIFFTAG_COMPRESSION, COMPRESSION_DEFLATE);
-		TIFFSetField(output, TIFFTAG_ZIPQUALITY, 9);
+		TIFFSetField(output, TIFFTAG_ZIPQUALITY, ZIP_QUALITY);
 	}
 
 	if (profile)
@@ -205,7 +227,174 @@ rs_tiff_generic_init(TIFF *output, guint w, guint h, const guint samples_per_pix
 		}
 
 	}
-	TIFFSetField(output, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(output, 0));
+	if (tiled)
+	{
+		TIFFSetField(output, TIFFTAG_TILEWIDTH, TILE_SIZE);
+		TIFFSetField(output, TIFFTAG_TILELENGTH, TILE_SIZE);
+	}
+	else
+		TIFFSetField(output, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(output, 0));
+}
+
+typedef struct {
+	/* Source, only one of image and pixbuf is set */
+	RS_IMAGE16 *image;
+	GdkPixbuf *pixbuf;
+	gint x;
+	gint y;
+	gint width;
+	gint height;
+	gboolean uncompressed;
+
+	/* Result, data is NULL if compression failed */
+	guchar *data;
+	gsize length;
+} Tile;
+
+/* Packs a tile to RGB and deflates it. Everything outside the image is left
+ * black, libtiff wants complete tiles */
+static gpointer
+compress_tile(gpointer data)
+{
+	Tile *tile = data;
+	const gint bytes_per_sample = (tile->image) ? 2 : 1;
+	const gsize row_bytes = TILE_SIZE * 3 * bytes_per_sample;
+	const gsize tile_bytes = row_bytes * TILE_SIZE;
+	guchar *raw = g_malloc0(tile_bytes);
+	gint row, col;
+
+	for(row = 0; row < tile->height; row++)
+	{
+		if (tile->image)
+		{
+			const gint pixelsize = tile->image->pixelsize;
+			gushort *in = GET_PIXEL(tile->image, tile->x, tile->y + row);
+			gushort *out = (gushort *) (raw + row * row_bytes);
+			for(col = 0; col < tile->width; col++)
+			{
+				out[col*3 + R] = in[col*pixelsize + R];
+				out[col*3 + G] = in[col*pixelsize + G];
+				out[col*3 + B] = in[col*pixelsize + B];
+			}
+		}
+		else
+		{
+			const gint channels = gdk_pixbuf_get_n_channels(tile->pixbuf);
+			guchar *in = GET_PIXBUF_PIXEL(tile->pixbuf, tile->x, tile->y + row);
+			guchar *out = raw + row * row_bytes;
+			for(col = 0; col < tile->width; col++)
+			{
+				out[col*3 + R] = in[col*channels + R];
+				out[col*3 + G] = in[col*channels + G];
+				out[col*3 + B] = in[col*channels + B];
+			}
+		}
+	}
+
+	if (tile->uncompressed)
+	{
+		tile->data = raw;
+		tile->length = tile_bytes;
+		return NULL;
+	}
+
+	/* A raw zlib stream is exactly what COMPRESSION_DEFLATE stores */
+	uLongf length = compressBound(tile_bytes);
+	tile->data = g_malloc(length);
+	if (compress2(tile->data, &length, raw, tile_bytes, ZIP_QUALITY) == Z_OK)
+		tile->length = length;
+	else
+	{
+		g_free(tile->data);
+		tile->data = NULL;
+	}
+	g_free(raw);
+
+	return NULL;
+}
+
+/* Writes the image as TILE_SIZE square tiles. The chain is pulled one row of
+ * tiles at a time, and the tiles of each row are compressed in parallel */
+static gboolean
+execute_tiled(RSTifffile *tifffile, TIFF *tiff, RSFilter *filter, RSFilterRequest *request, const RSIccProfile *profile)
+{
+	GHashTable *tile_cache;
+	GObject *complete = NULL;
+	GObject *source;
+	GdkRectangle strip;
+	Tile *tiles;
+	gint width, height, tiles_across;
+	gint strip_y, i;
+	gboolean ret = TRUE;
+
+	/* Ask for images covering only the strip, not the complete image */
+	rs_filter_param_set_boolean(RS_FILTER_PARAM(request), "crop-to-roi", TRUE);
+
+	if (!rs_filter_get_size_simple(filter, request, &width, &height) || width < 1 || height < 1)
+		return FALSE;
+
+	/* Filters needing their complete input are rendered once for all strips */
+	tile_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_object_unref);
+	rs_filter_request_set_tile_cache(request, tile_cache);
+	g_hash_table_unref(tile_cache);
+
+	rs_tiff_generic_init(tiff, width, height, 3, profile, tifffile->uncompressed, TRUE);
+	TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, (tifffile->save16bit) ? 16 : 8);
+
+	tiles_across = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tiles = g_new0(Tile, tiles_across);
+
+	strip.x = 0;
+	strip.width = width;
+	for(strip.y = 0; ret && strip.y < height; strip.y += TILE_SIZE)
+	{
+		strip.height = MIN(TILE_SIZE, height - strip.y);
+
+		source = rs_output_get_strip(filter, request, tifffile->save16bit, width, height, &strip, &strip_y, &complete);
+		if (!source)
+		{
+			ret = FALSE;
+			break;
+		}
+
+		for(i = 0; i < tiles_across; i++)
+		{
+			tiles[i].image = (tifffile->save16bit) ? RS_IMAGE16(source) : NULL;
+			tiles[i].pixbuf = (tifffile->save16bit) ? NULL : GDK_PIXBUF(source);
+			tiles[i].x = i * TILE_SIZE;
+			tiles[i].y = strip.y - strip_y;
+			tiles[i].width = MIN(TILE_SIZE, width - tiles[i].x);
+			tiles[i].height = strip.height;
+			tiles[i].uncompressed = tifffile->uncompressed;
+			tiles[i].data = NULL;
+		}
+
+		rs_worker_pool_run(tiles, sizeof(Tile), tiles_across, compress_tile);
+
+		/* Tiles are written in order, keeping the file layout sequential */
+		rs_io_lock();
+		for(i = 0; i < tiles_across; i++)
+		{
+			if (ret && tiles[i].data)
+			{
+				ttile_t index = TIFFComputeTile(tiff, tiles[i].x, strip.y, 0, 0);
+				if (TIFFWriteRawTile(tiff, index, tiles[i].data, tiles[i].length) < 0)
+					ret = FALSE;
+			}
+			else
+				ret = FALSE;
+			g_free(tiles[i].data);
+		}
+		rs_io_unlock();
+
+		g_object_unref(source);
+	}
+
+	if (complete)
+		g_object_unref(complete);
+	g_free(tiles);
+
+	return ret;
 }
 
 static gboolean
@@ -227,19 +416,28 @@ execute(RSOutput *output, RSFilter *filter)
 	rs_filter_request_set_quick(request, FALSE);
 	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", tifffile->color_space);
 
-	if (tifffile->save16bit)
+	if (tifffile->tiled)
+	{
+		if (!execute_tiled(tifffile, tiff, filter, request, profile))
+		{
+			g_object_unref(request);
+			TIFFClose(tiff);
+			return FALSE;
+		}
+		rs_io_lock();
+	}
+	else if (tifffile->save16bit)
 	{
 		gint col;
 		response = rs_filter_get_image(filter, request);
 		RS_IMAGE16 *image = rs_filter_response_get_image(response);
-		rs_tiff_generic_init(tiff, image->w, image->h, 3, profile, tifffile->uncompressed);
+		rs_tiff_generic_init(tiff, image->w, image->h, 3, profile, tifffile->uncompressed, FALSE);
 		gushort *line = g_new(gushort, image->w*3);
 
 		g_return_val_if_fail(image->channels == 3, FALSE);
 		g_return_val_if_fail(image->pixelsize == 4, FALSE);
 
 		TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 16);
-		printf("pixelsize: %d\n", image->pixelsize);
 		rs_io_lock();
 		for(row=0;row<image->h;row++)
 		{
@@ -265,7 +463,7 @@ execute(RSOutput *output, RSFilter *filter)
 		gint width = gdk_pixbuf_get_width(pixbuf);
 		gint height = gdk_pixbuf_get_height(pixbuf);
 		gint input_channels = gdk_pixbuf_get_n_channels(pixbuf);
-		rs_tiff_generic_init(tiff, width, height, 3, profile, tifffile->uncompressed);
+		rs_tiff_generic_init(tiff, width, height, 3, profile, tifffile->uncompressed, FALSE);
 		gchar *line = g_new(gchar, width * 3);
 
 		TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 8);
@@ -43,6 +43,7 @@ struct _RSResample {
 	gfloat scale;
 	gboolean bounding_box;
 	gboolean never_quick;
+	gboolean allow_binning;
 };
 
 struct _RSResampleClass {
@@ -58,7 +59,6 @@ typedef struct {
 	guint dest_end_other;		/* Where in the unchanged direction should we stop writing? */
 	guint (*resample_support)(void);
 	gfloat (*resample_func)(gfloat);
-	GThread *threadid;
 	gboolean use_compatible;	/* Use compatible resampler if pixelsize != 4 */
 	gboolean use_fast;		/* Use nearest neighbour resampler, also compatible*/
 } ResampleInfo;
@@ -71,15 +71,20 @@ enum {
 	PROP_HEIGHT,
 	PROP_BOUNDING_BOX,
 	PROP_NEVER_QUICK,
-	PROP_SCALE
+	PROP_SCALE,
+	PROP_ALLOW_BINNING
 };
 
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
-static void previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask);
+static void previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask, const GdkRectangle *region);
+static gboolean map_changed_region(RSFilter *filter, GdkRectangle *region);
 static RSFilterChangedMask recalculate_dimensions(RSResample *resample);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
+static gint get_margin(RSFilter *filter, const RSFilterRequest *request);
 static RSFilterResponse *get_size(RSFilter *filter, const RSFilterRequest *request);
+static guint lanczos_taps(void);
+static gboolean get_output_size(RSResample *resample, const RSFilterRequest *request, gint *width, gint *height);
 static void ResizeH(ResampleInfo *info);
 void ResizeV(ResampleInfo *info);
 extern void ResizeV_SSE2(ResampleInfo *info);
@@ -136,11 +141,18 @@ rs_resample_class_init(RSResampleClass *klass)
 			"never-quick", "never-quick", "Never use quick function, even if allowed by request",
 			FALSE, G_PARAM_READWRITE)
 	);
+	g_object_class_install_property(object_class,
+		PROP_ALLOW_BINNING, g_param_spec_boolean(
+			"allow-binning", "allow-binning", "Let demosaic bin 2x2 or 4x4 when scaling down by half or more, for previews",
+			FALSE, G_PARAM_READWRITE)
+	);
 
 	filter_class->name = "Resample filter";
 	filter_class->get_image = get_image;
 	filter_class->get_size = get_size;
+	filter_class->get_margin = get_margin;
 	filter_class->previous_changed = previous_changed;
+	filter_class->map_changed_region = map_changed_region;
 }
 
 static void
@@ -153,6 +165,7 @@ rs_resample_init(RSResample *resample)
 	resample->bounding_box = FALSE;
 	resample->scale = 1.0;
 	resample->never_quick = FALSE;
+	resample->allow_binning = FALSE;
 }
 
 static void
@@ -177,6 +190,9 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 		case PROP_SCALE:
 			g_value_set_float(value, resample->scale);
 			break;
+		case PROP_ALLOW_BINNING:
+			g_value_set_boolean(value, resample->allow_binning);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -220,6 +236,13 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 				mask |= RS_FILTER_CHANGED_PIXELDATA;
 			}
 			break;
+		case PROP_ALLOW_BINNING:
+			if (g_value_get_boolean(value) != resample->allow_binning)
+			{
+				resample->allow_binning = g_value_get_boolean(value);
+				mask |= RS_FILTER_CHANGED_PIXELDATA;
+			}
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -230,12 +253,54 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 }
 
 static void
-previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask)
+previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask, const GdkRectangle *region)
 {
 	if (mask & RS_FILTER_CHANGED_DIMENSION)
 		mask |= recalculate_dimensions(RS_RESAMPLE(filter));
 
-	rs_filter_changed(filter, mask);
+	rs_filter_changed_region(filter, mask, region);
+}
+
+static gboolean
+map_changed_region(RSFilter *filter, GdkRectangle *region)
+{
+	RSResample *resample = RS_RESAMPLE(filter);
+	gint previous_width, previous_height;
+	gfloat scale_x, scale_y, support_x, support_y;
+	GdkRectangle output;
+	gint x2, y2;
+
+	if ((resample->new_width < 0) || (resample->new_height < 0))
+		return FALSE;
+
+	if (!rs_filter_get_size_simple(filter->previous, RS_FILTER_REQUEST_QUICK, &previous_width, &previous_height))
+		return FALSE;
+
+	if ((previous_width <= 0) || (previous_height <= 0))
+		return FALSE;
+
+	scale_x = (gfloat) resample->new_width / previous_width;
+	scale_y = (gfloat) resample->new_height / previous_height;
+
+	/* Every output pixel depends on the input pixels within the filter support */
+	support_x = lanczos_taps() / MIN(scale_x, 1.0f);
+	support_y = lanczos_taps() / MIN(scale_y, 1.0f);
+
+	x2 = (gint) ceilf((region->x + region->width + support_x) * scale_x) + 1;
+	y2 = (gint) ceilf((region->y + region->height + support_y) * scale_y) + 1;
+	region->x = (gint) floorf((region->x - support_x) * scale_x) - 1;
+	region->y = (gint) floorf((region->y - support_y) * scale_y) - 1;
+	region->width = x2 - region->x;
+	region->height = y2 - region->y;
+
+	output.x = 0;
+	output.y = 0;
+	output.width = resample->new_width;
+	output.height = resample->new_height;
+	if (!gdk_rectangle_intersect(region, &output, region))
+		region->width = region->height = 0;
+
+	return TRUE;
 }
 
 static RSFilterChangedMask
@@ -314,14 +379,12 @@ start_thread_resampler(gpointer _thread_info)
 	if (!t->input)
 	{
 		g_debug("Resampler: input is NULL");
-		g_thread_exit(NULL);
 		return NULL;
 	}
 
 	if (!t->output)
 	{
 		g_debug("Resampler: output is NULL");
-		g_thread_exit(NULL);
 		return NULL;
 	}
 
@@ -357,9 +420,47 @@ start_thread_resampler(gpointer _thread_info)
 		bit_blt((char*)GET_PIXEL(t->output,0,0), t->output->rowstride * 2, 
 			(const char*)GET_PIXEL(t->input,0,0), t->input->rowstride * 2, t->input->rowstride * 2, t->input->h);
 
-	g_thread_exit(NULL);
+	return NULL;
+}
+
+/* The output size, reduced by the "preview-scale" request parameter if set */
+static gboolean
+get_output_size(RSResample *resample, const RSFilterRequest *request, gint *width, gint *height)
+{
+	gfloat preview_scale = 1.0f;
+
+	if ((resample->new_width == -1) || (resample->new_height == -1))
+		return FALSE;
+
+	*width = resample->new_width;
+	*height = resample->new_height;
+
+	if (rs_filter_param_get_float(RS_FILTER_PARAM(request), "preview-scale", &preview_scale) && (preview_scale > 0.0f) && (preview_scale < 1.0f))
+	{
+		*width = MAX(1, (gint) (*width * preview_scale + 0.5f));
+		*height = MAX(1, (gint) (*height * preview_scale + 0.5f));
+	}
 
-	return NULL; /* Make the compiler shut up - we'll never return */
+	return TRUE;
+}
+
+static gint
+get_margin(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSResample *resample = RS_RESAMPLE(filter);
+	gint input_width;
+	gint input_height;
+	gint new_width, new_height;
+
+	if (!get_output_size(resample, request, &new_width, &new_height))
+		return 0;
+
+	rs_filter_get_size_simple(filter->previous, request, &input_width, &input_height);
+	if ((input_width == new_width) && (input_height == new_height))
+		return 0;
+
+	/* ROI is removed when resampling, we always need the complete input */
+	return RS_FILTER_MARGIN_FULL;
 }
 
 static RSFilterResponse *
@@ -374,22 +475,44 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	RS_IMAGE16 *output = NULL;
 	gint input_width;
 	gint input_height;
+	gint new_width, new_height;
+	gfloat preview_scale;
+	gint binning = 1;
+	gint downstream_binning;
 
 	rs_filter_get_size_simple(filter->previous, request, &input_width, &input_height);
 
 	/* Return the input, if the new size is uninitialized */
-	if ((resample->new_width == -1) || (resample->new_height == -1))
+	if (!get_output_size(resample, request, &new_width, &new_height))
 		return rs_filter_get_image(filter->previous, request);
 
 	/* Simply return the input, if we don't scale */
-	if ((input_width == resample->new_width) && (input_height == resample->new_height))
+	if ((input_width == new_width) && (input_height == new_height))
 		return rs_filter_get_image(filter->previous, request);	
 	
-	/* Remove ROI, it doesn't make sense across resampler */
-	if (rs_filter_request_get_roi(request))
+	/* When scaling down by half or more, demosaic can average 2x2 or 4x4
+	 * blocks instead of interpolating pixels we would throw away. Binning
+	 * asked for by a later resampler is relative to our output, not input */
+	if (resample->allow_binning)
+	{
+		gfloat scale = MAX((gfloat) new_width / input_width, (gfloat) new_height / input_height);
+		if (scale <= 0.25f)
+			binning = 4;
+		else if (scale <= 0.5f)
+			binning = 2;
+	}
+
+	/* Remove ROI, it doesn't make sense across resampler. The preview scale
+	 * is applied here, filters before us should not see it */
+	if (rs_filter_request_get_roi(request) || rs_filter_param_get_float(RS_FILTER_PARAM(request), "preview-scale", &preview_scale)
+		|| binning > 1 || rs_filter_param_get_integer(RS_FILTER_PARAM(request), "demosaic-binning", &downstream_binning))
 	{
 		RSFilterRequest *new_request = rs_filter_request_clone(request);
 		rs_filter_request_set_roi(new_request, NULL);
+		rs_filter_param_delete(RS_FILTER_PARAM(new_request), "preview-scale");
+		rs_filter_param_delete(RS_FILTER_PARAM(new_request), "demosaic-binning");
+		if (binning > 1)
+			rs_filter_param_set_integer(RS_FILTER_PARAM(new_request), "demosaic-binning", binning);
 		previous_response = rs_filter_get_image(filter->previous, new_request);
 		g_object_unref(new_request);
 	}
@@ -427,7 +550,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	ResampleInfo* v_resample = g_new(ResampleInfo,  threads);
 
 	/* Create intermediate and output images*/
-	afterVertical = rs_image16_new(input_width, resample->new_height, input->channels, input->pixelsize);
+	afterVertical = rs_image16_new(input_width, new_height, input->channels, input->pixelsize);
 
 	// Only even count
 	guint output_x_per_thread = ((input_width + threads - 1 ) / threads );
@@ -443,32 +566,28 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		v->input = input;
 		v->output  = afterVertical;
 		v->old_size = input_height;
-		v->new_size = resample->new_height;
+		v->new_size = new_height;
 		v->dest_offset_other = output_x_offset;
 		v->dest_end_other  = MIN(output_x_offset + output_x_per_thread, input_width);
 		v->use_compatible = use_compatible;
 		v->use_fast = use_fast;
 
-		/* Start it up */
-		v->threadid = g_thread_new("RSResample worker (vertical)", start_thread_resampler, v);
-
 		/* Update offset */
 		output_x_offset = v->dest_end_other;
 	}
 
-	/* Wait for vertical threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(v_resample[i].threadid);
+	/* Run vertical resamplers and wait for them to finish */
+	rs_worker_pool_run(v_resample, sizeof(ResampleInfo), threads, start_thread_resampler);
 
 	/* input no longer needed */
 	g_object_unref(input);
 	input = NULL;
 
 	/* create output */
-	output = rs_image16_new(resample->new_width,  resample->new_height, afterVertical->channels, afterVertical->pixelsize);
+	output = rs_image16_new(new_width, new_height, afterVertical->channels, afterVertical->pixelsize);
 
 	guint input_y_offset = 0;
-	guint input_y_per_thread = (resample->new_height+threads-1) / threads;
+	guint input_y_per_thread = (new_height+threads-1) / threads;
 
 	for (i = 0; i < threads; i++)
 	{
@@ -477,23 +596,19 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		h->input = afterVertical;
 		h->output  = output;
 		h->old_size = input_width;
-		h->new_size = resample->new_width;
+		h->new_size = new_width;
 		h->dest_offset_other = input_y_offset;
-		h->dest_end_other  = MIN(input_y_offset+input_y_per_thread, resample->new_height);
+		h->dest_end_other  = MIN(input_y_offset+input_y_per_thread, new_height);
 		h->use_compatible = use_compatible;
 		h->use_fast = use_fast;
 
-		/* Start it up */
-		h->threadid = g_thread_new("RSResample worker (horizontal)", start_thread_resampler, h);
-
 		/* Update offset */
 		input_y_offset = h->dest_end_other;
 
 	}
 
-	/* Wait for horizontal threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(h_resample[i].threadid);
+	/* Run horizontal resamplers and wait for them to finish */
+	rs_worker_pool_run(h_resample, sizeof(ResampleInfo), threads, start_thread_resampler);
 
 	/* Clean up */
 	g_free(h_resample);
@@ -502,6 +617,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 
 	rs_filter_response_set_image(response, output);
 	rs_filter_param_set_boolean(RS_FILTER_PARAM(response), "half-size", FALSE);
+	rs_filter_param_delete(RS_FILTER_PARAM(response), "demosaic-binning");
 	g_object_unref(output);
 	g_rec_mutex_unlock(&resampler_mutex);
 	return response;
@@ -512,15 +628,16 @@ get_size(RSFilter *filter, const RSFilterRequest *request)
 {
 	RSResample *resample = RS_RESAMPLE(filter);
 	RSFilterResponse *previous_response = rs_filter_get_size(filter->previous, request);
+	gint new_width, new_height;
 
-	if ((resample->new_width == -1) || (resample->new_height == -1))
+	if (!get_output_size(resample, request, &new_width, &new_height))
 		return previous_response;
 
 	RSFilterResponse *response = rs_filter_response_clone(previous_response);
 	g_object_unref(previous_response);
 
-	rs_filter_response_set_width(response, resample->new_width);
-	rs_filter_response_set_height(response, resample->new_height);
+	rs_filter_response_set_width(response, new_width);
+	rs_filter_response_set_height(response, new_height);
 
 	return response;
 }
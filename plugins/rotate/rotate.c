@@ -60,7 +60,6 @@ typedef struct {
 	RS_IMAGE16 *output;			/* Output Image*/
 	gint start_y;
 	gint end_y;
-	GThread *threadid;
 	gboolean use_straight;
 	RSRotate* rotate;
 	gboolean use_fast;		/* Use nearest neighbour resampler */
@@ -69,8 +68,10 @@ typedef struct {
 
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
-static void previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask);
+static void previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask, const GdkRectangle *region);
+static gboolean map_changed_region(RSFilter *filter, GdkRectangle *region);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
+static gint get_margin(RSFilter *filter, const RSFilterRequest *request);
 static void turn_right_angle(RS_IMAGE16 *in, RS_IMAGE16 *out, gint start_y, gint end_y, const int direction);
 static RSFilterResponse *get_size(RSFilter *filter, const RSFilterRequest *request);
 static void inline bilinear(RS_IMAGE16 *in, gushort *out, gint x, gint y);
@@ -111,8 +112,10 @@ rs_rotate_class_init(RSRotateClass *klass)
 
 	filter_class->name = "Bilinear rotate filter";
 	filter_class->previous_changed = previous_changed;
+	filter_class->map_changed_region = map_changed_region;
 	filter_class->get_image = get_image;
 	filter_class->get_size = get_size;
+	filter_class->get_margin = get_margin;
 }
 
 static void
@@ -181,14 +184,62 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 }
 
 static void
-previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask)
+previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask, const GdkRectangle *region)
 {
 	RSRotate *rotate = RS_ROTATE(filter);
 
 	if (mask & RS_FILTER_CHANGED_DIMENSION)
 		rotate->dirty = TRUE;
 
-	rs_filter_changed(filter, mask);
+	rs_filter_changed_region(filter, mask, region);
+}
+
+static gboolean
+map_changed_region(RSFilter *filter, GdkRectangle *region)
+{
+	RSRotate *rotate = RS_ROTATE(filter);
+	RS_MATRIX3 forward;
+	GdkRectangle output;
+	gdouble minx, miny;
+	gdouble maxx, maxy;
+
+	if ((ABS(rotate->angle) < 0.001) && (rotate->orientation==0))
+		return TRUE;
+
+	recalculate(rotate, RS_FILTER_REQUEST_QUICK);
+	if (rotate->new_width < 0)
+		return FALSE;
+
+	/* rotate->affine maps output to input, one pixel is added for interpolation */
+	forward = rotate->affine;
+	matrix3_affine_invert(&forward);
+	matrix3_affine_get_minmax(&forward, &minx, &miny, &maxx, &maxy, region->x-1.0, region->y-1.0, (gdouble) (region->x+region->width+1), (gdouble) (region->y+region->height+1));
+
+	region->x = (gint) floor(minx);
+	region->y = (gint) floor(miny);
+	region->width = (gint) ceil(maxx) - region->x + 1;
+	region->height = (gint) ceil(maxy) - region->y + 1;
+
+	output.x = 0;
+	output.y = 0;
+	output.width = rotate->new_width;
+	output.height = rotate->new_height;
+	if (!gdk_rectangle_intersect(region, &output, region))
+		region->width = region->height = 0;
+
+	return TRUE;
+}
+
+static gint
+get_margin(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSRotate *rotate = RS_ROTATE(filter);
+
+	if ((ABS(rotate->angle) < 0.001) && (rotate->orientation==0))
+		return 0;
+
+	/* We render the complete rotated image */
+	return RS_FILTER_MARGIN_FULL;
 }
 
 static RSFilterResponse *
@@ -292,13 +343,9 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		t[i].end_y = y_offset;
 		t[i].rotate = rotate;
 		t[i].use_fast = use_fast;
-
-		t[i].threadid = g_thread_new("RSRotate worker", start_rotate_thread, &t[i]);
 	}
 
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	rs_worker_pool_run(t, sizeof(ThreadInfo), threads, start_rotate_thread);
 
 	g_free(t);
 	g_object_unref(input);
@@ -320,7 +367,6 @@ start_rotate_thread(gpointer _thread_info)
 
 	if (t->use_straight) {
 		turn_right_angle(input, output, t->start_y, t->end_y, rotate->orientation);
-		g_thread_exit(NULL);
 		return NULL;
 	}
 
@@ -346,9 +392,7 @@ start_rotate_thread(gpointer _thread_info)
 		}
 	}
 
-	g_thread_exit(NULL);
-
-	return NULL; /* Make the compiler shut up - we'll never return */
+	return NULL;
 }
 
 
@@ -48,6 +48,7 @@
 #include "filename.h"
 #include "rs-tiff.h"
 #include "rs-batch.h"
+#include "rs-batch-cli.h"
 #include "rs-store.h"
 #include "rs-preview-widget.h"
 #include "rs-histogram.h"
@@ -219,11 +220,10 @@ rs_new(void)
 	/* Build basic filter chain */
 	rs->filter_input = rs_filter_new("RSInputImage16", NULL);
 	rs->filter_demosaic = rs_filter_new("RSDemosaic", rs->filter_input);
-	rs->filter_fuji_rotate = rs_filter_new("RSFujiRotate", rs->filter_demosaic);
-	rs->filter_demosaic_cache = rs_filter_new("RSCache", rs->filter_fuji_rotate);
+	rs->filter_demosaic_cache = rs_filter_new("RSCache", rs->filter_demosaic);
 
-	/* We need this for 100% zoom */
-	g_object_set(rs->filter_demosaic_cache, "ignore-roi", TRUE, NULL);
+	/* RSDemosaic and RSCache are ROI-aware, so panning at 100% only
+	 * demosaics the visible area plus margin */
 
 	rs_filter_set_recursive(rs->filter_input, "color-space", rs_color_space_new_singleton("RSProphoto"), NULL);
 	rs->filter_end = rs->filter_demosaic_cache;
@@ -561,13 +561,16 @@ main(int argc, char **argv)
 	gboolean do_test = FALSE;
 	gboolean print_version = FALSE;
 	gchar *debug = NULL;
+	gchar *trace = NULL;
     gchar *client_mode_dest = NULL;
+	gboolean headless = rs_batch_cli_requested(argc, argv);
 
 	GError *error = NULL;
 	GOptionContext *option_context;
 	const GOptionEntry option_entries[] = {
         { "output", 'o', 0, G_OPTION_ARG_STRING, &client_mode_dest, "Run in client mode", "target filename"},
 		{ "debug", 'd', 0, G_OPTION_ARG_STRING, &debug, "Debug flags to use", "flags" },
+		{ "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace, "Write filter timings as Chrome trace JSON (also set by RS_TRACE)", "filename" },
 		{ "do-tests", 't', G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &do_test, "Do internal tests", NULL },
 		{ "version", 'V', 0, G_OPTION_ARG_NONE, &print_version, "Output version information and exit", NULL },
 		{ NULL }
@@ -590,7 +593,10 @@ main(int argc, char **argv)
 
 	option_context = g_option_context_new("");
 	g_option_context_add_main_entries(option_context, option_entries, NULL);
-	g_option_context_add_group(option_context, gtk_get_option_group(FALSE));
+	g_option_context_add_group(option_context, rs_batch_cli_get_option_group());
+	/* The GTK option group initializes GTK when parsing, avoid it for headless export */
+	if (!headless)
+		g_option_context_add_group(option_context, gtk_get_option_group(FALSE));
 
 	if (!g_option_context_parse(option_context, &argc, &argv, &error))
 	{
@@ -606,6 +612,8 @@ main(int argc, char **argv)
 
 	if (debug)	
 		rs_debug_setup(debug);
+	rs_trace_setup(trace);
+
 		if (client_mode_dest)
 		{
 			/* Client mode. */
@@ -629,6 +637,28 @@ main(int argc, char **argv)
 	textdomain(GETTEXT_PACKAGE);
 #endif
 
+	if (headless)
+	{
+		gint ret;
+
+#if ! GLIB_CHECK_VERSION(2,36,0)
+		g_type_init();
+#endif
+		rs_filetype_init();
+		rs_plugin_manager_load_all_plugins();
+#ifdef WITH_GCONF
+		client = gconf_client_get_default();
+		gconf_client_add_dir(client, "/apps/" PACKAGE, GCONF_CLIENT_PRELOAD_NONE, NULL);
+#endif
+		rs_lens_fix_init();
+
+		ret = rs_batch_cli_run(argc, argv);
+
+		if (rs_trace_is_enabled())
+			rs_trace_dump(NULL);
+		return ret;
+	}
+
 #if ! GLIB_CHECK_VERSION(2,36,0)
 	/* Make sure the GType system is initialized */
 	g_type_init();
@@ -659,6 +689,9 @@ main(int argc, char **argv)
 	else
 		gui_init(argc, argv, rs);
 
+	if (rs_trace_is_enabled())
+		rs_trace_dump(NULL);
+
 	/* This is so fucking evil, but Rawstudio will deadlock in some GTK atexit() function from time to time :-/ */
 	_exit(0);
 }
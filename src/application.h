@@ -95,7 +95,6 @@ typedef struct {
 	/* Generic filter chain */
 	RSFilter *filter_input;
 	RSFilter *filter_demosaic;
-	RSFilter *filter_fuji_rotate;
 	RSFilter *filter_demosaic_cache;
 	RSFilter *filter_end;
 } RS_BLOB;
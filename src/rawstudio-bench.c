@@ -0,0 +1,621 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Headless benchmark of the batch filter chain */
+
+#include <rawstudio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h> /* getrusage() */
+#include <config.h>
+
+/* Generate a Bayer image with some structure, so demosaic has edges to work with */
+static RSFilterResponse *
+synthetic_bayer_new(gint width, gint height)
+{
+	RSFilterResponse *response = rs_filter_response_new();
+	RS_IMAGE16 *image = rs_image16_new(width, height, 1, 1);
+	GRand *rand = g_rand_new_with_seed(42);
+	gint row, col;
+
+	/* RGGB */
+	image->filters = 0x94949494;
+
+	for(row = 0; row < height; row++)
+	{
+		gushort *pixel = GET_PIXEL(image, 0, row);
+		for(col = 0; col < width; col++)
+		{
+			gint value = ((row ^ col) & 0x40) ? 12000 : 3000;
+			value += (col * 20000) / width + g_rand_int_range(rand, 0, 1024);
+			pixel[col] = CLAMP(value, 0, 65535);
+		}
+	}
+
+	rs_filter_response_set_image(response, image);
+	rs_filter_response_set_width(response, width);
+	rs_filter_response_set_height(response, height);
+
+	g_object_unref(image);
+	g_rand_free(rand);
+
+	return response;
+}
+
+static glong
+peak_rss_kb(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+
+	return usage.ru_maxrss;
+}
+
+static gboolean
+parse_size(const gchar *str, gint *width, gint *height)
+{
+	gchar **parts;
+	gboolean ret = FALSE;
+
+	if (!str)
+		return TRUE;
+
+	parts = g_strsplit(str, "x", 2);
+	if (parts[0] && parts[1])
+	{
+		*width = atoi(parts[0]);
+		*height = atoi(parts[1]);
+		ret = (*width > 0) && (*height > 0);
+	}
+	g_strfreev(parts);
+
+	return ret;
+}
+
+static gchar *
+file_checksum(const gchar *filename)
+{
+	gchar *contents;
+	gsize length;
+	gchar *ret;
+
+	if (!g_file_get_contents(filename, &contents, &length, NULL))
+		return NULL;
+
+	ret = g_compute_checksum_for_data(G_CHECKSUM_SHA1, (guchar *) contents, length);
+	g_free(contents);
+
+	return ret;
+}
+
+/* Time an output plugin on an already rendered image, with a single
+ * encoder thread and with all cores if the output supports it */
+static void
+bench_encode(RSFilter *fend, const gchar *format, gboolean save16bit, gint iterations, gint width, gint height)
+{
+	static const struct {
+		const gchar *alias;
+		const gchar *type_name;
+	} aliases[] = {
+		{ "jpeg", "RSJpegfile" },
+		{ "jpg", "RSJpegfile" },
+		{ "png", "RSPngfile" },
+		{ "tiff", "RSTifffile" },
+		{ "tif", "RSTifffile" },
+	};
+	const gchar *type_name = format;
+	RSFilter *fcache;
+	RSOutput *output;
+	GTimer *gt;
+	gchar *filename;
+	gint n_threads[2] = { 1, rs_get_number_of_processor_cores() };
+	gint runs, r, i, fd;
+	guint n;
+
+	for(n = 0; n < G_N_ELEMENTS(aliases); n++)
+		if (g_ascii_strcasecmp(format, aliases[n].alias) == 0)
+			type_name = aliases[n].type_name;
+
+	if (!g_type_from_name(type_name) || !g_type_is_a(g_type_from_name(type_name), RS_TYPE_OUTPUT))
+	{
+		g_print("Unknown output format %s\n", format);
+		return;
+	}
+
+	fd = g_file_open_tmp("rawstudio-bench-XXXXXX", &filename, NULL);
+	if (fd < 0)
+		return;
+	close(fd);
+
+	/* Render once and let the output only measure encoding */
+	fcache = rs_filter_new("RSCache", fend);
+	g_object_set(fcache, "ignore-roi", TRUE, NULL);
+
+	output = rs_output_new(type_name);
+	g_object_set(output, "filename", filename, NULL);
+	if (save16bit && g_object_class_find_property(G_OBJECT_GET_CLASS(output), "save16bit"))
+		g_object_set(output, "save16bit", TRUE, NULL);
+	runs = g_object_class_find_property(G_OBJECT_GET_CLASS(output), "encoder-threads") ? 2 : 1;
+
+	g_print("\n%-24s %8s %12s %10s %10s  %s\n", "Encoder", "Threads", "Time/run", "Mpix/s", "Size", "SHA-1");
+	gt = g_timer_new();
+	for(r = 0; r < runs; r++)
+	{
+		gdouble total = 0.0;
+		gchar *first = NULL;
+		gboolean stable = TRUE;
+
+		if (runs > 1)
+			g_object_set(output, "encoder-threads", n_threads[r], NULL);
+
+		/* The first run fills the cache and is not counted */
+		for(i = -1; i < iterations; i++)
+		{
+			gchar *checksum;
+			gdouble elapsed;
+
+			g_timer_start(gt);
+			if (!rs_output_execute(output, fcache))
+			{
+				g_print("%s failed\n", type_name);
+				break;
+			}
+			elapsed = g_timer_elapsed(gt, NULL);
+
+			checksum = file_checksum(filename);
+			if (!first)
+				first = checksum;
+			else
+			{
+				stable = stable && checksum && g_str_equal(first, checksum);
+				g_free(checksum);
+			}
+
+			if (i >= 0)
+				total += elapsed;
+		}
+
+		if (i == iterations)
+		{
+			gchar threads[16] = "-";
+			GStatBuf st;
+
+			if (runs > 1)
+				g_snprintf(threads, sizeof(threads), "%d", n_threads[r]);
+			g_stat(filename, &st);
+			g_print("%-24s %8s %10.1fms %10.2f %8.1fMB  %s%s\n",
+				type_name,
+				threads,
+				total / iterations * 1000.0,
+				((gdouble) width) * height * iterations / total / 1000000.0,
+				((gdouble) st.st_size) / (1024.0 * 1024.0),
+				first ? first : "-",
+				stable ? "" : " (NOT STABLE)");
+		}
+		g_free(first);
+	}
+
+	g_timer_destroy(gt);
+	g_object_unref(output);
+	g_object_unref(fcache);
+	g_unlink(filename);
+	g_free(filename);
+}
+
+/* SHA-1 of the colour channels of an image, ignoring padding */
+static gchar *
+image_checksum(RS_IMAGE16 *image)
+{
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+	gushort *line = g_new(gushort, image->w * 3);
+	gchar *ret;
+	gint row, col;
+
+	for(row = 0; row < image->h; row++)
+	{
+		gushort *pixel = GET_PIXEL(image, 0, row);
+		for(col = 0; col < image->w; col++)
+		{
+			line[col*3 + R] = pixel[col*image->pixelsize + R];
+			line[col*3 + G] = pixel[col*image->pixelsize + G];
+			line[col*3 + B] = pixel[col*image->pixelsize + B];
+		}
+		g_checksum_update(checksum, (guchar *) line, image->w * 3 * sizeof(gushort));
+	}
+
+	ret = g_strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+	g_free(line);
+
+	return ret;
+}
+
+/* Time the demosaic filter alone with each of its vector kernels, and check
+ * that they all give the same image as plain C */
+static void
+bench_demosaic(RSFilter *fdemosaic, gint iterations, gint64 sensor_pixels)
+{
+	static const struct {
+		const gchar *simd;
+		guint cpuflags;
+	} kernels[] = {
+		{ "none", 0 },
+		{ "sse4.1", RS_CPU_FLAG_SSE4_1 },
+		{ "avx2", RS_CPU_FLAG_AVX2 },
+	};
+	const gint cores = rs_get_number_of_processor_cores();
+	RSFilterRequest *request;
+	GTimer *gt;
+	gchar *reference = NULL;
+	gdouble reference_time = 0.0;
+	guint n;
+	gint i;
+
+	if (!g_object_class_find_property(G_OBJECT_GET_CLASS(fdemosaic), "simd"))
+		return;
+
+	request = rs_filter_request_new();
+	rs_filter_request_set_quick(request, FALSE);
+
+	g_print("\n%-24s %12s %10s %12s %8s  %s\n", "Demosaic kernel", "Time/run", "Mpix/s", "Mpix/s/core", "Speedup", "SHA-1");
+	gt = g_timer_new();
+	for(n = 0; n < G_N_ELEMENTS(kernels); n++)
+	{
+		gdouble total = 0.0;
+		gchar *checksum = NULL;
+
+		if ((rs_detect_cpu_features() & kernels[n].cpuflags) != kernels[n].cpuflags)
+		{
+			g_print("%-24s not supported by this CPU\n", kernels[n].simd);
+			continue;
+		}
+
+		g_object_set(fdemosaic, "simd", kernels[n].simd, NULL);
+
+		/* The first run is not counted */
+		for(i = -1; i < iterations; i++)
+		{
+			RSFilterResponse *response;
+			RS_IMAGE16 *image;
+			gdouble elapsed;
+
+			g_timer_start(gt);
+			response = rs_filter_get_image(fdemosaic, request);
+			elapsed = g_timer_elapsed(gt, NULL);
+
+			image = rs_filter_response_get_image(response);
+			if (image && !checksum)
+				checksum = image_checksum(image);
+			if (image)
+				g_object_unref(image);
+			g_object_unref(response);
+
+			if (i >= 0)
+				total += elapsed;
+		}
+
+		if (!reference)
+		{
+			reference = g_strdup(checksum);
+			reference_time = total;
+		}
+
+		g_print("%-24s %10.1fms %10.2f %12.2f %7.2fx  %s%s\n",
+			kernels[n].simd,
+			total / iterations * 1000.0,
+			((gdouble) sensor_pixels) * iterations / total / 1000000.0,
+			((gdouble) sensor_pixels) * iterations / total / 1000000.0 / cores,
+			reference_time / total,
+			checksum ? checksum : "-",
+			(checksum && reference && g_str_equal(checksum, reference)) ? "" : " (DIFFERS FROM C)");
+		g_free(checksum);
+	}
+
+	g_object_set(fdemosaic, "simd", "auto", NULL);
+	g_timer_destroy(gt);
+	g_free(reference);
+	g_object_unref(request);
+}
+
+/* Time every method of the demosaic filter, the rest of the chain is not
+ * involved */
+static void
+bench_demosaic_methods(RSFilter *fdemosaic, gint iterations, gint64 sensor_pixels)
+{
+	/* Binning is asked for by RSResample when scaling down, the method is ignored */
+	static const struct { const gchar *name; const gchar *method; gint binning; } methods[] = {
+		{ "bilinear", "bilinear", 1 },
+		{ "pixel-grouping", "pixel-grouping", 1 },
+		{ "vng", "vng", 1 },
+		{ "ahd", "ahd", 1 },
+		{ "binning 2x2", "pixel-grouping", 2 },
+		{ "binning 4x4", "pixel-grouping", 4 },
+	};
+	const gint cores = rs_get_number_of_processor_cores();
+	RSFilterRequest *request;
+	GTimer *gt;
+	gchar *method;
+	guint n;
+	gint i;
+
+	request = rs_filter_request_new();
+	rs_filter_request_set_quick(request, FALSE);
+	g_object_get(fdemosaic, "method", &method, NULL);
+
+	g_print("\n%-24s %12s %10s %12s\n", "Demosaic method", "Time/run", "Mpix/s", "Mpix/s/core");
+	gt = g_timer_new();
+	for(n = 0; n < G_N_ELEMENTS(methods); n++)
+	{
+		gdouble total = 0.0;
+
+		g_object_set(fdemosaic, "method", methods[n].method, NULL);
+		rs_filter_param_set_integer(RS_FILTER_PARAM(request), "demosaic-binning", methods[n].binning);
+
+		/* The first run is not counted */
+		for(i = -1; i < iterations; i++)
+		{
+			RSFilterResponse *response;
+
+			g_timer_start(gt);
+			response = rs_filter_get_image(fdemosaic, request);
+			if (i >= 0)
+				total += g_timer_elapsed(gt, NULL);
+			g_object_unref(response);
+		}
+
+		g_print("%-24s %10.1fms %10.2f %12.2f\n",
+			methods[n].name,
+			total / iterations * 1000.0,
+			((gdouble) sensor_pixels) * iterations / total / 1000000.0,
+			((gdouble) sensor_pixels) * iterations / total / 1000000.0 / cores);
+	}
+
+	g_object_set(fdemosaic, "method", method, NULL);
+	g_free(method);
+	g_timer_destroy(gt);
+	g_object_unref(request);
+}
+
+int
+main(int argc, char **argv)
+{
+	gchar *input_size = NULL;
+	gchar *output_size = NULL;
+	gchar *debug = NULL;
+	gchar *trace = NULL;
+	gchar *encode = NULL;
+	gint iterations = 5;
+	gint threads = 0;
+	gint tile_rows = 0;
+	gboolean quick = FALSE;
+	gboolean encode16 = FALSE;
+	gboolean demosaic_kernels = FALSE;
+	gboolean demosaic_methods = FALSE;
+	gint input_width = 4000, input_height = 3000;
+	gint output_width = 65535, output_height = 65535;
+	gint i, width, height;
+	guint n;
+	gdouble total = 0.0, best = G_MAXDOUBLE;
+	gint64 sensor_pixels;
+	GTimer *gt;
+	GArray *summary;
+	RSImage16PoolStats pool_stats;
+	RSFilterResponse *input;
+	RSFilterRequest *request;
+	RSSettings *settings;
+
+	GError *error = NULL;
+	GOptionContext *option_context;
+	const GOptionEntry option_entries[] = {
+		{ "size", 's', 0, G_OPTION_ARG_STRING, &input_size, "Size of synthetic input image (default 4000x3000)", "WxH" },
+		{ "output", 'o', 0, G_OPTION_ARG_STRING, &output_size, "Bounding box of output image (default full size)", "WxH" },
+		{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Number of timed runs (default 5)", "N" },
+		{ "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Number of threads to use (default all cores)", "N" },
+		{ "quick", 'q', 0, G_OPTION_ARG_NONE, &quick, "Request quick rendering", NULL },
+		{ "tile-rows", 0, 0, G_OPTION_ARG_INT, &tile_rows, "Pull the 16 bit chain in strips of this height", "N" },
+		{ "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace, "Write filter timings as Chrome trace JSON", "filename" },
+		{ "encode", 'e', 0, G_OPTION_ARG_STRING, &encode, "Also time encoding with an output format, like jpeg", "format" },
+		{ "encode-16bit", 0, 0, G_OPTION_ARG_NONE, &encode16, "Encode 16 bit images where the format supports it", NULL },
+		{ "demosaic-kernels", 0, 0, G_OPTION_ARG_NONE, &demosaic_kernels, "Also compare the vector kernels of the demosaic filter", NULL },
+		{ "demosaic-methods", 0, 0, G_OPTION_ARG_NONE, &demosaic_methods, "Also time every method of the demosaic filter", NULL },
+		{ "debug", 'd', 0, G_OPTION_ARG_STRING, &debug, "Debug flags to use", "flags" },
+		{ NULL }
+	};
+
+	option_context = g_option_context_new("[RAW-FILE] - benchmark the Rawstudio filter chain");
+	g_option_context_add_main_entries(option_context, option_entries, NULL);
+
+	if (!g_option_context_parse(option_context, &argc, &argv, &error))
+	{
+		g_print("option parsing failed: %s\n", error->message);
+		exit(1);
+	}
+
+	if (!parse_size(input_size, &input_width, &input_height) || !parse_size(output_size, &output_width, &output_height))
+	{
+		g_print("Sizes must be given as WIDTHxHEIGHT\n");
+		exit(1);
+	}
+	iterations = MAX(1, iterations);
+
+	if (debug)
+		rs_debug_setup(debug);
+
+	/* Must be done before any filter spins up the worker pool */
+	if (threads > 0)
+		rs_set_number_of_processor_cores(threads);
+
+#if ! GLIB_CHECK_VERSION(2,36,0)
+	g_type_init();
+#endif
+
+	rs_filetype_init();
+	rs_plugin_manager_load_all_plugins();
+
+	if (argc > 1)
+	{
+		input = rs_filetype_load(argv[1]);
+		if (!input || !rs_filter_response_has_image(input))
+		{
+			g_print("Could not load %s\n", argv[1]);
+			exit(1);
+		}
+	}
+	else
+		input = synthetic_bayer_new(input_width, input_height);
+
+	/* Same chain as the batch engine, see rs-batch-engine.c */
+	RSFilter *finput = rs_filter_new("RSInputImage16", NULL);
+	RSFilter *fdemosaic = rs_filter_new("RSDemosaic", finput);
+	RSFilter *flensfun = rs_filter_new("RSLensfun", fdemosaic);
+	RSFilter *frotate = rs_filter_new("RSRotate", flensfun);
+	RSFilter *fcrop = rs_filter_new("RSCrop", frotate);
+	RSFilter *ftransform_input = rs_filter_new("RSColorspaceTransform", fcrop);
+	RSFilter *fdcp= rs_filter_new("RSDcp", ftransform_input);
+	RSFilter *fcache = rs_filter_new("RSCache", fdcp);
+	RSFilter *fresample= rs_filter_new("RSResample", fcache);
+	RSFilter *fdenoise= rs_filter_new("RSDenoise", fresample);
+	RSFilter *ftransform_display = rs_filter_new("RSColorspaceTransform", fdenoise);
+	RSFilter *fend = ftransform_display;
+
+	settings = rs_settings_new();
+	g_object_set(finput, "color-space", rs_color_space_new_singleton("RSProphoto"), NULL);
+	g_object_set(fdcp, "use-profile", FALSE, NULL);
+	rs_filter_set_recursive(fend,
+		"image", input,
+		"settings", settings,
+		"bounding-box", TRUE,
+		"width", output_width,
+		"height", output_height,
+		NULL);
+
+	request = rs_filter_request_new();
+	rs_filter_request_set_quick(request, quick);
+	if (tile_rows > 0)
+		rs_filter_request_set_tile_size(request, 0, tile_rows);
+	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", rs_color_space_new_singleton("RSSrgb"));
+
+	rs_filter_get_size_simple(finput, request, &input_width, &input_height);
+	rs_filter_get_size_simple(fend, request, &width, &height);
+	sensor_pixels = ((gint64) input_width) * input_height;
+
+	g_print("Input: %dx%d (%s), output: %dx%d, %s, %d threads, %d tile rows, %d iterations\n",
+		input_width, input_height, (argc > 1) ? argv[1] : "synthetic",
+		width, height, quick ? "quick" : "full", rs_get_number_of_processor_cores(), tile_rows, iterations);
+
+	if (trace)
+		rs_trace_setup(trace);
+	else
+		rs_trace_enable();
+
+	gt = g_timer_new();
+	/* The first run warms up the worker pool and plugin state and is not counted */
+	for(i = -1; i < iterations; i++)
+	{
+		RSFilterResponse *response;
+		GdkPixbuf *pixbuf;
+		gdouble elapsed;
+
+		/* Make sure nothing is served from RSCache */
+		rs_filter_changed(finput, RS_FILTER_CHANGED_PIXELDATA);
+
+		g_timer_start(gt);
+		response = rs_filter_get_image8(fend, request);
+		elapsed = g_timer_elapsed(gt, NULL);
+
+		pixbuf = rs_filter_response_get_image8(response);
+		if (!pixbuf)
+		{
+			g_print("Filter chain did not return an image\n");
+			exit(1);
+		}
+		g_object_unref(pixbuf);
+		g_object_unref(response);
+
+		if (i < 0)
+		{
+			rs_trace_clear();
+			continue;
+		}
+
+		g_print("Run %d: %.1fms, %.2f Mpix/s\n", i + 1, elapsed * 1000.0, ((gdouble) sensor_pixels) / elapsed / 1000000.0);
+		total += elapsed;
+		best = MIN(best, elapsed);
+	}
+
+	g_print("\n%-24s %8s %12s %10s %12s\n", "Filter", "Calls", "Time/run", "Mpix/s", "Alloc/run");
+	summary = rs_trace_summarize();
+	for(n = 0; n < summary->len; n++)
+	{
+		RSTraceSummary *sum = &g_array_index(summary, RSTraceSummary, n);
+		gdouble rate = (sum->self_us > 0) ? ((gdouble) sum->pixels) / ((gdouble) sum->self_us) : 0.0;
+
+		g_print("%-24s %8u %10.1fms %10.2f %10.1fMB\n",
+			sum->name, sum->calls / iterations,
+			((gdouble) sum->self_us) / iterations / 1000.0,
+			rate,
+			((gdouble) sum->bytes) / iterations / (1024.0 * 1024.0));
+	}
+	g_array_free(summary, TRUE);
+
+	g_print("\nEnd-to-end: average %.1fms (%.2f Mpix/s), best %.1fms (%.2f Mpix/s)\n",
+		total / iterations * 1000.0, ((gdouble) sensor_pixels) * iterations / total / 1000000.0,
+		best * 1000.0, ((gdouble) sensor_pixels) / best / 1000000.0);
+	g_print("Peak RSS: %.1fMB\n", ((gdouble) peak_rss_kb()) / 1024.0);
+
+	rs_image16_pool_get_stats(&pool_stats);
+	g_print("Image pool: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %" G_GUINT64_FORMAT " evictions, %.1fMB resident\n",
+		pool_stats.hits, pool_stats.misses, pool_stats.evictions, ((gdouble) pool_stats.bytes_resident) / (1024.0 * 1024.0));
+
+	if (trace)
+		rs_trace_dump(NULL);
+
+	if (demosaic_kernels)
+		bench_demosaic(fdemosaic, iterations, sensor_pixels);
+
+	if (demosaic_methods)
+		bench_demosaic_methods(fdemosaic, iterations, sensor_pixels);
+
+	if (encode)
+		bench_encode(fend, encode, encode16, iterations, width, height);
+
+	g_timer_destroy(gt);
+	g_object_unref(request);
+	g_object_unref(settings);
+	g_object_unref(input);
+	g_object_unref(finput);
+	g_object_unref(fdemosaic);
+	g_object_unref(flensfun);
+	g_object_unref(frotate);
+	g_object_unref(fcrop);
+	g_object_unref(fcache);
+	g_object_unref(fresample);
+	g_object_unref(fdcp);
+	g_object_unref(fdenoise);
+	g_object_unref(ftransform_input);
+	g_object_unref(ftransform_display);
+
+	return 0;
+}
@@ -1198,6 +1198,11 @@ TOGGLEACTION(exposure_mask)
 	rs_preview_widget_set_show_exposure_mask(RS_PREVIEW_WIDGET(rs->preview), gtk_toggle_action_get_active(toggleaction));
 }
 
+TOGGLEACTION(progressive_preview)
+{
+	rs_preview_widget_set_progressive(RS_PREVIEW_WIDGET(rs->preview), gtk_toggle_action_get_active(toggleaction));
+}
+
 TOGGLEACTION(load_selected)
 {
 	gtk_toggle_action_set_active(toggleaction, !rs_store_set_open_selected(rs->store, !gtk_toggle_action_get_active(toggleaction)));
@@ -1843,9 +1848,11 @@ rs_get_core_action_group(RS_BLOB *rs)
 {
 	gboolean show_filenames;
 	gboolean load_8bit = FALSE;
+	gboolean progressive_preview = TRUE;
 
 	rs_conf_get_boolean_with_default(CONF_SHOW_FILENAMES, &show_filenames, DEFAULT_CONF_SHOW_FILENAMES);
 	rs_conf_get_boolean_with_default(CONF_LOAD_GDK, &load_8bit, FALSE);
+	rs_conf_get_boolean_with_default(CONF_PREVIEW_PROGRESSIVE, &progressive_preview, TRUE);
 
 	/* FIXME: This should be static */
 	GtkActionEntry actionentries[] = {
@@ -1938,6 +1945,7 @@ rs_get_core_action_group(RS_BLOB *rs)
 	{ "Load8Bit", NULL, _("Load non-RAW images"), NULL, NULL, ACTION_CB(load_8bit), load_8bit },
 	{ "LoadSelected", NULL, _("Do not Load Selected Images"), "Pause", NULL, ACTION_CB(load_selected), FALSE },
 	{ "ExposureMask", NULL, _("_Exposure Mask"), "<control>E", NULL, ACTION_CB(exposure_mask), FALSE },
+	{ "ProgressivePreview", NULL, _("_Progressive Preview"), NULL, NULL, ACTION_CB(progressive_preview), progressive_preview },
 	{ "Split", NULL, _("_Split"), "<control>D", NULL, ACTION_CB(split), FALSE },
 	{ "Lightsout", NULL, _("_Lights Out"), "F12", NULL, ACTION_CB(lightsout), FALSE },
 	};
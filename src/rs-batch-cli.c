@@ -0,0 +1,520 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Headless batch export, nothing in here may touch GTK */
+
+#include <rawstudio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <config.h>
+#include "application.h"
+#include "rs-batch-cli.h"
+#include "rs-batch-engine.h"
+#include "rs-batch-journal.h"
+#include "conf_interface.h"
+#include "rs-cache.h"
+
+static gboolean export_enabled = FALSE;
+static gchar *export_format = NULL;
+static gchar *export_directory = NULL;
+static gchar *export_filename = NULL;
+static gchar *export_size = NULL;
+static gint export_scale = 0;
+static gchar *export_snapshot = NULL;
+static gint export_jobs = 0;
+static gchar **export_options = NULL;
+static gchar **export_profiles = NULL;
+static gchar *export_journal = NULL;
+
+static const GOptionEntry export_entries[] = {
+	{ "export", 0, 0, G_OPTION_ARG_NONE, &export_enabled, "Export files and directories without starting the user interface", NULL },
+	{ "export-format", 0, 0, G_OPTION_ARG_STRING, &export_format, "Output format, for example jpeg, tiff, png or RSJpegfile", "format" },
+	{ "export-directory", 0, 0, G_OPTION_ARG_FILENAME, &export_directory, "Output directory", "directory" },
+	{ "export-filename", 0, 0, G_OPTION_ARG_STRING, &export_filename, "Filename template, for example %f_%2c", "template" },
+	{ "export-size", 0, 0, G_OPTION_ARG_STRING, &export_size, "Bounding box as WxH, Wx / xH to lock width or height, or N% to scale", "size" },
+	{ "export-scale", 0, 0, G_OPTION_ARG_INT, &export_scale, "Scale in percent", "percent" },
+	{ "export-snapshot", 0, 0, G_OPTION_ARG_STRING, &export_snapshot, "Snapshot to export, A, B or C", "snapshot" },
+	{ "export-jobs", 0, 0, G_OPTION_ARG_INT, &export_jobs, "Number of photos to process concurrently, 0 for automatic", "n" },
+	{ "export-option", 0, 0, G_OPTION_ARG_STRING_ARRAY, &export_options, "Set an output property, for example quality=90", "name=value" },
+	{ "export-profile", 0, 0, G_OPTION_ARG_STRING_ARRAY, &export_profiles, "Additional output, each photo is only rendered once for all outputs", "format[,size[,template]]" },
+	{ "export-journal", 0, 0, G_OPTION_ARG_FILENAME, &export_journal, "Record exported photos in a journal and skip photos it lists on the next run", "file" },
+	{ NULL }
+};
+
+static void
+json_append_string(GString *json, const gchar *str)
+{
+	const gchar *p;
+
+	if (!str)
+	{
+		g_string_append(json, "null");
+		return;
+	}
+
+	g_string_append_c(json, '"');
+	for(p = str; *p; p++)
+	{
+		switch (*p)
+		{
+			case '"':
+				g_string_append(json, "\\\"");
+				break;
+			case '\\':
+				g_string_append(json, "\\\\");
+				break;
+			case '\n':
+				g_string_append(json, "\\n");
+				break;
+			case '\t':
+				g_string_append(json, "\\t");
+				break;
+			default:
+				if ((guchar) *p < 0x20)
+					g_string_append_printf(json, "\\u%04x", (guchar) *p);
+				else
+					g_string_append_c(json, *p);
+		}
+	}
+	g_string_append_c(json, '"');
+}
+
+/* Always use '.' as decimal separator, regardless of locale */
+static void
+json_append_double(GString *json, gdouble value)
+{
+	gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+	g_string_append(json, g_ascii_formatd(buffer, sizeof(buffer), "%.3f", value));
+}
+
+static void
+json_print(GString *json)
+{
+	g_string_append_c(json, '}');
+	printf("%s\n", json->str);
+	fflush(stdout);
+	g_string_free(json, TRUE);
+}
+
+static gboolean
+output_set_option(RSOutput *output, const gchar *option)
+{
+	gchar **pair = g_strsplit(option, "=", 2);
+	GParamSpec *spec = NULL;
+	GValue value = {0};
+	GType type;
+	gboolean ret = TRUE;
+
+	if (pair[0] && pair[1])
+		spec = g_object_class_find_property(G_OBJECT_GET_CLASS(output), pair[0]);
+
+	if (!spec)
+	{
+		g_strfreev(pair);
+		return FALSE;
+	}
+
+	type = G_PARAM_SPEC_VALUE_TYPE(spec);
+	g_value_init(&value, type);
+
+	if (type == G_TYPE_INT)
+		g_value_set_int(&value, atoi(pair[1]));
+	else if (type == G_TYPE_BOOLEAN)
+		g_value_set_boolean(&value, g_ascii_strcasecmp(pair[1], "true") == 0 || g_str_equal(pair[1], "1"));
+	else if (type == G_TYPE_DOUBLE)
+		g_value_set_double(&value, g_ascii_strtod(pair[1], NULL));
+	else if (type == G_TYPE_FLOAT)
+		g_value_set_float(&value, g_ascii_strtod(pair[1], NULL));
+	else if (type == G_TYPE_STRING)
+		g_value_set_string(&value, pair[1]);
+	else if (g_type_is_a(type, RS_TYPE_COLOR_SPACE))
+	{
+		RSColorSpace *color_space = rs_color_space_new_singleton(pair[1]);
+		if (color_space)
+			g_value_set_object(&value, color_space);
+		else
+			ret = FALSE;
+	}
+	else
+		ret = FALSE;
+
+	if (ret)
+		g_object_set_property(G_OBJECT(output), pair[0], &value);
+
+	g_value_unset(&value);
+	g_strfreev(pair);
+
+	return ret;
+}
+
+static gint
+compare_names(gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0(*(const gchar **) a, *(const gchar **) b);
+}
+
+static void
+collect_files(GPtrArray *files, const gchar *path)
+{
+	GDir *dir;
+	const gchar *name;
+	GPtrArray *found;
+	guint i;
+
+	if (!g_file_test(path, G_FILE_TEST_IS_DIR))
+	{
+		if (rs_filetype_can_load(path))
+			g_ptr_array_add(files, g_strdup(path));
+		else
+			g_printerr("Cannot export %s, unknown or missing file\n", path);
+		return;
+	}
+
+	dir = g_dir_open(path, 0, NULL);
+	if (!dir)
+		return;
+
+	found = g_ptr_array_new();
+	while ((name = g_dir_read_name(dir)))
+	{
+		gchar *filename;
+
+		if (name[0] == '.')
+			continue;
+
+		filename = g_build_filename(path, name, NULL);
+		if (g_file_test(filename, G_FILE_TEST_IS_REGULAR) && rs_filetype_can_load(filename))
+			g_ptr_array_add(found, filename);
+		else
+			g_free(filename);
+	}
+	g_dir_close(dir);
+
+	/* Export in a predictable order */
+	g_ptr_array_sort(found, compare_names);
+	for(i = 0; i < found->len; i++)
+		g_ptr_array_add(files, g_ptr_array_index(found, i));
+	g_ptr_array_free(found, TRUE);
+}
+
+/* Mirror the size the GUI batch queue would use */
+static void
+size_from_conf(RSBatchOutput *output)
+{
+	gchar *lock;
+
+	output->size_lock = LOCK_SCALE;
+	output->scale = 100;
+	output->width = 600;
+	output->height = 600;
+
+	rs_conf_get_integer(CONF_BATCH_SIZE_SCALE, &output->scale);
+	rs_conf_get_integer(CONF_BATCH_SIZE_WIDTH, &output->width);
+	rs_conf_get_integer(CONF_BATCH_SIZE_HEIGHT, &output->height);
+	lock = rs_conf_get_string(CONF_BATCH_SIZE_LOCK);
+	if (lock)
+	{
+		if (g_str_equal(lock, "bounding-box"))
+			output->size_lock = LOCK_BOUNDING_BOX;
+		else if (g_str_equal(lock, "width"))
+			output->size_lock = LOCK_WIDTH;
+		else if (g_str_equal(lock, "height"))
+			output->size_lock = LOCK_HEIGHT;
+		g_free(lock);
+	}
+}
+
+/**
+ * Check if headless export was requested, this must be known before any
+ * option parsing, since GTK options should not be added in that case
+ * @param argc Argument count from main()
+ * @param argv Arguments from main()
+ * @return TRUE if "--export" is present in argv
+ */
+gboolean
+rs_batch_cli_requested(gint argc, gchar **argv)
+{
+	gint i;
+
+	for(i = 1; i < argc; i++)
+	{
+		/* Stop at the end of options */
+		if (g_str_equal(argv[i], "--"))
+			break;
+		if (g_str_equal(argv[i], "--export"))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Get a GOptionGroup with all options for headless export
+ * @return A new GOptionGroup to add to the main GOptionContext
+ */
+GOptionGroup *
+rs_batch_cli_get_option_group(void)
+{
+	GOptionGroup *group;
+
+	group = g_option_group_new("export", "Headless export options:", "Show headless export options", NULL, NULL);
+	g_option_group_add_entries(group, export_entries);
+
+	return group;
+}
+
+/**
+ * Export all files and directories given on the command line without
+ * initializing GTK. Progress is written to stdout, one JSON object per line
+ * @param argc Argument count after option parsing
+ * @param argv Arguments after option parsing
+ * @return Exit status, 0 if every photo was exported
+ */
+gint
+rs_batch_cli_run(gint argc, gchar **argv)
+{
+	GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+	RSBatchOutput batch_output;
+	RSBatchEngine *engine;
+	RSBatchResult *result;
+	RSBatchJournal *journal = NULL;
+	RSBatchJournalStats stats;
+	RSOutput *output;
+	GType output_type;
+	GTimer *timer;
+	gdouble elapsed;
+	GString *json;
+	gchar *directory, *filename, *type_name;
+	gint setting_id = 0;
+	gint total, index = 0, exported = 0, failed = 0, skipped = 0;
+	guint i;
+
+	g_return_val_if_fail(export_enabled, 2);
+
+	for(i = 1; i < (guint) argc; i++)
+		collect_files(files, argv[i]);
+
+	if (files->len == 0)
+	{
+		g_printerr("No photos to export\n");
+		g_ptr_array_free(files, TRUE);
+		return 2;
+	}
+
+	if (export_snapshot)
+	{
+		if (g_ascii_strcasecmp(export_snapshot, "A") == 0)
+			setting_id = 0;
+		else if (g_ascii_strcasecmp(export_snapshot, "B") == 0)
+			setting_id = 1;
+		else if (g_ascii_strcasecmp(export_snapshot, "C") == 0)
+			setting_id = 2;
+		else
+		{
+			g_printerr("Unknown snapshot \"%s\", use A, B or C\n", export_snapshot);
+			g_ptr_array_free(files, TRUE);
+			return 2;
+		}
+	}
+
+	/* Default to whatever the batch queue would use */
+	if (export_format)
+		output_type = rs_batch_output_type_find(export_format);
+	else
+	{
+		type_name = rs_conf_get_string(CONF_BATCH_FILETYPE);
+		output_type = type_name ? rs_batch_output_type_find(type_name) : 0;
+		g_free(type_name);
+		if (!output_type)
+			output_type = g_type_from_name("RSJpegfile");
+	}
+
+	if (!output_type)
+	{
+		g_printerr("Unknown output format \"%s\"\n", export_format ? export_format : "RSJpegfile");
+		g_ptr_array_free(files, TRUE);
+		return 2;
+	}
+
+	output = rs_output_new(g_type_name(output_type));
+	rs_output_set_from_conf(output, "batch");
+	for(i = 0; export_options && export_options[i]; i++)
+		if (!output_set_option(output, export_options[i]))
+			g_printerr("Ignoring unknown output option \"%s\"\n", export_options[i]);
+
+	size_from_conf(&batch_output);
+	if (export_scale > 0)
+	{
+		batch_output.size_lock = LOCK_SCALE;
+		batch_output.scale = export_scale;
+	}
+	else if (export_size && !rs_batch_output_parse_size(&batch_output, export_size))
+	{
+		g_printerr("Cannot parse size \"%s\"\n", export_size);
+		g_object_unref(output);
+		g_ptr_array_free(files, TRUE);
+		return 2;
+	}
+
+	directory = export_directory ? g_strdup(export_directory) : rs_conf_get_string(CONF_BATCH_DIRECTORY);
+	if (!directory)
+		directory = g_strdup(DEFAULT_CONF_BATCH_DIRECTORY);
+	filename = export_filename ? g_strdup(export_filename) : rs_conf_get_string(CONF_BATCH_FILENAME);
+	if (!filename)
+		filename = g_strdup(DEFAULT_CONF_BATCH_FILENAME);
+
+	g_mkdir_with_parents(directory, 00755);
+	if (g_strrstr(filename, "%p"))
+		batch_output.filename_template = g_strdup(filename);
+	else
+		batch_output.filename_template = g_build_filename(directory, filename, NULL);
+	batch_output.output = output;
+
+	engine = rs_batch_engine_new(&batch_output, export_jobs);
+	for(i = 0; export_profiles && export_profiles[i]; i++)
+	{
+		RSBatchOutput profile;
+
+		if (!rs_batch_output_parse(&profile, export_profiles[i], directory, filename))
+		{
+			g_printerr("Cannot parse output profile \"%s\"\n", export_profiles[i]);
+			rs_batch_engine_free(engine);
+			g_free(batch_output.filename_template);
+			g_free(directory);
+			g_free(filename);
+			g_object_unref(output);
+			g_ptr_array_free(files, TRUE);
+			return 2;
+		}
+		rs_batch_engine_add_output(engine, &profile);
+		rs_batch_output_clear(&profile);
+	}
+
+	if (export_journal)
+	{
+		GError *error = NULL;
+		gchar *signature = rs_batch_engine_get_signature(engine);
+
+		journal = rs_batch_journal_open(export_journal, signature, &error);
+		g_free(signature);
+		if (!journal)
+		{
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+			rs_batch_engine_free(engine);
+			g_free(batch_output.filename_template);
+			g_free(directory);
+			g_free(filename);
+			g_object_unref(output);
+			g_ptr_array_free(files, TRUE);
+			return 2;
+		}
+		rs_batch_engine_set_checksums(engine, TRUE);
+	}
+
+	for(i = 0; i < files->len; i++)
+	{
+		if (journal && rs_batch_journal_is_done(journal, g_ptr_array_index(files, i), setting_id))
+			skipped++;
+		else
+			rs_batch_engine_add(engine, g_ptr_array_index(files, i), setting_id);
+	}
+	total = files->len - skipped;
+
+	json = g_string_new("{\"event\":\"start\",\"total\":");
+	g_string_append_printf(json, "%d,\"skipped\":%d,\"workers\":%d,\"format\":", total, skipped, rs_batch_engine_get_n_workers(engine));
+	json_append_string(json, g_type_name(output_type));
+	json_print(json);
+
+	timer = g_timer_new();
+	rs_batch_engine_start(engine);
+
+	while(rs_batch_engine_get_pending(engine) > 0)
+	{
+		result = rs_batch_engine_pop_result(engine, 1000);
+		if (!result)
+			continue;
+
+		index++;
+		if (journal)
+			rs_batch_journal_add(journal, result);
+		if (result->status == RS_BATCH_STATUS_EXPORTED)
+		{
+			gboolean flag = TRUE;
+			rs_cache_save_flags(result->filename, NULL, &flag, NULL);
+			exported++;
+		}
+		else
+			failed++;
+
+		json = g_string_new("{\"event\":\"file\",\"index\":");
+		g_string_append_printf(json, "%d,\"total\":%d,\"input\":", index, total);
+		json_append_string(json, result->filename);
+		g_string_append_printf(json, ",\"snapshot\":\"%c\",\"status\":", 'A' + result->setting_id);
+		json_append_string(json, (result->status == RS_BATCH_STATUS_EXPORTED) ? "exported" : "failed");
+		g_string_append(json, ",\"outputs\":[");
+		for(i = 0; result->output_filenames && result->output_filenames[i]; i++)
+		{
+			if (i > 0)
+				g_string_append_c(json, ',');
+			json_append_string(json, result->output_filenames[i]);
+		}
+		g_string_append_c(json, ']');
+		g_string_append(json, ",\"error\":");
+		json_append_string(json, result->error);
+		g_string_append(json, ",\"load_time\":");
+		json_append_double(json, result->load_time);
+		g_string_append(json, ",\"render_time\":");
+		json_append_double(json, result->render_time);
+		g_string_append(json, ",\"encode_time\":");
+		json_append_double(json, result->encode_time);
+		json_print(json);
+
+		rs_batch_result_free(result);
+	}
+
+	elapsed = g_timer_elapsed(timer, NULL);
+	json = g_string_new("{\"event\":\"done\",");
+	g_string_append_printf(json, "\"exported\":%d,\"failed\":%d,\"skipped\":%d,\"time\":", exported, failed, skipped);
+	json_append_double(json, elapsed);
+	g_string_append(json, ",\"photos_per_minute\":");
+	json_append_double(json, (elapsed > 0.0) ? (exported * 60.0 / elapsed) : 0.0);
+	if (journal)
+	{
+		rs_batch_journal_get_stats(journal, &stats);
+		g_string_append(json, ",\"worker_time\":");
+		json_append_double(json, stats.render_time);
+		rs_batch_journal_close(journal);
+	}
+	json_print(json);
+
+	rs_batch_engine_free(engine);
+	g_timer_destroy(timer);
+	g_free(batch_output.filename_template);
+	g_free(directory);
+	g_free(filename);
+	g_object_unref(output);
+	g_ptr_array_free(files, TRUE);
+
+	return (failed > 0) ? 1 : 0;
+}
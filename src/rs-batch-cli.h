@@ -0,0 +1,52 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_BATCH_CLI_H
+#define RS_BATCH_CLI_H
+
+#include <glib.h>
+
+/**
+ * Check if headless export was requested, this must be known before any
+ * option parsing, since GTK options should not be added in that case
+ * @param argc Argument count from main()
+ * @param argv Arguments from main()
+ * @return TRUE if "--export" is present in argv
+ */
+extern gboolean
+rs_batch_cli_requested(gint argc, gchar **argv);
+
+/**
+ * Get a GOptionGroup with all options for headless export
+ * @return A new GOptionGroup to add to the main GOptionContext
+ */
+extern GOptionGroup *
+rs_batch_cli_get_option_group(void);
+
+/**
+ * Export all files and directories given on the command line without
+ * initializing GTK. Progress is written to stdout, one JSON object per line
+ * @param argc Argument count after option parsing
+ * @param argv Arguments after option parsing
+ * @return Exit status, 0 if every photo was exported
+ */
+extern gint
+rs_batch_cli_run(gint argc, gchar **argv);
+
+#endif /* RS_BATCH_CLI_H */
@@ -0,0 +1,1564 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <rawstudio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <config.h>
+#include "application.h"
+#include "rs-batch-engine.h"
+#include "conf_interface.h"
+#include "gettext.h"
+#include "filename.h"
+#include "rs-cache.h"
+#include "rs-photo.h"
+
+/* Full size 16 bit images alive in a chain while a photo is rendered: the
+ * demosaiced input, lensfun, rotate, dcp, the cached copy and denoise */
+#define IMAGE_COPIES (6)
+#define BYTES_PER_PIXEL (4 * sizeof(gushort))
+
+/* Used to size the number of workers before we know anything about the photos */
+#define TYPICAL_PIXELS (16 * 1000 * 1000)
+
+/* Part of the memory budget that rendered images waiting for an encoder may use */
+#define ENCODE_QUEUE_SHARE (4)
+
+/* A filter answering requests with an image rendered earlier. This lets an
+ * encoder thread run an RSOutput while the chain renders the next photo */
+#define RS_TYPE_BATCH_FROZEN (rs_batch_frozen_get_type())
+#define RS_BATCH_FROZEN(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_BATCH_FROZEN, RSBatchFrozen))
+
+typedef struct {
+	RSFilter parent;
+	RSFilterResponse *response;
+	gchar *filename;
+} RSBatchFrozen;
+
+typedef struct {
+	RSFilterClass parent_class;
+} RSBatchFrozenClass;
+
+enum {
+	FROZEN_PROP_0,
+	FROZEN_PROP_FILENAME
+};
+
+static GType rs_batch_frozen_get_type(void);
+G_DEFINE_TYPE(RSBatchFrozen, rs_batch_frozen, RS_TYPE_FILTER)
+
+/* All snapshots of a file are exported by the same worker, so the photo is
+ * only loaded and demosaiced once */
+typedef struct {
+	gchar *filename;
+	gint setting_ids[3];
+	gint n_settings;
+} BatchJob;
+
+/* Everything after the cache depends on output size, so every output gets
+ * its own branch of the chain below the shared cache */
+typedef struct {
+	RSBatchOutput *batch_output;
+	RSOutput *output;
+	RSFilter *fresample;
+	RSFilter *fdenoise;
+	RSFilter *fend;
+} BatchBranch;
+
+/* A snapshot waiting for its outputs to be encoded */
+typedef struct {
+	RSBatchResult *result;
+	gchar **filenames;          /* One per output, NULL until written */
+	gchar **checksums;          /* One per output, NULL if not computed */
+	gint n_filenames;
+	gint outstanding;           /* Protected by the engine encode_lock */
+} PendingResult;
+
+typedef struct {
+	PendingResult *pending;
+	gint index;
+	RSOutput *output;
+	RSFilter *frozen;
+	gsize bytes;
+} EncodeTask;
+
+typedef struct {
+	RSBatchEngine *engine;
+	GThread *thread;
+	GSList *filters;
+	RSFilter *fcache_demosaic;
+	RSFilter *fcrop;
+	RSFilter *fcache;
+	BatchBranch *branches;
+} BatchWorker;
+
+struct _RSBatchEngine {
+	GPtrArray *outputs;
+	gint n_workers;
+	BatchWorker *workers;
+	gboolean started;
+
+	GMutex lock;
+	GCond memory_cond;
+	GQueue *jobs;
+	GHashTable *jobs_by_filename;
+	gint pending;
+	gboolean cancelled;
+	guint64 memory_budget;
+	guint64 memory_in_use;
+
+	/* Serializes filename_parse() and directory creation between workers */
+	GMutex filename_lock;
+
+	/* Write-behind, rendered images are queued here for encoder threads */
+	GMutex encode_lock;
+	GCond encode_cond;
+	GQueue *encode_queue;
+	gsize encode_queue_bytes;
+	gsize encode_queue_limit;
+	gint workers_running;
+	gint n_encoders;
+	GThread **encoders;
+
+	GAsyncQueue *results;
+
+	gint preview_size;
+	RSColorSpace *preview_colorspace;
+
+	gboolean checksums;
+};
+
+static guint64
+memory_budget_get(void)
+{
+	gint megabytes = 0;
+	guint64 budget = 0;
+
+	if (rs_conf_get_integer(CONF_BATCH_MEMORY_BUDGET, &megabytes) && megabytes > 0)
+		return ((guint64) megabytes) << 20;
+
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+	{
+		glong pages = sysconf(_SC_PHYS_PAGES);
+		glong page_size = sysconf(_SC_PAGESIZE);
+		if (pages > 0 && page_size > 0)
+			budget = ((guint64) pages * (guint64) page_size) / 2;
+	}
+#endif
+	/* Be conservative if we can't tell */
+	if (budget == 0)
+		budget = ((guint64) 1) << 30;
+
+	return budget;
+}
+
+static void
+rs_batch_frozen_finalize(GObject *object)
+{
+	RSBatchFrozen *frozen = RS_BATCH_FROZEN(object);
+
+	if (frozen->response)
+		g_object_unref(frozen->response);
+	g_free(frozen->filename);
+
+	G_OBJECT_CLASS(rs_batch_frozen_parent_class)->finalize(object);
+}
+
+static void
+rs_batch_frozen_get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspec)
+{
+	RSBatchFrozen *frozen = RS_BATCH_FROZEN(object);
+
+	switch (property_id)
+	{
+		case FROZEN_PROP_FILENAME:
+			g_value_set_string(value, frozen->filename);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+	}
+}
+
+/* Serves both 8 and 16 bit requests, only the kind captured is available */
+static RSFilterResponse *
+rs_batch_frozen_get_image(RSFilter *filter, const RSFilterRequest *request)
+{
+	return g_object_ref(RS_BATCH_FROZEN(filter)->response);
+}
+
+static RSFilterResponse *
+rs_batch_frozen_get_size(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSBatchFrozen *frozen = RS_BATCH_FROZEN(filter);
+	RSFilterResponse *response = rs_filter_response_new();
+	RS_IMAGE16 *image = rs_filter_response_get_image(frozen->response);
+	GdkPixbuf *pixbuf = rs_filter_response_get_image8(frozen->response);
+
+	if (image)
+	{
+		rs_filter_response_set_width(response, image->w);
+		rs_filter_response_set_height(response, image->h);
+		g_object_unref(image);
+	}
+	else if (pixbuf)
+	{
+		rs_filter_response_set_width(response, gdk_pixbuf_get_width(pixbuf));
+		rs_filter_response_set_height(response, gdk_pixbuf_get_height(pixbuf));
+	}
+	if (pixbuf)
+		g_object_unref(pixbuf);
+
+	return response;
+}
+
+static void
+rs_batch_frozen_class_init(RSBatchFrozenClass *klass)
+{
+	RSFilterClass *filter_class = RS_FILTER_CLASS(klass);
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+	object_class->finalize = rs_batch_frozen_finalize;
+	object_class->get_property = rs_batch_frozen_get_property;
+
+	g_object_class_install_property(object_class,
+		FROZEN_PROP_FILENAME, g_param_spec_string(
+			"filename", "filename", "Filename of the photo rendered",
+			NULL, G_PARAM_READABLE));
+
+	filter_class->name = "Frozen batch image";
+	filter_class->get_image = rs_batch_frozen_get_image;
+	filter_class->get_image8 = rs_batch_frozen_get_image;
+	filter_class->get_size = rs_batch_frozen_get_size;
+}
+
+static void
+rs_batch_frozen_init(RSBatchFrozen *frozen)
+{
+}
+
+static RSFilter *
+rs_batch_frozen_new(RSFilterResponse *response, const gchar *filename)
+{
+	RSBatchFrozen *frozen = g_object_new(RS_TYPE_BATCH_FROZEN, NULL);
+
+	frozen->response = g_object_ref(response);
+	frozen->filename = g_strdup(filename);
+
+	return RS_FILTER(frozen);
+}
+
+static RSOutput *
+output_clone(RSOutput *prototype)
+{
+	RSOutput *output = rs_output_new(G_OBJECT_TYPE_NAME(prototype));
+	GParamSpec **specs;
+	guint n_specs, i;
+
+	if (!output)
+		return NULL;
+
+	specs = g_object_class_list_properties(G_OBJECT_GET_CLASS(prototype), &n_specs);
+	for(i = 0; i < n_specs; i++)
+	{
+		GValue value = {0};
+
+		if ((specs[i]->flags & G_PARAM_READWRITE) != G_PARAM_READWRITE)
+			continue;
+		if (specs[i]->flags & G_PARAM_CONSTRUCT_ONLY)
+			continue;
+
+		g_value_init(&value, G_PARAM_SPEC_VALUE_TYPE(specs[i]));
+		g_object_get_property(G_OBJECT(prototype), specs[i]->name, &value);
+		g_object_set_property(G_OBJECT(output), specs[i]->name, &value);
+		g_value_unset(&value);
+	}
+	g_free(specs);
+
+	return output;
+}
+
+/* Chains are built and destroyed on the thread owning the engine, some
+ * filters (denoise) are not safe to instantiate concurrently */
+static void
+worker_init(BatchWorker *worker, RSBatchEngine *engine)
+{
+	RSFilter *finput = rs_filter_new("RSInputImage16", NULL);
+	RSFilter *fdemosaic = rs_filter_new("RSDemosaic", finput);
+	RSFilter *fcache_demosaic = rs_filter_new("RSCache", fdemosaic);
+	RSFilter *flensfun = rs_filter_new("RSLensfun", fcache_demosaic);
+	RSFilter *frotate = rs_filter_new("RSRotate", flensfun);
+	RSFilter *fcrop = rs_filter_new("RSCrop", frotate);
+	RSFilter *ftransform_input = rs_filter_new("RSColorspaceTransform", fcrop);
+	RSFilter *fdcp= rs_filter_new("RSDcp", ftransform_input);
+	RSFilter *fcache = rs_filter_new("RSCache", fdcp);
+	guint i;
+
+	worker->engine = engine;
+	worker->fcache_demosaic = fcache_demosaic;
+	worker->fcrop = fcrop;
+	worker->fcache = fcache;
+
+	worker->filters = NULL;
+	worker->filters = g_slist_prepend(worker->filters, finput);
+	worker->filters = g_slist_prepend(worker->filters, fdemosaic);
+	worker->filters = g_slist_prepend(worker->filters, fcache_demosaic);
+	worker->filters = g_slist_prepend(worker->filters, flensfun);
+	worker->filters = g_slist_prepend(worker->filters, frotate);
+	worker->filters = g_slist_prepend(worker->filters, fcrop);
+	worker->filters = g_slist_prepend(worker->filters, ftransform_input);
+	worker->filters = g_slist_prepend(worker->filters, fdcp);
+	worker->filters = g_slist_prepend(worker->filters, fcache);
+
+	/* Nothing before the demosaic cache depends on settings, it only has to
+	 * hold the one full size image shared by all snapshots of a file */
+	g_object_set(fcache_demosaic, "max-entries", 1, NULL);
+
+	worker->branches = g_new0(BatchBranch, engine->outputs->len);
+	for(i = 0; i < engine->outputs->len; i++)
+	{
+		BatchBranch *branch = &worker->branches[i];
+
+		branch->batch_output = g_ptr_array_index(engine->outputs, i);
+		branch->output = output_clone(branch->batch_output->output);
+		branch->fresample = rs_filter_new("RSResample", fcache);
+		branch->fdenoise = rs_filter_new("RSDenoise", branch->fresample);
+		branch->fend = rs_filter_new("RSColorspaceTransform", branch->fdenoise);
+
+		worker->filters = g_slist_prepend(worker->filters, branch->fresample);
+		worker->filters = g_slist_prepend(worker->filters, branch->fdenoise);
+		worker->filters = g_slist_prepend(worker->filters, branch->fend);
+	}
+}
+
+static void
+worker_destroy(BatchWorker *worker)
+{
+	guint i;
+
+	/* Children first, the list is in reverse order of creation */
+	g_slist_foreach(worker->filters, (GFunc) g_object_unref, NULL);
+	g_slist_free(worker->filters);
+	for(i = 0; i < worker->engine->outputs->len; i++)
+		if (worker->branches[i].output)
+			g_object_unref(worker->branches[i].output);
+	g_free(worker->branches);
+}
+
+static BatchJob *
+job_pop(RSBatchEngine *engine)
+{
+	BatchJob *job = NULL;
+	BatchJob *next;
+
+	g_mutex_lock(&engine->lock);
+	if (!engine->cancelled)
+		job = g_queue_pop_head(engine->jobs);
+
+	/* Let the IO layer start reading the next photo while we work on this */
+	next = g_queue_peek_head(engine->jobs);
+	if (job && next)
+		rs_io_idle_prefetch_file(next->filename, 0xC01A);
+	g_mutex_unlock(&engine->lock);
+
+	return job;
+}
+
+static void
+job_free(BatchJob *job)
+{
+	g_free(job->filename);
+	g_free(job);
+}
+
+/* Block until the photo fits in the memory budget. A photo is always
+ * admitted when nothing else is in flight, even if it's larger than the budget */
+static void
+memory_reserve(RSBatchEngine *engine, guint64 bytes)
+{
+	g_mutex_lock(&engine->lock);
+	while (engine->memory_in_use > 0 && (engine->memory_in_use + bytes) > engine->memory_budget)
+		g_cond_wait(&engine->memory_cond, &engine->lock);
+	engine->memory_in_use += bytes;
+	g_mutex_unlock(&engine->lock);
+}
+
+static void
+memory_release(RSBatchEngine *engine, guint64 bytes)
+{
+	g_mutex_lock(&engine->lock);
+	engine->memory_in_use -= bytes;
+	g_cond_broadcast(&engine->memory_cond);
+	g_mutex_unlock(&engine->lock);
+}
+
+/* Replace a reservation of reserved bytes with one of bytes. Growing gives up
+ * the old reservation while waiting, so two workers growing at the same time
+ * can't wait for each other */
+static void
+memory_adjust(RSBatchEngine *engine, guint64 reserved, guint64 bytes)
+{
+	g_mutex_lock(&engine->lock);
+	engine->memory_in_use -= reserved;
+	if (bytes > reserved)
+		while (engine->memory_in_use > 0 && (engine->memory_in_use + bytes) > engine->memory_budget)
+			g_cond_wait(&engine->memory_cond, &engine->lock);
+	engine->memory_in_use += bytes;
+	g_cond_broadcast(&engine->memory_cond);
+	g_mutex_unlock(&engine->lock);
+}
+
+/* Parse the output filename and make sure no other worker gets the same name
+ * from the %c counter, by creating the file before releasing the lock */
+static gchar *
+output_filename_reserve(RSBatchEngine *engine, BatchBranch *branch, const gchar *input, gint setting_id, gchar **error)
+{
+	gchar *template, *filename, *dir;
+	FILE *fp;
+
+	template = g_strconcat(branch->batch_output->filename_template, ".", rs_output_get_extension(branch->output), NULL);
+
+	g_mutex_lock(&engine->filename_lock);
+	filename = filename_parse(template, input, setting_id, TRUE);
+	g_free(template);
+
+	if (filename)
+	{
+		/* Create directory, if it doesn't exist */
+		dir = g_path_get_dirname(filename);
+		if (FALSE == g_file_test(dir, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))
+			if (g_mkdir_with_parents(dir, 0x1ff))
+			{
+				*error = g_strdup(_("Could not create output directory."));
+				g_free(filename);
+				filename = NULL;
+			}
+		g_free(dir);
+	}
+
+	if (filename && !g_file_test(filename, G_FILE_TEST_EXISTS))
+	{
+		fp = g_fopen(filename, "wb");
+		if (fp)
+			fclose(fp);
+	}
+	g_mutex_unlock(&engine->filename_lock);
+
+	return filename;
+}
+
+static void
+branch_set_size(BatchWorker *worker, BatchBranch *branch)
+{
+	const RSBatchOutput *output = branch->batch_output;
+	gint width = 65535;
+	gint height = 65535;
+	gdouble scale;
+
+	/* Calculate new size */
+	switch (output->size_lock)
+	{
+		case LOCK_SCALE:
+			scale = output->scale/100.0;
+			rs_filter_get_size_simple(worker->fcrop, RS_FILTER_REQUEST_QUICK, &width, &height);
+			width = (gint) (((gdouble) width) * scale);
+			height = (gint) (((gdouble) height) * scale);
+			break;
+		case LOCK_WIDTH:
+			width = output->width;
+			break;
+		case LOCK_HEIGHT:
+			height = output->height;
+			break;
+		case LOCK_BOUNDING_BOX:
+			width = output->width;
+			height = output->height;
+			break;
+	}
+	rs_filter_set_recursive(branch->fend,
+		"width", width,
+		"height", height,
+		NULL);
+}
+
+/* Outputs known to make exactly the request built by encode_capture() */
+static const gchar *deferrable_outputs[] = { "RSJpegfile", "RSPngfile", "RSTifffile", NULL };
+
+static gboolean
+output_can_defer(RSOutput *output)
+{
+	gint i;
+
+	for(i = 0; deferrable_outputs[i]; i++)
+		if (g_str_equal(G_OBJECT_TYPE_NAME(output), deferrable_outputs[i]))
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Very large images are better streamed by the output itself than kept
+ * in memory until an encoder is free */
+static gboolean
+encode_fits(RSBatchEngine *engine, RSFilter *filter)
+{
+	gint width, height;
+
+	if (!rs_filter_get_size_simple(filter, RS_FILTER_REQUEST_QUICK, &width, &height))
+		return FALSE;
+
+	return ((gsize) width * height * BYTES_PER_PIXEL) <= engine->encode_queue_limit;
+}
+
+/* Render what the output would ask for when executed */
+static RSFilterResponse *
+encode_capture(RSOutput *output, RSFilter *filter, gsize *bytes)
+{
+	RSFilterRequest *request = rs_filter_request_new();
+	RSFilterResponse *response;
+	RSColorSpace *color_space = NULL;
+	gboolean save16bit = FALSE;
+
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(output), "colorspace"))
+		g_object_get(output, "colorspace", &color_space, NULL);
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(output), "save16bit"))
+		g_object_get(output, "save16bit", &save16bit, NULL);
+
+	rs_filter_request_set_quick(request, FALSE);
+	if (color_space)
+		rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", color_space);
+
+	*bytes = 0;
+	if (save16bit)
+	{
+		RS_IMAGE16 *image;
+
+		response = rs_filter_get_image(filter, request);
+		image = rs_filter_response_get_image(response);
+		if (image)
+		{
+			*bytes = (gsize) image->rowstride * image->h * sizeof(gushort);
+			g_object_unref(image);
+		}
+	}
+	else
+	{
+		GdkPixbuf *pixbuf;
+
+		response = rs_filter_get_image8(filter, request);
+		pixbuf = rs_filter_response_get_image8(response);
+		if (pixbuf)
+		{
+			*bytes = (gsize) gdk_pixbuf_get_rowstride(pixbuf) * gdk_pixbuf_get_height(pixbuf);
+			g_object_unref(pixbuf);
+		}
+	}
+
+	g_object_unref(request);
+	if (color_space)
+		g_object_unref(color_space);
+
+	return response;
+}
+
+/* SHA-1 of a written output, computed by the thread that wrote it */
+static gchar *
+output_checksum(RSBatchEngine *engine, const gchar *filename)
+{
+	GChecksum *checksum;
+	guchar *buffer;
+	gchar *ret;
+	FILE *file;
+	size_t n;
+
+	if (!engine->checksums)
+		return NULL;
+
+	file = g_fopen(filename, "rb");
+	if (!file)
+		return NULL;
+
+	buffer = g_malloc(65536);
+	checksum = g_checksum_new(G_CHECKSUM_SHA1);
+	while ((n = fread(buffer, 1, 65536, file)) > 0)
+		g_checksum_update(checksum, buffer, n);
+	fclose(file);
+	g_free(buffer);
+
+	ret = g_strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+
+	return ret;
+}
+
+static PendingResult *
+pending_new(RSBatchResult *result, gint n_outputs)
+{
+	PendingResult *pending = g_new0(PendingResult, 1);
+
+	pending->result = result;
+	pending->filenames = g_new0(gchar *, n_outputs);
+	pending->checksums = g_new0(gchar *, n_outputs);
+	pending->n_filenames = n_outputs;
+	/* Held by the worker until it has handed off all outputs */
+	pending->outstanding = 1;
+
+	return pending;
+}
+
+/* Record the outcome of one output, the result is pushed when the last is done */
+static void
+pending_done(RSBatchEngine *engine, PendingResult *pending, gint index, gchar *filename, gchar *checksum, const gchar *error, gdouble encode_time)
+{
+	RSBatchResult *result = pending->result;
+	gboolean finished;
+	gint i, n = 0;
+
+	g_mutex_lock(&engine->encode_lock);
+	if (index >= 0)
+	{
+		pending->filenames[index] = filename;
+		pending->checksums[index] = checksum;
+	}
+	if (error)
+	{
+		result->status = RS_BATCH_STATUS_FAILED;
+		if (!result->error)
+			result->error = g_strdup(error);
+	}
+	result->encode_time += encode_time;
+	finished = (--pending->outstanding == 0);
+	g_mutex_unlock(&engine->encode_lock);
+
+	if (!finished)
+		return;
+
+	/* Keep the order outputs were added in */
+	result->output_filenames = g_new0(gchar *, pending->n_filenames + 1);
+	if (engine->checksums)
+		result->output_checksums = g_new0(gchar *, pending->n_filenames + 1);
+	for(i = 0; i < pending->n_filenames; i++)
+		if (pending->filenames[i])
+		{
+			if (result->output_checksums)
+				result->output_checksums[n] = pending->checksums[i] ? pending->checksums[i] : g_strdup("");
+			else
+				g_free(pending->checksums[i]);
+			result->output_filenames[n++] = pending->filenames[i];
+		}
+		else
+			g_free(pending->checksums[i]);
+
+	g_free(pending->filenames);
+	g_free(pending->checksums);
+	g_free(pending);
+	g_async_queue_push(engine->results, result);
+}
+
+/* Blocks while the queue is over its memory limit, unless it's empty */
+static void
+encode_push(RSBatchEngine *engine, EncodeTask *task)
+{
+	g_mutex_lock(&engine->encode_lock);
+	while (engine->encode_queue_bytes > 0 && (engine->encode_queue_bytes + task->bytes) > engine->encode_queue_limit)
+		g_cond_wait(&engine->encode_cond, &engine->encode_lock);
+	engine->encode_queue_bytes += task->bytes;
+	task->pending->outstanding++;
+	g_queue_push_tail(engine->encode_queue, task);
+	g_cond_broadcast(&engine->encode_cond);
+	g_mutex_unlock(&engine->encode_lock);
+}
+
+static gpointer
+encoder_thread(gpointer data)
+{
+	RSBatchEngine *engine = data;
+	EncodeTask *task;
+	GTimer *timer = g_timer_new();
+
+	while (TRUE)
+	{
+		gchar *filename = NULL;
+		gchar *checksum = NULL;
+		const gchar *error = NULL;
+		gdouble encode_time;
+
+		g_mutex_lock(&engine->encode_lock);
+		while (g_queue_is_empty(engine->encode_queue) && engine->workers_running > 0)
+			g_cond_wait(&engine->encode_cond, &engine->encode_lock);
+		task = g_queue_pop_head(engine->encode_queue);
+		g_mutex_unlock(&engine->encode_lock);
+
+		/* Queue is empty and no worker can add more */
+		if (!task)
+			break;
+
+		g_object_get(task->output, "filename", &filename, NULL);
+
+		g_timer_start(timer);
+		if (!rs_output_execute(task->output, task->frozen))
+		{
+			error = _("Could not export photo.");
+			/* Don't leave the placeholder from output_filename_reserve() behind */
+			g_unlink(filename);
+			g_free(filename);
+			filename = NULL;
+		}
+		encode_time = g_timer_elapsed(timer, NULL);
+
+		/* Free the image before admitting more */
+		g_object_unref(task->frozen);
+		g_object_unref(task->output);
+		g_mutex_lock(&engine->encode_lock);
+		engine->encode_queue_bytes -= task->bytes;
+		g_cond_broadcast(&engine->encode_cond);
+		g_mutex_unlock(&engine->encode_lock);
+
+		if (filename)
+			checksum = output_checksum(engine, filename);
+
+		pending_done(engine, task->pending, task->index, filename, checksum, error, encode_time);
+		g_free(task);
+	}
+
+	g_timer_destroy(timer);
+
+	return NULL;
+}
+
+static void
+render_snapshot(BatchWorker *worker, BatchJob *job, RS_PHOTO *photo, RSBatchResult *result)
+{
+	RSBatchEngine *engine = worker->engine;
+	const guint n_outputs = engine->outputs->len;
+	GTimer *timer = g_timer_new();
+	PendingResult *pending;
+	GList *filters = NULL;
+	guint i;
+
+	/* Apply settings to all branches before rendering anything, setting the
+	 * shared part of the chain again later would flush the cache */
+	for(i = 0; i < n_outputs; i++)
+		filters = g_list_append(filters, worker->branches[i].fend);
+	rs_photo_apply_to_filters(photo, filters, result->setting_id);
+	g_list_free(filters);
+
+	/* Render preview image */
+	if (engine->preview_size > 0)
+	{
+		RSFilterRequest *request = rs_filter_request_new();
+		RSFilterResponse *response;
+		RSFilter *fend = worker->branches[0].fend;
+
+		rs_filter_set_recursive(fend,
+			"width", engine->preview_size,
+			"height", engine->preview_size,
+			NULL);
+		rs_filter_request_set_quick(RS_FILTER_REQUEST(request), FALSE);
+		/* FIXME: Should be set to output colorspace, not forced to sRGB */
+		if (engine->preview_colorspace)
+			rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", engine->preview_colorspace);
+		response = rs_filter_get_image8(fend, request);
+		result->preview = rs_filter_response_get_image8(response);
+		g_object_unref(request);
+		g_object_unref(response);
+	}
+
+	/* Everything up to the cache is rendered by the first output, the rest
+	 * only resample from the cached image. Encoding is handed off to the
+	 * encoder threads whenever possible, so the next photo can start */
+	result->status = RS_BATCH_STATUS_EXPORTED;
+	pending = pending_new(result, n_outputs);
+	for(i = 0; i < n_outputs; i++)
+	{
+		BatchBranch *branch = &worker->branches[i];
+		gchar *filename, *checksum;
+		gchar *error = NULL;
+
+		filename = output_filename_reserve(engine, branch, job->filename, result->setting_id, &error);
+		if (!filename)
+		{
+			pending_done(engine, pending, -1, NULL, NULL, error, 0.0);
+			g_free(error);
+			pending = NULL;
+			break;
+		}
+
+		branch_set_size(worker, branch);
+
+		if (output_can_defer(branch->output) && encode_fits(engine, branch->fend))
+		{
+			EncodeTask *task = g_new0(EncodeTask, 1);
+			RSFilterResponse *response = encode_capture(branch->output, branch->fend, &task->bytes);
+
+			task->pending = pending;
+			task->index = i;
+			task->frozen = rs_batch_frozen_new(response, job->filename);
+			/* The branch output is reused for the next photo */
+			task->output = output_clone(branch->output);
+			g_object_set(task->output, "filename", filename, NULL);
+			g_free(filename);
+			g_object_unref(response);
+
+			encode_push(engine, task);
+			continue;
+		}
+
+		/* Save the image */
+		if (g_object_class_find_property(G_OBJECT_GET_CLASS(branch->output), "filename"))
+			g_object_set(branch->output, "filename", filename, NULL);
+
+		if (!rs_output_execute(branch->output, branch->fend))
+		{
+			/* Don't leave the placeholder from output_filename_reserve() behind */
+			g_unlink(filename);
+			g_free(filename);
+			pending_done(engine, pending, -1, NULL, NULL, _("Could not export photo."), 0.0);
+			pending = NULL;
+			break;
+		}
+		checksum = output_checksum(engine, filename);
+		g_mutex_lock(&engine->encode_lock);
+		pending->filenames[i] = filename;
+		pending->checksums[i] = checksum;
+		g_mutex_unlock(&engine->encode_lock);
+	}
+
+	result->render_time = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	/* Release the worker's hold, the result is pushed once encoders are done */
+	if (pending)
+		pending_done(engine, pending, -1, NULL, NULL, NULL, 0.0);
+}
+
+static RSBatchResult *
+result_new(BatchJob *job, gint n)
+{
+	RSBatchResult *result = g_new0(RSBatchResult, 1);
+
+	result->filename = g_strdup(job->filename);
+	result->setting_id = job->setting_ids[n];
+
+	return result;
+}
+
+/* Export every snapshot of a file, pushing a result for each */
+static void
+process_job(BatchWorker *worker, BatchJob *job)
+{
+	RSBatchEngine *engine = worker->engine;
+	const guint n_outputs = engine->outputs->len;
+	RSBatchResult *result;
+	RS_PHOTO *photo;
+	GTimer *timer = g_timer_new();
+	gdouble load_time;
+	guint64 per_pixel, footprint;
+	gint n;
+
+	/* Every extra output may add a full size copy after the cache, and the
+	 * demosaic cache holds one more when snapshots share it */
+	per_pixel = (guint64) (IMAGE_COPIES + n_outputs - 1 + ((job->n_settings > 1) ? 1 : 0)) * BYTES_PER_PIXEL;
+
+	/* The size is unknown until the photo is loaded, reserve for a typical
+	 * photo before loading it and settle the difference afterwards */
+	footprint = per_pixel * TYPICAL_PIXELS;
+	memory_reserve(engine, footprint);
+
+	photo = rs_photo_load_from_file(job->filename);
+	if (!photo)
+	{
+		memory_release(engine, footprint);
+		for(n = 0; n < job->n_settings; n++)
+		{
+			result = result_new(job, n);
+			result->status = RS_BATCH_STATUS_LOAD_FAILED;
+			result->error = g_strdup(_("Could not load photo."));
+			g_async_queue_push(engine->results, result);
+		}
+		g_timer_destroy(timer);
+		return;
+	}
+	rs_metadata_load_from_file(photo->metadata, job->filename);
+	rs_cache_load(photo);
+	load_time = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	if (photo->input)
+	{
+		guint64 actual = per_pixel * (guint64) photo->input->w * (guint64) photo->input->h;
+		memory_adjust(engine, footprint, actual);
+		footprint = actual;
+	}
+
+	/* Keeping the demosaiced image around is only worth it if it's used again */
+	rs_filter_set_enabled(worker->fcache_demosaic, job->n_settings > 1);
+
+	rs_filter_set_recursive(worker->fcache,
+		"image", photo->input_response,
+		"filename", photo->filename,
+		NULL);
+	for(n = 0; n < (gint) n_outputs; n++)
+		rs_filter_set_recursive(worker->branches[n].fend, "bounding-box", TRUE, NULL);
+
+	for(n = 0; n < job->n_settings; n++)
+	{
+		result = result_new(job, n);
+		result->settings_digest = rs_batch_settings_digest(job->filename, job->setting_ids[n]);
+
+		/* The photo was only loaded once, the first snapshot pays for it */
+		if (n == 0)
+			result->load_time = load_time;
+
+		/* Pushes the result when all outputs are written */
+		render_snapshot(worker, job, photo, result);
+	}
+
+	/* Drop references to the photo from the chain before releasing memory */
+	RSFilterResponse *empty = rs_filter_response_new();
+	rs_filter_set_recursive(worker->fcache, "image", empty, NULL);
+	g_object_unref(empty);
+	g_object_unref(photo);
+	memory_release(engine, footprint);
+}
+
+static gpointer
+worker_thread(gpointer data)
+{
+	BatchWorker *worker = data;
+	RSBatchEngine *engine = worker->engine;
+	BatchJob *job;
+
+	while ((job = job_pop(engine)))
+	{
+		process_job(worker, job);
+		job_free(job);
+	}
+
+	/* Let encoders finish once the last worker is done */
+	g_mutex_lock(&engine->encode_lock);
+	engine->workers_running--;
+	g_cond_broadcast(&engine->encode_cond);
+	g_mutex_unlock(&engine->encode_lock);
+
+	return NULL;
+}
+
+static void
+batch_output_free(RSBatchOutput *output)
+{
+	rs_batch_output_clear(output);
+	g_free(output);
+}
+
+/**
+ * Look up an RSOutput type from a user supplied name
+ * @param name A type name like "RSJpegfile", a short name like "jpeg" or an extension like "jpg"
+ * @return The GType of the output or 0 if not found
+ */
+GType
+rs_batch_output_type_find(const gchar *name)
+{
+	GType *savers;
+	GType found = 0;
+	guint n_savers = 0, i;
+	gchar *guess;
+
+	g_return_val_if_fail(name != NULL, 0);
+
+	guess = g_strdup_printf("RS%sfile", name);
+	savers = g_type_children(RS_TYPE_OUTPUT, &n_savers);
+	for (i = 0; i < n_savers && !found; i++)
+	{
+		RSOutputClass *klass = g_type_class_ref(savers[i]);
+
+		if (g_ascii_strcasecmp(name, g_type_name(savers[i])) == 0
+			|| g_ascii_strcasecmp(guess, g_type_name(savers[i])) == 0
+			|| (klass->extension && g_ascii_strcasecmp(name, klass->extension) == 0))
+			found = savers[i];
+		g_type_class_unref(klass);
+	}
+	g_free(savers);
+	g_free(guess);
+
+	return found;
+}
+
+/**
+ * Set the size of a RSBatchOutput from a string
+ * @param output A RSBatchOutput
+ * @param size "WxH" for a bounding box, "Wx" or "xH" to lock width or height and "N%" to scale
+ * @return TRUE if size could be parsed, output is untouched otherwise
+ */
+gboolean
+rs_batch_output_parse_size(RSBatchOutput *output, const gchar *size)
+{
+	gint width = 0, height = 0, scale = 0;
+	gchar percent = 0;
+
+	g_return_val_if_fail(output != NULL, FALSE);
+	g_return_val_if_fail(size != NULL, FALSE);
+
+	if (sscanf(size, "%d%c", &scale, &percent) == 2 && percent == '%' && scale > 0)
+	{
+		output->size_lock = LOCK_SCALE;
+		output->scale = scale;
+	}
+	else if (sscanf(size, "%dx%d", &width, &height) == 2 && width > 0 && height > 0)
+	{
+		output->size_lock = LOCK_BOUNDING_BOX;
+		output->width = width;
+		output->height = height;
+	}
+	else if (size[0] == 'x' && sscanf(size, "x%d", &height) == 1 && height > 0)
+	{
+		output->size_lock = LOCK_HEIGHT;
+		output->height = height;
+	}
+	else if (sscanf(size, "%dx", &width) == 1 && width > 0)
+	{
+		output->size_lock = LOCK_WIDTH;
+		output->width = width;
+	}
+	else
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Fill in a RSBatchOutput from a profile description of the form
+ * "format[,size[,template]]", for example "jpeg,2048x2048,%f_2048". The
+ * output plugin is configured from the batch settings in config
+ * @param output The RSBatchOutput to fill in, free with rs_batch_output_clear()
+ * @param description A profile description
+ * @param directory Output directory, used when the template doesn't contain %p
+ * @param default_filename Template to use when the description doesn't have one
+ * @return TRUE on success
+ */
+gboolean
+rs_batch_output_parse(RSBatchOutput *output, const gchar *description, const gchar *directory, const gchar *default_filename)
+{
+	gchar **fields;
+	const gchar *filename;
+	GType type;
+
+	g_return_val_if_fail(output != NULL, FALSE);
+	g_return_val_if_fail(description != NULL, FALSE);
+	g_return_val_if_fail(directory != NULL, FALSE);
+	g_return_val_if_fail(default_filename != NULL, FALSE);
+
+	memset(output, 0, sizeof(RSBatchOutput));
+	output->size_lock = LOCK_SCALE;
+	output->scale = 100;
+
+	fields = g_strsplit(description, ",", 3);
+	type = fields[0] ? rs_batch_output_type_find(g_strstrip(fields[0])) : 0;
+	if (!type || (fields[1] && !rs_batch_output_parse_size(output, g_strstrip(fields[1]))))
+	{
+		g_strfreev(fields);
+		return FALSE;
+	}
+
+	filename = (fields[1] && fields[2]) ? g_strstrip(fields[2]) : default_filename;
+	if (g_strrstr(filename, "%p"))
+		output->filename_template = g_strdup(filename);
+	else
+		output->filename_template = g_build_filename(directory, filename, NULL);
+
+	output->output = rs_output_new(g_type_name(type));
+	rs_output_set_from_conf(output->output, "batch");
+
+	g_strfreev(fields);
+
+	return TRUE;
+}
+
+/**
+ * Free the members of a RSBatchOutput filled in by rs_batch_output_parse()
+ * @param output A RSBatchOutput
+ */
+void
+rs_batch_output_clear(RSBatchOutput *output)
+{
+	g_return_if_fail(output != NULL);
+
+	if (output->output)
+		g_object_unref(output->output);
+	g_free(output->filename_template);
+	output->output = NULL;
+	output->filename_template = NULL;
+}
+
+/**
+ * Create a new batch engine. The engine runs several photos at once, each
+ * worker owning its own filter chain and outputs
+ * @param output What to write for each photo, this is copied
+ * @param max_in_flight Maximum number of photos to process concurrently,
+ *                      0 to size it from processor cores and memory budget
+ * @return A new RSBatchEngine, free with rs_batch_engine_free()
+ */
+RSBatchEngine *
+rs_batch_engine_new(const RSBatchOutput *output, gint max_in_flight)
+{
+	RSBatchEngine *engine;
+
+	g_return_val_if_fail(output != NULL, NULL);
+	g_return_val_if_fail(RS_IS_OUTPUT(output->output), NULL);
+	g_return_val_if_fail(output->filename_template != NULL, NULL);
+
+	engine = g_new0(RSBatchEngine, 1);
+	engine->outputs = g_ptr_array_new_with_free_func((GDestroyNotify) batch_output_free);
+	rs_batch_engine_add_output(engine, output);
+
+	g_mutex_init(&engine->lock);
+	g_mutex_init(&engine->filename_lock);
+	g_cond_init(&engine->memory_cond);
+	engine->jobs = g_queue_new();
+	engine->jobs_by_filename = g_hash_table_new(g_str_hash, g_str_equal);
+	engine->results = g_async_queue_new();
+	engine->memory_budget = memory_budget_get();
+
+	g_mutex_init(&engine->encode_lock);
+	g_cond_init(&engine->encode_cond);
+	engine->encode_queue = g_queue_new();
+	engine->encode_queue_limit = engine->memory_budget / ENCODE_QUEUE_SHARE;
+
+	/* Every photo is already rendered by all cores, but loading, metadata
+	 * and saving are single threaded. Keeping a photo per core in flight
+	 * hides those, as long as they fit in memory */
+	if (max_in_flight < 1)
+	{
+		guint64 per_photo = (guint64) IMAGE_COPIES * BYTES_PER_PIXEL * TYPICAL_PIXELS;
+
+		max_in_flight = rs_get_number_of_processor_cores();
+		max_in_flight = MIN(max_in_flight, (gint) MAX(1, engine->memory_budget / per_photo));
+	}
+	engine->n_workers = MAX(1, max_in_flight);
+
+	/* Encoders are mostly single threaded, but don't let them take all cores
+	 * from rendering */
+	engine->n_encoders = MAX(1, MIN(engine->n_workers, rs_get_number_of_processor_cores() / 2));
+
+	return engine;
+}
+
+/**
+ * Add another output to write for each photo. All outputs share the
+ * rendering up to the cache, only resampling and saving is done per output
+ * @param engine A RSBatchEngine
+ * @param output What to write for each photo, this is copied
+ */
+void
+rs_batch_engine_add_output(RSBatchEngine *engine, const RSBatchOutput *output)
+{
+	RSBatchOutput *copy;
+
+	g_return_if_fail(engine != NULL);
+	g_return_if_fail(output != NULL);
+	g_return_if_fail(RS_IS_OUTPUT(output->output));
+	g_return_if_fail(output->filename_template != NULL);
+	g_return_if_fail(!engine->started);
+
+	copy = g_new(RSBatchOutput, 1);
+	*copy = *output;
+	copy->output = g_object_ref(output->output);
+	copy->filename_template = g_strdup(output->filename_template);
+	g_ptr_array_add(engine->outputs, copy);
+}
+
+/* Append name=value for every readable property of object, except the ones
+ * in skip. Objects are described by their type, floats are written
+ * independent of locale */
+static void
+append_properties(GString *str, GObject *object, const gchar *skip)
+{
+	GParamSpec **specs;
+	guint n_specs = 0;
+	guint i;
+
+	specs = g_object_class_list_properties(G_OBJECT_GET_CLASS(object), &n_specs);
+	for(i = 0; i < n_specs; i++)
+	{
+		GValue value = {0};
+		gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+		if (!(specs[i]->flags & G_PARAM_READABLE) || (skip && g_str_equal(specs[i]->name, skip)))
+			continue;
+
+		g_value_init(&value, G_PARAM_SPEC_VALUE_TYPE(specs[i]));
+		g_object_get_property(object, specs[i]->name, &value);
+
+		g_string_append_printf(str, ",%s=", specs[i]->name);
+		if (G_VALUE_HOLDS_FLOAT(&value))
+			g_string_append(str, g_ascii_dtostr(buffer, sizeof(buffer), g_value_get_float(&value)));
+		else if (G_VALUE_HOLDS_DOUBLE(&value))
+			g_string_append(str, g_ascii_dtostr(buffer, sizeof(buffer), g_value_get_double(&value)));
+		else if (G_VALUE_HOLDS_OBJECT(&value))
+			g_string_append(str, g_value_get_object(&value) ? G_OBJECT_TYPE_NAME(g_value_get_object(&value)) : "none");
+		else
+		{
+			gchar *contents = g_strdup_value_contents(&value);
+			g_string_append(str, contents);
+			g_free(contents);
+		}
+		g_value_unset(&value);
+	}
+	g_free(specs);
+}
+
+/**
+ * Describe the outputs of an engine, two engines with the same signature
+ * write the same files for a photo
+ * @param engine A RSBatchEngine
+ * @return A newly allocated string
+ */
+gchar *
+rs_batch_engine_get_signature(RSBatchEngine *engine)
+{
+	GString *signature = g_string_new(NULL);
+	guint i;
+
+	g_return_val_if_fail(engine != NULL, NULL);
+
+	for(i = 0; i < engine->outputs->len; i++)
+	{
+		RSBatchOutput *output = g_ptr_array_index(engine->outputs, i);
+
+		if (i > 0)
+			g_string_append_c(signature, ';');
+		g_string_append_printf(signature, "%s,%d,%d,%d,%d,%s",
+			G_OBJECT_TYPE_NAME(output->output), output->size_lock,
+			output->width, output->height, output->scale,
+			output->filename_template);
+		/* Quality, bit depth, colorspace and whatever else the plugin has */
+		append_properties(signature, G_OBJECT(output->output), "filename");
+	}
+
+	return g_string_free(signature, FALSE);
+}
+
+/**
+ * Compute a digest of everything a snapshot of a photo is exported with, as
+ * stored in its cache. Photos with the same digest render the same image
+ * @param filename The photo
+ * @param setting_id The snapshot
+ * @return A newly allocated SHA-1 in hex
+ */
+gchar *
+rs_batch_settings_digest(const gchar *filename, gint setting_id)
+{
+	GString *str = g_string_new(NULL);
+	RS_PHOTO *photo;
+	RSDcpFile *dcp;
+	RSIccProfile *icc;
+	gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar *ret;
+	gint i;
+
+	g_return_val_if_fail(filename != NULL, NULL);
+	g_return_val_if_fail(setting_id >= 0 && setting_id < 3, NULL);
+
+	/* Only the cache is read, not the image */
+	photo = rs_photo_new();
+	photo->filename = g_strdup(filename);
+	rs_cache_load(photo);
+
+	g_string_append_printf(str, "orientation=%u,angle=%s", photo->orientation,
+		g_ascii_dtostr(buffer, sizeof(buffer), photo->angle));
+	if (photo->crop)
+		g_string_append_printf(str, ",crop=%d %d %d %d",
+			photo->crop->x1, photo->crop->y1, photo->crop->x2, photo->crop->y2);
+	dcp = rs_photo_get_dcp_profile(photo);
+	if (RS_IS_DCP_FILE(dcp))
+		g_string_append_printf(str, ",dcp-profile=%s", rs_dcp_get_id(dcp));
+	icc = rs_photo_get_icc_profile(photo);
+	if (RS_IS_ICC_PROFILE(icc))
+	{
+		gchar *icc_filename = NULL;
+		g_object_get(icc, "filename", &icc_filename, NULL);
+		g_string_append_printf(str, ",icc-profile=%s", icc_filename ? icc_filename : "");
+		g_free(icc_filename);
+	}
+
+	append_properties(str, G_OBJECT(photo->settings[setting_id]), NULL);
+	g_string_append(str, ",curve=");
+	for(i = 0; i < photo->settings[setting_id]->curve_nknots * 2; i++)
+	{
+		g_string_append(str, g_ascii_dtostr(buffer, sizeof(buffer), photo->settings[setting_id]->curve_knots[i]));
+		g_string_append_c(str, ' ');
+	}
+	g_object_unref(photo);
+
+	ret = g_compute_checksum_for_string(G_CHECKSUM_SHA1, str->str, str->len);
+	g_string_free(str, TRUE);
+
+	return ret;
+}
+
+/**
+ * Ask the engine to render a small preview of each photo
+ * @param engine A RSBatchEngine
+ * @param size The bounding box of the preview, 0 to disable
+ * @param colorspace The colorspace to render the preview in
+ */
+void
+rs_batch_engine_set_preview(RSBatchEngine *engine, gint size, RSColorSpace *colorspace)
+{
+	g_return_if_fail(engine != NULL);
+	g_return_if_fail(!engine->started);
+
+	engine->preview_size = MAX(0, size);
+	if (engine->preview_colorspace)
+		g_object_unref(engine->preview_colorspace);
+	engine->preview_colorspace = colorspace ? g_object_ref(colorspace) : NULL;
+}
+
+/**
+ * Ask the engine to compute a SHA-1 of every written output, in the thread
+ * that wrote it. They are returned in RSBatchResult output_checksums
+ * @param engine A RSBatchEngine
+ * @param checksums TRUE to compute checksums
+ */
+void
+rs_batch_engine_set_checksums(RSBatchEngine *engine, gboolean checksums)
+{
+	g_return_if_fail(engine != NULL);
+	g_return_if_fail(!engine->started);
+
+	engine->checksums = checksums;
+}
+
+/**
+ * Add a photo to the engine, must be called before rs_batch_engine_start().
+ * Snapshots of the same file are grouped and exported from a single load
+ * @param engine A RSBatchEngine
+ * @param filename The photo to export
+ * @param setting_id The snapshot to export
+ */
+void
+rs_batch_engine_add(RSBatchEngine *engine, const gchar *filename, gint setting_id)
+{
+	BatchJob *job;
+	gint i;
+
+	g_return_if_fail(engine != NULL);
+	g_return_if_fail(filename != NULL);
+	g_return_if_fail(!engine->started);
+
+	g_return_if_fail(setting_id >= 0 && setting_id < 3);
+
+	g_mutex_lock(&engine->lock);
+	job = g_hash_table_lookup(engine->jobs_by_filename, filename);
+	if (!job)
+	{
+		job = g_new0(BatchJob, 1);
+		job->filename = g_strdup(filename);
+		g_queue_push_tail(engine->jobs, job);
+		g_hash_table_insert(engine->jobs_by_filename, job->filename, job);
+	}
+	for(i = 0; i < job->n_settings; i++)
+		if (job->setting_ids[i] == setting_id)
+			break;
+	if (i == job->n_settings)
+	{
+		job->setting_ids[job->n_settings++] = setting_id;
+		engine->pending++;
+	}
+	g_mutex_unlock(&engine->lock);
+}
+
+/**
+ * Start the worker threads
+ * @param engine A RSBatchEngine
+ */
+void
+rs_batch_engine_start(RSBatchEngine *engine)
+{
+	gint i;
+
+	g_return_if_fail(engine != NULL);
+	g_return_if_fail(!engine->started);
+
+	engine->started = TRUE;
+	/* Jobs are freed by the workers, the lookup is only needed while adding */
+	g_hash_table_remove_all(engine->jobs_by_filename);
+	engine->workers = g_new0(BatchWorker, engine->n_workers);
+	for(i = 0; i < engine->n_workers; i++)
+		worker_init(&engine->workers[i], engine);
+	engine->workers_running = engine->n_workers;
+	for(i = 0; i < engine->n_workers; i++)
+		engine->workers[i].thread = g_thread_new("batch-worker", worker_thread, &engine->workers[i]);
+
+	engine->encoders = g_new0(GThread *, engine->n_encoders);
+	for(i = 0; i < engine->n_encoders; i++)
+		engine->encoders[i] = g_thread_new("batch-encoder", encoder_thread, engine);
+}
+
+/**
+ * Get the number of workers the engine runs
+ * @param engine A RSBatchEngine
+ * @return Maximum number of photos in flight
+ */
+gint
+rs_batch_engine_get_n_workers(RSBatchEngine *engine)
+{
+	g_return_val_if_fail(engine != NULL, 0);
+
+	return engine->n_workers;
+}
+
+/**
+ * Get the number of results not yet returned by rs_batch_engine_pop_result()
+ * @param engine A RSBatchEngine
+ * @return Number of photos queued, in flight or finished but not popped
+ */
+gint
+rs_batch_engine_get_pending(RSBatchEngine *engine)
+{
+	gint pending;
+
+	g_return_val_if_fail(engine != NULL, 0);
+
+	g_mutex_lock(&engine->lock);
+	pending = engine->pending;
+	g_mutex_unlock(&engine->lock);
+
+	return pending;
+}
+
+/**
+ * Wait for the next finished photo. Results arrive in completion order, not
+ * in the order they were added
+ * @param engine A RSBatchEngine
+ * @param timeout_ms How long to wait in milliseconds
+ * @return A RSBatchResult to be freed with rs_batch_result_free() or NULL on timeout
+ */
+RSBatchResult *
+rs_batch_engine_pop_result(RSBatchEngine *engine, guint timeout_ms)
+{
+	RSBatchResult *result;
+
+	g_return_val_if_fail(engine != NULL, NULL);
+
+	result = g_async_queue_timeout_pop(engine->results, ((guint64) timeout_ms) * 1000);
+
+	if (result)
+	{
+		g_mutex_lock(&engine->lock);
+		engine->pending--;
+		g_mutex_unlock(&engine->lock);
+	}
+
+	return result;
+}
+
+/**
+ * Stop the engine from starting new photos, photos already in flight will
+ * still be finished and returned
+ * @param engine A RSBatchEngine
+ */
+void
+rs_batch_engine_cancel(RSBatchEngine *engine)
+{
+	BatchJob *job;
+
+	g_return_if_fail(engine != NULL);
+
+	g_mutex_lock(&engine->lock);
+	engine->cancelled = TRUE;
+	while ((job = g_queue_pop_head(engine->jobs)))
+	{
+		engine->pending -= job->n_settings;
+		job_free(job);
+	}
+	g_mutex_unlock(&engine->lock);
+}
+
+/**
+ * Cancel, wait for all workers and free the engine
+ * @param engine A RSBatchEngine
+ */
+void
+rs_batch_engine_free(RSBatchEngine *engine)
+{
+	RSBatchResult *result;
+	gint i;
+
+	g_return_if_fail(engine != NULL);
+
+	rs_batch_engine_cancel(engine);
+
+	if (engine->workers)
+	{
+		for(i = 0; i < engine->n_workers; i++)
+		{
+			if (engine->workers[i].thread)
+				g_thread_join(engine->workers[i].thread);
+			worker_destroy(&engine->workers[i]);
+		}
+		g_free(engine->workers);
+	}
+
+	/* Encoders leave when the last worker is gone and the queue is empty */
+	if (engine->encoders)
+	{
+		for(i = 0; i < engine->n_encoders; i++)
+			g_thread_join(engine->encoders[i]);
+		g_free(engine->encoders);
+	}
+
+	while ((result = g_async_queue_try_pop(engine->results)))
+		rs_batch_result_free(result);
+	g_async_queue_unref(engine->results);
+
+	g_queue_free(engine->jobs);
+	g_queue_free(engine->encode_queue);
+	g_cond_clear(&engine->encode_cond);
+	g_mutex_clear(&engine->encode_lock);
+	g_hash_table_destroy(engine->jobs_by_filename);
+	g_cond_clear(&engine->memory_cond);
+	g_mutex_clear(&engine->filename_lock);
+	g_mutex_clear(&engine->lock);
+
+	if (engine->preview_colorspace)
+		g_object_unref(engine->preview_colorspace);
+	g_ptr_array_free(engine->outputs, TRUE);
+	g_free(engine);
+}
+
+/**
+ * Free a result returned by rs_batch_engine_pop_result()
+ * @param result A RSBatchResult
+ */
+void
+rs_batch_result_free(RSBatchResult *result)
+{
+	g_return_if_fail(result != NULL);
+
+	g_free(result->filename);
+	g_strfreev(result->output_filenames);
+	g_strfreev(result->output_checksums);
+	g_free(result->settings_digest);
+	g_free(result->error);
+	if (result->preview)
+		g_object_unref(result->preview);
+	g_free(result);
+}
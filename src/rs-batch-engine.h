@@ -0,0 +1,217 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_BATCH_ENGINE_H
+#define RS_BATCH_ENGINE_H
+
+#include "application.h"
+#include "rs-batch.h"
+
+typedef struct _RSBatchEngine RSBatchEngine;
+
+/* Describes what the engine should write for each photo */
+typedef struct {
+	RSOutput *output;           /* Prototype, every worker gets a copy */
+	gchar *filename_template;   /* Parsed by filename_parse(), without extension */
+	RS_QUEUE_SIZE_LOCK size_lock;
+	gint width;
+	gint height;
+	gint scale;                 /* Percent, used for LOCK_SCALE */
+} RSBatchOutput;
+
+typedef enum {
+	RS_BATCH_STATUS_EXPORTED = 0,
+	RS_BATCH_STATUS_LOAD_FAILED,
+	RS_BATCH_STATUS_FAILED,
+} RSBatchStatus;
+
+typedef struct {
+	gchar *filename;
+	gint setting_id;
+	RSBatchStatus status;
+	gchar **output_filenames;   /* Written files in the order outputs were added, NULL-terminated */
+	gchar **output_checksums;   /* SHA-1 of each written file, "" if unreadable, NULL unless requested */
+	gchar *settings_digest;     /* See rs_batch_settings_digest(), NULL if not loaded */
+	gchar *error;               /* Human readable, NULL on success */
+	GdkPixbuf *preview;         /* Only set if a preview size was requested */
+	gdouble load_time;          /* Seconds spent loading the photo and settings */
+	gdouble render_time;        /* Seconds spent rendering, and saving outputs that can't be deferred */
+	gdouble encode_time;        /* Seconds spent saving in the encoder threads */
+} RSBatchResult;
+
+/**
+ * Look up an RSOutput type from a user supplied name
+ * @param name A type name like "RSJpegfile", a short name like "jpeg" or an extension like "jpg"
+ * @return The GType of the output or 0 if not found
+ */
+extern GType
+rs_batch_output_type_find(const gchar *name);
+
+/**
+ * Set the size of a RSBatchOutput from a string
+ * @param output A RSBatchOutput
+ * @param size "WxH" for a bounding box, "Wx" or "xH" to lock width or height and "N%" to scale
+ * @return TRUE if size could be parsed, output is untouched otherwise
+ */
+extern gboolean
+rs_batch_output_parse_size(RSBatchOutput *output, const gchar *size);
+
+/**
+ * Fill in a RSBatchOutput from a profile description of the form
+ * "format[,size[,template]]", for example "jpeg,2048x2048,%f_2048". The
+ * output plugin is configured from the batch settings in config
+ * @param output The RSBatchOutput to fill in, free with rs_batch_output_clear()
+ * @param description A profile description
+ * @param directory Output directory, used when the template doesn't contain %p
+ * @param default_filename Template to use when the description doesn't have one
+ * @return TRUE on success
+ */
+extern gboolean
+rs_batch_output_parse(RSBatchOutput *output, const gchar *description, const gchar *directory, const gchar *default_filename);
+
+/**
+ * Free the members of a RSBatchOutput filled in by rs_batch_output_parse()
+ * @param output A RSBatchOutput
+ */
+extern void
+rs_batch_output_clear(RSBatchOutput *output);
+
+/**
+ * Create a new batch engine. The engine runs several photos at once, each
+ * worker owning its own filter chain and outputs
+ * @param output What to write for each photo, this is copied
+ * @param max_in_flight Maximum number of photos to process concurrently,
+ *                      0 to size it from processor cores and memory budget
+ * @return A new RSBatchEngine, free with rs_batch_engine_free()
+ */
+extern RSBatchEngine *
+rs_batch_engine_new(const RSBatchOutput *output, gint max_in_flight);
+
+/**
+ * Add another output to write for each photo. All outputs share the
+ * rendering up to the cache, only resampling and saving is done per output
+ * @param engine A RSBatchEngine
+ * @param output What to write for each photo, this is copied
+ */
+extern void
+rs_batch_engine_add_output(RSBatchEngine *engine, const RSBatchOutput *output);
+
+/**
+ * Describe the outputs of an engine, two engines with the same signature
+ * write the same files for a photo
+ * @param engine A RSBatchEngine
+ * @return A newly allocated string
+ */
+extern gchar *
+rs_batch_engine_get_signature(RSBatchEngine *engine);
+
+/**
+ * Compute a digest of everything a snapshot of a photo is exported with, as
+ * stored in its cache. Photos with the same digest render the same image
+ * @param filename The photo
+ * @param setting_id The snapshot
+ * @return A newly allocated SHA-1 in hex
+ */
+extern gchar *
+rs_batch_settings_digest(const gchar *filename, gint setting_id);
+
+/**
+ * Ask the engine to render a small preview of each photo
+ * @param engine A RSBatchEngine
+ * @param size The bounding box of the preview, 0 to disable
+ * @param colorspace The colorspace to render the preview in
+ */
+extern void
+rs_batch_engine_set_preview(RSBatchEngine *engine, gint size, RSColorSpace *colorspace);
+
+/**
+ * Ask the engine to compute a SHA-1 of every written output, in the thread
+ * that wrote it. They are returned in RSBatchResult output_checksums
+ * @param engine A RSBatchEngine
+ * @param checksums TRUE to compute checksums
+ */
+extern void
+rs_batch_engine_set_checksums(RSBatchEngine *engine, gboolean checksums);
+
+/**
+ * Add a photo to the engine, must be called before rs_batch_engine_start().
+ * Snapshots of the same file are grouped and exported from a single load
+ * @param engine A RSBatchEngine
+ * @param filename The photo to export
+ * @param setting_id The snapshot to export
+ */
+extern void
+rs_batch_engine_add(RSBatchEngine *engine, const gchar *filename, gint setting_id);
+
+/**
+ * Start the worker threads
+ * @param engine A RSBatchEngine
+ */
+extern void
+rs_batch_engine_start(RSBatchEngine *engine);
+
+/**
+ * Get the number of workers the engine runs
+ * @param engine A RSBatchEngine
+ * @return Maximum number of photos in flight
+ */
+extern gint
+rs_batch_engine_get_n_workers(RSBatchEngine *engine);
+
+/**
+ * Get the number of results not yet returned by rs_batch_engine_pop_result()
+ * @param engine A RSBatchEngine
+ * @return Number of photos queued, in flight or finished but not popped
+ */
+extern gint
+rs_batch_engine_get_pending(RSBatchEngine *engine);
+
+/**
+ * Wait for the next finished photo. Results arrive in completion order, not
+ * in the order they were added
+ * @param engine A RSBatchEngine
+ * @param timeout_ms How long to wait in milliseconds
+ * @return A RSBatchResult to be freed with rs_batch_result_free() or NULL on timeout
+ */
+extern RSBatchResult *
+rs_batch_engine_pop_result(RSBatchEngine *engine, guint timeout_ms);
+
+/**
+ * Stop the engine from starting new photos, photos already in flight will
+ * still be finished and returned
+ * @param engine A RSBatchEngine
+ */
+extern void
+rs_batch_engine_cancel(RSBatchEngine *engine);
+
+/**
+ * Cancel, wait for all workers and free the engine
+ * @param engine A RSBatchEngine
+ */
+extern void
+rs_batch_engine_free(RSBatchEngine *engine);
+
+/**
+ * Free a result returned by rs_batch_engine_pop_result()
+ * @param result A RSBatchResult
+ */
+extern void
+rs_batch_result_free(RSBatchResult *result);
+
+#endif /* RS_BATCH_ENGINE_H */
@@ -0,0 +1,390 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* An append-only record of batch runs. Every finished photo is written as a
+ * single line and synced before the photo is reported, so a run that is
+ * killed can be resumed without exporting anything twice.
+ *
+ * Lines are tab separated, strings are escaped with g_strescape():
+ *   begin <time> <signature>
+ *   item <time> <status> <snapshot> <load> <render> <encode> <input> <settings> [<output> <sha1>]...
+ *   end <time> <exported> <failed> <skipped> <elapsed>
+ */
+
+#include <rawstudio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <config.h>
+#include "rs-batch-journal.h"
+
+#define JOURNAL_HEADER "# rawstudio batch journal 2\n"
+
+/* Fixed fields of an item line, outputs follow as pairs */
+#define ITEM_FIELDS (9)
+
+typedef struct {
+	gchar *settings_digest;     /* See rs_batch_settings_digest() */
+	gchar **outputs;            /* NULL-terminated */
+} JournalItem;
+
+struct _RSBatchJournal {
+	gint fd;
+	gchar *signature;
+	GHashTable *done;           /* "snapshot:filename" -> JournalItem */
+	GTimer *timer;
+	gint exported;
+	gint failed;
+	gint skipped;
+	gdouble render_time;
+};
+
+static gchar *
+journal_key(const gchar *filename, gint setting_id)
+{
+	return g_strdup_printf("%d:%s", setting_id, filename);
+}
+
+static void
+journal_item_free(JournalItem *item)
+{
+	g_free(item->settings_digest);
+	g_strfreev(item->outputs);
+	g_free(item);
+}
+
+static const gchar *
+status_to_string(RSBatchStatus status)
+{
+	switch (status)
+	{
+		case RS_BATCH_STATUS_EXPORTED:
+			return "exported";
+		case RS_BATCH_STATUS_LOAD_FAILED:
+			return "load-failed";
+		default:
+			return "failed";
+	}
+}
+
+static void
+append_double(GString *line, gdouble value)
+{
+	gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+	g_string_append_c(line, '\t');
+	g_string_append(line, g_ascii_formatd(buffer, sizeof(buffer), "%.3f", value));
+}
+
+static void
+append_string(GString *line, const gchar *str)
+{
+	gchar *escaped = g_strescape(str, NULL);
+
+	g_string_append_c(line, '\t');
+	g_string_append(line, escaped);
+	g_free(escaped);
+}
+
+/* Write a complete line and make sure it has reached the disk */
+static gboolean
+journal_write(RSBatchJournal *journal, GString *line)
+{
+	const gchar *p = line->str;
+	gssize left, written;
+
+	g_string_append_c(line, '\n');
+	left = line->len;
+	while (left > 0)
+	{
+		written = write(journal->fd, p, left);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			g_warning("Could not write batch journal: %s", g_strerror(errno));
+			return FALSE;
+		}
+		p += written;
+		left -= written;
+	}
+#ifndef G_OS_WIN32
+	fsync(journal->fd);
+#endif
+
+	return TRUE;
+}
+
+static void
+journal_load(RSBatchJournal *journal, gchar *contents)
+{
+	gboolean same_outputs = FALSE;
+	gchar **lines;
+	gchar *end;
+	gint i;
+
+	/* A crash may have left the last line half written, ignore it */
+	end = strrchr(contents, '\n');
+	if (!end)
+		return;
+	end[1] = '\0';
+
+	lines = g_strsplit(contents, "\n", 0);
+	for(i = 0; lines[i]; i++)
+	{
+		gchar **fields;
+		guint n_fields;
+
+		if (lines[i][0] == '\0' || lines[i][0] == '#')
+			continue;
+
+		fields = g_strsplit(lines[i], "\t", 0);
+		n_fields = g_strv_length(fields);
+
+		if (g_str_equal(fields[0], "begin") && n_fields >= 3)
+		{
+			gchar *signature = g_strcompress(fields[2]);
+			/* Items from runs writing other files don't count */
+			same_outputs = g_str_equal(signature, journal->signature);
+			g_free(signature);
+		}
+		else if (g_str_equal(fields[0], "item") && n_fields >= ITEM_FIELDS && same_outputs)
+		{
+			gchar *input = g_strcompress(fields[7]);
+			gchar *key = journal_key(input, atoi(fields[3]));
+
+			if (g_str_equal(fields[2], "exported"))
+			{
+				JournalItem *item = g_new0(JournalItem, 1);
+				guint n, o = 0;
+
+				item->settings_digest = g_strdup(fields[8]);
+				item->outputs = g_new0(gchar *, (n_fields - ITEM_FIELDS) / 2 + 1);
+				for(n = ITEM_FIELDS; n < n_fields; n += 2)
+					item->outputs[o++] = g_strcompress(fields[n]);
+				g_hash_table_replace(journal->done, key, item);
+			}
+			else
+			{
+				/* A later failure may have removed the files */
+				g_hash_table_remove(journal->done, key);
+				g_free(key);
+			}
+			g_free(input);
+		}
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+}
+
+/**
+ * Open or create a batch journal. Photos recorded as exported by a run with
+ * the same signature are remembered, so they can be skipped
+ * @param filename The journal file, it is only ever appended to
+ * @param signature Outputs of this run, see rs_batch_engine_get_signature()
+ * @param error Return location for a GError or NULL
+ * @return A new RSBatchJournal, free with rs_batch_journal_close(), or NULL on error
+ */
+RSBatchJournal *
+rs_batch_journal_open(const gchar *filename, const gchar *signature, GError **error)
+{
+	RSBatchJournal *journal;
+	gchar *contents = NULL;
+	gsize length = 0;
+	GString *line;
+	gint fd;
+
+	g_return_val_if_fail(filename != NULL, NULL);
+	g_return_val_if_fail(signature != NULL, NULL);
+
+	fd = g_open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		gint saved_errno = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+			"Could not open batch journal %s: %s", filename, g_strerror(saved_errno));
+		return NULL;
+	}
+
+	journal = g_new0(RSBatchJournal, 1);
+	journal->fd = fd;
+	journal->signature = g_strdup(signature);
+	journal->done = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) journal_item_free);
+	journal->timer = g_timer_new();
+
+	g_file_get_contents(filename, &contents, &length, NULL);
+	if (contents)
+		journal_load(journal, contents);
+
+	line = g_string_new(NULL);
+	if (length == 0)
+		g_string_append(line, JOURNAL_HEADER);
+	else if (contents[length-1] != '\n')
+		/* Terminate the line a crash left behind, so it stays ignored */
+		g_string_append_c(line, '\n');
+	g_free(contents);
+
+	g_string_append_printf(line, "begin\t%" G_GINT64_FORMAT, g_get_real_time() / G_USEC_PER_SEC);
+	append_string(line, signature);
+	journal_write(journal, line);
+	g_string_free(line, TRUE);
+
+	return journal;
+}
+
+/**
+ * Check if a photo was already exported with its current settings and all its
+ * outputs still exist. Photos found are counted as skipped
+ * @param journal A RSBatchJournal
+ * @param filename The photo
+ * @param setting_id The snapshot
+ * @return TRUE if the photo can be skipped
+ */
+gboolean
+rs_batch_journal_is_done(RSBatchJournal *journal, const gchar *filename, gint setting_id)
+{
+	JournalItem *item;
+	gchar *key, *digest;
+	gboolean same_settings;
+	gint i;
+
+	g_return_val_if_fail(journal != NULL, FALSE);
+	g_return_val_if_fail(filename != NULL, FALSE);
+
+	key = journal_key(filename, setting_id);
+	item = g_hash_table_lookup(journal->done, key);
+	g_free(key);
+
+	if (!item)
+		return FALSE;
+
+	/* The photo must be exported again if it was edited since */
+	digest = rs_batch_settings_digest(filename, setting_id);
+	same_settings = digest && g_str_equal(digest, item->settings_digest);
+	g_free(digest);
+	if (!same_settings)
+		return FALSE;
+
+	/* Don't trust the journal if someone removed the files since */
+	for(i = 0; item->outputs[i]; i++)
+		if (!g_file_test(item->outputs[i], G_FILE_TEST_IS_REGULAR))
+			return FALSE;
+
+	journal->skipped++;
+
+	return TRUE;
+}
+
+/**
+ * Append a finished photo to the journal. The record is on disk when this returns
+ * @param journal A RSBatchJournal
+ * @param result A result from rs_batch_engine_pop_result(), output checksums
+ *               are recorded if rs_batch_engine_set_checksums() was enabled
+ */
+void
+rs_batch_journal_add(RSBatchJournal *journal, const RSBatchResult *result)
+{
+	GString *line;
+	gint i;
+
+	g_return_if_fail(journal != NULL);
+	g_return_if_fail(result != NULL);
+
+	if (result->status == RS_BATCH_STATUS_EXPORTED)
+	{
+		journal->exported++;
+		journal->render_time += result->load_time + result->render_time + result->encode_time;
+	}
+	else
+		journal->failed++;
+
+	line = g_string_new(NULL);
+	g_string_append_printf(line, "item\t%" G_GINT64_FORMAT "\t%s\t%d",
+		g_get_real_time() / G_USEC_PER_SEC,
+		status_to_string(result->status),
+		result->setting_id);
+	append_double(line, result->load_time);
+	append_double(line, result->render_time);
+	append_double(line, result->encode_time);
+	append_string(line, result->filename);
+	g_string_append_c(line, '\t');
+	g_string_append(line, result->settings_digest ? result->settings_digest : "-");
+
+	for(i = 0; result->output_filenames && result->output_filenames[i]; i++)
+	{
+		const gchar *checksum = result->output_checksums ? result->output_checksums[i] : NULL;
+
+		append_string(line, result->output_filenames[i]);
+		g_string_append_c(line, '\t');
+		g_string_append(line, (checksum && checksum[0]) ? checksum : "-");
+	}
+
+	journal_write(journal, line);
+	g_string_free(line, TRUE);
+}
+
+/**
+ * Get statistics for the run so far
+ * @param journal A RSBatchJournal
+ * @param stats Filled in with statistics
+ */
+void
+rs_batch_journal_get_stats(RSBatchJournal *journal, RSBatchJournalStats *stats)
+{
+	g_return_if_fail(journal != NULL);
+	g_return_if_fail(stats != NULL);
+
+	stats->exported = journal->exported;
+	stats->failed = journal->failed;
+	stats->skipped = journal->skipped;
+	stats->elapsed = g_timer_elapsed(journal->timer, NULL);
+	stats->render_time = journal->render_time;
+	stats->photos_per_minute = (stats->elapsed > 0.0) ? (journal->exported * 60.0 / stats->elapsed) : 0.0;
+}
+
+/**
+ * Record the end of a run and close the journal
+ * @param journal A RSBatchJournal
+ */
+void
+rs_batch_journal_close(RSBatchJournal *journal)
+{
+	GString *line;
+
+	g_return_if_fail(journal != NULL);
+
+	line = g_string_new(NULL);
+	g_string_append_printf(line, "end\t%" G_GINT64_FORMAT "\t%d\t%d\t%d",
+		g_get_real_time() / G_USEC_PER_SEC,
+		journal->exported, journal->failed, journal->skipped);
+	append_double(line, g_timer_elapsed(journal->timer, NULL));
+	journal_write(journal, line);
+	g_string_free(line, TRUE);
+
+	close(journal->fd);
+	g_hash_table_destroy(journal->done);
+	g_timer_destroy(journal->timer);
+	g_free(journal->signature);
+	g_free(journal);
+}
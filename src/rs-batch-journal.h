@@ -0,0 +1,82 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_BATCH_JOURNAL_H
+#define RS_BATCH_JOURNAL_H
+
+#include "rs-batch-engine.h"
+
+typedef struct _RSBatchJournal RSBatchJournal;
+
+typedef struct {
+	gint exported;              /* Photos exported in this run */
+	gint failed;                /* Photos that failed in this run */
+	gint skipped;               /* Photos already exported by an earlier run */
+	gdouble elapsed;            /* Seconds since the journal was opened */
+	gdouble render_time;        /* Seconds spent in workers, summed over exported photos */
+	gdouble photos_per_minute;  /* Exported photos per minute of wall time */
+} RSBatchJournalStats;
+
+/**
+ * Open or create a batch journal. Photos recorded as exported by a run with
+ * the same signature are remembered, so they can be skipped
+ * @param filename The journal file, it is only ever appended to
+ * @param signature Outputs of this run, see rs_batch_engine_get_signature()
+ * @param error Return location for a GError or NULL
+ * @return A new RSBatchJournal, free with rs_batch_journal_close(), or NULL on error
+ */
+extern RSBatchJournal *
+rs_batch_journal_open(const gchar *filename, const gchar *signature, GError **error);
+
+/**
+ * Check if a photo was already exported with its current settings and all its
+ * outputs still exist. Photos found are counted as skipped
+ * @param journal A RSBatchJournal
+ * @param filename The photo
+ * @param setting_id The snapshot
+ * @return TRUE if the photo can be skipped
+ */
+extern gboolean
+rs_batch_journal_is_done(RSBatchJournal *journal, const gchar *filename, gint setting_id);
+
+/**
+ * Append a finished photo to the journal. The record is on disk when this returns
+ * @param journal A RSBatchJournal
+ * @param result A result from rs_batch_engine_pop_result(), output checksums
+ *               are recorded if rs_batch_engine_set_checksums() was enabled
+ */
+extern void
+rs_batch_journal_add(RSBatchJournal *journal, const RSBatchResult *result);
+
+/**
+ * Get statistics for the run so far
+ * @param journal A RSBatchJournal
+ * @param stats Filled in with statistics
+ */
+extern void
+rs_batch_journal_get_stats(RSBatchJournal *journal, RSBatchJournalStats *stats);
+
+/**
+ * Record the end of a run and close the journal
+ * @param journal A RSBatchJournal
+ */
+extern void
+rs_batch_journal_close(RSBatchJournal *journal);
+
+#endif /* RS_BATCH_JOURNAL_H */
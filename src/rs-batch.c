@@ -19,6 +19,7 @@
 
 #include <rawstudio.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <stdio.h>
 #include <gtk/gtk.h>
 #include <config.h>
@@ -26,6 +27,8 @@
 #include <libxml/xmlwriter.h>
 #include "application.h"
 #include "rs-batch.h"
+#include "rs-batch-engine.h"
+#include "rs-batch-journal.h"
 #include "conf_interface.h"
 #include "gettext.h"
 #include "gtk-helper.h"
@@ -374,15 +377,11 @@ cancel_clicked(GtkButton *button, gpointer user_data)
 void
 rs_batch_process(RS_QUEUE *queue)
 {
-	RS_PHOTO *photo = NULL;
 	GtkTreeIter iter;
 	gchar *filename_in;
 	gint setting_id;
 	GtkWidget *preview = gtk_image_new();
-	GdkPixbuf *pixbuf = NULL;
-	gint width = -1, height = -1;
-	gdouble scale = -1.0;
-	gchar *parsed_filename, *basename, *parsed_dir;
+	gchar *basename;
 	GString *filename;
 	GString *status = g_string_new(NULL);
 	GtkWidget *window;
@@ -397,21 +396,16 @@ rs_batch_process(RS_QUEUE *queue)
 	gchar *eta_text, *title_text;
 	gint h = 0, m = 0, s = 0;
 	gint done = 0, left = 0;
-	RSFilter *finput = rs_filter_new("RSInputImage16", NULL);
-	RSFilter *fdemosaic = rs_filter_new("RSDemosaic", finput);
-	RSFilter *ffujirotate = rs_filter_new("RSFujiRotate", fdemosaic);
-	RSFilter *flensfun = rs_filter_new("RSLensfun", ffujirotate);
-	RSFilter *frotate = rs_filter_new("RSRotate", flensfun);
-	RSFilter *fcrop = rs_filter_new("RSCrop", frotate);
-	RSFilter *ftransform_input = rs_filter_new("RSColorspaceTransform", fcrop);
-	RSFilter *fdcp= rs_filter_new("RSDcp", ftransform_input);
-	RSFilter *fcache = rs_filter_new("RSCache", fdcp);
-	RSFilter *fresample= rs_filter_new("RSResample", fcache);
-	RSFilter *fdenoise= rs_filter_new("RSDenoise", fresample);
-	RSFilter *ftransform_display = rs_filter_new("RSColorspaceTransform", fdenoise);
-	RSFilter *fend = ftransform_display;
-	RSFilterResponse *filter_response;
 	RSColorSpace *display_color_space;
+	RSBatchOutput batch_output;
+	RSBatchEngine *engine;
+	RSBatchResult *result;
+	RSBatchJournal *journal;
+	RSBatchJournalStats stats;
+	gboolean valid;
+	GError *error = NULL;
+	gchar *journal_filename, *signature;
+	gchar *profiles;
 
 	gdk_threads_enter();
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
@@ -438,11 +432,99 @@ rs_batch_process(RS_QUEUE *queue)
 	display_color_space = rs_get_display_profile(GTK_WIDGET(window));
 	g_mkdir_with_parents(queue->directory, 00755);
 
+	/* Build filename template */
+	if (NULL == g_strrstr(queue->filename, "%p"))
+	{
+		filename = g_string_new(queue->directory);
+		g_string_append(filename, G_DIR_SEPARATOR_S);
+		g_string_append(filename, queue->filename);
+	}
+	else
+		filename = g_string_new(queue->filename);
+
+	rs_output_set_from_conf(queue->output, "batch");
+	g_assert(RS_IS_OUTPUT(queue->output));
+
+	batch_output.output = queue->output;
+	batch_output.filename_template = filename->str;
+	batch_output.size_lock = queue->size_lock;
+	batch_output.width = queue->width;
+	batch_output.height = queue->height;
+	batch_output.scale = queue->scale;
+
+	engine = rs_batch_engine_new(&batch_output, 0);
+	rs_batch_engine_set_preview(engine, 250, display_color_space);
+
+	/* Extra outputs like "jpeg,2048x2048,%f_2048;jpeg,600x600,%f_web", each
+	 * photo is only rendered once for all of them */
+	profiles = rs_conf_get_string(CONF_BATCH_PROFILES);
+	if (profiles)
+	{
+		gchar **descriptions = g_strsplit(profiles, ";", 0);
+		gint i;
+
+		for(i = 0; descriptions[i]; i++)
+		{
+			RSBatchOutput profile;
+
+			if (descriptions[i][0] == '\0')
+				continue;
+			if (rs_batch_output_parse(&profile, descriptions[i], queue->directory, queue->filename))
+			{
+				rs_batch_engine_add_output(engine, &profile);
+				rs_batch_output_clear(&profile);
+			}
+			else
+				g_warning("Ignoring batch output profile \"%s\"", descriptions[i]);
+		}
+		g_strfreev(descriptions);
+		g_free(profiles);
+	}
+	g_string_free(filename, TRUE);
+
+	/* The journal lives next to the queue, and remembers what an earlier
+	 * run exported with the same outputs */
+	journal_filename = g_build_filename(rs_confdir_get(), "batch-journal.log", NULL);
+	signature = rs_batch_engine_get_signature(engine);
+	journal = rs_batch_journal_open(journal_filename, signature, &error);
+	if (!journal)
+	{
+		g_warning("%s", error->message);
+		g_error_free(error);
+	}
+	g_free(signature);
+	rs_batch_engine_set_checksums(engine, journal != NULL);
+
+	valid = gtk_tree_model_get_iter_first(queue->list, &iter);
+	while (valid)
+	{
+		gtk_tree_model_get(queue->list, &iter,
+			RS_QUEUE_ELEMENT_FILENAME, &filename_in,
+			RS_QUEUE_ELEMENT_SETTING_ID, &setting_id,
+			-1);
+		/* Exported by an interrupted run before the queue was saved */
+		if (journal && rs_batch_journal_is_done(journal, filename_in, setting_id))
+			valid = gtk_list_store_remove(GTK_LIST_STORE(queue->list), &iter);
+		else
+		{
+			rs_batch_engine_add(engine, filename_in, setting_id);
+			valid = gtk_tree_model_iter_next(queue->list, &iter);
+		}
+		g_free(filename_in);
+	}
+	batch_queue_save(queue);
+
+	g_string_printf(status, _("Processing %d images at a time ..."), rs_batch_engine_get_n_workers(engine));
+	gtk_label_set_text(GTK_LABEL(label), status->str);
+
 	g_get_current_time(&start_time);
+	rs_batch_engine_start(engine);
 
-	while(gtk_tree_model_get_iter_first(queue->list, &iter) && (!abort_render))
+	while((left = rs_batch_engine_get_pending(engine)) > 0)
 	{
-		left = rs_batch_num_entries(queue);
+		if (abort_render)
+			rs_batch_engine_cancel(engine);
+
 		if (done > 0 && now_time.tv_sec > 0)
 		{
 			time = (gint) (now_time.tv_sec-start_time.tv_sec);
@@ -466,169 +548,75 @@ rs_batch_process(RS_QUEUE *queue)
 		gtk_label_set_text(GTK_LABEL(eta_label), eta_text);
 		g_free(eta_text);
 		g_free(title_text);
-		done++;
-
-		gtk_tree_model_get(queue->list, &iter,
-			RS_QUEUE_ELEMENT_FILENAME, &filename_in,
-			RS_QUEUE_ELEMENT_SETTING_ID, &setting_id,
-			-1);
-		basename = g_path_get_basename(filename_in);
-		g_string_printf(status, _("Loading %s ..."), basename);
-		gtk_label_set_text(GTK_LABEL(label), status->str);
 		while (gtk_events_pending()) gtk_main_iteration();
-		g_free(basename);
 
+		/* Photos finish out of order, wait for whichever is first */
 		gdk_threads_leave();
-		photo = rs_photo_load_from_file(filename_in);
-		if (photo)
-		{
-			rs_metadata_load_from_file(photo->metadata, filename_in);
-			rs_cache_load(photo);
+		result = rs_batch_engine_pop_result(engine, 250);
+		/* Record the photo before it leaves the queue */
+		if (result && journal)
+			rs_batch_journal_add(journal, result);
+		gdk_threads_enter();
+		if (!result)
+			continue;
 
-			/* Build new filename */
-			if (NULL == g_strrstr(queue->filename, "%p"))
-			{
-				filename = g_string_new(queue->directory);
-				g_string_append(filename, G_DIR_SEPARATOR_S);
-				g_string_append(filename, queue->filename);
-			} 
-			else
-				filename = g_string_new(queue->filename);
-			
-			g_string_append(filename, ".");
-			g_string_append(filename, rs_output_get_extension(queue->output));
-			parsed_filename = filename_parse(filename->str, filename_in, setting_id, TRUE);
-			
-			/* Create directory, if it doesn't exist */
-			parsed_dir = g_path_get_dirname(parsed_filename);
-			if (FALSE == g_file_test(parsed_dir, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))
-				if (g_mkdir_with_parents(parsed_dir, 0x1ff))
-				{
-					gdk_threads_enter();
-					gui_status_notify(_("Could not create output directory."));
-					break;
-				}
+		done++;
+		g_get_current_time(&now_time);
 
-			GList *filters = g_list_append(NULL, fend);
-			rs_photo_apply_to_filters(photo, filters, setting_id);
-			g_list_free(filters);
-
-			rs_filter_set_recursive(fend,
-				"image", photo->input_response,
-				"filename", photo->filename,
-				"bounding-box", TRUE,
-				"width", 250,
-				"height", 250,
-				NULL);
-
-			/* Render preview image */
-			RSFilterRequest *request = rs_filter_request_new();
-			rs_filter_request_set_quick(RS_FILTER_REQUEST(request), FALSE);
-			/* FIXME: Should be set to output colorspace, not forced to sRGB */
-
-			rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", display_color_space);	
-			filter_response = rs_filter_get_image8(fend, request);
-			pixbuf = rs_filter_response_get_image8(filter_response);
-			gdk_threads_enter();
-			if (pixbuf)
-			{
-				gtk_image_set_from_pixbuf(GTK_IMAGE(preview), pixbuf);
-				g_object_unref(pixbuf);
-			}
-			g_object_unref(request);
-			g_object_unref(filter_response);
+		if (result->preview)
+			gtk_image_set_from_pixbuf(GTK_IMAGE(preview), result->preview);
+
+		if (result->status == RS_BATCH_STATUS_EXPORTED)
+		{
+			gboolean exported = TRUE;
+			rs_store_set_flags(NULL, result->filename, NULL, NULL, &exported, NULL);
 
-			if (left > 1)
-			{
-				GtkTreeIter iter2 = iter;
-				if (gtk_tree_model_iter_next (queue->list, &iter2))
-				{
-					gtk_tree_model_get(queue->list, &iter2, RS_QUEUE_ELEMENT_FILENAME, &filename_in, -1);
-					rs_io_idle_prefetch_file(filename_in, 0xC01A);
-				}
-			}
 			/* Build text for small preview-window */
-			basename = g_path_get_basename(parsed_filename);
-			g_string_printf(status, _("Saving %s ..."), basename);
+			basename = g_path_get_basename(result->output_filenames[0]);
+			g_string_printf(status, _("Saved %s"), basename);
 			gtk_label_set_text(GTK_LABEL(label), status->str);
-			while (gtk_events_pending())
-				gtk_main_iteration();
 			g_free(basename);
-			gdk_threads_leave();
-
-			width = 65535;
-			height = 65535;
-			/* Calculate new size */
-			switch (queue->size_lock)
-			{
-				case LOCK_SCALE:
-					scale = queue->scale/100.0;
-					rs_filter_get_size_simple(fcrop, RS_FILTER_REQUEST_QUICK, &width, &height);
-					width = (gint) (((gdouble) width) * scale);
-					height = (gint) (((gdouble) height) * scale);
-					break;
-				case LOCK_WIDTH:
-					width = queue->width;
-					break;
-				case LOCK_HEIGHT:
-					height = queue->height;
-					break;
-				case LOCK_BOUNDING_BOX:
-					width = queue->width;
-					height = queue->height;
-					break;
-			}
-			rs_filter_set_recursive(fend,
-				"width", width,
-				"height", height,
-				NULL);
-
-			/* Save the image */
-			if (g_object_class_find_property(G_OBJECT_GET_CLASS(queue->output), "filename"))
-				g_object_set(queue->output, "filename", parsed_filename, NULL);
-
-			rs_output_set_from_conf(queue->output, "batch");
-
-			g_assert(RS_IS_OUTPUT(queue->output));
-			g_assert(RS_IS_FILTER(fend));
-
-			gboolean exported = rs_output_execute(queue->output, fend);
-			gdk_threads_enter();
-			if (exported)
-				rs_store_set_flags(NULL, photo->filename, NULL, NULL, &exported, NULL);
-			else
-			{
-				gui_status_notify(_("Could not export photo."));
-				break;
-			}
-
-			g_free(parsed_filename);
-			g_string_free(filename, TRUE);
-			g_object_unref(photo);
-			photo = NULL;
 		}
-		gtk_list_store_remove(GTK_LIST_STORE(queue->list), &iter);
-		batch_queue_save(queue);
+		else if (result->status == RS_BATCH_STATUS_FAILED)
+		{
+			/* Leave the photo in the queue and stop, like a serial run would */
+			gui_status_notify(result->error);
+			rs_batch_engine_cancel(engine);
+			rs_batch_result_free(result);
+			continue;
+		}
 
-		g_get_current_time(&now_time);
+		rs_batch_remove_from_queue(queue, result->filename, result->setting_id);
+		rs_batch_result_free(result);
 	}
 	gtk_widget_destroy(window);
 
+	/* Wait for the workers and free the chains, this must happen on this thread */
+	gdk_threads_leave();
+	rs_batch_engine_free(engine);
+	gdk_threads_enter();
+
+	if (journal)
+	{
+		rs_batch_journal_get_stats(journal, &stats);
+		rs_batch_journal_close(journal);
+
+		g_string_printf(status, _("Exported %d images in %.0f seconds, %.1f images per minute"),
+			stats.exported, stats.elapsed, stats.photos_per_minute);
+		if (stats.skipped > 0)
+			g_string_append_printf(status, _(", %d already exported"), stats.skipped);
+		gui_status_notify(status->str);
+
+		/* Nothing left to resume */
+		if (rs_batch_num_entries(queue) == 0)
+			g_unlink(journal_filename);
+	}
+	g_free(journal_filename);
+
 	batch_queue_update_sensivity(queue);
 	gdk_threads_leave();
 
-	g_object_unref(finput);
-	g_object_unref(fdemosaic);
-	g_object_unref(ffujirotate);
-	g_object_unref(flensfun);
-	g_object_unref(frotate);
-	g_object_unref(fcrop);
-	g_object_unref(fcache);
-	g_object_unref(fresample);
-	g_object_unref(fdcp);
-	g_object_unref(fdenoise);
-	g_object_unref(ftransform_input);
-	g_object_unref(ftransform_display);
+	g_string_free(status, TRUE);
 }
 
 static void
@@ -101,6 +101,26 @@ const static gint SPLITTER_WIDTH = 4;
 #define MAX_VIEWS 2 /* maximum 32! */
 #define VIEW_IS_VALID(view) (((view)>=0) && ((view)<MAX_VIEWS))
 
+/* Progressive rendering, each level is shown as soon as it is ready. Levels
+ * are not interrupted, a change while one renders restarts at the first level
+ * on the next draw. Only the final level is drawn in bands. RSResample strips
+ * "preview-scale" before going upstream, so the 1/2 level already pays for
+ * full resolution work in the filters before it, like lensfun and rotate */
+static const struct {
+	gfloat scale;
+	gboolean quick;
+} progressive_levels[] = {
+	{ 0.125f, TRUE },  /* From the half size demosaic */
+	{ 0.5f,   FALSE },
+	{ 1.0f,   FALSE },
+};
+#define PROGRESSIVE_FINAL (G_N_ELEMENTS(progressive_levels)-1)
+
+/* Rows of the final level rendered per draw, input is handled in between.
+ * Renders can't be interrupted, so this is what bounds how long a settings
+ * change waits when the final level is banded */
+#define PROGRESSIVE_BAND_HEIGHT 128
+
 static GdkCursor *cur_fleur = NULL;
 static GdkCursor *cur_watch = NULL;
 static GdkCursor *cur_normal = NULL;
@@ -132,6 +152,7 @@ struct _RSPreviewWidget
 	gboolean zoom_to_fit;
 	gboolean exposure_mask;
 	gboolean keep_quick_enabled;
+	gboolean progressive;
 
 	GdkRGBA bgcolor; /* Background color of widget */
 	VIEW_SPLIT split;
@@ -171,6 +192,10 @@ struct _RSPreviewWidget
 	RSFilter *filter_end[MAX_VIEWS]; /* For convenience */
 
 	RSFilterRequest *request[MAX_VIEWS];
+	guint progressive_level[MAX_VIEWS]; /* Next level to render */
+	GdkPixbuf *level_buffer[MAX_VIEWS]; /* Last reduced level, shown under unfinished bands */
+	GdkRectangle level_placement[MAX_VIEWS];
+	GdkRectangle level_area[MAX_VIEWS]; /* Valid part of level_buffer on the canvas */
 	GdkRectangle *last_roi[MAX_VIEWS];
 	RS_PHOTO *photo;
 	RS_PHOTO *photo_blank_stored;
@@ -237,7 +262,7 @@ static gboolean button(GtkWidget *widget, GdkEventButton *event, RSPreviewWidget
 static gboolean motion(GtkWidget *widget, GdkEventMotion *event, gpointer user_data);
 static gboolean leave(GtkWidget *widget, GdkEventCrossing *event, gpointer user_data);
 static void profile_changed(RS_PHOTO *photo, gpointer profile, RSPreviewWidget *preview);
-static void filter_changed(RSFilter *filter, RSFilterChangedMask mask, RSPreviewWidget *preview);
+static void filter_changed(RSFilter *filter, RSFilterChangedMask mask, GdkRectangle *region, RSPreviewWidget *preview);
 static void lens_changed(RS_PHOTO *photo, RSPreviewWidget *preview);
 static gboolean get_image_coord(RSPreviewWidget *preview, gint view, const gint x, const gint y, gint *scaled_x, gint *scaled_y, gint *real_x, gint *real_y, gint *max_w, gint *max_h);
 static gint get_view_from_coord(RSPreviewWidget *preview, const gint x, const gint y);
@@ -338,6 +363,7 @@ rs_preview_widget_init(RSPreviewWidget *preview)
 	preview->exposure_mask = FALSE;
 	preview->crop_near = CROP_NEAR_NOTHING;
 	preview->keep_quick_enabled = FALSE;
+	rs_conf_get_boolean_with_default(CONF_PREVIEW_PROGRESSIVE, &preview->progressive, TRUE);
 
 	gchar* name;
 	preview->display_color_space = NULL;
@@ -382,6 +408,7 @@ rs_preview_widget_init(RSPreviewWidget *preview)
 		preview->filter_crop[i] = rs_filter_new("RSCrop", preview->filter_rotate[i]);
 		preview->filter_cache0[i] = rs_filter_new("RSCache", preview->filter_crop[i]);
 		preview->filter_resample[i] = rs_filter_new("RSResample", preview->filter_cache0[i]);
+		g_object_set(preview->filter_resample[i], "allow-binning", TRUE, NULL);
 		/* Careful - "make_cbdata" grabs data from "filter_cache1" */
 		preview->filter_cache1[i] = rs_filter_new("RSCache", preview->filter_resample[i]);
 		preview->filter_transform_input[i] = rs_filter_new("RSColorspaceTransform", preview->filter_cache1[i]);
@@ -392,7 +419,7 @@ rs_preview_widget_init(RSPreviewWidget *preview)
 		preview->filter_cache3[i] = rs_filter_new("RSCache", preview->filter_transform_display[i]);
 		preview->filter_mask[i] = rs_filter_new("RSExposureMask", preview->filter_cache3[i]);
 		preview->filter_end[i] = preview->filter_mask[i];
-		g_signal_connect(preview->filter_end[i], "changed", G_CALLBACK(filter_changed), preview);
+		g_signal_connect(preview->filter_end[i], "region-changed", G_CALLBACK(filter_changed), preview);
 
 		rs_filter_set_recursive(preview->filter_end[i], "bounding-box", TRUE, NULL);
 		g_object_set(preview->filter_cache3[i], "latency", 1, NULL);
@@ -403,6 +430,8 @@ rs_preview_widget_init(RSPreviewWidget *preview)
 #error Fix line below
 #endif
 		preview->snapshot[i] = i;
+		preview->progressive_level[i] = 0;
+		preview->level_buffer[i] = NULL;
 		preview->last_roi[i] = NULL;
 	}
 #if MAX_VIEWS != 2
@@ -424,6 +453,7 @@ rs_preview_widget_init(RSPreviewWidget *preview)
 	preview->loupe_view = -1;
 
 	preview->navigator_filter_scale = rs_filter_new("RSResample", NULL);
+	g_object_set(preview->navigator_filter_scale, "allow-binning", TRUE, NULL);
 	preview->navigator_filter_cache = rs_filter_new("RSCache", preview->navigator_filter_scale);
 	preview->navigator_transform_input = rs_filter_new("RSColorspaceTransform", preview->navigator_filter_cache);
 	preview->navigator_filter_rotate = rs_filter_new("RSRotate", preview->navigator_transform_input);
@@ -749,6 +779,10 @@ rs_preview_widget_set_photo_settings(RSPreviewWidget *preview)
 	for(view=0;view<MAX_VIEWS;view++) 
 	{
 		rs_filter_request_set_quick(preview->request[view], TRUE);
+		preview->progressive_level[view] = 0;
+		if (preview->level_buffer[view])
+			g_object_unref(preview->level_buffer[view]);
+		preview->level_buffer[view] = NULL;
 		filters = g_list_append(NULL, preview->filter_end[view]);
 		rs_photo_apply_to_filters(preview->photo, filters, preview->snapshot[view]);
 		g_list_free(filters);
@@ -1285,6 +1319,29 @@ rs_preview_widget_quick_end(RSPreviewWidget *preview)
 	GUI_CATCHUP_DISPLAY(preview->display);
 }
 
+/**
+ * Enables or disables progressive rendering. When enabled, the preview is
+ * first rendered at reduced size and quality after each change and then
+ * refined until the final image is shown. Renders are not cancelled, each
+ * level runs to completion before a change is picked up
+ * @param preview A RSPreviewWidget
+ * @param progressive TRUE to enable progressive rendering
+ */
+void
+rs_preview_widget_set_progressive(RSPreviewWidget *preview, gboolean progressive)
+{
+	gint view;
+
+	g_return_if_fail(RS_IS_PREVIEW_WIDGET(preview));
+
+	preview->progressive = progressive;
+	rs_conf_set_boolean(CONF_PREVIEW_PROGRESSIVE, progressive);
+
+	for(view=0;view<MAX_VIEWS;view++)
+		preview->progressive_level[view] = PROGRESSIVE_FINAL;
+	canvas_draw(preview, NULL, FALSE);
+}
+
 void 
 rs_preview_widget_blank(RSPreviewWidget *preview)
 {
@@ -2108,7 +2165,7 @@ profile_changed(RS_PHOTO *photo, gpointer profile, RSPreviewWidget *preview)
 }
 
 static void
-filter_changed(RSFilter *filter, RSFilterChangedMask mask, RSPreviewWidget *preview)
+filter_changed(RSFilter *filter, RSFilterChangedMask mask, GdkRectangle *region, RSPreviewWidget *preview)
 {
 	gint view;
 	GdkRectangle placement;
@@ -2125,6 +2182,12 @@ filter_changed(RSFilter *filter, RSFilterChangedMask mask, RSPreviewWidget *prev
 	{
 		if (filter == preview->filter_end[view])
 		{
+			/* Start over from the lowest level, small changes are cheap to patch.
+			 * Bands of the final level not drawn yet are then drawn at the
+			 * lowest level instead */
+			if ((mask & RS_FILTER_CHANGED_PIXELDATA) && !region)
+				preview->progressive_level[view] = 0;
+
 			if ((view==0) && (mask & RS_FILTER_CHANGED_DIMENSION))
 			{
 				gint width, height;
@@ -2144,6 +2207,24 @@ filter_changed(RSFilter *filter, RSFilterChangedMask mask, RSPreviewWidget *prev
 
 			if (get_placement(preview, view, &placement))
 			{
+				/* Only redraw the changed part of the image */
+				if (region)
+				{
+					if (!preview->zoom_to_fit)
+					{
+						GdkRectangle rect;
+						gtk_widget_get_allocation(GTK_WIDGET(preview->canvas), &rect);
+						if (placement.width > rect.width)
+							placement.x = -gtk_adjustment_get_value(preview->hadjustment);
+						if (placement.height > rect.height)
+							placement.y = -gtk_adjustment_get_value(preview->vadjustment);
+					}
+					placement.x += region->x;
+					placement.y += region->y;
+					placement.width = region->width;
+					placement.height = region->height;
+				}
+
 				dirty.x = MIN(placement.x, dirty.x);
 				dirty.y = MIN(placement.y, dirty.y);
 				dirty.width = MAX(placement.width + placement.x, dirty.width + dirty.x) - dirty.x;
@@ -2437,6 +2518,42 @@ canvas_draw(RSPreviewWidget *preview, GdkRectangle *rect, gboolean now)
 	}
 }
 
+/* Paints buffer stretched over placement, limited to area */
+static void
+paint_stretched(cairo_t *cr, GdkPixbuf *buffer, const GdkRectangle *placement, const GdkRectangle *area)
+{
+	cairo_save(cr);
+	cairo_rectangle(cr, area->x, area->y, area->width, area->height);
+	cairo_clip(cr);
+	cairo_translate(cr, placement->x, placement->y);
+	cairo_scale(cr,
+		((gdouble) placement->width) / gdk_pixbuf_get_width(buffer),
+		((gdouble) placement->height) / gdk_pixbuf_get_height(buffer));
+	gdk_cairo_set_source_pixbuf(cr, buffer, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_BILINEAR);
+	cairo_paint(cr);
+	cairo_restore(cr);
+}
+
+/* Returns TRUE if the last reduced level can be shown in area */
+static gboolean
+level_buffer_covers(RSPreviewWidget *preview, const gint view, const GdkRectangle *placement, const GdkRectangle *area)
+{
+	const GdkRectangle *valid = &preview->level_area[view];
+	const GdkRectangle *level_placement = &preview->level_placement[view];
+
+	if (!preview->level_buffer[view])
+		return FALSE;
+
+	if (level_placement->x != placement->x || level_placement->y != placement->y
+		|| level_placement->width != placement->width || level_placement->height != placement->height)
+		return FALSE;
+
+	return (area->x >= valid->x && area->y >= valid->y
+		&& area->x + area->width <= valid->x + valid->width
+		&& area->y + area->height <= valid->y + valid->height);
+}
+
 static void
 canvas_draw_handler(GtkWidget *widget, cairo_t *cr, RSPreviewWidget *preview)
 {
@@ -2488,6 +2605,26 @@ canvas_draw_handler(GtkWidget *widget, cairo_t *cr, RSPreviewWidget *preview)
 		/* Render the photo itself */
 		if (preview->photo && gdk_rectangle_intersect(&dirty_area, &placement, &area))
 		{
+			guint level = PROGRESSIVE_FINAL;
+			if (preview->progressive && !preview->keep_quick_enabled)
+				level = MIN(preview->progressive_level[i], PROGRESSIVE_FINAL);
+			const gfloat scale = progressive_levels[level].scale;
+
+			/* The final level is drawn a band at a time over the previous
+			 * level. GTK handles input between the bands, so a change of
+			 * settings starts over without waiting for the complete render */
+			GdkRectangle rest;
+			rest.height = 0;
+			const gboolean banded = (level == PROGRESSIVE_FINAL) && preview->progressive && !preview->keep_quick_enabled
+				&& level_buffer_covers(preview, i, &placement, &area);
+			if (banded && area.height > PROGRESSIVE_BAND_HEIGHT)
+			{
+				rest = area;
+				rest.y += PROGRESSIVE_BAND_HEIGHT;
+				rest.height -= PROGRESSIVE_BAND_HEIGHT;
+				area.height = PROGRESSIVE_BAND_HEIGHT;
+			}
+
 			GdkRectangle roi = area;
 			roi.x -= placement.x;
 			roi.y -= placement.y;
@@ -2496,7 +2633,7 @@ canvas_draw_handler(GtkWidget *widget, cairo_t *cr, RSPreviewWidget *preview)
 				preview->last_roi[i] = g_new(GdkRectangle, 1);
 			*preview->last_roi[i] = roi;
 
-			if (preview->zoom_to_fit)
+			if (preview->zoom_to_fit && !banded)
 				rs_filter_request_set_roi(preview->request[i], NULL);
 			else
 				rs_filter_request_set_roi(preview->request[i], &roi);
@@ -2504,10 +2641,37 @@ canvas_draw_handler(GtkWidget *widget, cairo_t *cr, RSPreviewWidget *preview)
 			/* Clone, now so it cannot change while filters are being called */
 			RSFilterRequest *new_request = rs_filter_request_clone(preview->request[i]);  
 
+			if (progressive_levels[level].quick)
+				rs_filter_request_set_quick(new_request, TRUE);
+			if (scale < 1.0f)
+			{
+				rs_filter_param_set_float(RS_FILTER_PARAM(new_request), "preview-scale", scale);
+				if (!preview->zoom_to_fit)
+				{
+					GdkRectangle scaled_roi;
+					scaled_roi.x = (gint) floorf(roi.x * scale);
+					scaled_roi.y = (gint) floorf(roi.y * scale);
+					scaled_roi.width = (gint) ceilf((roi.x + roi.width) * scale) - scaled_roi.x + 1;
+					scaled_roi.height = (gint) ceilf((roi.y + roi.height) * scale) - scaled_roi.y + 1;
+					rs_filter_request_set_roi(new_request, &scaled_roi);
+				}
+			}
+
 			RSFilterResponse *response = rs_filter_get_image8(preview->filter_end[i], new_request);
 			GdkPixbuf *buffer = rs_filter_response_get_image8(response);
 
-			if (buffer)
+			if (buffer && scale < 1.0f)
+			{
+				paint_stretched(cr, buffer, &placement, &area);
+
+				/* Keep it to show while the final level is drawn */
+				if (preview->level_buffer[i])
+					g_object_unref(preview->level_buffer[i]);
+				preview->level_buffer[i] = buffer;
+				preview->level_placement[i] = placement;
+				preview->level_area[i] = preview->zoom_to_fit ? placement : area;
+			}
+			else if (buffer)
 			{
 				if (area.x-placement.x >= 0 && area.x-placement.x + area.width <= gdk_pixbuf_get_width(buffer)
 					&& area.y-placement.y >= 0 && area.y-placement.y + area.height <= gdk_pixbuf_get_height(buffer))
@@ -2520,7 +2684,22 @@ canvas_draw_handler(GtkWidget *widget, cairo_t *cr, RSPreviewWidget *preview)
 				g_object_unref(buffer);
 			}
 
-			if(preview->views > 1 && rs_filter_request_get_quick(new_request) && !preview->keep_quick_enabled)
+			/* Show the previous level where the final is not drawn yet */
+			if (rest.height > 0)
+			{
+				paint_stretched(cr, preview->level_buffer[i], &preview->level_placement[i], &rest);
+				canvas_draw(preview, &rest, FALSE);
+			}
+
+			if (level < PROGRESSIVE_FINAL)
+			{
+				/* Refine when GTK gets to it, changes in between start over */
+				preview->progressive_level[i] = level + 1;
+				if (!progressive_levels[level + 1].quick)
+					rs_filter_request_set_quick(preview->request[i], FALSE);
+				canvas_draw(preview, &area, FALSE);
+			}
+			else if(preview->views > 1 && rs_filter_request_get_quick(new_request) && !preview->keep_quick_enabled)
 			{
 				rs_filter_request_set_quick(preview->request[i], FALSE);
 				canvas_draw(preview, &area, FALSE);
@@ -168,6 +168,17 @@ rs_preview_widget_quick_start(RSPreviewWidget *preview, gboolean keep_quick);
 extern void
 rs_preview_widget_quick_end(RSPreviewWidget *preview);
 
+/**
+ * Enables or disables progressive rendering. When enabled, the preview is
+ * first rendered at reduced size and quality after each change and then
+ * refined until the final image is shown. Renders are not cancelled, each
+ * level runs to completion before a change is picked up
+ * @param preview A RSPreviewWidget
+ * @param progressive TRUE to enable progressive rendering
+ */
+extern void
+rs_preview_widget_set_progressive(RSPreviewWidget *preview, gboolean progressive);
+
 extern void 
 rs_preview_widget_update_display_colorspace(RSPreviewWidget *preview);
 